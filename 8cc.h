@@ -4,8 +4,10 @@
 #ifndef EIGHTCC_H
 #define EIGHTCC_H
 
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include "arena.h"
 #include "dict.h"
 #include "list.h"
 #include "error.h"
@@ -174,6 +176,10 @@ typedef struct Node {
             // local
             int loff;
             List *lvarinit;
+            // Register allocated to the local, or NULL
+            char *lreg;
+            // Index of its interval while registers are allocated
+            int lindex;
             // global
             char *glabel;
         };
@@ -200,6 +206,12 @@ typedef struct Node {
             struct List *params;
             struct List *localvars;
             struct Node *body;
+            // Number of labels made by the parser in the function
+            int nlabels;
+            // For incremental compilation: the fingerprint of the
+            // function, and its code if it was not parsed
+            char *fingerprint;
+            char *code;
         };
         // Declaration
         struct {
@@ -232,8 +244,10 @@ typedef struct Node {
         };
         // Switch-case label
         struct {
-            int casebeg;
-            int caseend;
+            long casebeg;
+            long caseend;
+            // Label of the case, set by the code generator
+            char *caselabel;
         };
         // Goto and label
         struct {
@@ -262,6 +276,47 @@ typedef struct {
 
 extern void *make_pair(void *first, void *second);
 
+typedef struct LexState LexState;
+typedef struct CppState CppState;
+typedef struct ParseState ParseState;
+typedef struct GenState GenState;
+typedef struct AsmState AsmState;
+typedef struct CodegenPool CodegenPool;
+
+// Returns the contents of a header file and sets *len, or returns NULL
+// to look for the file on disk.
+typedef char *ReadFileFn(char *path, int *len, void *data);
+
+typedef struct {
+    LexState *lex;
+    CppState *cpp;
+    ParseState *parse;
+    GenState *gen;
+    // NULL until asm_init()
+    AsmState *as;
+    // If set, error() jumps here instead of exiting.
+    jmp_buf *on_error;
+    // If set, diagnostics go here instead of stderr.
+    FILE *diag;
+    // If set, diagnostics are copied here, without colors.
+    FILE *diag_copy;
+    // If set, header files are read through this first.
+    ReadFileFn *read_file;
+    void *read_file_data;
+    // If set, set_context() makes it the arena for the calling thread.
+    Arena *arena;
+} Context;
+
+extern THREAD_LOCAL Context *context;
+
+extern Context *make_context(void);
+extern void set_context(Context *ctx);
+extern LexState *make_lex_state(void);
+extern CppState *make_cpp_state(void);
+extern ParseState *make_parse_state(void);
+extern GenState *make_gen_state(void);
+extern GenState *make_worker_gen_state(void);
+
 extern Ctype *ctype_char;
 extern Ctype *ctype_short;
 extern Ctype *ctype_int;
@@ -280,8 +335,14 @@ extern List *get_input_buffer(void);
 extern void skip_cond_incl(void);
 extern char *read_header_file_name(bool *std);
 extern void push_input_file(char *displayname, char *realname, FILE *input);
+extern void push_token_stream(char *displayname, char *realname, char *p, long len);
+extern char *make_token_stream(char *body, long size, long *len);
 extern void set_input_file(char *displayname, char *realname, FILE *input);
+extern void close_input_files(void);
+extern bool has_ungotten_tokens(void);
 extern char *input_position(void);
+extern void set_input_position(Token *tok);
+extern Token *get_input_position(void);
 extern char *get_current_file(void);
 extern int get_current_line(void);
 extern char *get_current_displayname(void);
@@ -289,6 +350,11 @@ extern void set_current_displayname(char *name);
 extern void set_current_line(int line);
 extern void cpp_eval(char *buf);
 extern void add_include_path(char *path);
+extern List *get_include_path(void);
+extern List *read_all_tokens(void);
+extern void replay_tokens(List *tokens);
+extern void record_tokens(List *list);
+extern void set_token_source(Token *(*fn)(void *data), void *data);
 
 extern void parse_init(void);
 extern void unget_token(Token *tok);
@@ -302,17 +368,216 @@ extern bool is_ident(Token *tok, char *s);
 extern char *a2s(Node *node);
 extern char *c2s(Ctype *ctype);
 extern void print_asm_header(void);
-extern char *make_label(void);
-extern List *read_toplevels(void);
+extern Node *read_toplevel(void);
+extern void set_function_cache(Dict *cache, char *seed);
+extern void release_function_bodies(void);
 extern Node *read_expr(void);
-extern int eval_intexpr(Node *node);
+extern long eval_intexpr(Node *node);
 extern bool is_inttype(Ctype *ctype);
 extern bool is_flotype(Ctype *ctype);
 
+extern bool open_header(char *path, FILE **fp, char **tokens, long *len);
+extern void set_file_report_fd(int fd);
+extern void cache_reported_file(char *line);
+extern void start_prefetch(char *file, List *include_path);
+extern void open_shared_headers(void);
+extern char *get_include_guard(char *path);
+
+extern void cache_open(char *dir);
+extern void set_cache_size(long size);
+extern bool cache_enabled(void);
+extern char *hash_tokens(char *seed, List *tokens);
+extern char *cache_key(List *tokens, char *options);
+extern bool cache_get(char *key, char *path, char **diag);
+extern void cache_put(char *key, char *path, char *diag);
+extern Dict *read_function_cache(char *path);
+extern void write_function_cache(char *path, List *funcs);
+
+extern char *get_server_socket(void);
+extern int run_client(int argc, char **argv);
+extern void run_server(int (*compile)(int argc, char **argv)) NORETURN;
+
 extern void emit_toplevel(Node *v);
+extern int allocate_registers(Node *func, char **regs, int nregs);
 extern void set_output_file(FILE *fp);
 extern void close_output_file(void);
 
+#define IR_MAXARGS 3
+
+// Registers: 0-15 are general purpose registers in the order of their
+// encoding and 16-31 are xmm0-15. Virtual registers are numbered from
+// VREG_BASE.
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+#define XMM0 16
+#define REG_IP 32
+#define VREG_BASE 64
+#define NO_REG (-1)
+
+// Scratch registers that virtual registers are assigned to
+#define NUM_INT_TEMPS 6
+#define NUM_XMM_TEMPS 8
+
+enum {
+    OPD_REG,
+    OPD_IMM,
+    OPD_MEM,
+    // A label or function name, as the target of a jump or a call
+    OPD_SYM,
+};
+
+// How a number is written in assembly
+enum { NUM_DEC, NUM_UDEC, NUM_HEX };
+
+typedef struct {
+    int kind;
+    // Register, or base register of a memory operand
+    int reg;
+    // Size of a register operand in bits, 128 for xmm registers
+    int width;
+    int index;
+    int scale;
+    // Immediate or displacement
+    long val;
+    int numfmt;
+    // Whether a memory operand is written with its displacement
+    bool hasdisp;
+    // Symbol of an operand, or NULL
+    char *sym;
+    // Whether a jump or call goes to the address in the operand
+    bool indirect;
+} Operand;
+
+enum {
+    INSN_OP,
+    INSN_LABEL,
+    // Directives, and anything in a data section
+    INSN_DATA,
+};
+
+typedef struct {
+    int kind;
+    // Mnemonic of an instruction, or name of a label
+    char *op;
+    Operand args[IR_MAXARGS];
+    int nargs;
+    // The line of a label or data as emitted
+    char *text;
+    // Annotation for assembly output, or NULL
+    char *note;
+    // Storage of op and the symbols of the operands
+    char *buf;
+} Insn;
+
+typedef struct Block {
+    int id;
+    // Label at the beginning of the block, if any
+    char *label;
+    // True if the address of the label is taken
+    bool taken;
+    List *insns;
+    List *succs;
+    List *preds;
+} Block;
+
+typedef struct {
+    char *name;
+    List *insns;
+    List *blocks;
+    // Number of virtual registers
+    int nvregs;
+    // True while the code being appended is in a data section
+    bool indata;
+} IrFunc;
+
+extern int opt_level;
+extern bool dump_ir;
+
+extern IrFunc *make_ir_func(char *name);
+extern int new_vreg(IrFunc *fn);
+extern void ir_append(IrFunc *fn, char *text, char *note);
+extern void set_reg_operand(Operand *o, int reg, int width);
+extern bool same_operand(Operand *a, Operand *b);
+extern char *reg_name(int reg, int width);
+extern void rewrite_insn(Insn *insn, char *op, Operand *a0, Operand *a1);
+extern void free_insn(Insn *insn);
+extern bool is_jump(Insn *insn);
+extern bool is_indirect_jump(Insn *insn);
+extern Insn *block_last_op(Block *b);
+extern void build_cfg(IrFunc *fn);
+extern void run_passes(IrFunc *fn);
+extern char *insn_text(Insn *insn);
+extern void print_ir(FILE *fp, IrFunc *fn);
+extern List *ir_insns(IrFunc *fn);
+extern void free_ir_func(IrFunc *fn);
+
+extern bool peephole(IrFunc *fn);
+extern void print_peephole_stats(FILE *fp);
+
+typedef struct {
+    char *name;
+    // NULL for .bss
+    String *body;
+    long size;
+    int align;
+    List *relocs;
+} Section;
+
+typedef struct {
+    char *name;
+    // NULL if undefined
+    Section *section;
+    long value;
+    bool global;
+    // Index in the symbol table of the object file
+    int index;
+} Symbol;
+
+enum {
+    RELOC_PC32,
+    RELOC_PLT32,
+    RELOC_32,
+    RELOC_32S,
+    RELOC_64,
+};
+
+typedef struct {
+    long offset;
+    Symbol *sym;
+    int type;
+    long addend;
+} Reloc;
+
+typedef struct {
+    List *sections;
+    List *symbols;
+} Object;
+
+extern void asm_init(void);
+extern void assemble(char *line);
+extern Object *asm_finish(void);
+extern void write_elf(char *path, Object *obj);
+extern int run_jit(Object *obj, int argc, char **argv);
+
+extern void run_pipeline(void (*emit)(Node *v));
+
+extern CodegenPool *start_codegen_workers(int n);
+extern void queue_toplevel(CodegenPool *pool, Node *v);
+extern void finish_codegen(CodegenPool *pool, void (*emit)(Node *v));
+
 extern bool debug_cpp;
 
+enum {
+    TRACE_CPP = 1,
+    TRACE_PARSE,
+    TRACE_CODEGEN,
+    TRACE_AS,
+};
+
+extern void trace_open(char *path);
+extern bool trace_enabled(void);
+extern long trace_time(void);
+extern void trace_begin(int tid, char *name, char *args);
+extern void trace_end(int tid);
+extern void trace_complete(int tid, char *name, long start, char *args);
+
 #endif /* EIGHTCC_H */
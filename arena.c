@@ -0,0 +1,101 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Arena allocator.
+ *
+ * While an arena is set for the calling thread, the compiler's data
+ * structures are allocated from it and are released all at once by
+ * free_arena(). Without an arena, they come from malloc() and are
+ * never freed, which is fine for a process that compiles one file and
+ * exits.
+ *
+ * Memory must be passed to arena_free() under the arena it was
+ * allocated from, which is a no-op if that is not NULL.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "error.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGN 16
+
+typedef struct Chunk {
+    struct Chunk *next;
+} Chunk;
+
+struct Arena {
+    Chunk *chunks;
+    char *p;
+    char *end;
+};
+
+#define HEADER_SIZE ((sizeof(Chunk) + ALIGN - 1) & ~(ALIGN - 1))
+
+static THREAD_LOCAL Arena *arena;
+
+Arena *make_arena(void) {
+    Arena *r = malloc(sizeof(Arena));
+    r->chunks = NULL;
+    r->p = r->end = NULL;
+    return r;
+}
+
+void free_arena(Arena *a) {
+    Chunk *c = a->chunks;
+    while (c) {
+        Chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+
+// Sets the arena for the calling thread and returns the previous one.
+Arena *set_arena(Arena *a) {
+    Arena *r = arena;
+    arena = a;
+    return r;
+}
+
+static void *new_chunk(Arena *a, size_t size) {
+    Chunk *c = malloc(HEADER_SIZE + size);
+    c->next = a->chunks;
+    a->chunks = c;
+    return (char *)c + HEADER_SIZE;
+}
+
+void *arena_malloc(size_t size) {
+    Arena *a = arena;
+    if (!a)
+        return malloc(size);
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+#ifdef __SANITIZE_ADDRESS__
+    // One chunk for each object, so that AddressSanitizer catches uses
+    // after free_arena().
+    return new_chunk(a, size);
+#else
+    if (size > CHUNK_SIZE / 4)
+        return new_chunk(a, size);
+    if ((size_t)(a->end - a->p) < size) {
+        a->p = new_chunk(a, CHUNK_SIZE);
+        a->end = a->p + CHUNK_SIZE;
+    }
+    void *r = a->p;
+    a->p += size;
+    return r;
+#endif
+}
+
+void *arena_calloc(size_t nmemb, size_t size) {
+    void *r = arena_malloc(nmemb * size);
+    memset(r, 0, nmemb * size);
+    return r;
+}
+
+void arena_free(void *p) {
+    if (!arena)
+        free(p);
+}
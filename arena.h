@@ -0,0 +1,18 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+#ifndef EIGHTCC_ARENA_H
+#define EIGHTCC_ARENA_H
+
+#include <stddef.h>
+
+typedef struct Arena Arena;
+
+extern Arena *make_arena(void);
+extern void free_arena(Arena *arena);
+extern Arena *set_arena(Arena *arena);
+extern void *arena_malloc(size_t size);
+extern void *arena_calloc(size_t nmemb, size_t size);
+extern void arena_free(void *p);
+
+#endif /* EIGHTCC_ARENA_H */
@@ -0,0 +1,1130 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Integrated assembler.
+ *
+ * Translates the x86-64 assembly in AT&T syntax that gen.c emits into
+ * an object in memory, made of sections, symbols and relocations, which
+ * elf.c writes out as an ELF relocatable file. The code generator hands
+ * each line over as soon as it is formatted, so "8cc -c" writes no
+ * temporary file and runs no external assembler.
+ *
+ * Only the instructions and directives the code generator uses are
+ * supported. Branches always take 32-bit displacements, so code is laid
+ * out in a single pass. References to labels in the same section are
+ * resolved when the object is finished; the rest become relocations.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+// A subsection, such as ".data 1". Subsections of a section are
+// concatenated in order of their numbers when the object is finished.
+typedef struct {
+    Section *sec;
+    int subsection;
+    String *body;
+    long size;
+    int align;
+    long base;
+    List *fixups;
+} Chunk;
+
+typedef struct Label {
+    Symbol *sym;
+    Chunk *chunk;
+    long off;
+    struct Label *next;
+} Label;
+
+// A reference to a label that is not known until the object is finished
+typedef struct {
+    Chunk *chunk;
+    long off;
+    int type;
+    Label *label;
+    long addend;
+    // For "label - base", the label the value is relative to
+    Label *base;
+} Fixup;
+
+enum { ARG_REG, ARG_XMM, ARG_IMM, ARG_MEM };
+enum { NOREG = -1, RIP = 16 };
+
+typedef struct {
+    int kind;
+    // Register number, or the base register of a memory operand
+    int reg;
+    // Size of a register in bytes
+    int size;
+    int index;
+    int scale;
+    // Immediate value or displacement, relative to sym if not NULL
+    long disp;
+    char *sym;
+    // "*" of indirect jumps and calls
+    bool indirect;
+} Arg;
+
+#define LABEL_HASH_SIZE 4096
+
+struct AsmState {
+    Label *label_hash[LABEL_HASH_SIZE];
+    List *labels;
+    List *chunks;
+    List *sections;
+    Chunk *current;
+    // The line being assembled and the position in it
+    char *line;
+    char *pos;
+};
+
+
+static char *REGS[][16] = {
+    { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+      "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" },
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+      "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" },
+    { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+      "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" },
+    { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+      "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" },
+};
+
+static char *CONDS[] = {
+    "o", "no", "b", "ae", "e", "ne", "be", "a",
+    "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+static struct { char *name; int cond; } COND_ALIASES[] = {
+    { "c", 2 }, { "nae", 2 }, { "nb", 3 }, { "nc", 3 }, { "z", 4 },
+    { "nz", 5 }, { "na", 6 }, { "nbe", 7 }, { "nge", 12 }, { "nl", 13 },
+    { "ng", 14 }, { "nle", 15 },
+};
+
+// SSE instructions taking an XMM register and an XMM register or memory
+static struct { char *name; int prefix; int opcode; } SSE_INSNS[] = {
+    { "addsd", 0xF2, 0x0F58 }, { "addss", 0xF3, 0x0F58 },
+    { "subsd", 0xF2, 0x0F5C }, { "subss", 0xF3, 0x0F5C },
+    { "mulsd", 0xF2, 0x0F59 }, { "mulss", 0xF3, 0x0F59 },
+    { "divsd", 0xF2, 0x0F5E }, { "divss", 0xF3, 0x0F5E },
+    { "sqrtsd", 0xF2, 0x0F51 }, { "sqrtss", 0xF3, 0x0F51 },
+    { "ucomisd", 0x66, 0x0F2E }, { "ucomiss", 0, 0x0F2E },
+    { "comisd", 0x66, 0x0F2F }, { "comiss", 0, 0x0F2F },
+    { "xorpd", 0x66, 0x0F57 }, { "xorps", 0, 0x0F57 },
+    { "cvtps2pd", 0, 0x0F5A }, { "cvtpd2ps", 0x66, 0x0F5A },
+    { "cvtss2sd", 0xF3, 0x0F5A }, { "cvtsd2ss", 0xF2, 0x0F5A },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+#define asm_error(...)                                          \
+    error("%s: %s", format(__VA_ARGS__), context->as->line)
+
+/*----------------------------------------------------------------------
+ * Sections and labels
+ */
+
+static Section *get_section(char *name) {
+    AsmState *s = context->as;
+    for (Iter *i = list_iter(s->sections); !iter_end(i);) {
+        Section *sec = iter_next(i);
+        if (!strcmp(sec->name, name))
+            return sec;
+    }
+    Section *sec = arena_malloc(sizeof(Section));
+    sec->name = format("%s", name);
+    sec->body = strcmp(name, ".bss") ? make_string() : NULL;
+    sec->size = 0;
+    sec->align = 1;
+    sec->relocs = make_list();
+    list_push(s->sections, sec);
+    return sec;
+}
+
+static void set_chunk(char *name, int subsection) {
+    AsmState *s = context->as;
+    Section *sec = get_section(name);
+    for (Iter *i = list_iter(s->chunks); !iter_end(i);) {
+        Chunk *c = iter_next(i);
+        if (c->sec == sec && c->subsection == subsection) {
+            s->current = c;
+            return;
+        }
+    }
+    Chunk *c = arena_malloc(sizeof(Chunk));
+    c->sec = sec;
+    c->subsection = subsection;
+    c->body = sec->body ? make_string() : NULL;
+    c->size = 0;
+    c->align = 1;
+    c->fixups = make_list();
+    list_push(s->chunks, c);
+    s->current = c;
+}
+
+static Label *get_label(char *name) {
+    AsmState *s = context->as;
+    unsigned hash = 0;
+    for (char *p = name; *p; p++)
+        hash = hash * 31 + *p;
+    Label **bucket = &s->label_hash[hash % LABEL_HASH_SIZE];
+    for (Label *l = *bucket; l; l = l->next)
+        if (!strcmp(l->sym->name, name))
+            return l;
+    Label *l = arena_malloc(sizeof(Label));
+    l->sym = arena_malloc(sizeof(Symbol));
+    l->sym->name = format("%s", name);
+    l->sym->section = NULL;
+    l->sym->value = 0;
+    l->sym->global = false;
+    l->chunk = NULL;
+    l->off = 0;
+    l->next = *bucket;
+    *bucket = l;
+    list_push(s->labels, l);
+    return l;
+}
+
+static void define_label(char *name) {
+    AsmState *s = context->as;
+    Label *l = get_label(name);
+    if (l->chunk)
+        asm_error("label redefined");
+    l->chunk = s->current;
+    l->off = s->current->size;
+}
+
+/*----------------------------------------------------------------------
+ * Output
+ */
+
+static void out(int c) {
+    AsmState *s = context->as;
+    if (!s->current->body)
+        asm_error("data in %s", s->current->sec->name);
+    string_append(s->current->body, c);
+    s->current->size++;
+}
+
+static void out_int(long v, int size) {
+    for (int i = 0; i < size; i++)
+        out((v >> (i * 8)) & 0xff);
+}
+
+static void out_opcode(int opcode) {
+    if (opcode > 0xff)
+        out(opcode >> 8);
+    out(opcode & 0xff);
+}
+
+static void add_fixup(int type, char *name, long addend) {
+    AsmState *s = context->as;
+    Fixup *f = arena_malloc(sizeof(Fixup));
+    f->chunk = s->current;
+    f->off = s->current->size;
+    f->type = type;
+    f->label = get_label(name);
+    f->addend = addend;
+    f->base = NULL;
+    list_push(s->current->fixups, f);
+    out_int(0, (type == RELOC_64) ? 8 : 4);
+}
+
+static void align_chunk(int n, int fill) {
+    AsmState *s = context->as;
+    if (n & (n - 1))
+        asm_error("alignment is not a power of 2");
+    if (s->current->align < n)
+        s->current->align = n;
+    while (s->current->size % n) {
+        if (s->current->body)
+            out(fill);
+        else
+            s->current->size++;
+    }
+}
+
+/*----------------------------------------------------------------------
+ * Parser
+ */
+
+static void skip_space(void) {
+    AsmState *s = context->as;
+    while (isspace(*s->pos))
+        s->pos++;
+}
+
+static bool at_end(void) {
+    AsmState *s = context->as;
+    skip_space();
+    return *s->pos == '\0' || *s->pos == '#';
+}
+
+static void expect(char c) {
+    AsmState *s = context->as;
+    skip_space();
+    if (*s->pos != c)
+        asm_error("'%c' expected", c);
+    s->pos++;
+}
+
+static bool next(char c) {
+    AsmState *s = context->as;
+    skip_space();
+    if (*s->pos != c)
+        return false;
+    s->pos++;
+    return true;
+}
+
+static bool is_name_char(char c) {
+    return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static char *read_name(void) {
+    AsmState *s = context->as;
+    skip_space();
+    char *start = s->pos;
+    if (!isalpha(*s->pos) && *s->pos != '_' && *s->pos != '.')
+        asm_error("name expected");
+    while (is_name_char(*s->pos))
+        s->pos++;
+    return format("%.*s", (int)(s->pos - start), start);
+}
+
+static long read_number(void) {
+    AsmState *s = context->as;
+    skip_space();
+    char *end;
+    long r = strtoul(s->pos, &end, 0);
+    if (end == s->pos)
+        asm_error("number expected");
+    s->pos = end;
+    return r;
+}
+
+static bool at_name(char *p) {
+    return isalpha(*p) || *p == '_' || *p == '.';
+}
+
+// Reads "sym", "sym+n", "sym-n" or "n". The "-" of "sym-sym" is left
+// for the caller.
+static void read_value(Arg *a) {
+    AsmState *s = context->as;
+    skip_space();
+    if (at_name(s->pos))
+        a->sym = read_name();
+    skip_space();
+    if (*s->pos == '-' && a->sym && at_name(s->pos + 1))
+        return;
+    if (*s->pos == '+' || *s->pos == '-' || isdigit(*s->pos))
+        a->disp = read_number();
+}
+
+static bool read_reg(Arg *a, char *name) {
+    if (!strncmp(name, "xmm", 3)) {
+        a->kind = ARG_XMM;
+        a->reg = atoi(name + 3);
+        return true;
+    }
+    if (!strcmp(name, "rip")) {
+        a->kind = ARG_REG;
+        a->reg = RIP;
+        a->size = 8;
+        return true;
+    }
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 16; j++) {
+            if (!strcmp(name, REGS[i][j])) {
+                a->kind = ARG_REG;
+                a->reg = j;
+                a->size = 1 << i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int read_register(void) {
+    expect('%');
+    Arg a;
+    if (!read_reg(&a, read_name()) || a.kind != ARG_REG)
+        asm_error("register expected");
+    return a.reg;
+}
+
+static void read_arg(Arg *a) {
+    memset(a, 0, sizeof(Arg));
+    a->reg = a->index = NOREG;
+    a->scale = 1;
+    if (next('*'))
+        a->indirect = true;
+    if (next('%')) {
+        if (!read_reg(a, read_name()))
+            asm_error("unknown register");
+        return;
+    }
+    if (next('$')) {
+        a->kind = ARG_IMM;
+        read_value(a);
+        return;
+    }
+    a->kind = ARG_MEM;
+    read_value(a);
+    if (!next('('))
+        return;
+    if (!next(',')) {
+        a->reg = read_register();
+        if (!next(',')) {
+            expect(')');
+            return;
+        }
+    }
+    a->index = read_register();
+    if (next(','))
+        a->scale = read_number();
+    expect(')');
+}
+
+/*----------------------------------------------------------------------
+ * Instruction encoding
+ */
+
+static bool fits8(long v) {
+    return -128 <= v && v <= 127;
+}
+
+static bool fits32(long v) {
+    return -2147483648L <= v && v <= 2147483647L;
+}
+
+// The opcode extension in the reg field of ModR/M
+static Arg *ext(int n) {
+    Arg *a = arena_calloc(1, sizeof(Arg));
+    a->kind = ARG_REG;
+    a->reg = n;
+    return a;
+}
+
+// spl, bpl, sil and dil are accessible only with a REX prefix.
+static bool needs_rex(Arg *a) {
+    return a->kind == ARG_REG && a->size == 1 && 4 <= a->reg && a->reg < 8;
+}
+
+static int scale_bits(Arg *a) {
+    switch (a->scale) {
+    case 1: return 0;
+    case 2: return 1;
+    case 4: return 2;
+    case 8: return 3;
+    }
+    asm_error("invalid scale");
+}
+
+static void emit_disp32(Arg *a, int type, long adjust) {
+    if (a->sym)
+        add_fixup(type, a->sym, a->disp + adjust);
+    else
+        out_int(a->disp, 4);
+}
+
+// immsize is the size of the immediate after the displacement, which
+// a RIP-relative displacement is relative to.
+static void emit_modrm(int reg, Arg *rm, int immsize) {
+    reg &= 7;
+    if (rm->kind != ARG_MEM) {
+        out(0xC0 | reg << 3 | (rm->reg & 7));
+        return;
+    }
+    int index = (rm->index == NOREG) ? 4 : (rm->index & 7);
+    if (rm->reg == RIP) {
+        out(reg << 3 | 5);
+        emit_disp32(rm, RELOC_PC32, -4 - immsize);
+        return;
+    }
+    if (rm->reg == NOREG) {
+        out(reg << 3 | 4);
+        out(scale_bits(rm) << 6 | index << 3 | 5);
+        emit_disp32(rm, RELOC_32S, 0);
+        return;
+    }
+    int mod;
+    if (rm->sym || !fits8(rm->disp))
+        mod = 2;
+    else if (rm->disp == 0 && (rm->reg & 7) != 5)
+        mod = 0;
+    else
+        mod = 1;
+    bool sib = (rm->index != NOREG || (rm->reg & 7) == 4);
+    out(mod << 6 | reg << 3 | (sib ? 4 : (rm->reg & 7)));
+    if (sib)
+        out(scale_bits(rm) << 6 | index << 3 | (rm->reg & 7));
+    if (mod == 1)
+        out(rm->disp & 0xff);
+    else if (mod == 2)
+        emit_disp32(rm, RELOC_32S, 0);
+}
+
+// Emits an instruction with a ModR/M byte, whose reg field is r and
+// whose r/m field is rm.
+static void emit_insn(int prefix, bool w, int opcode, Arg *r, Arg *rm, int immsize) {
+    if (prefix)
+        out(prefix);
+    int rex = (w ? 8 : 0) | ((r->reg & 8) ? 4 : 0);
+    if (rm->kind != ARG_MEM)
+        rex |= (rm->reg & 8) ? 1 : 0;
+    else if (rm->reg != NOREG && rm->reg != RIP)
+        rex |= (rm->reg & 8) ? 1 : 0;
+    if (rm->kind == ARG_MEM && rm->index != NOREG)
+        rex |= (rm->index & 8) ? 2 : 0;
+    if (rex || needs_rex(r) || needs_rex(rm))
+        out(0x40 | rex);
+    out_opcode(opcode);
+    emit_modrm(r->reg, rm, immsize);
+}
+
+// Emits an instruction with the register in the low bits of the opcode.
+static void emit_short_insn(int prefix, bool w, int opcode, Arg *r) {
+    if (prefix)
+        out(prefix);
+    int rex = (w ? 8 : 0) | ((r->reg & 8) ? 1 : 0);
+    if (rex || needs_rex(r))
+        out(0x40 | rex);
+    out(opcode + (r->reg & 7));
+}
+
+static void emit_imm(Arg *a, int size) {
+    if (a->sym) {
+        if (size != 4)
+            asm_error("symbol in %d-byte immediate", size);
+        add_fixup(RELOC_32S, a->sym, a->disp);
+        return;
+    }
+    out_int(a->disp, size);
+}
+
+static int get_size(int suffix, Arg *args, int nargs) {
+    if (suffix)
+        return suffix;
+    for (int i = nargs - 1; i >= 0; i--)
+        if (args[i].kind == ARG_REG)
+            return args[i].size;
+    asm_error("operand size unknown");
+}
+
+static void emit_mov(int size, Arg *src, Arg *dst) {
+    int prefix = (size == 2) ? 0x66 : 0;
+    bool w = (size == 8);
+    if (src->kind == ARG_IMM && dst->kind == ARG_REG) {
+        long v = src->disp;
+        if (size == 8 && !src->sym && 0 <= v && v <= 0xffffffffL) {
+            // Writing to a 32-bit register clears the upper half.
+            emit_short_insn(0, false, 0xB8, dst);
+            out_int(v, 4);
+        } else if (size == 8 && (src->sym || fits32(v))) {
+            emit_insn(0, true, 0xC7, ext(0), dst, 4);
+            emit_imm(src, 4);
+        } else {
+            emit_short_insn(prefix, w, (size == 1) ? 0xB0 : 0xB8, dst);
+            emit_imm(src, size);
+        }
+        return;
+    }
+    if (src->kind == ARG_IMM) {
+        int immsize = (size == 8) ? 4 : size;
+        emit_insn(prefix, w, (size == 1) ? 0xC6 : 0xC7, ext(0), dst, immsize);
+        emit_imm(src, immsize);
+        return;
+    }
+    if (src->kind == ARG_REG)
+        emit_insn(prefix, w, (size == 1) ? 0x88 : 0x89, src, dst, 0);
+    else
+        emit_insn(prefix, w, (size == 1) ? 0x8A : 0x8B, dst, src, 0);
+}
+
+// add, or, adc, sbb, and, sub, xor and cmp
+static void emit_alu(int op, int size, Arg *src, Arg *dst) {
+    int prefix = (size == 2) ? 0x66 : 0;
+    bool w = (size == 8);
+    if (src->kind == ARG_IMM) {
+        if (size == 1) {
+            emit_insn(prefix, w, 0x80, ext(op), dst, 1);
+            emit_imm(src, 1);
+        } else if (!src->sym && fits8(src->disp)) {
+            emit_insn(prefix, w, 0x83, ext(op), dst, 1);
+            out(src->disp & 0xff);
+        } else {
+            int immsize = (size == 2) ? 2 : 4;
+            emit_insn(prefix, w, 0x81, ext(op), dst, immsize);
+            emit_imm(src, immsize);
+        }
+    } else if (src->kind == ARG_REG) {
+        emit_insn(prefix, w, op * 8 + ((size == 1) ? 0 : 1), src, dst, 0);
+    } else {
+        emit_insn(prefix, w, op * 8 + ((size == 1) ? 2 : 3), dst, src, 0);
+    }
+}
+
+static void emit_test(int size, Arg *src, Arg *dst) {
+    int prefix = (size == 2) ? 0x66 : 0;
+    bool w = (size == 8);
+    if (src->kind == ARG_IMM) {
+        int immsize = (size == 8) ? 4 : size;
+        emit_insn(prefix, w, (size == 1) ? 0xF6 : 0xF7, ext(0), dst, immsize);
+        emit_imm(src, immsize);
+    } else {
+        emit_insn(prefix, w, (size == 1) ? 0x84 : 0x85, src, dst, 0);
+    }
+}
+
+static void emit_imul(int size, Arg *args, int nargs) {
+    int prefix = (size == 2) ? 0x66 : 0;
+    bool w = (size == 8);
+    if (nargs == 1) {
+        emit_insn(prefix, w, 0xF7, ext(5), &args[0], 0);
+        return;
+    }
+    Arg *dst = &args[nargs - 1];
+    if (args[0].kind != ARG_IMM) {
+        emit_insn(prefix, w, 0x0FAF, dst, &args[0], 0);
+        return;
+    }
+    Arg *src = (nargs == 3) ? &args[1] : dst;
+    if (!args[0].sym && fits8(args[0].disp)) {
+        emit_insn(prefix, w, 0x6B, dst, src, 1);
+        out(args[0].disp & 0xff);
+    } else {
+        int immsize = (size == 2) ? 2 : 4;
+        emit_insn(prefix, w, 0x69, dst, src, immsize);
+        emit_imm(&args[0], immsize);
+    }
+}
+
+// rol, ror, shl, sal, shr and sar
+static void emit_shift(int op, int size, Arg *args, int nargs) {
+    int prefix = (size == 2) ? 0x66 : 0;
+    bool w = (size == 8);
+    int base = (size == 1) ? 0 : 1;
+    Arg *dst = &args[nargs - 1];
+    if (nargs == 1 || (args[0].kind == ARG_IMM && args[0].disp == 1)) {
+        emit_insn(prefix, w, 0xD0 + base, ext(op), dst, 0);
+    } else if (args[0].kind == ARG_REG) {
+        if (args[0].reg != 1 || args[0].size != 1)
+            asm_error("shift count must be %%cl");
+        emit_insn(prefix, w, 0xD2 + base, ext(op), dst, 0);
+    } else {
+        emit_insn(prefix, w, 0xC0 + base, ext(op), dst, 1);
+        out(args[0].disp & 0xff);
+    }
+}
+
+// movsbq, movzwl, movslq, etc.
+static void emit_extend(bool sign, int from, int to, Arg *src, Arg *dst) {
+    int prefix = (to == 2) ? 0x66 : 0;
+    bool w = (to == 8);
+    int opcode;
+    if (from == 4 && sign && to == 8)
+        opcode = 0x63;
+    else if (from == 1)
+        opcode = sign ? 0x0FBE : 0x0FB6;
+    else if (from == 2)
+        opcode = sign ? 0x0FBF : 0x0FB7;
+    else
+        asm_error("invalid operand size");
+    emit_insn(prefix, w, opcode, dst, src, 0);
+}
+
+static void emit_branch(int opcode, int type, Arg *target) {
+    if (target->kind != ARG_MEM || target->reg != NOREG || !target->sym)
+        asm_error("invalid branch target");
+    out_opcode(opcode);
+    add_fixup(type, target->sym, target->disp - 4);
+}
+
+static int get_cond(char *name) {
+    for (int i = 0; i < ARRAY_SIZE(CONDS); i++)
+        if (!strcmp(name, CONDS[i]))
+            return i;
+    for (int i = 0; i < ARRAY_SIZE(COND_ALIASES); i++)
+        if (!strcmp(name, COND_ALIASES[i].name))
+            return COND_ALIASES[i].cond;
+    return -1;
+}
+
+static bool emit_sse(char *name, Arg *args, int nargs) {
+    if (nargs != 2)
+        return false;
+    Arg *src = &args[0];
+    Arg *dst = &args[1];
+    for (int i = 0; i < ARRAY_SIZE(SSE_INSNS); i++) {
+        if (!strcmp(name, SSE_INSNS[i].name)) {
+            emit_insn(SSE_INSNS[i].prefix, false, SSE_INSNS[i].opcode, dst, src, 0);
+            return true;
+        }
+    }
+    if (!strcmp(name, "movsd") || !strcmp(name, "movss")) {
+        int prefix = (name[4] == 'd') ? 0xF2 : 0xF3;
+        if (dst->kind == ARG_XMM)
+            emit_insn(prefix, false, 0x0F10, dst, src, 0);
+        else
+            emit_insn(prefix, false, 0x0F11, src, dst, 0);
+        return true;
+    }
+    if (!strcmp(name, "movq") || !strcmp(name, "movd")) {
+        bool w = (name[3] == 'q');
+        if (dst->kind == ARG_XMM && src->kind == ARG_REG)
+            emit_insn(0x66, w, 0x0F6E, dst, src, 0);
+        else if (src->kind == ARG_XMM && dst->kind == ARG_REG)
+            emit_insn(0x66, w, 0x0F7E, src, dst, 0);
+        else if (w && dst->kind == ARG_XMM)
+            emit_insn(0xF3, false, 0x0F7E, dst, src, 0);
+        else if (w && src->kind == ARG_XMM)
+            emit_insn(0x66, false, 0x0FD6, src, dst, 0);
+        else
+            return false;
+        return true;
+    }
+    return false;
+}
+
+// cvtsi2sd, cvttsd2si, etc. The general purpose operand decides the
+// operand size unless a suffix is given.
+static bool emit_sse_convert(char *name, int size, Arg *args, int nargs) {
+    if (nargs != 2)
+        return false;
+    Arg *src = &args[0];
+    Arg *dst = &args[1];
+    int prefix, opcode;
+    Arg *gp;
+    if (!strcmp(name, "cvtsi2sd") || !strcmp(name, "cvtsi2ss")) {
+        prefix = (name[7] == 'd') ? 0xF2 : 0xF3;
+        opcode = 0x0F2A;
+        gp = src;
+    } else if (!strcmp(name, "cvttsd2si") || !strcmp(name, "cvttss2si")) {
+        prefix = (name[5] == 'd') ? 0xF2 : 0xF3;
+        opcode = 0x0F2C;
+        gp = dst;
+    } else if (!strcmp(name, "cvtsd2si") || !strcmp(name, "cvtss2si")) {
+        prefix = (name[4] == 'd') ? 0xF2 : 0xF3;
+        opcode = 0x0F2D;
+        gp = dst;
+    } else {
+        return false;
+    }
+    if (!size)
+        size = (gp->kind == ARG_REG) ? gp->size : 4;
+    emit_insn(prefix, size == 8, opcode, dst, src, 0);
+    return true;
+}
+
+static int suffix_size(char c) {
+    switch (c) {
+    case 'b': return 1;
+    case 'w': return 2;
+    case 'l': return 4;
+    case 'q': return 8;
+    }
+    return 0;
+}
+
+static bool emit_extend_insn(char *name, Arg *args, int nargs) {
+    if (nargs != 2 || (strncmp(name, "movs", 4) && strncmp(name, "movz", 4)))
+        return false;
+    bool sign = (name[3] == 's');
+    Arg *src = &args[0];
+    Arg *dst = &args[1];
+    int len = strlen(name);
+    int from, to;
+    if (len == 6) {
+        from = suffix_size(name[4]);
+        to = suffix_size(name[5]);
+    } else if (len == 5 && name[4] == 'x') {
+        from = (src->kind == ARG_REG) ? src->size : 0;
+        to = dst->size;
+    } else if (len == 5) {
+        from = suffix_size(name[4]);
+        to = dst->size;
+    } else {
+        return false;
+    }
+    if (!from || !to || dst->kind != ARG_REG)
+        return false;
+    emit_extend(sign, from, to, src, dst);
+    return true;
+}
+
+/*
+ * Assembles an instruction whose mnemonic, without the operand size
+ * suffix if any, is name. Returns false if the mnemonic is unknown.
+ */
+static bool emit_insn_by_name(char *name, int suffix, Arg *args, int nargs) {
+    static char *ALU[] = { "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp" };
+    static char *UNARY[] = { "", "", "not", "neg", "mul", "", "div", "idiv" };
+    static char *SHIFTS[] = { "rol", "ror", "", "", "shl", "shr", "", "sar" };
+
+    if (!suffix) {
+        if (emit_sse(name, args, nargs) || emit_extend_insn(name, args, nargs))
+            return true;
+        if (nargs == 0) {
+            if (!strcmp(name, "ret"))   { out(0xC3); return true; }
+            if (!strcmp(name, "leave")) { out(0xC9); return true; }
+            if (!strcmp(name, "nop"))   { out(0x90); return true; }
+            if (!strcmp(name, "cqto"))  { out(0x48); out(0x99); return true; }
+            if (!strcmp(name, "cltq"))  { out(0x48); out(0x98); return true; }
+            if (!strcmp(name, "cltd"))  { out(0x99); return true; }
+            if (!strcmp(name, "cwtl"))  { out(0x98); return true; }
+            if (!strcmp(name, "ud2"))   { out(0x0F); out(0x0B); return true; }
+        }
+        if (name[0] == 'j' && nargs == 1 && get_cond(name + 1) >= 0) {
+            emit_branch(0x0F80 + get_cond(name + 1), RELOC_PC32, &args[0]);
+            return true;
+        }
+        if (!strncmp(name, "set", 3) && nargs == 1 && get_cond(name + 3) >= 0) {
+            emit_insn(0, false, 0x0F90 + get_cond(name + 3), ext(0), &args[0], 0);
+            return true;
+        }
+    }
+    if (emit_sse_convert(name, suffix, args, nargs))
+        return true;
+    if ((!strcmp(name, "jmp") || !strcmp(name, "call")) && nargs == 1) {
+        bool call = (name[0] == 'c');
+        if (args[0].indirect)
+            emit_insn(0, false, 0xFF, ext(call ? 2 : 4), &args[0], 0);
+        else
+            emit_branch(call ? 0xE8 : 0xE9, RELOC_PLT32, &args[0]);
+        return true;
+    }
+    if ((!strcmp(name, "push") || !strcmp(name, "pop")) && nargs == 1) {
+        bool push = (name[1] == 'u');
+        if (args[0].kind == ARG_REG) {
+            emit_short_insn(0, false, push ? 0x50 : 0x58, &args[0]);
+        } else if (push && args[0].kind == ARG_IMM) {
+            out(0x68);
+            emit_imm(&args[0], 4);
+        } else {
+            emit_insn(0, false, push ? 0xFF : 0x8F, ext(push ? 6 : 0), &args[0], 0);
+        }
+        return true;
+    }
+    if (!strcmp(name, "mov") && nargs == 2) {
+        emit_mov(get_size(suffix, args, nargs), &args[0], &args[1]);
+        return true;
+    }
+    if (!strcmp(name, "lea") && nargs == 2) {
+        int size = get_size(suffix, args, nargs);
+        emit_insn(0, size == 8, 0x8D, &args[1], &args[0], 0);
+        return true;
+    }
+    if (!strcmp(name, "test") && nargs == 2) {
+        emit_test(get_size(suffix, args, nargs), &args[0], &args[1]);
+        return true;
+    }
+    if (!strcmp(name, "imul") && 1 <= nargs && nargs <= 3) {
+        emit_imul(get_size(suffix, args, nargs), args, nargs);
+        return true;
+    }
+    for (int i = 0; i < ARRAY_SIZE(ALU); i++) {
+        if (!strcmp(name, ALU[i]) && nargs == 2) {
+            emit_alu(i, get_size(suffix, args, nargs), &args[0], &args[1]);
+            return true;
+        }
+    }
+    for (int i = 0; i < ARRAY_SIZE(UNARY); i++) {
+        if (*UNARY[i] && !strcmp(name, UNARY[i]) && nargs == 1) {
+            int size = get_size(suffix, args, nargs);
+            emit_insn((size == 2) ? 0x66 : 0, size == 8, (size == 1) ? 0xF6 : 0xF7,
+                      ext(i), &args[0], 0);
+            return true;
+        }
+    }
+    if (!strcmp(name, "sal") && (nargs == 1 || nargs == 2)) {
+        emit_shift(4, get_size(suffix, args, nargs), args, nargs);
+        return true;
+    }
+    for (int i = 0; i < ARRAY_SIZE(SHIFTS); i++) {
+        if (*SHIFTS[i] && !strcmp(name, SHIFTS[i]) && (nargs == 1 || nargs == 2)) {
+            emit_shift(i, get_size(suffix, args, nargs), args, nargs);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void emit_instruction(char *name) {
+    Arg args[3];
+    int nargs = 0;
+    if (!at_end()) {
+        do {
+            if (nargs == 3)
+                asm_error("too many operands");
+            read_arg(&args[nargs++]);
+        } while (next(','));
+    }
+    if (!at_end())
+        asm_error("junk at end of line");
+    if (emit_insn_by_name(name, 0, args, nargs))
+        return;
+    int len = strlen(name);
+    int size = suffix_size(name[len - 1]);
+    if (size && emit_insn_by_name(format("%.*s", len - 1, name), size, args, nargs))
+        return;
+    asm_error("unknown instruction");
+}
+
+/*----------------------------------------------------------------------
+ * Directives
+ */
+
+static void emit_data(int size) {
+    do {
+        Arg a;
+        memset(&a, 0, sizeof(Arg));
+        read_value(&a);
+        if (a.sym && next('-')) {
+            // The difference of two labels, as in jump tables
+            if (size != 4)
+                asm_error("label difference in %d-byte data", size);
+            add_fixup(RELOC_PC32, a.sym, 0);
+            Fixup *f = list_tail(context->as->current->fixups);
+            f->base = get_label(read_name());
+        } else if (!a.sym)
+            out_int(a.disp, size);
+        else if (size == 8)
+            add_fixup(RELOC_64, a.sym, a.disp);
+        else if (size == 4)
+            add_fixup(RELOC_32, a.sym, a.disp);
+        else
+            asm_error("symbol in %d-byte data", size);
+    } while (next(','));
+}
+
+static void emit_string(bool nul) {
+    AsmState *s = context->as;
+    expect('"');
+    while (*s->pos != '"') {
+        if (*s->pos == '\0')
+            asm_error("unterminated string");
+        if (*s->pos != '\\') {
+            out(*s->pos++);
+            continue;
+        }
+        s->pos++;
+        char c = *s->pos++;
+        switch (c) {
+        case 'n': out('\n'); break;
+        case 't': out('\t'); break;
+        case 'r': out('\r'); break;
+        case 'f': out('\f'); break;
+        case 'b': out('\b'); break;
+        case 'x': out(strtoul(s->pos, &s->pos, 16)); break;
+        default:
+            if ('0' <= c && c <= '7') {
+                int v = c - '0';
+                for (int i = 0; i < 2 && '0' <= *s->pos && *s->pos <= '7'; i++)
+                    v = v * 8 + *s->pos++ - '0';
+                out(v);
+            } else {
+                out(c);
+            }
+        }
+    }
+    s->pos++;
+    if (nul)
+        out(0);
+}
+
+// .lcomm name, size[, align]. Without an alignment, the object is
+// aligned by its size up to 8 bytes, as GNU as does.
+static void emit_lcomm(void) {
+    AsmState *s = context->as;
+    char *name = read_name();
+    expect(',');
+    long size = read_number();
+    int align = (size >= 8) ? 8 : (size >= 4) ? 4 : (size >= 2) ? 2 : 1;
+    if (next(','))
+        align = read_number();
+    Chunk *save = s->current;
+    set_chunk(".bss", 0);
+    align_chunk(align, 0);
+    define_label(name);
+    s->current->size += size;
+    s->current = save;
+}
+
+static void emit_directive(char *name) {
+    AsmState *s = context->as;
+    if (!strcmp(name, ".text") || !strcmp(name, ".data") || !strcmp(name, ".bss")) {
+        set_chunk(name, at_end() ? 0 : read_number());
+    } else if (!strcmp(name, ".section")) {
+        char *sec = read_name();
+        // Section flags and types are implied by the name.
+        while (!at_end())
+            s->pos++;
+        set_chunk(sec, 0);
+    } else if (!strcmp(name, ".global") || !strcmp(name, ".globl")) {
+        get_label(read_name())->sym->global = true;
+    } else if (!strcmp(name, ".lcomm")) {
+        emit_lcomm();
+    } else if (!strcmp(name, ".byte")) {
+        emit_data(1);
+    } else if (!strcmp(name, ".short") || !strcmp(name, ".value") || !strcmp(name, ".word")) {
+        emit_data(2);
+    } else if (!strcmp(name, ".long") || !strcmp(name, ".int")) {
+        emit_data(4);
+    } else if (!strcmp(name, ".quad")) {
+        emit_data(8);
+    } else if (!strcmp(name, ".string") || !strcmp(name, ".asciz")) {
+        emit_string(true);
+    } else if (!strcmp(name, ".ascii")) {
+        emit_string(false);
+    } else if (!strcmp(name, ".zero") || !strcmp(name, ".skip")) {
+        for (long n = read_number(); n > 0; n--)
+            out(0);
+    } else if (!strcmp(name, ".align") || !strcmp(name, ".balign")) {
+        align_chunk(read_number(), strcmp(s->current->sec->name, ".text") ? 0 : 0x90);
+    } else {
+        asm_error("unknown directive");
+    }
+    if (!at_end())
+        asm_error("junk at end of line");
+}
+
+/*----------------------------------------------------------------------
+ * Entry points
+ */
+
+void asm_init(void) {
+    AsmState *s = arena_calloc(1, sizeof(AsmState));
+    s->labels = make_list();
+    s->chunks = make_list();
+    s->sections = make_list();
+    context->as = s;
+    set_chunk(".text", 0);
+}
+
+static void assemble_line(char *s) {
+    context->as->line = context->as->pos = s;
+    while (!at_end()) {
+        char *name = read_name();
+        if (next(':')) {
+            define_label(name);
+            continue;
+        }
+        if (name[0] == '.')
+            emit_directive(name);
+        else
+            emit_instruction(name);
+        return;
+    }
+}
+
+// The object being assembled outlives the function being emitted.
+void assemble(char *s) {
+    Arena *saved = set_arena(context->arena);
+    assemble_line(s);
+    set_arena(saved);
+}
+
+static void layout(Section *sec) {
+    AsmState *s = context->as;
+    int maxsub = -1;
+    for (Iter *i = list_iter(s->chunks); !iter_end(i);) {
+        Chunk *c = iter_next(i);
+        if (c->sec == sec && maxsub < c->subsection)
+            maxsub = c->subsection;
+    }
+    for (int sub = 0; sub <= maxsub; sub++) {
+        for (Iter *i = list_iter(s->chunks); !iter_end(i);) {
+            Chunk *c = iter_next(i);
+            if (c->sec != sec || c->subsection != sub)
+                continue;
+            if (sec->align < c->align)
+                sec->align = c->align;
+            while (sec->size % c->align) {
+                if (sec->body)
+                    string_append(sec->body, 0);
+                sec->size++;
+            }
+            c->base = sec->size;
+            if (sec->body)
+                for (int j = 0; j < c->size; j++)
+                    string_append(sec->body, get_cstring(c->body)[j]);
+            sec->size += c->size;
+        }
+    }
+}
+
+static bool is_pcrel(int type) {
+    return type == RELOC_PC32 || type == RELOC_PLT32;
+}
+
+static void resolve(Fixup *f) {
+    Section *sec = f->chunk->sec;
+    long off = f->chunk->base + f->off;
+    Symbol *sym = f->label->sym;
+    if (!sym->section && !strncmp(sym->name, ".L", 2))
+        error("undefined label: %s", sym->name);
+    if (f->base) {
+        // label - base, where base is in this section. If the label is
+        // in another one, it is label + (off - base) - off.
+        Symbol *base = f->base->sym;
+        if (base->section != sec)
+            error("%s is not in section %s", base->name, sec->name);
+        if (sym->section == sec) {
+            int v = sym->value - base->value;
+            memcpy(get_cstring(sec->body) + off, &v, 4);
+            return;
+        }
+        Reloc *rel = arena_malloc(sizeof(Reloc));
+        rel->offset = off;
+        rel->sym = sym;
+        rel->type = RELOC_PC32;
+        rel->addend = off - base->value;
+        list_push(sec->relocs, rel);
+        return;
+    }
+    if (is_pcrel(f->type) && sym->section == sec) {
+        int v = sym->value + f->addend - off;
+        memcpy(get_cstring(sec->body) + off, &v, 4);
+        return;
+    }
+    Reloc *rel = arena_malloc(sizeof(Reloc));
+    rel->offset = off;
+    rel->sym = sym;
+    rel->type = f->type;
+    rel->addend = f->addend;
+    list_push(sec->relocs, rel);
+}
+
+/*
+ * Lays out subsections and resolves labels. Returns the sections with
+ * their relocations, and every symbol that was defined or referenced.
+ */
+Object *asm_finish(void) {
+    AsmState *s = context->as;
+    for (Iter *i = list_iter(s->sections); !iter_end(i);)
+        layout(iter_next(i));
+    List *symbols = make_list();
+    for (Iter *i = list_iter(s->labels); !iter_end(i);) {
+        Label *l = iter_next(i);
+        if (l->chunk) {
+            l->sym->section = l->chunk->sec;
+            l->sym->value = l->chunk->base + l->off;
+        }
+        list_push(symbols, l->sym);
+    }
+    for (Iter *i = list_iter(s->chunks); !iter_end(i);) {
+        Chunk *c = iter_next(i);
+        for (Iter *j = list_iter(c->fixups); !iter_end(j);)
+            resolve(iter_next(j));
+    }
+    Object *obj = arena_malloc(sizeof(Object));
+    obj->sections = s->sections;
+    obj->symbols = symbols;
+    return obj;
+}
@@ -0,0 +1,384 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Compilation cache.
+ *
+ * With -fcache, the output of a compilation is stored in a local
+ * directory under the SHA-256 of the preprocessed token stream, the
+ * identity of the compiler executable and the options that change the
+ * output. If the same key is seen again, the stored file is copied to
+ * the output and the parser and the code generator do not run at all.
+ * The diagnostics of the parser and the code generator are stored in
+ * front of the output and printed again on a hit.
+ *
+ * The directory is kept under a size limit by removing the least
+ * recently used entries. An entry's modification time is updated when
+ * it is used.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "8cc.h"
+
+#define DEFAULT_CACHE_SIZE (256L * 1024 * 1024)
+
+static char *cache_dir;
+static long cache_size = DEFAULT_CACHE_SIZE;
+static char *compiler_id;
+
+/*----------------------------------------------------------------------
+ * SHA-256
+ */
+
+typedef struct {
+    uint32_t h[8];
+    unsigned char buf[64];
+    int buflen;
+    long len;
+} Sha256;
+
+static uint32_t K[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_init(Sha256 *s) {
+    uint32_t h[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(s->h, h, sizeof(h));
+    s->buflen = 0;
+    s->len = 0;
+}
+
+static void sha256_block(Sha256 *s, unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (p[i * 4] << 24) | (p[i * 4 + 1] << 16) | (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, s->h, sizeof(v));
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+        uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        uint32_t t1 = v[7] + s1 + ch + K[i] + w[i];
+        uint32_t s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+        uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        uint32_t t2 = s0 + maj;
+        memmove(v + 1, v, sizeof(uint32_t) * 7);
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++)
+        s->h[i] += v[i];
+}
+
+static void sha256_update(Sha256 *s, void *data, long len) {
+    unsigned char *p = data;
+    s->len += len;
+    while (len > 0) {
+        if (s->buflen == 0 && len >= 64) {
+            sha256_block(s, p);
+            p += 64;
+            len -= 64;
+            continue;
+        }
+        int n = (64 - s->buflen < len) ? 64 - s->buflen : len;
+        memcpy(s->buf + s->buflen, p, n);
+        s->buflen += n;
+        p += n;
+        len -= n;
+        if (s->buflen == 64) {
+            sha256_block(s, s->buf);
+            s->buflen = 0;
+        }
+    }
+}
+
+// Returns the digest as 64 hex digits.
+static char *sha256_final(Sha256 *s) {
+    long bits = s->len * 8;
+    unsigned char pad = 0x80;
+    sha256_update(s, &pad, 1);
+    pad = 0;
+    while (s->buflen != 56)
+        sha256_update(s, &pad, 1);
+    unsigned char len[8];
+    for (int i = 0; i < 8; i++)
+        len[i] = bits >> (56 - i * 8);
+    sha256_update(s, len, 8);
+    String *r = make_string();
+    for (int i = 0; i < 8; i++)
+        string_appendf(r, "%08x", s->h[i]);
+    return get_cstring(r);
+}
+
+/*----------------------------------------------------------------------
+ * Files
+ */
+
+// Writes header followed by the rest of in to dst.
+static bool write_file(char *dst, char *header, FILE *in) {
+    FILE *out = fopen(dst, "w");
+    if (!out)
+        return false;
+    char buf[8192];
+    bool ok = (fputs(header, out) >= 0);
+    for (;;) {
+        int n = fread(buf, 1, sizeof(buf), in);
+        if (n <= 0)
+            break;
+        if (fwrite(buf, 1, n, out) != n)
+            ok = false;
+    }
+    if (fclose(out) || !ok) {
+        unlink(dst);
+        return false;
+    }
+    return true;
+}
+
+static void make_dirs(char *path) {
+    char *p = format("%s", path);
+    for (char *q = p + 1; *q; q++) {
+        if (*q != '/')
+            continue;
+        *q = '\0';
+        mkdir(p, 0777);
+        *q = '/';
+    }
+    if (mkdir(p, 0777) < 0 && errno != EEXIST)
+        error("cannot create %s: %s", p, strerror(errno));
+}
+
+// Identifies the compiler executable by its inode, size and
+// modification time, so that rebuilding the compiler invalidates the
+// cache without reading the executable on every compilation.
+static char *get_compiler_id(void) {
+    struct stat st;
+    if (stat("/proc/self/exe", &st) < 0)
+        error("cannot stat the compiler executable: %s", strerror(errno));
+    return format("%lx:%lx:%lx:%lx.%09lx", (long)st.st_dev, (long)st.st_ino, (long)st.st_size,
+                  (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+}
+
+/*----------------------------------------------------------------------
+ * Eviction
+ */
+
+typedef struct {
+    char *path;
+    long size;
+    long mtime;
+} Entry;
+
+static int compare_entries(const void *a, const void *b) {
+    long x = (*(Entry **)a)->mtime;
+    long y = (*(Entry **)b)->mtime;
+    return (x < y) ? -1 : (x > y);
+}
+
+// Removes the least recently used entries until the cache fits in
+// cache_size. The entry just added is kept.
+static void evict(char *key) {
+    DIR *dir = opendir(cache_dir);
+    if (!dir)
+        return;
+    List *entries = make_list();
+    long total = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' || !strcmp(ent->d_name, key))
+            continue;
+        char *path = format("%s/%s", cache_dir, ent->d_name);
+        struct stat st;
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        Entry *e = malloc(sizeof(Entry));
+        e->path = path;
+        e->size = st.st_size;
+        e->mtime = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+        list_push(entries, e);
+        total += st.st_size;
+    }
+    closedir(dir);
+    struct stat st;
+    if (stat(format("%s/%s", cache_dir, key), &st) == 0)
+        total += st.st_size;
+    if (total <= cache_size)
+        return;
+    int n = list_len(entries);
+    Entry **v = malloc(sizeof(Entry *) * n);
+    for (int i = 0; i < n; i++)
+        v[i] = list_shift(entries);
+    qsort(v, n, sizeof(Entry *), compare_entries);
+    for (int i = 0; i < n && total > cache_size; i++) {
+        unlink(v[i]->path);
+        total -= v[i]->size;
+    }
+}
+
+/*----------------------------------------------------------------------
+ * Entry points
+ */
+
+// dir is NULL for $EIGHTCC_CACHE_DIR or ~/.cache/8cc.
+void cache_open(char *dir) {
+    if (!dir)
+        dir = getenv("EIGHTCC_CACHE_DIR");
+    if (!dir)
+        dir = format("%s/.cache/8cc", getenv("HOME") ? getenv("HOME") : "/tmp");
+    cache_dir = dir;
+}
+
+void set_cache_size(long size) {
+    cache_size = size;
+}
+
+bool cache_enabled(void) {
+    return cache_dir != NULL;
+}
+
+static char *hash_token_list(char *seed, List *tokens, bool positions) {
+    Sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, seed, strlen(seed) + 1);
+    for (Iter *i = list_iter(tokens); !iter_end(i);) {
+        Token *tok = iter_next(i);
+        char type = tok->type;
+        char *str = t2s(tok);
+        sha256_update(&s, &type, 1);
+        sha256_update(&s, str, strlen(str) + 1);
+        if (positions) {
+            char *pos = format("%s:%d:%d", tok->file ? tok->file : "", tok->line, tok->column);
+            sha256_update(&s, pos, strlen(pos) + 1);
+        }
+    }
+    return sha256_final(&s);
+}
+
+// Returns the SHA-256 of seed followed by tokens.
+char *hash_tokens(char *seed, List *tokens) {
+    return hash_token_list(seed, tokens, false);
+}
+
+// Returns the key of the given tokens compiled with the given options.
+// The positions of the tokens are part of the key, as the diagnostics
+// stored with the output refer to them.
+char *cache_key(List *tokens, char *options) {
+    if (!compiler_id)
+        compiler_id = get_compiler_id();
+    return hash_token_list(format("%s %s", compiler_id, options), tokens, true);
+}
+
+// Copies the output in the entry for key to path, and sets *diag to the
+// diagnostics of the compilation that made it. Returns false if there
+// is no entry.
+bool cache_get(char *key, char *path, char **diag) {
+    char *entry = format("%s/%s", cache_dir, key);
+    FILE *in = fopen(entry, "r");
+    if (!in)
+        return false;
+    long len;
+    char *d = NULL;
+    bool ok = (fscanf(in, "%ld", &len) == 1 && getc(in) == '\n' && len >= 0);
+    if (ok) {
+        d = calloc(1, len + 1);
+        ok = (fread(d, 1, len, in) == len);
+    }
+    ok = ok && write_file(path, "", in);
+    fclose(in);
+    if (!ok) {
+        free(d);
+        return false;
+    }
+    utimes(entry, NULL);
+    *diag = d;
+    return true;
+}
+
+// Stores the output in path along with its diagnostics.
+void cache_put(char *key, char *path, char *diag) {
+    make_dirs(cache_dir);
+    char *tmp = format("%s/.tmp.%d", cache_dir, getpid());
+    FILE *in = fopen(path, "r");
+    if (!in)
+        return;
+    bool ok = write_file(tmp, format("%ld\n%s", (long)strlen(diag), diag), in);
+    fclose(in);
+    if (!ok)
+        return;
+    if (rename(tmp, format("%s/%s", cache_dir, key)) < 0) {
+        unlink(tmp);
+        return;
+    }
+    evict(key);
+}
+
+/*----------------------------------------------------------------------
+ * Function cache
+ *
+ * With -fincremental, the code of each function is kept in a file next
+ * to the output, under the function's fingerprint (see parse.c). The
+ * next compilation of the file reuses the code of the functions whose
+ * fingerprint has not changed. Each entry is a line with the
+ * fingerprint and the length of the code, followed by the code.
+ */
+
+Dict *read_function_cache(char *path) {
+    Dict *r = make_dict(NULL);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return r;
+    char line[128];
+    char key[65];
+    long len;
+    while (fgets(line, sizeof(line), fp) && sscanf(line, "%64s %ld", key, &len) == 2) {
+        if (len < 0)
+            break;
+        char *code = malloc(len + 1);
+        if (fread(code, 1, len, fp) != len)
+            break;
+        code[len] = '\0';
+        dict_put(r, format("%s", key), code);
+    }
+    fclose(fp);
+    return r;
+}
+
+// Writes the code of the functions that have a fingerprint.
+void write_function_cache(char *path, List *funcs) {
+    char *tmp = format("%s.tmp.%d", path, getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return;
+    for (Iter *i = list_iter(funcs); !iter_end(i);) {
+        Node *func = iter_next(i);
+        fprintf(fp, "%s %ld\n", func->fingerprint, (long)strlen(func->code));
+        fputs(func->code, fp);
+    }
+    if (fclose(fp) || rename(tmp, path) < 0)
+        unlink(tmp);
+}
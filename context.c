@@ -0,0 +1,43 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Compiler context.
+ *
+ * The state of the preprocessor, the parser, the code generator and the
+ * assembler lives in a Context, so that one process can hold more than
+ * one compilation. Instead of taking the context as a parameter, the
+ * compiler uses the one set for the calling thread by set_context().
+ */
+
+#include <stdlib.h>
+#include "8cc.h"
+
+THREAD_LOCAL Context *context;
+
+// Returns a context with the predefined macros and builtins set up.
+Context *make_context(void) {
+    Context *r = arena_malloc(sizeof(Context));
+    r->lex = make_lex_state();
+    r->cpp = make_cpp_state();
+    r->parse = make_parse_state();
+    r->gen = make_gen_state();
+    r->as = NULL;
+    r->on_error = NULL;
+    r->diag = NULL;
+    r->diag_copy = NULL;
+    r->read_file = NULL;
+    r->read_file_data = NULL;
+    r->arena = NULL;
+    Context *saved = context;
+    context = r;
+    cpp_init();
+    parse_init();
+    context = saved;
+    return r;
+}
+
+void set_context(Context *ctx) {
+    context = ctx;
+    set_arena(ctx ? ctx->arena : NULL);
+}
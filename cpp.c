@@ -17,13 +17,8 @@
 #include "8cc.h"
 
 bool debug_cpp;
-static Dict *macros = &EMPTY_DICT;
-static List *cond_incl_stack = &EMPTY_LIST;
-static List *std_include_path = &EMPTY_LIST;
 static Token *cpp_token_zero = &(Token){ .type = TNUMBER, .sval = "0" };
 static Token *cpp_token_one = &(Token){ .type = TNUMBER, .sval = "1" };
-static struct tm *current_time;
-static int macro_counter;
 
 typedef void special_macro_handler(Token *tok);
 typedef enum { IN_THEN, IN_ELSE } CondInclCtx;
@@ -38,6 +33,21 @@ typedef struct {
     special_macro_handler *fn;
 } Macro;
 
+struct CppState {
+    Dict *macros;
+    List *cond_incl_stack;
+    List *std_include_path;
+    struct tm *current_time;
+    int macro_counter;
+    // If not NULL, read_token() returns these tokens, last one first,
+    // and then those made by source if any, instead of reading the input.
+    List *replay;
+    Token *(*source)(void *data);
+    void *source_data;
+    // If not NULL, the tokens read_token() returns are appended to it.
+    List *record;
+};
+
 static Macro *make_obj_macro(List *body);
 static Macro *make_func_macro(List *body, int nargs, bool is_varg);
 static Macro *make_special_macro(special_macro_handler *fn);
@@ -51,9 +61,9 @@ static Token *read_expand(void);
 void cpp_eval(char *buf) {
     FILE *fp = fmemopen(buf, strlen(buf), "r");
     set_input_file("(eval)", NULL, fp);
-    List *toplevels = read_toplevels();
-    for (Iter *i = list_iter(toplevels); !iter_end(i);)
-        emit_toplevel(iter_next(i));
+    for (Node *v; (v = read_toplevel()) != NULL;)
+        emit_toplevel(v);
+    close_input_files();
 }
 
 /*----------------------------------------------------------------------
@@ -61,14 +71,14 @@ void cpp_eval(char *buf) {
  */
 
 static CondIncl *make_cond_incl(CondInclCtx ctx, bool wastrue) {
-    CondIncl *r = malloc(sizeof(CondIncl));
+    CondIncl *r = arena_malloc(sizeof(CondIncl));
     r->ctx = ctx;
     r->wastrue = wastrue;
     return r;
 }
 
 static Macro *make_macro(Macro *tmpl) {
-    Macro *r = malloc(sizeof(Macro));
+    Macro *r = arena_malloc(sizeof(Macro));
     *r = *tmpl;
     return r;
 }
@@ -87,7 +97,7 @@ static Macro *make_special_macro(special_macro_handler *fn) {
 }
 
 static Token *make_macro_token(int position, bool is_vararg) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(sizeof(Token));
     r->type = TMACRO_PARAM;
     r->is_vararg = is_vararg;
     r->hideset = make_dict(NULL);
@@ -98,13 +108,13 @@ static Token *make_macro_token(int position, bool is_vararg) {
 }
 
 static Token *copy_token(Token *tok) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(sizeof(Token));
     *r = *tok;
     return r;
 }
 
 static Token *make_number(char *s) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(sizeof(Token));
     *r = (Token){ TNUMBER, .sval = s };
     return r;
 }
@@ -390,7 +400,7 @@ static Token *read_expand(void) {
     if (tok->type != TIDENT)
         return tok;
     char *name = tok->sval;
-    Macro *macro = dict_get(macros, name);
+    Macro *macro = dict_get(context->cpp->macros, name);
     if (!macro || dict_get(tok->hideset, name))
         return tok;
 
@@ -481,7 +491,7 @@ static void read_funclike_macro(char *name) {
     bool is_varg = read_funclike_macro_params(param);
     List *body = read_funclike_macro_body(param);
     Macro *macro = make_func_macro(body, list_len(dict_keys(param)), is_varg);
-    dict_put(macros, name, macro);
+    dict_put(context->cpp->macros, name, macro);
 }
 
 static void read_obj_macro(char *name) {
@@ -492,7 +502,7 @@ static void read_obj_macro(char *name) {
             break;
         list_push(body, tok);
     }
-    dict_put(macros, name, make_obj_macro(body));
+    dict_put(context->cpp->macros, name, make_obj_macro(body));
 }
 
 /*----------------------------------------------------------------------
@@ -517,7 +527,7 @@ static void read_define(void) {
 static void read_undef(void) {
     Token *name = read_ident();
     expect_newline();
-    dict_remove(macros, name->sval);
+    dict_remove(context->cpp->macros, name->sval);
 }
 
 /*----------------------------------------------------------------------
@@ -532,7 +542,7 @@ static Token *read_defined_op(void) {
     }
     if (tok->type != TIDENT)
         error("Identifier expected, but got %s", t2s(tok));
-    return dict_get(macros, tok->sval) ?
+    return dict_get(context->cpp->macros, tok->sval) ?
         cpp_token_one : cpp_token_zero;
 }
 
@@ -566,7 +576,7 @@ static bool read_constexpr(void) {
 }
 
 static void read_if_generic(bool cond) {
-    list_push(cond_incl_stack, make_cond_incl(IN_THEN, cond));
+    list_push(context->cpp->cond_incl_stack, make_cond_incl(IN_THEN, cond));
     if (!cond)
         skip_cond_incl();
 }
@@ -579,7 +589,7 @@ static void read_ifdef_generic(bool is_ifdef) {
     Token *tok = read_cpp_token();
     if (!tok || tok->type != TIDENT)
         error("identifier expected, but got %s", t2s(tok));
-    bool cond = dict_get(macros, tok->sval);
+    bool cond = dict_get(context->cpp->macros, tok->sval);
     expect_newline();
     read_if_generic(is_ifdef ? cond : !cond);
 }
@@ -593,9 +603,9 @@ static void read_ifndef(void) {
 }
 
 static void read_else(void) {
-    if (list_len(cond_incl_stack) == 0)
+    if (list_len(context->cpp->cond_incl_stack) == 0)
         error("stray #else");
-    CondIncl *ci = list_tail(cond_incl_stack);
+    CondIncl *ci = list_tail(context->cpp->cond_incl_stack);
     if (ci->ctx == IN_ELSE)
         error("#else appears in #else");
     expect_newline();
@@ -604,9 +614,9 @@ static void read_else(void) {
 }
 
 static void read_elif(void) {
-    if (list_len(cond_incl_stack) == 0)
+    if (list_len(context->cpp->cond_incl_stack) == 0)
         error("stray #elif");
-    CondIncl *ci = list_tail(cond_incl_stack);
+    CondIncl *ci = list_tail(context->cpp->cond_incl_stack);
     if (ci->ctx == IN_ELSE)
         error("#elif after #else");
     if (ci->wastrue)
@@ -616,9 +626,9 @@ static void read_elif(void) {
 }
 
 static void read_endif(void) {
-    if (list_len(cond_incl_stack) == 0)
+    if (list_len(context->cpp->cond_incl_stack) == 0)
         error("stray #endif");
-    list_pop(cond_incl_stack);
+    list_pop(context->cpp->cond_incl_stack);
     expect_newline();
 }
 
@@ -664,10 +674,19 @@ static char *read_cpp_header_name(bool *std) {
 
 static bool try_include(char *dir, char *filename) {
     char *path = format("%s/%s", dir, filename);
-    FILE *fp = fopen(path, "r");
-    if (!fp)
+    // The header would be empty if its include guard is defined.
+    char *guard = get_include_guard(path);
+    if (guard && dict_get(context->cpp->macros, guard))
+        return true;
+    FILE *fp;
+    char *tokens;
+    long len;
+    if (!open_header(path, &fp, &tokens, &len))
         return false;
-    push_input_file(path, path, fp);
+    if (fp)
+        push_input_file(path, path, fp);
+    else
+        push_token_stream(path, path, tokens, len);
     return true;
 }
 
@@ -684,7 +703,7 @@ static void read_include(void) {
             return;
         }
     }
-    for (Iter *i = list_iter(std_include_path); !iter_end(i);) {
+    for (Iter *i = list_iter(context->cpp->std_include_path); !iter_end(i);) {
         if (try_include(iter_next(i), filename))
             return;
     }
@@ -726,6 +745,9 @@ static void read_line(void) {
 
 static void read_directive(void) {
     Token *tok = read_cpp_token();
+    // Macros, included files and conditionals may outlive the function
+    // body being read.
+    Arena *saved = set_arena(context->arena);
     if (is_ident(tok, "define"))       read_define();
     else if (is_ident(tok, "undef"))   read_undef();
     else if (is_ident(tok, "if"))      read_if();
@@ -739,6 +761,7 @@ static void read_directive(void) {
     else if (is_ident(tok, "line"))    read_line();
     else if (tok->type != TNEWLINE)
         error("unsupported preprocessor directive: %s", t2s(tok));
+    set_arena(saved);
 }
 
 /*----------------------------------------------------------------------
@@ -746,12 +769,15 @@ static void read_directive(void) {
  */
 
 static struct tm *gettime(void) {
-    if (current_time)
-        return current_time;
+    CppState *s = context->cpp;
+    if (s->current_time)
+        return s->current_time;
     time_t timet = time(NULL);
-    current_time = malloc(sizeof(struct tm));
-    localtime_r(&timet, current_time);
-    return current_time;
+    Arena *saved = set_arena(context->arena);
+    s->current_time = arena_malloc(sizeof(struct tm));
+    set_arena(saved);
+    localtime_r(&timet, s->current_time);
+    return s->current_time;
 }
 
 static void handle_date_macro(Token *tmpl) {
@@ -792,7 +818,7 @@ static void handle_pragma_macro(Token *ignore) {
 static void handle_counter_macro(Token *tmpl) {
     Token *tok = copy_token(tmpl);
     tok->type = TNUMBER;
-    tok->sval = format("%d", macro_counter++);
+    tok->sval = format("%d", context->cpp->macro_counter++);
     unget_token(tok);
 }
 
@@ -809,7 +835,11 @@ static char *drop_last_slash(char *s) {
 }
 
 void add_include_path(char *path) {
-    list_unshift(std_include_path, drop_last_slash(path));
+    list_unshift(context->cpp->std_include_path, drop_last_slash(path));
+}
+
+List *get_include_path(void) {
+    return list_copy(context->cpp->std_include_path);
 }
 
 /*----------------------------------------------------------------------
@@ -817,19 +847,34 @@ void add_include_path(char *path) {
  */
 
 static void define_obj_macro(char *name, Token *value) {
-    dict_put(macros, name, make_obj_macro(make_list1(value)));
+    dict_put(context->cpp->macros, name, make_obj_macro(make_list1(value)));
 }
 
 static void define_special_macro(char *name, special_macro_handler *fn) {
-    dict_put(macros, name, make_special_macro(fn));
+    dict_put(context->cpp->macros, name, make_special_macro(fn));
+}
+
+CppState *make_cpp_state(void) {
+    CppState *r = arena_malloc(sizeof(CppState));
+    r->macros = make_dict(NULL);
+    r->cond_incl_stack = make_list();
+    r->std_include_path = make_list();
+    r->current_time = NULL;
+    r->macro_counter = 0;
+    r->replay = NULL;
+    r->source = NULL;
+    r->source_data = NULL;
+    r->record = NULL;
+    return r;
 }
 
 void cpp_init(void) {
-    list_unshift(std_include_path, "/usr/include/x86_64-linux-gnu");
-    list_unshift(std_include_path, "/usr/include/linux");
-    list_unshift(std_include_path, "/usr/include");
-    list_unshift(std_include_path, "/usr/local/include");
-    list_unshift(std_include_path, "./include");
+    List *path = context->cpp->std_include_path;
+    list_unshift(path, "/usr/include/x86_64-linux-gnu");
+    list_unshift(path, "/usr/include/linux");
+    list_unshift(path, "/usr/include");
+    list_unshift(path, "/usr/local/include");
+    list_unshift(path, "./include");
 
     define_special_macro("__DATE__", handle_date_macro);
     define_special_macro("__TIME__", handle_time_macro);
@@ -892,6 +937,14 @@ static Token *maybe_convert_keyword(Token *tok) {
  */
 
 void unget_token(Token *tok) {
+    List *record = context->cpp->record;
+    if (tok && record && list_len(record) > 0 && list_tail(record) == tok)
+        list_pop(record);
+    if (context->cpp->replay) {
+        if (tok)
+            list_push(context->cpp->replay, tok);
+        return;
+    }
     unget_cpp_token(tok);
 }
 
@@ -925,7 +978,12 @@ static Token *read_token_sub(bool return_at_eol) {
     }
 }
 
-Token *read_token(void) {
+static Token *read_token_int(void) {
+    CppState *s = context->cpp;
+    if (s->replay && list_len(s->replay) > 0)
+        return list_pop(s->replay);
+    if (s->replay)
+        return s->source ? s->source(s->source_data) : NULL;
     Token *tok;
     for (;;) {
         tok = read_token_sub(false);
@@ -949,3 +1007,38 @@ Token *read_token(void) {
         fprintf(stderr, "  token=%s\n", t2s(r));
     return r;
 }
+
+Token *read_token(void) {
+    Token *r = read_token_int();
+    if (r && context->cpp->record)
+        list_push(context->cpp->record, r);
+    return r;
+}
+
+// Preprocesses the rest of the input.
+List *read_all_tokens(void) {
+    List *r = make_list();
+    for (Token *tok; (tok = read_token()) != NULL;)
+        list_push(r, tok);
+    return r;
+}
+
+// Makes read_token() return tokens already read by read_all_tokens().
+void replay_tokens(List *tokens) {
+    context->cpp->replay = list_reverse(tokens);
+}
+
+// Makes read_token() return the tokens made by fn, which returns NULL at
+// the end of input.
+void set_token_source(Token *(*fn)(void *data), void *data) {
+    context->cpp->replay = make_list();
+    context->cpp->source = fn;
+    context->cpp->source_data = data;
+}
+
+// Makes read_token() append the tokens it returns to list, or stops
+// recording if list is NULL. A token given back with unget_token() is
+// removed again, so the list holds the tokens the parser consumed.
+void record_tokens(List *list) {
+    context->cpp->record = list;
+}
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 #include "dict.h"
 
 typedef struct DictEntry {
@@ -11,12 +12,20 @@ typedef struct DictEntry {
 } DictEntry;
 
 void *make_dict(void *parent) {
-    Dict *r = malloc(sizeof(Dict));
+    Dict *r = arena_malloc(sizeof(Dict));
     r->list = make_list();
     r->parent = parent;
     return r;
 }
 
+// Frees a dictionary and its entries, but not the keys and values.
+void dict_free(Dict *dict) {
+    for (Iter *i = list_iter(dict->list); !iter_end(i);)
+        arena_free(iter_next(i));
+    list_free(dict->list);
+    arena_free(dict);
+}
+
 void *dict_get(Dict *dict, char *key) {
     for (; dict; dict = dict->parent) {
         for (Iter *i = list_iter(dict->list); !iter_end(i);) {
@@ -29,7 +38,7 @@ void *dict_get(Dict *dict, char *key) {
 }
 
 void dict_put(Dict *dict, char *key, void *val) {
-    DictEntry *e = malloc(sizeof(DictEntry));
+    DictEntry *e = arena_malloc(sizeof(DictEntry));
     e->key = key;
     e->val = val;
     list_unshift(dict->list, e);
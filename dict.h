@@ -16,6 +16,7 @@ typedef struct Dict {
     ((Dict){ &EMPTY_LIST, NULL })
 
 void *make_dict(void *parent);
+void dict_free(Dict *dict);
 void *dict_get(Dict *dict, char *key);
 void dict_put(Dict *dict, char *key, void *val);
 void dict_remove(Dict *dict, char *key);
@@ -0,0 +1,213 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Writes an object made by the integrated assembler as an ELF64
+ * relocatable file.
+ *
+ * Labels starting with ".L" do not go into the symbol table, as with
+ * GNU as. Relocations against them refer to their section instead.
+ */
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "8cc.h"
+
+static void append(String *s, void *p, int size) {
+    for (int i = 0; i < size; i++)
+        string_append(s, ((char *)p)[i]);
+}
+
+static void pad(String *s, int align) {
+    while (string_len(s) % align)
+        string_append(s, 0);
+}
+
+static int add_name(String *tab, char *name) {
+    int r = string_len(tab);
+    append(tab, name, strlen(name) + 1);
+    return r;
+}
+
+static bool is_local_label(Symbol *sym) {
+    return !strncmp(sym->name, ".L", 2);
+}
+
+static int get_reloc_type(int type) {
+    switch (type) {
+    case RELOC_PC32:  return R_X86_64_PC32;
+    case RELOC_PLT32: return R_X86_64_PLT32;
+    case RELOC_32:    return R_X86_64_32;
+    case RELOC_32S:   return R_X86_64_32S;
+    case RELOC_64:    return R_X86_64_64;
+    default:
+        error("internal error: unknown relocation %d", type);
+    }
+}
+
+static long get_section_flags(char *name) {
+    if (!strcmp(name, ".text"))
+        return SHF_ALLOC | SHF_EXECINSTR;
+    if (!strcmp(name, ".rodata"))
+        return SHF_ALLOC;
+    return SHF_ALLOC | SHF_WRITE;
+}
+
+static void add_symbol(String *symtab, String *strtab, Symbol *sym, int shndx, int info) {
+    Elf64_Sym esym;
+    memset(&esym, 0, sizeof(esym));
+    esym.st_name = sym ? add_name(strtab, sym->name) : 0;
+    esym.st_info = info;
+    esym.st_shndx = shndx;
+    esym.st_value = sym ? sym->value : 0;
+    append(symtab, &esym, sizeof(esym));
+}
+
+static void add_shdr(String *shdrs, int name, int type, long flags, long off, long size,
+                     int link, int info, int align, int entsize) {
+    Elf64_Shdr shdr;
+    memset(&shdr, 0, sizeof(shdr));
+    shdr.sh_name = name;
+    shdr.sh_type = type;
+    shdr.sh_flags = flags;
+    shdr.sh_offset = off;
+    shdr.sh_size = size;
+    shdr.sh_link = link;
+    shdr.sh_info = info;
+    shdr.sh_addralign = align;
+    shdr.sh_entsize = entsize;
+    append(shdrs, &shdr, sizeof(shdr));
+}
+
+// Returns the index of sec in the section header table.
+static int get_shndx(Object *obj, Section *sec) {
+    int i = 1;
+    for (Iter *iter = list_iter(obj->sections); !iter_end(iter); i++)
+        if (iter_next(iter) == sec)
+            return i;
+    error("internal error: unknown section");
+}
+
+/*
+ * The section header table is laid out as follows: the null section,
+ * the sections of the object, a .rela section for each of them that
+ * has relocations, .note.GNU-stack (no executable stack), .symtab,
+ * .strtab and .shstrtab.
+ */
+void write_elf(char *path, Object *obj) {
+    int nsecs = list_len(obj->sections);
+    int nrela = 0;
+    for (Iter *i = list_iter(obj->sections); !iter_end(i);)
+        if (list_len(((Section *)iter_next(i))->relocs) > 0)
+            nrela++;
+    int symtab_ndx = nsecs + nrela + 2;
+
+    // Symbol table: null, section symbols, locals, then globals.
+    String *symtab = make_string();
+    String *strtab = make_string();
+    string_append(strtab, 0);
+    add_symbol(symtab, strtab, NULL, 0, 0);
+    for (int i = 1; i <= nsecs; i++)
+        add_symbol(symtab, strtab, NULL, i, ELF64_ST_INFO(STB_LOCAL, STT_SECTION));
+    int nsyms = nsecs + 1;
+    for (Iter *i = list_iter(obj->symbols); !iter_end(i);) {
+        Symbol *sym = iter_next(i);
+        if (sym->global || !sym->section || is_local_label(sym))
+            continue;
+        sym->index = nsyms++;
+        add_symbol(symtab, strtab, sym, get_shndx(obj, sym->section),
+                   ELF64_ST_INFO(STB_LOCAL, STT_NOTYPE));
+    }
+    int nlocals = nsyms;
+    for (Iter *i = list_iter(obj->symbols); !iter_end(i);) {
+        Symbol *sym = iter_next(i);
+        if (!(sym->global || !sym->section) || is_local_label(sym))
+            continue;
+        sym->index = nsyms++;
+        add_symbol(symtab, strtab, sym, sym->section ? get_shndx(obj, sym->section) : SHN_UNDEF,
+                   ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE));
+    }
+
+    String *file = make_string();
+    String *shdrs = make_string();
+    String *shstrtab = make_string();
+    string_append(shstrtab, 0);
+    Elf64_Ehdr ehdr;
+    append(file, &ehdr, sizeof(ehdr));
+    add_shdr(shdrs, 0, SHT_NULL, 0, 0, 0, 0, 0, 0, 0);
+
+    for (Iter *i = list_iter(obj->sections); !iter_end(i);) {
+        Section *sec = iter_next(i);
+        pad(file, sec->align);
+        long off = string_len(file);
+        if (sec->body)
+            append(file, get_cstring(sec->body), sec->size);
+        add_shdr(shdrs, add_name(shstrtab, sec->name), sec->body ? SHT_PROGBITS : SHT_NOBITS,
+                 get_section_flags(sec->name), off, sec->size, 0, 0, sec->align, 0);
+    }
+    for (Iter *i = list_iter(obj->sections); !iter_end(i);) {
+        Section *sec = iter_next(i);
+        if (list_len(sec->relocs) == 0)
+            continue;
+        pad(file, 8);
+        long off = string_len(file);
+        for (Iter *j = list_iter(sec->relocs); !iter_end(j);) {
+            Reloc *rel = iter_next(j);
+            Elf64_Rela rela;
+            rela.r_offset = rel->offset;
+            rela.r_addend = rel->addend;
+            int symndx = rel->sym->index;
+            if (is_local_label(rel->sym)) {
+                symndx = get_shndx(obj, rel->sym->section);
+                rela.r_addend += rel->sym->value;
+            }
+            rela.r_info = ELF64_R_INFO(symndx, get_reloc_type(rel->type));
+            append(file, &rela, sizeof(rela));
+        }
+        add_shdr(shdrs, add_name(shstrtab, format(".rela%s", sec->name)), SHT_RELA, SHF_INFO_LINK,
+                 off, string_len(file) - off, symtab_ndx, get_shndx(obj, sec), 8,
+                 sizeof(Elf64_Rela));
+    }
+    add_shdr(shdrs, add_name(shstrtab, ".note.GNU-stack"), SHT_PROGBITS, 0,
+             string_len(file), 0, 0, 0, 1, 0);
+
+    pad(file, 8);
+    add_shdr(shdrs, add_name(shstrtab, ".symtab"), SHT_SYMTAB, 0, string_len(file),
+             string_len(symtab), symtab_ndx + 1, nlocals, 8, sizeof(Elf64_Sym));
+    append(file, get_cstring(symtab), string_len(symtab));
+    add_shdr(shdrs, add_name(shstrtab, ".strtab"), SHT_STRTAB, 0, string_len(file),
+             string_len(strtab), 0, 0, 1, 0);
+    append(file, get_cstring(strtab), string_len(strtab));
+    int shstrtab_name = add_name(shstrtab, ".shstrtab");
+    add_shdr(shdrs, shstrtab_name, SHT_STRTAB, 0, string_len(file),
+             string_len(shstrtab), 0, 0, 1, 0);
+    append(file, get_cstring(shstrtab), string_len(shstrtab));
+
+    pad(file, 8);
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    ehdr.e_type = ET_REL;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_shoff = string_len(file);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = symtab_ndx + 3;
+    ehdr.e_shstrndx = symtab_ndx + 2;
+    memcpy(get_cstring(file), &ehdr, sizeof(ehdr));
+    append(file, get_cstring(shdrs), string_len(shdrs));
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        error("Cannot open output file: %s", path);
+    if (fwrite(get_cstring(file), 1, string_len(file), fp) != string_len(file) || fclose(fp)) {
+        unlink(path);
+        error("Failed to write %s", path);
+    }
+}
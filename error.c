@@ -8,25 +8,40 @@
 
 bool suppress_warning = false;
 
+static FILE *diag_file(void) {
+    return (context && context->diag) ? context->diag : stderr;
+}
+
+static bool is_tty(FILE *fp) {
+    return fp == stderr && isatty(fileno(stderr));
+}
+
+static void print_diag(char *kind, char *pos, char *fmt, va_list args) {
+    char *msg = vformat(fmt, args);
+    FILE *fp = diag_file();
+    if (is_tty(fp))
+        fprintf(fp, "\e[1;31m[%s]\e[0m %s: %s\n", kind, pos, msg);
+    else
+        fprintf(fp, "[%s] %s: %s\n", kind, pos, msg);
+    if (context && context->diag_copy)
+        fprintf(context->diag_copy, "[%s] %s: %s\n", kind, pos, msg);
+}
+
 void errorf(char *file, int line, char *fmt, ...) {
-    fprintf(stderr, isatty(fileno(stderr)) ? "\e[1;31m[ERROR]\e[0m " : "[ERROR] ");
-    fprintf(stderr, "%s:%d: %s: ", file, line, input_position());
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    print_diag("ERROR", format("%s:%d: %s", file, line, input_position()), fmt, args);
     va_end(args);
+    if (context && context->on_error)
+        longjmp(*context->on_error, 1);
     exit(1);
 }
 
 void warn(char *fmt, ...) {
     if (suppress_warning)
         return;
-    fprintf(stderr, isatty(fileno(stderr)) ? "\e[1;31m[WARNING]\e[0m " : "[WARNING] ");
-    fprintf(stderr, "%s: ", input_position());
     va_list args;
     va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
+    print_diag("WARNING", input_position(), fmt, args);
     va_end(args);
 }
@@ -14,8 +14,10 @@
 
 #ifndef __8cc__
 #define NORETURN __attribute__((noreturn))
+#define THREAD_LOCAL __thread
 #else
 #define NORETURN
+#define THREAD_LOCAL
 #endif
 
 extern void errorf(char *file, int line, char *fmt, ...) NORETURN;
@@ -0,0 +1,699 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Header file cache.
+ *
+ * A long-running compile server keeps the contents of header files it
+ * has seen, so that compilations forked from it read headers from
+ * memory instead of the file system. An entry is used only if the file
+ * still has the same device, inode, size and modification time.
+ *
+ * Headers that were looked up but did not exist are cached too, as most
+ * lookups along the include path fail. Such an entry stays valid as
+ * long as the directory it was looked up in has not been modified.
+ *
+ * Programs embedding the compiler can also supply headers from memory
+ * through a callback in the context, which is asked before the disk.
+ *
+ * With -fprefetch-headers, a helper thread reads the source file ahead
+ * of the preprocessor, looks for #include lines, and reads the headers
+ * they name from wherever the preprocessor would look for them,
+ * recursively. open_header() then gets them from memory. Headers that
+ * were looked up but did not exist are remembered as well. Includes
+ * are prefetched regardless of conditionals, and computed includes are
+ * not prefetched at all.
+ *
+ * With -fshared-headers, the headers are kept in a POSIX shared memory
+ * segment that all 8cc processes of a user map, so that concurrent
+ * compilations read and lex each header only once. An entry holds the
+ * tokens of a header along with its include guard, the macro X if the
+ * header is "#ifndef X ... #endif" with nothing outside. A header whose
+ * include guard is defined would come out empty, so the preprocessor
+ * does not include it again. When the segment fills up, it is replaced
+ * by an empty one.
+ */
+
+// For fmemopen() and st_mtim
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "8cc.h"
+
+typedef struct {
+    // Stat of the file, or of its directory if the file does not exist
+    struct stat st;
+    // NULL if the file does not exist
+    char *body;
+    int size;
+} CachedFile;
+
+static Dict *cache = &EMPTY_DICT;
+static int report_fd = -1;
+
+static char *get_dirname(char *path) {
+    return dirname(format("%s", path));
+}
+
+static bool same_stat(struct stat *a, struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+        a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static bool is_fresh(CachedFile *f, char *path) {
+    struct stat st;
+    if (stat(f->body ? path : get_dirname(path), &st) < 0)
+        return false;
+    return same_stat(&st, &f->st);
+}
+
+// Tells the process listening on report_fd which files were read from
+// disk, so that it can add them to its cache.
+static void report(char c, char *path) {
+    if (report_fd < 0)
+        return;
+    char *line = format("%c%s\n", c, path);
+    if (write(report_fd, line, strlen(line)) < 0)
+        perror("write");
+}
+
+void set_file_report_fd(int fd) {
+    report_fd = fd;
+}
+
+// Opens a header file supplied through the context's callback.
+static FILE *open_virtual_header(char *path) {
+    if (!context || !context->read_file)
+        return NULL;
+    int len;
+    char *body = context->read_file(path, &len, context->read_file_data);
+    if (!body)
+        return NULL;
+    // fmemopen() does not accept an empty buffer.
+    return (len > 0) ? fmemopen(body, len, "r") : fmemopen("\n", 1, "r");
+}
+
+static bool open_prefetched_header(char *path, FILE **fp);
+static bool open_shared_header(char *path, FILE **fp, char **tokens, long *len);
+
+// Returns false if the header does not exist. Otherwise sets *fp, or
+// sets it to NULL and *tokens to a token stream of *len bytes.
+bool open_header(char *path, FILE **fp, char **tokens, long *len) {
+    if ((*fp = open_virtual_header(path)))
+        return true;
+    if (open_prefetched_header(path, fp))
+        return *fp != NULL;
+    CachedFile *f = dict_get(cache, path);
+    if (f && is_fresh(f, path)) {
+        if (!f->body)
+            return false;
+        *fp = fmemopen(f->body, f->size, "r");
+        return *fp != NULL;
+    }
+    if (open_shared_header(path, fp, tokens, len))
+        return true;
+    *fp = fopen(path, "r");
+    report(*fp ? '+' : '-', path);
+    return *fp != NULL;
+}
+
+static CachedFile *read_file(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    CachedFile *r = malloc(sizeof(CachedFile));
+    if (fstat(fileno(fp), &r->st) < 0 || r->st.st_size == 0) {
+        // fmemopen() does not accept an empty buffer.
+        fclose(fp);
+        return NULL;
+    }
+    r->size = r->st.st_size;
+    r->body = malloc(r->size);
+    if (fread(r->body, 1, r->size, fp) != r->size) {
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    return r;
+}
+
+static CachedFile *read_missing_file(char *path) {
+    CachedFile *r = malloc(sizeof(CachedFile));
+    if (stat(path, &r->st) == 0 || stat(get_dirname(path), &r->st) < 0)
+        return NULL;
+    r->body = NULL;
+    r->size = 0;
+    return r;
+}
+
+// Handles a line written by report().
+void cache_reported_file(char *line) {
+    char *path = line + 1;
+    CachedFile *f = (line[0] == '+') ? read_file(path) : read_missing_file(path);
+    if (!f)
+        return;
+    dict_remove(cache, path);
+    dict_put(cache, format("%s", path), f);
+}
+
+/*----------------------------------------------------------------------
+ * Prefetching
+ */
+
+#ifdef __8cc__
+
+// 8cc has no thread-local variables, so it does not prefetch.
+void start_prefetch(char *file, List *include_path) {}
+
+static bool open_prefetched_header(char *path, FILE **fp) {
+    return false;
+}
+
+#else
+
+#include <pthread.h>
+
+// Files the helper thread has looked up. Only the stat of the file is
+// not filled in.
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static Dict *prefetched;
+
+// Returns false if path has not been looked up yet.
+static bool open_prefetched_header(char *path, FILE **fp) {
+    if (!prefetched)
+        return false;
+    pthread_mutex_lock(&prefetch_lock);
+    CachedFile *f = dict_get(prefetched, path);
+    pthread_mutex_unlock(&prefetch_lock);
+    if (!f)
+        return false;
+    *fp = f->body ? fmemopen(f->body, f->size, "r") : NULL;
+    return true;
+}
+
+static char *read_whole_file(char *path, int *size) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    String *s = make_string();
+    char buf[8192];
+    for (int n; (n = fread(buf, 1, sizeof(buf), fp)) > 0;)
+        for (int i = 0; i < n; i++)
+            string_append(s, buf[i]);
+    fclose(fp);
+    *size = string_len(s);
+    return get_cstring(s);
+}
+
+// Reads path into the prefetched files unless it has been looked up
+// already. Returns the file, or NULL if it does not exist.
+static CachedFile *prefetch(char *path) {
+    pthread_mutex_lock(&prefetch_lock);
+    CachedFile *f = dict_get(prefetched, path);
+    pthread_mutex_unlock(&prefetch_lock);
+    if (f)
+        return f->body ? f : NULL;
+    f = malloc(sizeof(CachedFile));
+    f->body = read_whole_file(path, &f->size);
+    // fmemopen() does not accept an empty buffer.
+    if (f->body && f->size == 0) {
+        f->body = "\n";
+        f->size = 1;
+    }
+    pthread_mutex_lock(&prefetch_lock);
+    dict_put(prefetched, path, f);
+    pthread_mutex_unlock(&prefetch_lock);
+    return f->body ? f : NULL;
+}
+
+// Returns the name in an "#include" line starting at p, or NULL. *std
+// is set for <name>.
+static char *read_include_name(char *p, char *end, bool *std) {
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p == end || *p++ != '#')
+        return NULL;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (end - p < 7 || strncmp(p, "include", 7))
+        return NULL;
+    p += 7;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p == end || (*p != '"' && *p != '<'))
+        return NULL;
+    char close = (*p == '"') ? '"' : '>';
+    *std = (close == '>');
+    char *start = ++p;
+    while (p < end && *p != close && *p != '\n')
+        p++;
+    if (p == end || *p != close || p == start)
+        return NULL;
+    return format("%.*s", (int)(p - start), start);
+}
+
+typedef struct {
+    char *file;
+    List *include_path;
+} PrefetchArgs;
+
+// Looks up the headers of each file in the same order as read_include()
+// in cpp.c, breadth first.
+static void *run_prefetch(void *arg) {
+    PrefetchArgs *args = arg;
+    List *queue = make_list1(args->file);
+    Dict *seen = make_dict(NULL);
+    int size;
+    List *bodies = make_list1(read_whole_file(args->file, &size));
+    while (list_len(queue) > 0) {
+        char *file = list_shift(queue);
+        char *p = list_shift(bodies);
+        if (!p)
+            continue;
+        char *end = p + strlen(p);
+        char *dir = dirname(format("%s", file));
+        for (char *eol; p < end; p = eol + 1) {
+            eol = strchr(p, '\n');
+            if (!eol)
+                eol = end;
+            bool std;
+            char *name = read_include_name(p, end, &std);
+            if (!name)
+                continue;
+            List *dirs = std ? list_copy(args->include_path) : make_list1(dir);
+            if (!std)
+                list_append(dirs, args->include_path);
+            for (Iter *i = list_iter(dirs); !iter_end(i);) {
+                char *path = format("%s/%s", iter_next(i), name);
+                CachedFile *f = prefetch(path);
+                if (!f)
+                    continue;
+                if (!dict_get(seen, path)) {
+                    dict_put(seen, path, f);
+                    list_push(queue, path);
+                    list_push(bodies, f->body);
+                }
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Starts prefetching the headers of file. include_path is the list of
+// directories searched for all headers, as in cpp.c.
+void start_prefetch(char *file, List *include_path) {
+    prefetched = make_dict(NULL);
+    PrefetchArgs *args = malloc(sizeof(PrefetchArgs));
+    args->file = file;
+    args->include_path = include_path;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_prefetch, args) == 0)
+        pthread_detach(thread);
+}
+
+#endif
+
+/*----------------------------------------------------------------------
+ * Shared header cache
+ */
+
+#ifdef __8cc__
+
+// 8cc has no atomic operations, so it does not share headers.
+void open_shared_headers(void) {}
+
+char *get_include_guard(char *path) {
+    return NULL;
+}
+
+static bool open_shared_header(char *path, FILE **fp, char **tokens, long *len) {
+    return false;
+}
+
+#else
+
+#include <sys/mman.h>
+
+#define SHM_MAGIC 0x38636302
+#define SHM_SIZE (64L << 20)
+#define SHM_SLOTS 16384
+
+// Entries are appended to the segment and never move. A slot holds the
+// offset of an entry, or 0. Slots are written only while holding the
+// lock on the segment, but are read without it: an entry is complete
+// before its offset is stored.
+//
+// A full segment is retired: it is removed, so that processes opening
+// it by name get a new one, and processes that have it mapped move on
+// to the new one when they see it retired. They keep the old mapping,
+// which their tokens and include guards point into.
+typedef struct {
+    int magic;
+    int retired;
+    long used;
+    long slots[SHM_SLOTS];
+} ShmHeader;
+
+// Followed by the path, the include guard and the data, which is a
+// token stream made by make_token_stream(), or the contents of the file
+// if it could not be made into one. The path and the guard are
+// NUL-terminated; the guard is empty if the header has none.
+typedef struct {
+    long dev;
+    long ino;
+    long size;
+    long mtime;
+    long mtime_nsec;
+    long datalen;
+    int pathlen;
+    int guardlen;
+    bool tokens;
+} ShmEntry;
+
+static char *shm_name;
+static int shm_fd = -1;
+static ShmHeader *shm;
+static Dict *guards = &EMPTY_DICT;
+
+// Returns false, and stops sharing headers, if the lock fails.
+static bool lock_shm(short type) {
+    struct flock fl = { .l_type = type, .l_whence = SEEK_SET };
+    while (fcntl(shm_fd, F_SETLKW, &fl) < 0) {
+        if (errno == EINTR)
+            continue;
+        warn("cannot lock shared header segment %s: %s", shm_name, strerror(errno));
+        close(shm_fd);
+        shm_fd = -1;
+        shm = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Maps the segment, creating it if it does not exist.
+static bool map_shm(void) {
+    shm_fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+    if (shm_fd < 0)
+        return false;
+    if (!lock_shm(F_WRLCK))
+        return false;
+    struct stat st;
+    ShmHeader *p = MAP_FAILED;
+    if (fstat(shm_fd, &st) == 0 && (st.st_size == SHM_SIZE || ftruncate(shm_fd, SHM_SIZE) == 0))
+        p = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (p != MAP_FAILED && p->magic != SHM_MAGIC) {
+        memset(p, 0, sizeof(ShmHeader));
+        p->used = sizeof(ShmHeader);
+        p->magic = SHM_MAGIC;
+    }
+    if (!lock_shm(F_UNLCK))
+        return false;
+    if (p == MAP_FAILED) {
+        close(shm_fd);
+        shm_fd = -1;
+        return false;
+    }
+    shm = p;
+    return true;
+}
+
+// Moves on to the new segment if this one has been retired. Returns
+// false if headers are no longer shared.
+static bool check_retired(void) {
+    if (!__atomic_load_n(&shm->retired, __ATOMIC_ACQUIRE))
+        return true;
+    close(shm_fd);
+    shm_fd = -1;
+    shm = NULL;
+    return map_shm();
+}
+
+// Called with the lock held.
+static void retire_shm(void) {
+    warn("shared header segment %s is full; starting a new one", shm_name);
+    shm_unlink(shm_name);
+    __atomic_store_n(&shm->retired, 1, __ATOMIC_RELEASE);
+}
+
+// If the segment cannot be mapped, headers are read as usual.
+void open_shared_headers(void) {
+    shm_name = getenv("EIGHTCC_SHM");
+    if (!shm_name)
+        shm_name = format("/8cc-headers-%d", getuid());
+    if (map_shm())
+        guards = make_dict(NULL);
+}
+
+char *get_include_guard(char *path) {
+    return dict_get(guards, path);
+}
+
+static char *skip_comment(char *p, char *end) {
+    if (p[1] == '/') {
+        while (p < end && *p != '\n')
+            p++;
+        return p;
+    }
+    for (p += 2; p + 1 < end; p++)
+        if (p[0] == '*' && p[1] == '/')
+            return p + 2;
+    return NULL;
+}
+
+static bool is_comment(char *p, char *end) {
+    return p + 1 < end && p[0] == '/' && (p[1] == '*' || p[1] == '/');
+}
+
+static char *read_ident(char **p, char *end) {
+    while (*p < end && (**p == ' ' || **p == '\t'))
+        (*p)++;
+    char *start = *p;
+    while (*p < end && (isalnum(**p) || **p == '_'))
+        (*p)++;
+    return format("%.*s", (int)(*p - start), start);
+}
+
+// Returns the include guard of a header, or NULL. Only "#ifndef" is
+// recognized as the opening directive.
+static char *find_include_guard(char *p, char *end) {
+    char *guard = NULL;
+    int depth = 0;
+    bool closed = false;
+    bool bol = true;
+    while (p < end) {
+        if (*p == '\n') {
+            bol = true;
+            p++;
+            continue;
+        }
+        if (isspace(*p)) {
+            p++;
+            continue;
+        }
+        if (is_comment(p, end)) {
+            if (!(p = skip_comment(p, end)))
+                return NULL;
+            continue;
+        }
+        // Anything after the #endif matching the guard
+        if (closed)
+            return NULL;
+        if (*p == '#' && bol) {
+            p++;
+            char *dir = read_ident(&p, end);
+            if (!guard) {
+                if (strcmp(dir, "ifndef"))
+                    return NULL;
+                guard = read_ident(&p, end);
+                if (!*guard)
+                    return NULL;
+                depth = 1;
+            } else if (!strcmp(dir, "if") || !strcmp(dir, "ifdef") || !strcmp(dir, "ifndef")) {
+                depth++;
+            } else if (!strcmp(dir, "endif")) {
+                closed = (--depth == 0);
+            } else if ((!strcmp(dir, "else") || !strcmp(dir, "elif")) && depth == 1) {
+                return NULL;
+            }
+            // Skip the rest of the directive.
+            while (p < end && *p != '\n') {
+                if (is_comment(p, end)) {
+                    if (!(p = skip_comment(p, end)))
+                        return NULL;
+                    continue;
+                }
+                if (*p == '\\' && p + 1 < end && p[1] == '\n')
+                    p++;
+                p++;
+            }
+            continue;
+        }
+        if (!guard)
+            return NULL;
+        bol = false;
+        if (*p == '"' || *p == '\'') {
+            char quote = *p++;
+            while (p < end && *p != quote && *p != '\n')
+                p += (*p == '\\') ? 2 : 1;
+        }
+        p++;
+    }
+    return closed ? guard : NULL;
+}
+
+static char *entry_path(ShmEntry *e) {
+    return (char *)(e + 1);
+}
+
+static char *entry_guard(ShmEntry *e) {
+    return entry_path(e) + e->pathlen + 1;
+}
+
+static char *entry_data(ShmEntry *e) {
+    return entry_guard(e) + e->guardlen + 1;
+}
+
+static bool same_entry(ShmEntry *e, char *path, struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+        e->size == st->st_size &&
+        e->mtime == st->st_mtim.tv_sec && e->mtime_nsec == st->st_mtim.tv_nsec &&
+        !strcmp(entry_path(e), path);
+}
+
+static unsigned hash_path(char *path) {
+    unsigned h = 2166136261u;
+    for (char *p = path; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    return h;
+}
+
+// Returns the entry of path, or NULL. If slot is not NULL, it is set to
+// the first empty slot, or to -1 if there is none.
+static ShmEntry *find_entry(char *path, struct stat *st, int *slot) {
+    unsigned h = hash_path(path);
+    for (int i = 0; i < SHM_SLOTS; i++) {
+        int s = (h + i) % SHM_SLOTS;
+        long off = __atomic_load_n(&shm->slots[s], __ATOMIC_ACQUIRE);
+        if (!off) {
+            if (slot)
+                *slot = s;
+            return NULL;
+        }
+        ShmEntry *e = (ShmEntry *)((char *)shm + off);
+        if (same_entry(e, path, st))
+            return e;
+    }
+    if (slot)
+        *slot = -1;
+    return NULL;
+}
+
+static ShmEntry *put_entry(int slot, long need, char *path, struct stat *st,
+                           char *guard, char *data, long datalen, bool tokens) {
+    long off = shm->used;
+    ShmEntry *e = (ShmEntry *)((char *)shm + off);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim.tv_sec;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->datalen = datalen;
+    e->pathlen = strlen(path);
+    e->guardlen = strlen(guard);
+    e->tokens = tokens;
+    strcpy(entry_path(e), path);
+    strcpy(entry_guard(e), guard);
+    memcpy(entry_data(e), data, datalen);
+    shm->used = off + need;
+    __atomic_store_n(&shm->slots[slot], off, __ATOMIC_RELEASE);
+    return e;
+}
+
+// Reads path into the segment, starting a new segment if this one is
+// full. Returns NULL if it does not fit.
+static ShmEntry *add_entry(char *path, struct stat *st) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    long size = st->st_size;
+    char *body = malloc(size + 1);
+    bool ok = (fread(body, 1, size, fp) == size);
+    fclose(fp);
+    if (!ok) {
+        free(body);
+        return NULL;
+    }
+    char *guard = find_include_guard(body, body + size);
+    if (!guard)
+        guard = "";
+    long datalen;
+    char *data = make_token_stream(body, size, &datalen);
+    bool tokens = (data != NULL);
+    if (!tokens) {
+        data = body;
+        datalen = size;
+    }
+    long need = (sizeof(ShmEntry) + strlen(path) + strlen(guard) + datalen + 2 + 7) & ~7;
+
+    ShmEntry *e = NULL;
+    for (int i = 0; i < 2 && shm && check_retired(); i++) {
+        if (!lock_shm(F_WRLCK))
+            break;
+        int slot;
+        e = find_entry(path, st, &slot);
+        if (!e && !shm->retired) {
+            if (slot >= 0 && shm->used + need <= SHM_SIZE)
+                e = put_entry(slot, need, path, st, guard, data, datalen, tokens);
+            else if (sizeof(ShmHeader) + need <= SHM_SIZE)
+                retire_shm();
+        }
+        bool retry = !e && shm->retired;
+        if (!lock_shm(F_UNLCK) || !retry)
+            break;
+    }
+    if (tokens)
+        free(data);
+    free(body);
+    return e;
+}
+
+// Returns false if path is not in the segment and cannot be added.
+static bool open_shared_header(char *path, FILE **fp, char **tokens, long *len) {
+    if (!shm || !check_retired())
+        return false;
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+    ShmEntry *e = find_entry(path, &st, NULL);
+    if (!e)
+        e = add_entry(path, &st);
+    if (!e)
+        return false;
+    if (e->guardlen) {
+        // The guards outlive the arena of the compilation.
+        Arena *saved = set_arena(NULL);
+        dict_put(guards, format("%s", path), entry_guard(e));
+        set_arena(saved);
+    }
+    if (e->tokens) {
+        *fp = NULL;
+        *tokens = entry_data(e);
+        *len = e->datalen;
+        return true;
+    }
+    // fmemopen() does not accept an empty buffer.
+    *fp = e->datalen ? fmemopen(entry_data(e), e->datalen, "r") : fmemopen("\n", 1, "r");
+    return true;
+}
+
+#endif
@@ -10,17 +10,42 @@
 static char *REGS[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static char *SREGS[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 static char *MREGS[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+// Registers for local variables
+static char *CALLEE_SAVED[] = {"rbx", "r12", "r13", "r14", "r15"};
 static int TAB = 8;
-static List *functions = &EMPTY_LIST;
-static char *lbreak;
-static char *lcontinue;
-static char *lswitch;
-static int stackpos;
-static int numgp;
-static int numfp;
-static FILE *outputfp;
+
+struct GenState {
+    List *functions;
+    char *lbreak;
+    char *lcontinue;
+    int stackpos;
+    int numgp;
+    int numfp;
+    // Number of virtual registers holding temporaries
+    int ntemps;
+    int nxtemps;
+    // Number of callee-saved registers used by the function, and the
+    // offset of the stack slot where the first one is saved
+    int nsaved;
+    int savedoff;
+    FILE *outputfp;
+    // Name of the function being emitted, if any, and its label counter
+    char *fname;
+    IrFunc *ir;
+    int labelseq;
+    // If not NULL, the emitted code is appended to it as well.
+    String *capture;
+    // Whether the code is assembly text with comments, rather than
+    // lines for the integrated assembler
+    bool annotate;
+    // If true, the code of a function is only kept in its node, to be
+    // emitted later. Used by code generation workers.
+    bool buffered;
+};
 
 static void emit_expr(Node *node);
+static void emit_load_indirect(Ctype *ctype, Node *ptr, long off);
+static void emit_store_indirect(Node *node);
 static void emit_decl_init(List *inits, int off);
 static void emit_data_int(List *inits, int size, int off, int depth);
 static void emit_data(Node *v, int off, int depth);
@@ -33,10 +58,10 @@ static void emit_data(Node *v, int off, int depth);
 #ifdef __GNUC__
 #define SAVE                                                            \
     int save_hook __attribute__((unused, cleanup(pop_function)));       \
-    list_push(functions, (void *)__func__)
+    list_push(context->gen->functions, (void *)__func__)
 
 static void pop_function(void *ignore) {
-    list_pop(functions);
+    list_pop(context->gen->functions);
 }
 #else
 #define SAVE
@@ -44,7 +69,7 @@ static void pop_function(void *ignore) {
 
 static char *get_caller_list(void) {
     String *s = make_string();
-    for (Iter *i = list_iter(functions); !iter_end(i);) {
+    for (Iter *i = list_iter(context->gen->functions); !iter_end(i);) {
         string_appendf(s, "%s", iter_next(i));
         if (!iter_end(i))
             string_appendf(s, " -> ");
@@ -52,76 +77,158 @@ static char *get_caller_list(void) {
     return get_cstring(s);
 }
 
+// If fp is NULL, the code goes to the integrated assembler.
 void set_output_file(FILE *fp) {
-    outputfp = fp;
+    context->gen->outputfp = fp;
+    context->gen->annotate = (fp != NULL);
 }
 
 void close_output_file(void) {
-    fclose(outputfp);
+    if (context->gen->outputfp)
+        fclose(context->gen->outputfp);
+}
+
+// Writes a line of code out. note is the annotation for assembly output.
+static void emit_line(char *text, char *note) {
+    GenState *s = context->gen;
+    if (!s->annotate) {
+        if (!s->buffered)
+            assemble(text);
+        if (s->capture)
+            string_appendf(s->capture, "%s\n", text);
+        return;
+    }
+    int col = strlen(text);
+    if (*text == '\t')
+        col += TAB - 1;
+    int space = (28 - col) > 0 ? (30 - col) : 2;
+    if (!s->buffered)
+        fprintf(s->outputfp, "%s%*c %s\n", text, space, '#', note);
+    if (s->capture)
+        string_appendf(s->capture, "%s%*c %s\n", text, space, '#', note);
 }
 
+// The code of a function goes to its IR first.
 static void emitf(int line, char *fmt, ...) {
+    GenState *s = context->gen;
     va_list args;
     va_start(args, fmt);
-    int col = vfprintf(outputfp, fmt, args);
+    char *text = vformat(fmt, args);
     va_end(args);
+    char *note = s->annotate ? format("%s:%d", get_caller_list(), line) : NULL;
+    if (s->ir)
+        ir_append(s->ir, text, note);
+    else
+        emit_line(text, note);
+}
 
-    for (char *p = fmt; *p; p++)
-        if (*p == '\t')
-            col += TAB - 1;
-    int space = (28 - col) > 0 ? (30 - col) : 2;
-    fprintf(outputfp, "%*c %s:%d\n", space, '#', get_caller_list(), line);
+// Emits code captured by emitf() in an earlier compilation.
+static void emit_code(char *code) {
+    if (context->gen->outputfp) {
+        fputs(code, context->gen->outputfp);
+        return;
+    }
+    char *p = format("%s", code);
+    for (char *nl; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+        *nl = '\0';
+        assemble(p);
+    }
+}
+
+// Labels in a function continue the numbering of the parser's labels
+// in the function.
+static char *make_label(void) {
+    GenState *s = context->gen;
+    if (s->fname)
+        return format(".L%s.%d", s->fname, s->labelseq++);
+    return format(".L%d", s->labelseq++);
 }
 
 static char *get_int_reg(Ctype *ctype, char r) {
-    assert(r == 'a' || r == 'c');
+    assert(r == 'a' || r == 'c' || r == 'd');
     switch (ctype->size) {
-    case 1: return (r == 'a') ? "al" : "cl";
-    case 2: return (r == 'a') ? "ax" : "cx";
-    case 4: return (r == 'a') ? "eax" : "ecx";
-    case 8: return (r == 'a') ? "rax" : "rcx";
+    case 1: return format("%cl", r);
+    case 2: return format("%cx", r);
+    case 4: return format("e%cx", r);
+    case 8: return format("r%cx", r);
     default:
         error("Unknown data size: %s: %d", c2s(ctype), ctype->size);
     }
 }
 
-static char *get_load_inst(Ctype *ctype) {
+// Returns the 32-bit name of a 64-bit register, as in ebx or r12d.
+static char *get_reg32(char *reg) {
+    if (reg[1] >= '0' && reg[1] <= '9')
+        return format("%sd", reg);
+    return format("e%s", reg + 1);
+}
+
+/*
+ * Moves an integer of ctype from src into the 64-bit register reg,
+ * sign- or zero-extending it by the signedness of the type. A 32-bit
+ * mov clears the upper half of the register.
+ *
+ * Integers narrower than 8 bytes are computed in 32 bits, so only the
+ * lower half of rax is meaningful for them; it is extended when they
+ * are converted to a wider type or used as an index.
+ */
+static void emit_extend(Ctype *ctype, char *src, char *reg) {
+    SAVE;
+    bool sig = ctype->sig && ctype->type != CTYPE_BOOL;
     switch (ctype->size) {
-    case 1: return "movsbq";
-    case 2: return "movswq";
-    case 4: return "movslq";
-    case 8: return "mov";
+    case 1: emit("%s %s, %%%s", sig ? "movsbq" : "movzbq", src, reg); break;
+    case 2: emit("%s %s, %%%s", sig ? "movswq" : "movzwq", src, reg); break;
+    case 4:
+        if (sig)
+            emit("movslq %s, %%%s", src, reg);
+        else
+            emit("mov %s, %%%s", src, get_reg32(reg));
+        break;
+    case 8: emit("mov %s, %%%s", src, reg); break;
     default:
         error("Unknown data size: %s: %d", c2s(ctype), ctype->size);
     }
 }
 
+// Whether an integer of ctype is computed with 32-bit instructions
+static bool is_narrow(Ctype *ctype) {
+    return ctype->size < 8;
+}
+
+// Sets the flags by the integer in rax, as wide as it is kept for ctype.
+static void emit_test(Ctype *ctype) {
+    if (is_inttype(ctype) && is_narrow(ctype))
+        emit("test %%eax, %%eax");
+    else
+        emit("test %%rax, %%rax");
+}
+
 static void push_xmm(int reg) {
     SAVE;
     emit("sub $8, %%rsp");
     emit("movsd %%xmm%d, (%%rsp)", reg);
-    stackpos += 8;
+    context->gen->stackpos += 8;
 }
 
 static void pop_xmm(int reg) {
     SAVE;
     emit("movsd (%%rsp), %%xmm%d", reg);
     emit("add $8, %%rsp");
-    stackpos -= 8;
-    assert(stackpos >= 0);
+    context->gen->stackpos -= 8;
+    assert(context->gen->stackpos >= 0);
 }
 
 static void push(char *reg) {
     SAVE;
     emit("push %%%s", reg);
-    stackpos += 8;
+    context->gen->stackpos += 8;
 }
 
 static void pop(char *reg) {
     SAVE;
     emit("pop %%%s", reg);
-    stackpos -= 8;
-    assert(stackpos >= 0);
+    context->gen->stackpos -= 8;
+    assert(context->gen->stackpos >= 0);
 }
 
 static void maybe_emit_bitshift_load(Ctype *ctype) {
@@ -152,43 +259,43 @@ static void maybe_emit_bitshift_save(Ctype *ctype, char *addr) {
     pop("rcx");
 }
 
+static void emit_load(Ctype *ctype, char *addr);
+
 static void emit_gload(Ctype *ctype, char *label, int off) {
     SAVE;
-    if (ctype->type == CTYPE_ARRAY) {
-        if (off)
-            emit("lea %s+%d(%%rip), %%rax", label, off);
-        else
-            emit("lea %s(%%rip), %%rax", label);
-        return;
-    }
-    char *inst = get_load_inst(ctype);
-    emit("%s %s+%d(%%rip), %%rax", inst, label, off);
-    maybe_emit_bitshift_load(ctype);
+    emit_load(ctype, off ? format("%s+%d(%%rip)", label, off) : format("%s(%%rip)", label));
 }
 
+// Converts a floating point number to an integer. The conversion is
+// done in 64 bits, which is exact for unsigned int too.
 static void emit_toint(Ctype *ctype) {
     SAVE;
     if (ctype->type == CTYPE_FLOAT)
-        emit("cvttss2si %%xmm0, %%eax");
-    else if (ctype->type == CTYPE_FLOAT)
-        emit("cvttsd2si %%xmm0, %%eax");
+        emit("cvttss2si %%xmm0, %%rax");
+    else if (is_flotype(ctype))
+        emit("cvttsd2si %%xmm0, %%rax");
 }
 
-static void emit_lload(Ctype *ctype, char *base, int off) {
+// Loads a value of ctype from a memory operand.
+static void emit_load(Ctype *ctype, char *addr) {
     SAVE;
     if (ctype->type == CTYPE_ARRAY) {
-        emit("lea %d(%%%s), %%rax", off, base);
+        emit("lea %s, %%rax", addr);
     } else if (ctype->type == CTYPE_FLOAT) {
-        emit("movss %d(%%%s), %%xmm0", off, base);
+        emit("movss %s, %%xmm0", addr);
     } else if (ctype->type == CTYPE_DOUBLE || ctype->type == CTYPE_LDOUBLE) {
-        emit("movsd %d(%%%s), %%xmm0", off, base);
+        emit("movsd %s, %%xmm0", addr);
     } else {
-        char *inst = get_load_inst(ctype);
-        emit("%s %d(%%%s), %%rax", inst, off, base);
+        emit_extend(ctype, addr, "rax");
         maybe_emit_bitshift_load(ctype);
     }
 }
 
+static void emit_lload(Ctype *ctype, char *base, int off) {
+    SAVE;
+    emit_load(ctype, format("%d(%%%s)", off, base));
+}
+
 static void maybe_convert_bool(Ctype *ctype) {
     if (ctype->type == CTYPE_BOOL) {
         emit("test %%rax, %%rax");
@@ -221,41 +328,12 @@ static void emit_lsave(Ctype *ctype, int off) {
     }
 }
 
-static void emit_assign_deref_int(Ctype *ctype, int off) {
+// Moves rax to the register of a local, extended in the same way as
+// a load from the stack.
+static void emit_rsave(Ctype *ctype, char *reg) {
     SAVE;
-    emit("mov (%%rsp), %%rcx");
-    char *reg = get_int_reg(ctype, 'c');
-    if (off)
-        emit("mov %%%s, %d(%%rax)", reg, off);
-    else
-        emit("mov %%%s, (%%rax)", reg);
-    pop("rax");
-}
-
-static void emit_assign_deref(Node *var) {
-    SAVE;
-    push("rax");
-    emit_expr(var->operand);
-    emit_assign_deref_int(var->operand->ctype->ptr, 0);
-}
-
-static void emit_pointer_arith(char type, Node *left, Node *right) {
-    SAVE;
-    emit_expr(left);
-    push("rcx");
-    push("rax");
-    emit_expr(right);
-    int size = left->ctype->ptr->size;
-    if (size > 1)
-        emit("imul $%d, %%rax", size);
-    emit("mov %%rax, %%rcx");
-    pop("rax");
-    switch (type) {
-    case '+': emit("add %%rcx, %%rax"); break;
-    case '-': emit("sub %%rcx, %%rax"); break;
-    default: error("invalid operator '%d'", type);
-    }
-    pop("rcx");
+    maybe_convert_bool(ctype);
+    emit_extend(ctype, format("%%%s", get_int_reg(ctype, 'a')), reg);
 }
 
 static void emit_zero_filler(int start, int end) {
@@ -287,11 +365,6 @@ static void emit_assign_struct_ref(Node *struc, Ctype *field, int off) {
     case AST_STRUCT_REF:
         emit_assign_struct_ref(struc->struc, field, off + struc->ctype->offset);
         break;
-    case AST_DEREF:
-        push("rax");
-        emit_expr(struc->operand);
-        emit_assign_deref_int(field, field->offset + off);
-        break;
     default:
         error("internal error: %s", a2s(struc));
     }
@@ -311,71 +384,983 @@ static void emit_load_struct_ref(Node *struc, Ctype *field, int off) {
         emit_load_struct_ref(struc->struc, field, struc->ctype->offset + off);
         break;
     case AST_DEREF:
-        emit_expr(struc->operand);
-        emit_lload(field, "rax", field->offset + off);
+        emit_load_indirect(field, struc->operand, field->offset + off);
         break;
     default:
         error("internal error: %s", a2s(struc));
     }
 }
 
+// Returns the struct variable or dereference a chain of struct
+// references starts from.
+static Node *get_struct_root(Node *node) {
+    while (node->type == AST_STRUCT_REF)
+        node = node->struc;
+    return node;
+}
+
 static void emit_store(Node *var) {
     SAVE;
     switch (var->type) {
-    case AST_DEREF: emit_assign_deref(var); break;
-    case AST_STRUCT_REF: emit_assign_struct_ref(var->struc, var->ctype, 0); break;
+    case AST_DEREF: emit_store_indirect(var); break;
+    case AST_STRUCT_REF:
+        if (get_struct_root(var)->type == AST_DEREF)
+            emit_store_indirect(var);
+        else
+            emit_assign_struct_ref(var->struc, var->ctype, 0);
+        break;
     case AST_LVAR:
         ensure_lvar_init(var);
-        emit_lsave(var->ctype, var->loff);
+        if (var->lreg)
+            emit_rsave(var->ctype, var->lreg);
+        else
+            emit_lsave(var->ctype, var->loff);
         break;
     case AST_GVAR: emit_gsave(var->varname, var->ctype, 0); break;
     default: error("internal error");
     }
 }
 
+/*
+ * Binary operators evaluate one operand, keep its value in a scratch
+ * register, and evaluate the other. The operand that needs more
+ * registers, by Sethi-Ullman numbering, goes first if the order does
+ * not matter. A value is pushed onto the stack only if no scratch
+ * register is free or the other operand calls a function, which would
+ * clobber the scratch registers.
+ */
+
+static bool is_leaf(Node *node) {
+    switch (node->type) {
+    case AST_LITERAL: case AST_STRING: case AST_GVAR:
+        return true;
+    case AST_LVAR:
+        return !node->lvarinit;
+    }
+    return false;
+}
+
+// Returns true if evaluating node has no side effects, so that it can
+// be moved across the other operand of a binary operator.
+static bool is_pure(Node *node) {
+    if (is_leaf(node))
+        return true;
+    switch (node->type) {
+    case AST_CONV: case AST_ADDR: case AST_DEREF: case OP_UMINUS:
+    case OP_CAST: case '!': case '~':
+        return is_pure(node->operand);
+    case AST_STRUCT_REF:
+        return is_pure(node->struc);
+    case AST_TERNARY:
+        return is_pure(node->cond) && is_pure(node->then) && is_pure(node->els);
+    case '+': case '-': case '*': case '/': case '%': case '^': case '&': case '|':
+    case '<': case '>': case OP_EQ: case OP_NE: case OP_LE: case OP_GE:
+    case OP_SAL: case OP_SAR: case OP_SHR: case OP_LOGAND: case OP_LOGOR: case ',':
+        return is_pure(node->left) && is_pure(node->right);
+    }
+    return false;
+}
+
+// Returns true if node may call a function. Unknown nodes are assumed to.
+static bool has_call(Node *node) {
+    if (is_leaf(node))
+        return false;
+    switch (node->type) {
+    case AST_CONV: case AST_ADDR: case AST_DEREF: case OP_UMINUS: case OP_CAST:
+    case '!': case '~': case OP_PRE_INC: case OP_PRE_DEC: case OP_POST_INC: case OP_POST_DEC:
+        return has_call(node->operand);
+    case AST_STRUCT_REF:
+        return has_call(node->struc);
+    case AST_TERNARY:
+        return has_call(node->cond) || has_call(node->then) || has_call(node->els);
+    case '+': case '-': case '*': case '/': case '%': case '^': case '&': case '|':
+    case '<': case '>': case OP_EQ: case OP_NE: case OP_LE: case OP_GE:
+    case OP_SAL: case OP_SAR: case OP_SHR: case OP_LOGAND: case OP_LOGOR: case ',':
+        return has_call(node->left) || has_call(node->right);
+    case '=':
+        // Large structs are copied with a register of their own.
+        return node->left->ctype->type == CTYPE_STRUCT || has_call(node->left) ||
+            has_call(node->right);
+    }
+    return true;
+}
+
+// Returns the number of registers needed to evaluate node.
+static int su_number(Node *node) {
+    switch (node->type) {
+    case AST_CONV: case AST_ADDR: case AST_DEREF: case OP_UMINUS: case OP_CAST:
+    case '!': case '~':
+        return su_number(node->operand);
+    case AST_STRUCT_REF:
+        return su_number(node->struc);
+    case '+': case '-': case '*': case '/': case '%': case '^': case '&': case '|':
+    case '<': case '>': case OP_EQ: case OP_NE: case OP_LE: case OP_GE:
+    case OP_SAL: case OP_SAR: case OP_SHR: {
+        int l = su_number(node->left);
+        int r = su_number(node->right);
+        return (l == r) ? l + 1 : (l > r) ? l : r;
+    }
+    }
+    return 1;
+}
+
+// Returns true if the right operand should be evaluated first.
+static bool right_first(Node *left, Node *right) {
+    if (!is_pure(left))
+        return false;
+    return is_leaf(left) || has_call(right) || su_number(right) > su_number(left);
+}
+
+// Keeps the value of rax while other is evaluated. Returns the virtual
+// register holding it, or -1 if it has been pushed. The live virtual
+// registers are at most as many as the scratch registers they are
+// assigned to.
+static int hold_int(Node *other) {
+    SAVE;
+    GenState *s = context->gen;
+    if (s->ntemps == NUM_INT_TEMPS || has_call(other)) {
+        push("rax");
+        return -1;
+    }
+    s->ntemps++;
+    int temp = new_vreg(s->ir);
+    emit("mov %%rax, %%v%d", temp);
+    return temp;
+}
+
+static void release_int(int temp, char *reg) {
+    SAVE;
+    if (temp < 0) {
+        pop(reg);
+        return;
+    }
+    emit("mov %%v%d, %%%s", temp, reg);
+    context->gen->ntemps--;
+}
+
+// Same as hold_int() for xmm0.
+static int hold_xmm(Node *other) {
+    SAVE;
+    GenState *s = context->gen;
+    if (s->nxtemps == NUM_XMM_TEMPS || has_call(other)) {
+        push_xmm(0);
+        return -1;
+    }
+    s->nxtemps++;
+    int temp = new_vreg(s->ir);
+    emit("movsd %%xmm0, %%vx%d", temp);
+    return temp;
+}
+
+static void release_xmm(int temp, int reg) {
+    SAVE;
+    if (temp < 0) {
+        pop_xmm(reg);
+        return;
+    }
+    emit("movsd %%vx%d, %%xmm%d", temp, reg);
+    context->gen->nxtemps--;
+}
+
+// Evaluates the operands of an integer operator into rax and rcx.
+static void emit_int_operands(Node *left, Node *right) {
+    SAVE;
+    if (right_first(left, right)) {
+        emit_expr(right);
+        if (is_leaf(left)) {
+            emit("mov %%rax, %%rcx");
+            emit_expr(left);
+            return;
+        }
+        int temp = hold_int(left);
+        emit_expr(left);
+        release_int(temp, "rcx");
+        return;
+    }
+    emit_expr(left);
+    int temp = hold_int(right);
+    emit_expr(right);
+    emit("mov %%rax, %%rcx");
+    release_int(temp, "rax");
+}
+
+// Evaluates the operands of a floating point operator into xmm0 and xmm1.
+static void emit_float_operands(Node *left, Node *right) {
+    SAVE;
+    if (right_first(left, right)) {
+        emit_expr(right);
+        if (is_leaf(left)) {
+            emit("movsd %%xmm0, %%xmm1");
+            emit_expr(left);
+            return;
+        }
+        int temp = hold_xmm(left);
+        emit_expr(left);
+        release_xmm(temp, 1);
+        return;
+    }
+    emit_expr(left);
+    int temp = hold_xmm(right);
+    emit_expr(right);
+    emit("movsd %%xmm0, %%xmm1");
+    release_xmm(temp, 0);
+}
+
+/*
+ * Strength reduction
+ *
+ * Multiplication, division and remainder by an integer constant are
+ * lowered to cheaper instructions. Multiplication becomes shifts and lea,
+ * and division by a power of two becomes shifts. Division by another
+ * constant becomes a multiplication by its reciprocal, a "magic number",
+ * keeping the high half of the product, as described in Granlund and
+ * Montgomery, "Division by Invariant Integers using Multiplication".
+ * A remainder is the dividend minus the quotient times the divisor.
+ */
+
+// Returns true if node is an integer constant, setting *val to its value.
+static bool get_int_const(Node *node, long *val) {
+    if (node->type == AST_CONV && is_inttype(node->ctype) &&
+        is_inttype(node->operand->ctype) && node->ctype->size >= node->operand->ctype->size)
+        node = node->operand;
+    if (node->type != AST_LITERAL || !is_inttype(node->ctype))
+        return false;
+    // Literals smaller than long are 32-bit values, extended by their type.
+    if (node->ctype->size < 8)
+        *val = node->ctype->sig ? (int)node->ival : (unsigned int)node->ival;
+    else
+        *val = node->ival;
+    return true;
+}
+
+// Returns k if v is 2^k, or -1.
+static int log2_exact(long v) {
+    if (v <= 0 || (v & (v - 1)))
+        return -1;
+    int k = 0;
+    while ((1L << k) < v)
+        k++;
+    return k;
+}
+
+// Returns the smallest k such that v <= 2^k.
+static int log2_ceil(long v) {
+    int k = 0;
+    while ((1L << k) < v)
+        k++;
+    return k;
+}
+
+// Returns the low 64 bits of 2^k / d for 0 < d < 2^62. Only signed
+// arithmetic is needed, as the remainder is less than d.
+static unsigned long div_pow2(int k, long d) {
+    unsigned long q = 0;
+    long r = 0;
+    for (int i = k; i >= 0; i--) {
+        r = r * 2 + (i == k);
+        if (r >= d) {
+            r -= d;
+            if (i < 64)
+                q |= 1L << i;
+        }
+    }
+    return q;
+}
+
+// Multiplies reg by c with at most a lea and a shift. Returns false if
+// c needs a multiplication.
+static bool emit_mul_const(char *reg, long c) {
+    SAVE;
+    static int LEA[] = { 3, 5, 9 };
+    if (c == 0) {
+        emit("mov $0, %%%s", reg);
+        return true;
+    }
+    if (c == 1)
+        return true;
+    if (c == -1) {
+        emit("neg %%%s", reg);
+        return true;
+    }
+    int k = log2_exact(c);
+    if (k > 0) {
+        emit("sal $%d, %%%s", k, reg);
+        return true;
+    }
+    for (int i = 0; i < sizeof(LEA) / sizeof(*LEA); i++) {
+        if (c % LEA[i] || (k = log2_exact(c / LEA[i])) < 0)
+            continue;
+        emit("lea (%%%s,%%%s,%d), %%%s", reg, reg, LEA[i] - 1, reg);
+        if (k > 0)
+            emit("sal $%d, %%%s", k, reg);
+        return true;
+    }
+    return false;
+}
+
+static bool fits_imm32(long v) {
+    return -2147483648L <= v && v <= 2147483647L;
+}
+
+// Multiplies rax by c.
+static void emit_mul_imm(long c) {
+    SAVE;
+    if (emit_mul_const("rax", c))
+        return;
+    if (fits_imm32(c)) {
+        emit("imul $%ld, %%rax", c);
+        return;
+    }
+    emit("mov $%ld, %%rcx", c);
+    emit("imul %%rcx, %%rax");
+}
+
+// ANDs rax with mask, using rdx if it is too large for an immediate.
+static void emit_and_imm(long mask) {
+    SAVE;
+    if (fits_imm32(mask)) {
+        emit("and $%ld, %%rax", mask);
+        return;
+    }
+    emit("mov $%ld, %%rdx", mask);
+    emit("and %%rdx, %%rax");
+}
+
+// Whether division of a value of ctype by d is lowered
+static bool is_reducible_divisor(Ctype *ctype, long d) {
+    if (d <= 0)
+        return false;
+    if (ctype->size == 4)
+        return d <= 2147483647L;
+    return ctype->size == 8 && d < (1L << 62);
+}
+
+// Divides rax by a power of two 2^k, rounding toward zero.
+static void emit_div_pow2(bool sig, int k, bool rem) {
+    SAVE;
+    if (!sig) {
+        if (rem)
+            emit_and_imm((1L << k) - 1);
+        else
+            emit("shr $%d, %%rax", k);
+        return;
+    }
+    // A negative dividend is biased by 2^k - 1 so that the shift rounds
+    // toward zero.
+    emit("mov %%rax, %%rcx");
+    emit("sar $63, %%rcx");
+    emit("shr $%d, %%rcx", 64 - k);
+    emit("add %%rcx, %%rax");
+    if (rem) {
+        emit_and_imm((1L << k) - 1);
+        emit("sub %%rcx, %%rax");
+    } else {
+        emit("sar $%d, %%rax", k);
+    }
+}
+
+/*
+ * Divides rax, a value of ctype, by d, leaving the quotient or the
+ * remainder in rax. A 32-bit value is extended to 64 bits first, so
+ * that one sequence serves both sizes.
+ */
+static void emit_div_const(Ctype *ctype, bool sig, long d, bool rem) {
+    SAVE;
+    if (ctype->size == 4 && sig)
+        emit("movslq %%eax, %%rax");
+    else if (ctype->size == 4)
+        emit("mov %%eax, %%eax");
+    if (d == 1) {
+        if (rem)
+            emit("mov $0, %%rax");
+        return;
+    }
+    int k = log2_exact(d);
+    if (k > 0) {
+        emit_div_pow2(sig, k, rem);
+        return;
+    }
+    int l = log2_ceil(d);
+    emit("mov %%rax, %%rcx");
+    if (sig) {
+        // q = (n * m >> (63 + l)) + (n < 0), where m is 2^(63+l) / d + 1.
+        // m may not fit in a signed 64-bit register, in which case it
+        // is taken as m - 2^64 and n is added to the high half.
+        long m = div_pow2(63 + l, d) + 1;
+        emit("mov $%ld, %%rax", m);
+        emit("imul %%rcx");
+        if (m < 0)
+            emit("add %%rcx, %%rdx");
+        if (l > 1)
+            emit("sar $%d, %%rdx", l - 1);
+        emit("mov %%rcx, %%rax");
+        emit("shr $63, %%rax");
+        emit("add %%rdx, %%rax");
+    } else if (ctype->size == 4) {
+        // A dividend of less than 2^32 is exact with m = 2^64 / d + 1.
+        emit("mov $%ld, %%rax", (long)(div_pow2(64, d) + 1));
+        emit("mul %%rcx");
+        emit("mov %%rdx, %%rax");
+    } else {
+        // t = n * m >> 64, where m is 2^64 * (2^l - d) / d + 1, and
+        // q = (t + ((n - t) >> 1)) >> (l - 1).
+        emit("mov $%ld, %%rax", (long)(div_pow2(64 + l, d) + 1));
+        emit("mul %%rcx");
+        emit("mov %%rcx, %%rax");
+        emit("sub %%rdx, %%rax");
+        emit("shr $1, %%rax");
+        emit("add %%rdx, %%rax");
+        if (l > 1)
+            emit("shr $%d, %%rax", l - 1);
+    }
+    if (rem) {
+        if (fits_imm32(d)) {
+            emit("imul $%ld, %%rax", d);
+        } else {
+            emit("mov $%ld, %%rdx", d);
+            emit("imul %%rdx, %%rax");
+        }
+        emit("sub %%rax, %%rcx");
+        emit("mov %%rcx, %%rax");
+    }
+}
+
+// Emits multiplication, division or remainder by a constant. Returns
+// false if node is not one.
+static bool emit_const_arith(Node *node) {
+    SAVE;
+    long c;
+    if (node->type == '*') {
+        if (get_int_const(node->right, &c)) {
+            emit_expr(node->left);
+        } else if (get_int_const(node->left, &c)) {
+            emit_expr(node->right);
+        } else {
+            return false;
+        }
+        emit_mul_imm(c);
+        return true;
+    }
+    if (node->type != '/' && node->type != '%')
+        return false;
+    if (!get_int_const(node->right, &c) || !is_reducible_divisor(node->ctype, c))
+        return false;
+    // As with the usual arithmetic conversions, the division is unsigned
+    // if either operand is.
+    bool sig = node->left->ctype->sig && node->right->ctype->sig;
+    emit_expr(node->left);
+    emit_div_const(node->ctype, sig, c, node->type == '%');
+    return true;
+}
+
+/*
+ * Direct operands
+ *
+ * The right operand of an integer operator need not be evaluated into a
+ * register if it is a constant, a local kept in a register, or a scalar
+ * variable in memory. The instruction takes it as it is, as in
+ * "add $1, %rax", "cmp %ebx, %eax" or "add -8(%rbp), %rax".
+ */
+
+// Returns node as an operand of an instruction working on size bytes,
+// or NULL if it has to be evaluated first.
+static char *get_operand(Node *node, int size) {
+    long val;
+    if (get_int_const(node, &val))
+        return fits_imm32(val) ? format("$%ld", val) : NULL;
+    if (node->type == AST_LVAR && node->lreg)
+        return (size == 8) ? format("%%%s", node->lreg) : format("%%%s", get_reg32(node->lreg));
+    Ctype *ctype = node->ctype;
+    if ((!is_inttype(ctype) && ctype->type != CTYPE_PTR) || ctype->size != size)
+        return NULL;
+    if (node->type == AST_LVAR && !node->lvarinit)
+        return format("%d(%%rbp)", node->loff);
+    if (node->type == AST_GVAR)
+        return format("%s(%%rip)", node->glabel);
+    return NULL;
+}
+
+// Emits "op right, %rax", or "op right, %eax" for a narrow type, with
+// the right operand of node taken directly. Returns false if it cannot be.
+static bool emit_direct_binop(char *op, Node *node) {
+    SAVE;
+    bool narrow = is_narrow(node->ctype);
+    char *operand = get_operand(node->right, narrow ? 4 : 8);
+    if (!operand)
+        return false;
+    emit_expr(node->left);
+    emit("%s %s, %s", op, operand, narrow ? "%eax" : "%rax");
+    return true;
+}
+
+// Emits "op %rcx, %rax" in the width node is computed in.
+static void emit_int_binop(char *op, Node *node) {
+    SAVE;
+    if (is_narrow(node->ctype))
+        emit("%s %%ecx, %%eax", op);
+    else
+        emit("%s %%rcx, %%rax", op);
+}
+
+/*
+ * Addressing modes
+ *
+ * An x86-64 memory operand is a base register, plus an index register
+ * scaled by 1, 2, 4 or 8, plus a constant displacement. Array indexing
+ * and struct fields are matched to it, so that a[i], p->x or s.a[2].b
+ * are loaded or stored with one instruction and no separate address
+ * arithmetic. Constant indices and field offsets go into the
+ * displacement. Locals and globals need no base register to be loaded.
+ */
+
+typedef struct {
+    // Symbol of a rip-relative address, which takes no registers
+    char *sym;
+    char *base;
+    char *index;
+    int scale;
+    long disp;
+} Addr;
+
+static char *addr_string(Addr *a) {
+    if (a->sym)
+        return a->disp ? format("%s+%ld(%%rip)", a->sym, a->disp) : format("%s(%%rip)", a->sym);
+    if (a->index)
+        return format("%ld(%%%s,%%%s,%d)", a->disp, a->base, a->index, a->scale);
+    return format("%ld(%%%s)", a->disp, a->base);
+}
+
+static void set_addr(Addr *a, char *sym, char *base, long disp) {
+    a->sym = sym;
+    a->base = base;
+    a->index = NULL;
+    a->scale = 1;
+    a->disp = disp;
+}
+
+static bool is_index_scale(int size) {
+    return size == 1 || size == 2 || size == 4 || size == 8;
+}
+
+// Returns true if node adds a constant to a pointer, setting *off to
+// the number of bytes.
+static bool get_const_step(Node *node, long *off) {
+    if (node->type != '+' && node->type != '-')
+        return false;
+    Ctype *left = node->left->ctype;
+    if (left->type != CTYPE_PTR && left->type != CTYPE_ARRAY)
+        return false;
+    long c;
+    if (!get_int_const(node->right, &c))
+        return false;
+    int size = (left->ptr->size > 1) ? left->ptr->size : 1;
+    *off = (node->type == '+') ? c * size : -c * size;
+    return true;
+}
+
+// Returns true if node is ptr + index with an index register scale.
+static bool is_indexing(Node *node) {
+    if (node->type != '+' || !is_inttype(node->right->ctype))
+        return false;
+    Ctype *left = node->left->ctype;
+    return (left->type == CTYPE_PTR || left->type == CTYPE_ARRAY) && is_index_scale(left->ptr->size);
+}
+
+static bool get_static_ptr(Node *node, long off, Addr *a);
+
+// Sets the address of an lvalue plus off if no code is needed to
+// compute it.
+static bool get_static_addr(Node *node, long off, Addr *a) {
+    switch (node->type) {
+    case AST_LVAR:
+        if (node->lreg)
+            return false;
+        ensure_lvar_init(node);
+        set_addr(a, NULL, "rbp", node->loff + off);
+        return true;
+    case AST_GVAR:
+        set_addr(a, node->glabel, NULL, off);
+        return true;
+    case AST_STRUCT_REF:
+        return get_static_addr(node->struc, off + node->ctype->offset, a);
+    case AST_DEREF:
+        return get_static_ptr(node->operand, off, a);
+    }
+    return false;
+}
+
+// Same as get_static_addr() for the value of a pointer.
+static bool get_static_ptr(Node *node, long off, Addr *a) {
+    long step;
+    if (node->ctype->type == CTYPE_ARRAY)
+        return get_static_addr(node, off, a);
+    if (node->type == AST_ADDR)
+        return get_static_addr(node->operand, off, a);
+    if (node->type == AST_LVAR && node->lreg) {
+        set_addr(a, NULL, node->lreg, off);
+        return true;
+    }
+    if (get_const_step(node, &step) && fits_imm32(off + step))
+        return get_static_ptr(node->left, off + step, a);
+    return false;
+}
+
+static void emit_lvalue_addr(Node *node, long off, Addr *a);
+
+// Extends an integer in reg to 64 bits to be added to a pointer.
+static void emit_index_extend(Ctype *ctype, char *reg) {
+    SAVE;
+    if (!is_narrow(ctype))
+        return;
+    if (ctype->size == 4 && !ctype->sig)
+        emit("mov %%%s, %%%s", get_reg32(reg), get_reg32(reg));
+    else
+        emit("movslq %%%s, %%%s", get_reg32(reg), reg);
+}
+
+/*
+ * Emits the code to compute the value of a pointer plus off, and sets
+ * the address it points to. The address may use rax and rcx, so it must
+ * be used before they are changed.
+ */
+static void emit_ptr_addr(Node *node, long off, Addr *a) {
+    SAVE;
+    long step;
+    if (get_static_ptr(node, off, a))
+        return;
+    if (get_const_step(node, &step) && fits_imm32(off + step)) {
+        emit_ptr_addr(node->left, off + step, a);
+        return;
+    }
+    if (node->ctype->type == CTYPE_ARRAY && (node->type == AST_STRUCT_REF || node->type == AST_DEREF)) {
+        emit_lvalue_addr(node, off, a);
+        return;
+    }
+    if (!is_indexing(node)) {
+        emit_expr(node);
+        set_addr(a, NULL, "rax", off);
+        return;
+    }
+    Node *ptr = node->left, *index = node->right;
+    if (get_static_ptr(ptr, off, a) && !a->sym) {
+        if (index->type == AST_LVAR && index->lreg) {
+            a->index = index->lreg;
+        } else {
+            emit_expr(index);
+            emit_index_extend(index->ctype, "rax");
+            a->index = "rax";
+        }
+    } else if (index->type == AST_LVAR && index->lreg) {
+        emit_expr(ptr);
+        set_addr(a, NULL, "rax", off);
+        a->index = index->lreg;
+    } else {
+        emit_int_operands(ptr, index);
+        emit_index_extend(index->ctype, "rcx");
+        set_addr(a, NULL, "rax", off);
+        a->index = "rcx";
+    }
+    a->scale = ptr->ctype->ptr->size;
+}
+
+// Same as emit_ptr_addr() for the address of an lvalue.
+static void emit_lvalue_addr(Node *node, long off, Addr *a) {
+    SAVE;
+    if (get_static_addr(node, off, a))
+        return;
+    switch (node->type) {
+    case AST_STRUCT_REF:
+        emit_lvalue_addr(node->struc, off + node->ctype->offset, a);
+        return;
+    case AST_DEREF:
+        emit_ptr_addr(node->operand, off, a);
+        return;
+    }
+    error("internal error: %s", a2s(node));
+}
+
+// Puts an address into rax.
+static void emit_lea(Addr *a) {
+    SAVE;
+    if (a->sym || a->index || a->disp || strcmp(a->base, "rax"))
+        emit("lea %s, %%rax", addr_string(a));
+}
+
+// Loads a value of ctype from where a pointer plus off points to.
+static void emit_load_indirect(Ctype *ctype, Node *ptr, long off) {
+    SAVE;
+    Addr a;
+    emit_ptr_addr(ptr, off, &a);
+    emit_load(ctype, addr_string(&a));
+}
+
+/*
+ * Stores rax, or xmm0 for a floating point type, to the lvalue node
+ * whose address is computed by emit_lvalue_addr(), leaving the value
+ * where it was.
+ */
+static void emit_store_indirect(Node *node) {
+    SAVE;
+    Ctype *ctype = node->ctype;
+    Addr a;
+    if (is_flotype(ctype)) {
+        int temp = hold_xmm(node);
+        emit_lvalue_addr(node, 0, &a);
+        release_xmm(temp, 0);
+        emit("%s %%xmm0, %s", (ctype->type == CTYPE_FLOAT) ? "movss" : "movsd", addr_string(&a));
+        return;
+    }
+    int temp = hold_int(node);
+    emit_lvalue_addr(node, 0, &a);
+    release_int(temp, "rdx");
+    emit("mov %%%s, %s", get_int_reg(ctype, 'd'), addr_string(&a));
+    emit("mov %%rdx, %%rax");
+}
+
+static void emit_pointer_arith(Node *node) {
+    SAVE;
+    Node *left = node->left, *right = node->right;
+    if (node->type != '+' && node->type != '-')
+        error("invalid operator '%d'", node->type);
+    char *op = (node->type == '+') ? "add" : "sub";
+    int size = left->ctype->ptr->size;
+    long step;
+    if ((get_const_step(node, &step) && fits_imm32(step)) || is_indexing(node)) {
+        Addr a;
+        emit_ptr_addr(node, 0, &a);
+        emit_lea(&a);
+        return;
+    }
+    emit_int_operands(left, right);
+    emit_index_extend(right->ctype, "rcx");
+    if (size > 1 && !emit_mul_const("rcx", size))
+        emit("imul $%d, %%rcx", size);
+    emit("%s %%rcx, %%rax", op);
+}
+
 static void emit_to_bool(Ctype *ctype) {
     SAVE;
     if (is_flotype(ctype)) {
         push_xmm(1);
         emit("xorpd %%xmm1, %%xmm1");
         emit("%s %%xmm1, %%xmm0", (ctype->type == CTYPE_FLOAT) ? "ucomiss" : "ucomisd");
+        // NaN is unordered, and true.
         emit("setne %%al");
+        emit("setp %%cl");
+        emit("or %%cl, %%al");
         pop_xmm(1);
     } else {
-        emit("cmp $0, %%rax");
+        emit_test(ctype);
         emit("setne %%al");
     }
     emit("movzb %%al, %%eax");
 }
 
-static void emit_comp(char *inst, Node *node) {
+// Whether a comparison of integers or pointers is unsigned. Types
+// narrower than int are compared as int.
+static bool is_unsigned_comp(Node *node) {
+    Ctype *left = node->left->ctype, *right = node->right->ctype;
+    if (!is_inttype(left) || !is_inttype(right))
+        return true;
+    return left->size >= 4 && (!left->sig || !right->sig);
+}
+
+// Returns the condition code of a comparison, such as "l" for a signed
+// "<" and "b" for an unsigned one.
+static char *get_cond(int op, bool usig) {
+    switch (op) {
+    case '<': return usig ? "b" : "l";
+    case '>': return usig ? "a" : "g";
+    case OP_LE: return usig ? "be" : "le";
+    case OP_GE: return usig ? "ae" : "ge";
+    case OP_EQ: return "e";
+    case OP_NE: return "ne";
+    }
+    error("internal error: %d", op);
+}
+
+/*
+ * Compare and branch
+ *
+ * A comparison sets the flags, and a condition code says whether it
+ * holds. Conditions of if, loops and ?:, and the operands of && and ||,
+ * jump on the flags directly instead of making a 0 or 1 first. && and ||
+ * become chains of jumps.
+ *
+ * ucomisd sets the carry, zero and parity flags, as an unsigned
+ * comparison does, and all three if either operand is NaN. Floating
+ * point comparisons use the "above" conditions, which are false for NaN,
+ * with the operands swapped for < and <=. Equality also checks parity.
+ */
+
+static void emit_label(char *label) {
+    emit("%s:", label);
+}
+
+static void emit_jmp(char *label) {
+    emit("jmp %s", label);
+}
+
+static char *invert_cond(char *cond) {
+    static char *pairs[] = { "e", "ne", "l", "ge", "g", "le", "b", "ae", "a", "be", NULL };
+    for (int i = 0; pairs[i]; i += 2) {
+        if (!strcmp(cond, pairs[i]))
+            return pairs[i + 1];
+        if (!strcmp(cond, pairs[i + 1]))
+            return pairs[i];
+    }
+    error("internal error: %s", cond);
+}
+
+// Whether a comparison is == or != of floating point numbers, which
+// need the parity flag too
+static bool is_float_eq(Node *node) {
+    return is_flotype(node->left->ctype) && (node->type == OP_EQ || node->type == OP_NE);
+}
+
+// Emits a comparison and returns the condition code that holds if the
+// comparison is true.
+static char *emit_compare(Node *node) {
     SAVE;
     if (is_flotype(node->left->ctype)) {
-        emit_expr(node->left);
-        push_xmm(0);
-        emit_expr(node->right);
-        pop_xmm(1);
-        if (node->left->ctype->type == CTYPE_FLOAT)
-            emit("ucomiss %%xmm0, %%xmm1");
-        else
-            emit("ucomisd %%xmm0, %%xmm1");
+        emit_float_operands(node->left, node->right);
+        char *op = (node->left->ctype->type == CTYPE_FLOAT) ? "ucomiss" : "ucomisd";
+        switch (node->type) {
+        case '<':
+            emit("%s %%xmm0, %%xmm1", op);
+            return "a";
+        case OP_LE:
+            emit("%s %%xmm0, %%xmm1", op);
+            return "ae";
+        }
+        emit("%s %%xmm1, %%xmm0", op);
+        return get_cond(node->type, true);
+    }
+    // Pointers are compared in full, and smaller integers in 32 bits.
+    Ctype *ctype = node->left->ctype;
+    bool wide = !is_inttype(ctype) || ctype->size == 8;
+    char *operand = get_operand(node->right, wide ? 8 : 4);
+    if (!operand) {
+        emit_int_operands(node->left, node->right);
+        operand = wide ? "%rcx" : "%ecx";
     } else {
         emit_expr(node->left);
-        push("rax");
-        emit_expr(node->right);
-        pop("rcx");
-        int type = node->left->ctype->type;
-        if (type == CTYPE_LONG || type == CTYPE_LLONG)
-          emit("cmp %%rax, %%rcx");
-        else
-          emit("cmp %%eax, %%ecx");
     }
-    emit("%s %%al", inst);
+    if (!strcmp(operand, "$0"))
+        emit("test %s, %s", wide ? "%rax" : "%eax", wide ? "%rax" : "%eax");
+    else
+        emit("cmp %s, %s", operand, wide ? "%rax" : "%eax");
+    return get_cond(node->type, is_unsigned_comp(node));
+}
+
+static void emit_comp(Node *node) {
+    SAVE;
+    char *cond = emit_compare(node);
+    emit("set%s %%al", cond);
+    if (is_float_eq(node)) {
+        if (node->type == OP_EQ) {
+            emit("setnp %%cl");
+            emit("and %%cl, %%al");
+        } else {
+            emit("setp %%cl");
+            emit("or %%cl, %%al");
+        }
+    }
     emit("movzb %%al, %%eax");
 }
 
+static bool is_comparison(Node *node) {
+    switch (node->type) {
+    case '<': case '>': case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+        return true;
+    }
+    return false;
+}
+
+// Jumps to label if the value of node as a condition is flag.
+static void emit_cond_jump(Node *node, bool flag, char *label) {
+    SAVE;
+    long val;
+    if (get_int_const(node, &val)) {
+        if ((val != 0) == flag)
+            emit_jmp(label);
+        return;
+    }
+    if (node->type == '!') {
+        emit_cond_jump(node->operand, !flag, label);
+        return;
+    }
+    if (node->type == OP_LOGAND || node->type == OP_LOGOR) {
+        // a && b jumps if both are true, and a || b if either is.
+        bool both = (node->type == OP_LOGAND) == flag;
+        if (both) {
+            char *skip = make_label();
+            emit_cond_jump(node->left, !flag, skip);
+            emit_cond_jump(node->right, flag, label);
+            emit_label(skip);
+        } else {
+            emit_cond_jump(node->left, flag, label);
+            emit_cond_jump(node->right, flag, label);
+        }
+        return;
+    }
+    if (!is_comparison(node)) {
+        emit_expr(node);
+        if (is_flotype(node->ctype))
+            emit_to_bool(node->ctype);
+        emit_test(is_flotype(node->ctype) ? ctype_int : node->ctype);
+        emit("j%s %s", flag ? "ne" : "e", label);
+        return;
+    }
+    char *cond = emit_compare(node);
+    if (!flag)
+        cond = invert_cond(cond);
+    if (is_float_eq(node)) {
+        // "e" holds only if the operands are ordered, and "ne" also
+        // holds if they are not.
+        if (!strcmp(cond, "e")) {
+            char *skip = make_label();
+            emit("jp %s", skip);
+            emit("je %s", label);
+            emit_label(skip);
+        } else {
+            emit("jp %s", label);
+            emit("jne %s", label);
+        }
+        return;
+    }
+    emit("j%s %s", cond, label);
+}
+
+/*
+ * Divides rax by rcx. int and unsigned int are divided in 32 bits,
+ * which is faster, and types narrower than int as int. Unsigned
+ * division, by "div", is used if either operand is unsigned; its
+ * dividend is zero-extended into rdx rather than sign-extended.
+ */
+static void emit_div(Node *node) {
+    SAVE;
+    Ctype *ctype = node->ctype;
+    bool narrow = is_narrow(ctype);
+    bool sig = ctype->size < 4 || (node->left->ctype->sig && node->right->ctype->sig);
+    if (!sig) {
+        emit("xor %%edx, %%edx");
+        emit("div %s", narrow ? "%ecx" : "%rcx");
+    } else if (narrow) {
+        emit("cltd");
+        emit("idiv %%ecx");
+    } else {
+        emit("cqto");
+        emit("idiv %%rcx");
+    }
+    if (node->type == '%')
+        emit("mov %s, %s", narrow ? "%edx" : "%rdx", narrow ? "%eax" : "%rax");
+}
+
 static void emit_binop_int_arith(Node *node) {
     SAVE;
+    if (emit_const_arith(node))
+        return;
     char *op = NULL;
     switch (node->type) {
     case '+': op = "add"; break;
@@ -388,21 +1373,23 @@ static void emit_binop_int_arith(Node *node) {
     case '/': case '%': break;
     default: error("invalid operator '%d'", node->type);
     }
-    emit_expr(node->left);
-    push("rax");
-    emit_expr(node->right);
-    emit("mov %%rax, %%rcx");
-    pop("rax");
-    if (node->type == '/' || node->type == '%') {
-        emit("cqto");
-        emit("idiv %%rcx");
-        if (node->type == '%')
-            emit("mov %%edx, %%eax");
-    } else if (node->type == OP_SAL || node->type == OP_SAR || node->type == OP_SHR) {
-        emit("%s %%cl, %%%s", op, get_int_reg(node->left->ctype, 'a'));
-    } else {
-        emit("%s %%rcx, %rax", op);
+    bool shift = (node->type == OP_SAL || node->type == OP_SAR || node->type == OP_SHR);
+    if (op && !shift && emit_direct_binop(op, node))
+        return;
+    long c;
+    bool narrow = is_narrow(node->left->ctype);
+    if (shift && get_int_const(node->right, &c)) {
+        emit_expr(node->left);
+        emit("%s $%ld, %s", op, c & (narrow ? 31 : 63), narrow ? "%eax" : "%rax");
+        return;
     }
+    emit_int_operands(node->left, node->right);
+    if (node->type == '/' || node->type == '%')
+        emit_div(node);
+    else if (shift)
+        emit("%s %%cl, %s", op, narrow ? "%eax" : "%rax");
+    else
+        emit_int_binop(op, node);
 }
 
 static void emit_binop_float_arith(Node *node) {
@@ -416,32 +1403,65 @@ static void emit_binop_float_arith(Node *node) {
     case '/': op = (isdouble ? "divsd" : "divss"); break;
     default: error("invalid operator '%d'", node->type);
     }
-    emit_expr(node->left);
-    push_xmm(0);
-    emit_expr(node->right);
-    emit("%s %%xmm0, %%xmm1", (isdouble ? "movsd" : "movss"));
-    pop_xmm(0);
+    emit_float_operands(node->left, node->right);
     emit("%s %%xmm1, %%xmm0", op);
 }
 
+static bool is_intptr(Ctype *ctype) {
+    return is_inttype(ctype) || ctype->type == CTYPE_PTR;
+}
+
+// Converts an integer to another integer type. Conversion to a type
+// narrower than int truncates the value, and conversion from a narrow
+// type to a 64-bit one extends it by the signedness of the source.
+static void emit_intcast(Ctype *to, Ctype *from) {
+    SAVE;
+    if (to->size < 4) {
+        if (from->type != CTYPE_BOOL)
+            emit_extend(to, format("%%%s", get_int_reg(to, 'a')), "rax");
+    } else if (!is_narrow(to) && is_narrow(from)) {
+        if (from->size == 4 && !from->sig)
+            emit("mov %%eax, %%eax");
+        else
+            emit("movslq %%eax, %%rax");
+    }
+}
+
+// Converts an integer to a floating point number. Integers that may not
+// fit in 32 signed bits are converted from 64 bits.
+static void emit_intfloat(Ctype *to, Ctype *from) {
+    SAVE;
+    char *op = (to->type == CTYPE_FLOAT) ? "cvtsi2ss" : "cvtsi2sd";
+    if (from->size < 4 || (from->size == 4 && from->sig)) {
+        emit("%s %%eax, %%xmm0", op);
+        return;
+    }
+    if (from->size == 4)
+        emit("mov %%eax, %%eax");
+    emit("%s %%rax, %%xmm0", op);
+}
+
 static void emit_load_convert(Ctype *to, Ctype *from) {
     SAVE;
-    if (is_inttype(from) && to->type == CTYPE_FLOAT)
-        emit("cvtsi2ss %%eax, %%xmm0");
-    else if (is_inttype(from) && to->type == CTYPE_DOUBLE)
-        emit("cvtsi2sd %%eax, %%xmm0");
+    if (is_inttype(from) && is_flotype(to))
+        emit_intfloat(to, from);
     else if (from->type == CTYPE_FLOAT && to->type == CTYPE_DOUBLE)
         emit("cvtps2pd %%xmm0, %%xmm0");
     else if (from->type == CTYPE_DOUBLE && to->type == CTYPE_FLOAT)
         emit("cvtpd2ps %%xmm0, %%xmm0");
     else if (to->type == CTYPE_BOOL)
         emit_to_bool(from);
+    else if (is_intptr(to) && is_intptr(from))
+        emit_intcast(to, from);
     else if (is_inttype(to))
         emit_toint(from);
 }
 
 static void emit_ret(void) {
     SAVE;
+    GenState *s = context->gen;
+    for (int i = 0; i < s->nsaved; i++)
+        emit("mov %d(%%rbp), %%%s", s->savedoff - i * 8, CALLEE_SAVED[i]);
     emit("leave");
     emit("ret");
 }
@@ -449,16 +1469,13 @@ static void emit_ret(void) {
 static void emit_binop(Node *node) {
     SAVE;
     if (node->ctype->type == CTYPE_PTR) {
-        emit_pointer_arith(node->type, node->left, node->right);
+        emit_pointer_arith(node);
         return;
     }
     switch (node->type) {
-    case '<': emit_comp("setl", node); return;
-    case '>': emit_comp("setg", node); return;
-    case OP_EQ: emit_comp("sete", node); return;
-    case OP_GE: emit_comp("setge", node); return;
-    case OP_LE: emit_comp("setle", node); return;
-    case OP_NE: emit_comp("setne", node); return;
+    case '<': case '>': case OP_EQ: case OP_GE: case OP_LE: case OP_NE:
+        emit_comp(node);
+        return;
     }
     if (is_inttype(node->ctype))
         emit_binop_int_arith(node);
@@ -509,12 +1526,12 @@ static void emit_addr(Node *node) {
         emit("lea %s(%%rip), %%rax", node->glabel);
         break;
     case AST_DEREF:
-        emit_expr(node->operand);
-        break;
-    case AST_STRUCT_REF:
-        emit_addr(node->struc);
-        emit("add $%d, %%rax", node->ctype->offset);
+    case AST_STRUCT_REF: {
+        Addr a;
+        emit_lvalue_addr(node, 0, &a);
+        emit_lea(&a);
         break;
+    }
     default:
         error("internal error: %s", a2s(node));
     }
@@ -524,8 +1541,9 @@ static void emit_copy_struct(Node *left, Node *right) {
     push("rcx");
     push("r11");
     emit_addr(right);
-    emit("mov %%rax, %%rcx");
+    push("rax");
     emit_addr(left);
+    pop("rcx");
     int i = 0;
     for (; i < left->ctype->size; i += 8) {
         emit("movq %d(%%rcx), %%r11", i);
@@ -570,54 +1588,99 @@ static void emit_uminus(Node *node) {
     }
 }
 
+// Returns the amount ++ and -- add to a value of ctype.
+static int get_inc_step(Ctype *ctype) {
+    if (ctype->type == CTYPE_PTR && ctype->ptr->size > 1)
+        return ctype->ptr->size;
+    return 1;
+}
+
+static char get_size_suffix(int size) {
+    switch (size) {
+    case 1: return 'b';
+    case 2: return 'w';
+    case 4: return 'l';
+    default: return 'q';
+    }
+}
+
+/*
+ * Increments or decrements a variable in place, without going through
+ * rax and the stack. Leaves the value before or after the update in rax
+ * as post says. Returns false for other lvalues.
+ */
+static bool emit_inc_dec_var(Node *var, char *op, bool post) {
+    SAVE;
+    Ctype *ctype = var->ctype;
+    if (var->type != AST_LVAR && var->type != AST_GVAR)
+        return false;
+    if ((!is_inttype(ctype) && ctype->type != CTYPE_PTR) || ctype->type == CTYPE_BOOL)
+        return false;
+    int step = get_inc_step(ctype);
+    if (var->type == AST_LVAR && var->lreg) {
+        // The register is extended again as emit_rsave() would.
+        char *reg = var->lreg;
+        if (post)
+            emit("mov %%%s, %%rax", reg);
+        emit("lea %d(%%%s), %%rcx", (op[0] == 'a') ? step : -step, reg);
+        emit_extend(ctype, format("%%%s", get_int_reg(ctype, 'c')), reg);
+        if (!post)
+            emit("mov %%%s, %%rax", reg);
+        return true;
+    }
+    if (var->type == AST_LVAR && var->lvarinit)
+        return false;
+    char *addr = get_operand(var, ctype->size);
+    if (post)
+        emit_expr(var);
+    emit("%s%c $%d, %s", op, get_size_suffix(ctype->size), step, addr);
+    if (!post)
+        emit_expr(var);
+    return true;
+}
+
 static void emit_pre_inc_dec(Node *node, char *op) {
+    SAVE;
+    if (emit_inc_dec_var(node->operand, op, false))
+        return;
     emit_expr(node->operand);
-    emit("%s $1, %%rax", op);
+    emit("%s $%d, %%rax", op, get_inc_step(node->ctype));
     emit_store(node->operand);
+    // The value is the one stored, which may have wrapped around.
+    if (is_inttype(node->ctype) && node->ctype->size < 4)
+        emit_extend(node->ctype, format("%%%s", get_int_reg(node->ctype, 'a')), "rax");
 }
 
 static void emit_post_inc_dec(Node *node, char *op) {
     SAVE;
+    if (emit_inc_dec_var(node->operand, op, true))
+        return;
     emit_expr(node->operand);
     push("rax");
-    emit("%s $1, %%rax", op);
+    emit("%s $%d, %%rax", op, get_inc_step(node->ctype));
     emit_store(node->operand);
     pop("rax");
 }
 
 static void set_reg_nums(List *args) {
-    numgp = numfp = 0;
+    GenState *s = context->gen;
+    s->numgp = s->numfp = 0;
     for (Iter *i = list_iter(args); !iter_end(i);) {
         Node *arg = iter_next(i);
         if (is_flotype(arg->ctype))
-            numfp++;
+            s->numfp++;
         else
-            numgp++;
+            s->numgp++;
     }
 }
 
-static void emit_je(char *label) {
-    emit("test %%rax, %%rax");
-    emit("je %s", label);
-}
-
-static void emit_label(char *label) {
-    emit("%s:", label);
-}
-
-static void emit_jmp(char *label) {
-    emit("jmp %s", label);
-}
-
 static void emit_literal(Node *node) {
     SAVE;
     switch (node->ctype->type) {
     case CTYPE_BOOL:
     case CTYPE_CHAR:
-        emit("mov $%d, %%rax", node->ival);
-        break;
     case CTYPE_INT:
-        emit("mov $%d, %%rax", node->ival);
+        emit("mov $%d, %%eax", (int)node->ival);
         break;
     case CTYPE_LONG:
     case CTYPE_LLONG: {
@@ -671,7 +1734,10 @@ static void emit_literal_string(Node *node) {
 static void emit_lvar(Node *node) {
     SAVE;
     ensure_lvar_init(node);
-    emit_lload(node->ctype, "rbp", node->loff);
+    if (node->lreg)
+        emit("mov %%%s, %%rax", node->lreg);
+    else
+        emit_lload(node->ctype, "rbp", node->loff);
 }
 
 static void emit_gvar(Node *node) {
@@ -744,7 +1810,7 @@ static void maybe_booleanize_retval(Ctype *ctype) {
 
 static void emit_func_call(Node *node) {
     SAVE;
-    int opos = stackpos;
+    int opos = context->gen->stackpos;
     bool isptr = (node->type == AST_FUNCPTR_CALL);
     Ctype *ftype = isptr ? node->fptr->ctype->ptr : node->ftype;
 
@@ -754,10 +1820,10 @@ static void emit_func_call(Node *node) {
     classify_args(ints, floats, rest, node->args);
     save_arg_regs(list_len(ints), list_len(floats));
 
-    bool padding = stackpos % 16;
+    bool padding = context->gen->stackpos % 16;
     if (padding) {
         emit("sub $8, %%rsp");
-        stackpos += 8;
+        context->gen->stackpos += 8;
     }
 
     emit_args(list_reverse(rest));
@@ -781,20 +1847,31 @@ static void emit_func_call(Node *node) {
     maybe_booleanize_retval(node->ctype);
     if (list_len(rest) > 0) {
         emit("add $%d, %%rsp", list_len(rest) * 8);
-        stackpos -= list_len(rest) * 8;
+        context->gen->stackpos -= list_len(rest) * 8;
     }
     if (padding) {
         emit("add $8, %%rsp");
-        stackpos -= 8;
+        context->gen->stackpos -= 8;
     }
     restore_arg_regs(list_len(ints), list_len(floats));
-    assert(opos == stackpos);
+    assert(opos == context->gen->stackpos);
 }
 
 static void emit_decl(Node *node) {
     SAVE;
     if (!node->declinit)
         return;
+    Node *var = node->declvar;
+    if (var->lreg) {
+        if (list_len(node->declinit) == 0)
+            emit("mov $0, %%%s", var->lreg);
+        for (Iter *i = list_iter(node->declinit); !iter_end(i);) {
+            Node *init = iter_next(i);
+            emit_expr(init->initval);
+            emit_rsave(init->totype, var->lreg);
+        }
+        return;
+    }
     emit_zero_filler(node->declvar->loff,
                      node->declvar->loff + node->declvar->ctype->size);
     emit_decl_init(node->declinit, node->declvar->loff);
@@ -808,16 +1885,14 @@ static void emit_conv(Node *node) {
 
 static void emit_deref(Node *node) {
     SAVE;
-    emit_expr(node->operand);
-    emit_lload(node->operand->ctype->ptr, "rax", 0);
+    emit_load_indirect(node->operand->ctype->ptr, node->operand, 0);
     emit_load_convert(node->ctype, node->operand->ctype->ptr);
 }
 
 static void emit_ternary(Node *node) {
     SAVE;
-    emit_expr(node->cond);
     char *ne = make_label();
-    emit_je(ne);
+    emit_cond_jump(node->cond, false, ne);
     if (node->then)
         emit_expr(node->then);
     if (node->els) {
@@ -832,13 +1907,13 @@ static void emit_ternary(Node *node) {
 }
 
 #define SET_JUMP_LABELS(brk, cont)              \
-    char *obreak = lbreak;                      \
-    char *ocontinue = lcontinue;                \
-    lbreak = brk;                               \
-    lcontinue = cont
+    char *obreak = context->gen->lbreak;        \
+    char *ocontinue = context->gen->lcontinue;  \
+    context->gen->lbreak = brk;                 \
+    context->gen->lcontinue = cont
 #define RESTORE_JUMP_LABELS()                   \
-    lbreak = obreak;                            \
-    lcontinue = ocontinue
+    context->gen->lbreak = obreak;              \
+    context->gen->lcontinue = ocontinue
 
 static void emit_for(Node *node) {
     SAVE;
@@ -849,10 +1924,8 @@ static void emit_for(Node *node) {
     char *end = make_label();
     SET_JUMP_LABELS(end, step);
     emit_label(begin);
-    if (node->forcond) {
-        emit_expr(node->forcond);
-        emit_je(end);
-    }
+    if (node->forcond)
+        emit_cond_jump(node->forcond, false, end);
     if (node->forbody)
         emit_expr(node->forbody);
     emit_label(step);
@@ -869,8 +1942,7 @@ static void emit_while(Node *node) {
     char *end = make_label();
     SET_JUMP_LABELS(end, begin);
     emit_label(begin);
-    emit_expr(node->forcond);
-    emit_je(end);
+    emit_cond_jump(node->forcond, false, end);
     if (node->forbody)
         emit_expr(node->forbody);
     emit_jmp(begin);
@@ -881,14 +1953,14 @@ static void emit_while(Node *node) {
 static void emit_do(Node *node) {
     SAVE;
     char *begin = make_label();
+    char *cond = make_label();
     char *end = make_label();
-    SET_JUMP_LABELS(end, begin);
+    SET_JUMP_LABELS(end, cond);
     emit_label(begin);
     if (node->forbody)
         emit_expr(node->forbody);
-    emit_expr(node->forcond);
-    emit_je(end);
-    emit_jmp(begin);
+    emit_label(cond);
+    emit_cond_jump(node->forcond, true, begin);
     emit_label(end);
     RESTORE_JUMP_LABELS();
 }
@@ -896,46 +1968,224 @@ static void emit_do(Node *node) {
 #undef SET_JUMP_LABELS
 #undef RESTORE_JUMP_LABELS
 
+/*
+ * Switch statements
+ *
+ * The case labels of a switch are collected before its body is emitted,
+ * so that the dispatch can be chosen by looking at all of them. Dense
+ * sets of values use a table of offsets to the labels in .rodata, and
+ * the others a binary search with comparisons. Either takes the value
+ * of the switch in eax.
+ */
+
+typedef struct {
+    long beg;
+    long end;
+    char *label;
+} CaseRange;
+
+// Cases of nested switches are not collected, as they belong to those.
+static void collect_cases(List *cases, Node *node) {
+    if (!node)
+        return;
+    switch (node->type) {
+    case AST_CASE:
+    case AST_DEFAULT:
+        list_push(cases, node);
+        return;
+    case AST_COMPOUND_STMT:
+        for (Iter *i = list_iter(node->stmts); !iter_end(i);)
+            collect_cases(cases, iter_next(i));
+        return;
+    case AST_IF:
+        collect_cases(cases, node->then);
+        collect_cases(cases, node->els);
+        return;
+    case AST_FOR:
+    case AST_WHILE:
+    case AST_DO:
+        collect_cases(cases, node->forbody);
+        return;
+    }
+}
+
+static int compare_cases(const void *a, const void *b) {
+    long x = ((CaseRange *)a)->beg, y = ((CaseRange *)b)->beg;
+    return (x < y) ? -1 : (x > y);
+}
+
+static int compare_cases_unsigned(const void *a, const void *b) {
+    unsigned long x = ((CaseRange *)a)->beg, y = ((CaseRange *)b)->beg;
+    return (x < y) ? -1 : (x > y);
+}
+
+// Case values are converted to the promoted type of the switch. Values
+// of 4-byte types are compared in eax and 8-byte ones in rax.
+static long case_value(Ctype *ctype, long val) {
+    if (ctype->size == 8)
+        return val;
+    if (ctype->size == 4 && !ctype->sig)
+        return (unsigned int)val;
+    return (int)val;
+}
+
+static bool case_less(Ctype *ctype, long x, long y) {
+    if (ctype->size == 8 && !ctype->sig)
+        return (unsigned long)x < (unsigned long)y;
+    return x < y;
+}
+
+// Cases that are dense enough for a jump table
+#define SWITCH_TABLE_MIN 4
+#define SWITCH_TABLE_MAX 4096
+// Number of cases below which the binary search compares one by one
+#define SWITCH_LINEAR_MAX 3
+
+// The differences are taken as unsigned, since they are
+// nonnegative in the order of the cases but may not fit in a long.
+static bool use_jump_table(CaseRange *v, int n) {
+    unsigned long values = 0;
+    for (int i = 0; i < n; i++)
+        values += (unsigned long)v[i].end - v[i].beg + 1;
+    unsigned long size = (unsigned long)v[n - 1].end - v[0].beg + 1;
+    return values >= SWITCH_TABLE_MIN && size <= SWITCH_TABLE_MAX && size <= values * 4;
+}
+
+// The index is the value minus the smallest case, which is compared
+// with the size of the table as unsigned at the width of the switch.
+// For 4-byte values, the upper half of rax is cleared before indexing.
+static void emit_jump_table(Ctype *ctype, CaseRange *v, int n, char *ldefault) {
+    SAVE;
+    long min = v[0].beg;
+    long size = (unsigned long)v[n - 1].end - min + 1;
+    char *table = make_label();
+    if (ctype->size < 8) {
+        if (min)
+            emit("sub $%d, %%eax", (int)min);
+        else
+            emit("mov %%eax, %%eax");
+        emit("cmp $%ld, %%eax", size - 1);
+    } else {
+        if (fits_imm32(min)) {
+            if (min)
+                emit("sub $%ld, %%rax", min);
+        } else {
+            emit("mov $%ld, %%rcx", min);
+            emit("sub %%rcx, %%rax");
+        }
+        emit("cmp $%ld, %%rax", size - 1);
+    }
+    emit("ja %s", ldefault);
+    emit("lea %s(%%rip), %%rcx", table);
+    emit("movslq (%%rcx,%%rax,4), %%rax");
+    emit("add %%rcx, %%rax");
+    emit("jmp *%%rax");
+    emit_noindent(".section .rodata");
+    emit(".align 4");
+    emit_label(table);
+    long off = 0;
+    for (int i = 0; i < n; i++) {
+        for (; off < v[i].beg - min; off++)
+            emit(".long %s-%s", ldefault, table);
+        for (; off <= v[i].end - min; off++)
+            emit(".long %s-%s", v[i].label, table);
+    }
+    emit_noindent(".text");
+}
+
+static void emit_case_cmp(Ctype *ctype, long val) {
+    if (ctype->size < 8) {
+        emit("cmp $%d, %%eax", (int)val);
+    } else if (fits_imm32(val)) {
+        emit("cmp $%ld, %%rax", val);
+    } else {
+        emit("mov $%ld, %%rcx", val);
+        emit("cmp %%rcx, %%rax");
+    }
+}
+
+// Emits comparisons for the cases from v[lo] to v[hi - 1].
+static void emit_case_tree(Ctype *ctype, CaseRange *v, int lo, int hi, char *ldefault) {
+    SAVE;
+    char *lt = ctype->sig ? "jl" : "jb";
+    char *le = ctype->sig ? "jle" : "jbe";
+    if (hi - lo <= SWITCH_LINEAR_MAX) {
+        for (int i = lo; i < hi; i++) {
+            if (v[i].beg == v[i].end) {
+                emit_case_cmp(ctype, v[i].beg);
+                emit("je %s", v[i].label);
+                continue;
+            }
+            char *next = make_label();
+            emit_case_cmp(ctype, v[i].beg);
+            emit("%s %s", lt, next);
+            emit_case_cmp(ctype, v[i].end);
+            emit("%s %s", le, v[i].label);
+            emit_label(next);
+        }
+        emit_jmp(ldefault);
+        return;
+    }
+    int mid = (lo + hi) / 2;
+    char *left = make_label();
+    emit_case_cmp(ctype, v[mid].beg);
+    emit("%s %s", lt, left);
+    emit_case_tree(ctype, v, mid, hi, ldefault);
+    emit_label(left);
+    emit_case_tree(ctype, v, lo, mid, ldefault);
+}
+
 static void emit_switch(Node *node) {
     SAVE;
-    char *oswitch = lswitch, *obreak = lbreak;
+    GenState *s = context->gen;
+    char *obreak = s->lbreak;
+    Ctype *ctype = node->switchexpr->ctype;
+    if (ctype->size < 4)
+        ctype = ctype_int;
     emit_expr(node->switchexpr);
-    lswitch = make_label();
-    lbreak = make_label();
-    emit_jmp(lswitch);
+    s->lbreak = make_label();
+
+    List *cases = make_list();
+    collect_cases(cases, node->switchbody);
+    CaseRange *v = arena_malloc(sizeof(CaseRange) * (list_len(cases) + 1));
+    int n = 0;
+    char *ldefault = s->lbreak;
+    for (Iter *i = list_iter(cases); !iter_end(i);) {
+        Node *c = iter_next(i);
+        c->caselabel = make_label();
+        if (c->type == AST_DEFAULT) {
+            ldefault = c->caselabel;
+            continue;
+        }
+        v[n].beg = case_value(ctype, c->casebeg);
+        v[n].end = case_value(ctype, c->caseend);
+        v[n].label = c->caselabel;
+        n++;
+    }
+    bool wide_unsigned = ctype->size == 8 && !ctype->sig;
+    qsort(v, n, sizeof(CaseRange), wide_unsigned ? compare_cases_unsigned : compare_cases);
+    for (int i = 0; i < n; i++) {
+        if (case_less(ctype, v[i].end, v[i].beg))
+            error("case region is not in correct order: %ld %ld", v[i].beg, v[i].end);
+        if (i > 0 && !case_less(ctype, v[i - 1].end, v[i].beg))
+            error("duplicate case value: %ld", v[i].beg);
+    }
+
+    if (n > 0 && use_jump_table(v, n))
+        emit_jump_table(ctype, v, n, ldefault);
+    else
+        emit_case_tree(ctype, v, 0, n, ldefault);
     if (node->switchbody)
         emit_expr(node->switchbody);
-    emit_label(lswitch);
-    emit_label(lbreak);
-    lswitch = oswitch;
-    lbreak = obreak;
+    emit_label(s->lbreak);
+    s->lbreak = obreak;
 }
 
 static void emit_case(Node *node) {
     SAVE;
-    if (!lswitch)
+    if (!node->caselabel)
         error("stray case label");
-    char *skip = make_label();
-    emit_jmp(skip);
-    emit_label(lswitch);
-    lswitch = make_label();
-    emit("cmp $%d, %%eax", node->casebeg);
-    if (node->casebeg == node->caseend) {
-        emit("jne %s", lswitch);
-    } else {
-        emit("jl %s", lswitch);
-        emit("cmp $%d, %%eax", node->caseend);
-        emit("jg %s", lswitch);
-    }
-    emit_label(skip);
-}
-
-static void emit_default(Node *node) {
-    SAVE;
-    if (!lswitch)
-        error("stray case label");
-    emit_label(lswitch);
-    lswitch = make_label();
+    emit_label(node->caselabel);
 }
 
 static void emit_goto(Node *node) {
@@ -955,16 +2205,16 @@ static void emit_return(Node *node) {
 
 static void emit_break(Node *node) {
     SAVE;
-    if (!lbreak)
+    if (!context->gen->lbreak)
         error("stray break statement");
-    emit_jmp(lbreak);
+    emit_jmp(context->gen->lbreak);
 }
 
 static void emit_continue(Node *node) {
     SAVE;
-    if (!lcontinue)
+    if (!context->gen->lcontinue)
         error("stray continue statement");
-    emit_jmp(lcontinue);
+    emit_jmp(context->gen->lcontinue);
 }
 
 static void emit_compound_stmt(Node *node) {
@@ -977,8 +2227,8 @@ static void emit_va_start(Node *node) {
     SAVE;
     emit_expr(node->ap);
     push("rcx");
-    emit("movl $%d, (%%rax)", numgp * 8);
-    emit("movl $%d, 4(%%rax)", 48 + numfp * 16);
+    emit("movl $%d, (%%rax)", context->gen->numgp * 8);
+    emit("movl $%d, 4(%%rax)", 48 + context->gen->numfp * 16);
     emit("lea %d(%%rbp), %%rcx", -REGAREA_SIZE);
     emit("mov %%rcx, 16(%%rax)");
     pop("rcx");
@@ -1010,60 +2260,41 @@ static void emit_va_arg(Node *node) {
     pop("rcx");
 }
 
-static void emit_logand(Node *node) {
+// Makes the value of a condition, as of && and ||, with jumps.
+static void emit_cond_value(Node *node) {
     SAVE;
+    char *no = make_label();
     char *end = make_label();
-    emit_expr(node->left);
-    emit("test %%rax, %%rax");
-    emit("mov $0, %%rax");
-    emit("je %s", end);
-    emit_expr(node->right);
-    emit("test %%rax, %%rax");
-    emit("mov $0, %%rax");
-    emit("je %s", end);
-    emit("mov $1, %%rax");
-    emit_label(end);
-}
-
-static void emit_logor(Node *node) {
-    SAVE;
-    char *end = make_label();
-    emit_expr(node->left);
-    emit("test %%rax, %%rax");
-    emit("mov $1, %%rax");
-    emit("jne %s", end);
-    emit_expr(node->right);
-    emit("test %%rax, %%rax");
-    emit("mov $1, %%rax");
-    emit("jne %s", end);
-    emit("mov $0, %%rax");
+    emit_cond_jump(node, false, no);
+    emit("mov $1, %%eax");
+    emit_jmp(end);
+    emit_label(no);
+    emit("mov $0, %%eax");
     emit_label(end);
 }
 
 static void emit_lognot(Node *node) {
     SAVE;
     emit_expr(node->operand);
-    emit("cmp $0, %%rax");
+    emit_test(node->operand->ctype);
     emit("sete %%al");
     emit("movzb %%al, %%eax");
 }
 
 static void emit_bitand(Node *node) {
     SAVE;
-    emit_expr(node->left);
-    push("rax");
-    emit_expr(node->right);
-    pop("rcx");
-    emit("and %%rcx, %%rax");
+    if (emit_direct_binop("and", node))
+        return;
+    emit_int_operands(node->left, node->right);
+    emit_int_binop("and", node);
 }
 
 static void emit_bitor(Node *node) {
     SAVE;
-    emit_expr(node->left);
-    push("rax");
-    emit_expr(node->right);
-    pop("rcx");
-    emit("or %%rcx, %%rax");
+    if (emit_direct_binop("or", node))
+        return;
+    emit_int_operands(node->left, node->right);
+    emit_int_binop("or", node);
 }
 
 static void emit_bitnot(Node *node) {
@@ -1099,7 +2330,7 @@ static void emit_assign(Node *node) {
 
 static void emit_label_addr(Node *node) {
     SAVE;
-    emit("mov $%s, %%rax", node->newlabel);
+    emit("lea %s(%%rip), %%rax", node->newlabel);
 }
 
 static void emit_computed_goto(Node *node) {
@@ -1132,7 +2363,7 @@ static void emit_expr(Node *node) {
     case AST_DO:      emit_do(node); return;
     case AST_SWITCH:  emit_switch(node); return;
     case AST_CASE:    emit_case(node); return;
-    case AST_DEFAULT: emit_default(node); return;
+    case AST_DEFAULT: emit_case(node); return;
     case AST_GOTO:    emit_goto(node); return;
     case AST_LABEL:
         if (node->newlabel)
@@ -1156,8 +2387,10 @@ static void emit_expr(Node *node) {
     case '&': emit_bitand(node); return;
     case '|': emit_bitor(node); return;
     case '~': emit_bitnot(node); return;
-    case OP_LOGAND: emit_logand(node); return;
-    case OP_LOGOR:  emit_logor(node); return;
+    case OP_LOGAND:
+    case OP_LOGOR:
+        emit_cond_value(node);
+        return;
     case OP_CAST:   emit_cast(node); return;
     case ',': emit_comma(node); return;
     case '=': emit_assign(node); return;
@@ -1224,13 +2457,13 @@ static void emit_data_primtype(Ctype *ctype, Node *val) {
         emit(".byte %d", !!eval_intexpr(val));
         break;
     case CTYPE_CHAR:
-        emit(".byte %d", eval_intexpr(val));
+        emit(".byte %d", (int)eval_intexpr(val));
         break;
     case CTYPE_SHORT:
-        emit(".short %d", eval_intexpr(val));
+        emit(".short %d", (int)eval_intexpr(val));
         break;
     case CTYPE_INT:
-        emit(".long %d", eval_intexpr(val));
+        emit(".long %d", (int)eval_intexpr(val));
         break;
     case CTYPE_LONG:
     case CTYPE_LLONG:
@@ -1238,7 +2471,7 @@ static void emit_data_primtype(Ctype *ctype, Node *val) {
         if (val->type == AST_GVAR)
             emit(".quad %s", val->varname);
         else
-            emit(".quad %d", eval_intexpr(val));
+            emit(".quad %ld", eval_intexpr(val));
         break;
     default:
         error("don't know how to handle\n  <%s>\n  <%s>", c2s(ctype), a2s(val));
@@ -1342,7 +2575,10 @@ static int emit_regsave_area(void) {
     return REGAREA_SIZE;
 }
 
-static void push_func_params(List *params, int off) {
+// Moves the parameters from the registers and the stack, where the
+// caller passed them, to their stack slots or registers.
+static void emit_func_params(List *params) {
+    SAVE;
     int ireg = 0;
     int xreg = 0;
     int arg = 2;
@@ -1351,32 +2587,39 @@ static void push_func_params(List *params, int off) {
         if (is_flotype(v->ctype)) {
             if (xreg >= 8) {
                 emit("mov %d(%%rbp), %%rax", arg++ * 8);
-                push("rax");
+                emit("mov %%rax, %d(%%rbp)", v->loff);
             } else {
-                push_xmm(xreg++);
+                emit("movsd %%xmm%d, %d(%%rbp)", xreg++, v->loff);
             }
-        } else {
-            if (ireg >= 6) {
-                if (v->ctype->type == CTYPE_BOOL) {
-                    emit("mov %d(%%rbp), %%al", arg++ * 8);
-                    emit("movzb %%al, %%eax");
-                } else {
-                    emit("mov %d(%%rbp), %%rax", arg++ * 8);
-                }
-                push("rax");
+            continue;
+        }
+        if (ireg >= 6) {
+            if (v->ctype->type == CTYPE_BOOL) {
+                emit("mov %d(%%rbp), %%al", arg++ * 8);
+                emit("movzb %%al, %%eax");
             } else {
-                if (v->ctype->type == CTYPE_BOOL)
-                    emit("movzb %%%s, %%%s", SREGS[ireg], MREGS[ireg]);
-                push(REGS[ireg++]);
+                emit("mov %d(%%rbp), %%rax", arg++ * 8);
             }
+            if (v->lreg)
+                emit_rsave(v->ctype, v->lreg);
+            else
+                emit("mov %%rax, %d(%%rbp)", v->loff);
+            continue;
+        }
+        if (v->ctype->type == CTYPE_BOOL)
+            emit("movzb %%%s, %%%s", SREGS[ireg], MREGS[ireg]);
+        if (v->lreg) {
+            emit("mov %%%s, %%rax", REGS[ireg++]);
+            emit_rsave(v->ctype, v->lreg);
+        } else {
+            emit("mov %%%s, %d(%%rbp)", REGS[ireg++], v->loff);
         }
-        off -= 8;
-        v->loff = off;
     }
 }
 
 static void emit_func_prologue(Node *func) {
     SAVE;
+    GenState *s = context->gen;
     emit(".text");
     if (!func->ctype->isstatic)
         emit_noindent(".global %s", func->fname);
@@ -1389,30 +2632,112 @@ static void emit_func_prologue(Node *func) {
         set_reg_nums(func->params);
         off -= emit_regsave_area();
     }
-    push_func_params(func->params, off);
-    off -= list_len(func->params) * 8;
+    int nregs = sizeof(CALLEE_SAVED) / sizeof(*CALLEE_SAVED);
+    s->nsaved = allocate_registers(func, CALLEE_SAVED, nregs);
 
-    int localarea = 0;
+    int area = 0;
+    for (Iter *i = list_iter(func->params); !iter_end(i);) {
+        Node *v = iter_next(i);
+        if (v->lreg)
+            continue;
+        off -= 8;
+        v->loff = off;
+        area += 8;
+    }
     for (Iter *i = list_iter(func->localvars); !iter_end(i);) {
         Node *v = iter_next(i);
+        if (v->lreg)
+            continue;
         int size = align(v->ctype->size, 8);
         assert(size % 8 == 0);
         off -= size;
         v->loff = off;
-        localarea += size;
+        area += size;
+    }
+    s->savedoff = off - 8;
+    area += s->nsaved * 8;
+    if (area) {
+        emit("sub $%d, %%rsp", area);
+        s->stackpos += area;
     }
-    if (localarea) {
-        emit("sub $%d, %%rsp", localarea);
-        stackpos += localarea;
+    for (int i = 0; i < s->nsaved; i++)
+        emit("mov %%%s, %d(%%rbp)", CALLEE_SAVED[i], s->savedoff - i * 8);
+    emit_func_params(func->params);
+}
+
+GenState *make_gen_state(void) {
+    GenState *r = arena_malloc(sizeof(GenState));
+    r->functions = make_list();
+    r->lbreak = NULL;
+    r->lcontinue = NULL;
+    r->stackpos = 0;
+    r->numgp = 0;
+    r->numfp = 0;
+    r->ntemps = 0;
+    r->nxtemps = 0;
+    r->nsaved = 0;
+    r->savedoff = 0;
+    r->outputfp = NULL;
+    r->fname = NULL;
+    r->ir = NULL;
+    r->labelseq = 0;
+    r->capture = NULL;
+    r->annotate = false;
+    r->buffered = false;
+    return r;
+}
+
+// Returns a state for a code generation worker, which makes the same
+// code as the current state but keeps it in the function nodes.
+GenState *make_worker_gen_state(void) {
+    GenState *r = make_gen_state();
+    r->annotate = context->gen->annotate;
+    r->buffered = true;
+    return r;
+}
+
+// Emits a function. If it has a fingerprint or the state is buffered,
+// its code is also kept in the node.
+static void emit_func(Node *v) {
+    GenState *s = context->gen;
+    if (v->code) {
+        if (!s->buffered)
+            emit_code(v->code);
+        return;
+    }
+    long start = trace_time();
+    int seq = s->labelseq;
+    s->fname = v->fname;
+    s->labelseq = v->nlabels;
+    if (v->fingerprint || s->buffered)
+        s->capture = make_string();
+    s->ir = make_ir_func(v->fname);
+    emit_func_prologue(v);
+    emit_expr(v->body);
+    emit_ret();
+    s->nsaved = 0;
+    IrFunc *fn = s->ir;
+    s->ir = NULL;
+    run_passes(fn);
+    for (Iter *i = list_iter(ir_insns(fn)); !iter_end(i);) {
+        Insn *insn = iter_next(i);
+        char *text = insn_text(insn);
+        emit_line(text, insn->note);
+        arena_free(text);
     }
+    free_ir_func(fn);
+    if (s->capture)
+        v->code = get_cstring(s->capture);
+    s->capture = NULL;
+    s->fname = NULL;
+    s->labelseq = seq;
+    trace_complete(TRACE_CODEGEN, v->fname, start, NULL);
 }
 
 void emit_toplevel(Node *v) {
-    stackpos = 8;
+    context->gen->stackpos = 8;
     if (v->type == AST_FUNC) {
-        emit_func_prologue(v);
-        emit_expr(v->body);
-        emit_ret();
+        emit_func(v);
     } else if (v->type == AST_DECL) {
         emit_global_var(v);
     } else {
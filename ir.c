@@ -0,0 +1,828 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Instruction IR.
+ *
+ * The code generator does not write the code of a function out as it
+ * walks the AST. Instead each instruction goes into an IrFunc as an
+ * Insn, with its mnemonic and operands. An operand is a register, an
+ * immediate, a memory reference made of a symbol, a displacement and
+ * base and index registers, or a symbol a jump or a call goes to.
+ *
+ * The code generator writes instructions in assembler syntax, which
+ * ir_append() parses into operands. Temporaries are kept in virtual
+ * registers, written %vN (%vNd, %vNw and %vNb for the lower 32, 16 and
+ * 8 bits) and %vxN for floating point values. A pass assigns them to
+ * scratch registers before the others run.
+ *
+ * Once the function is complete, the instructions are divided into
+ * basic blocks, which start at labels and end at jumps and returns,
+ * and the blocks are linked into a control flow graph. Passes then
+ * rewrite the blocks, and the code generator writes out what is left
+ * in order.
+ *
+ * Directives, and anything in a data section such as the literals a
+ * function uses, stay in place but are opaque to the passes.
+ *
+ * The peephole optimizer is in peephole.c.
+ *
+ * Register assignment runs at every level. The other passes run at -O1,
+ * the default, so at -O0 the output is the code as the code generator
+ * made it. -fdump-ir prints the blocks of each function to stderr after
+ * the passes.
+ *
+ * The IR of a function is freed once its code is written out, so memory
+ * use does not grow with the number of functions in a file.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+int opt_level = 1;
+bool dump_ir;
+
+static char *REGS64[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+static char *REGS32[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+static char *REGS16[] = {
+    "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+static char *REGS8[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+
+// Scratch registers for virtual registers, in the order they are
+// taken. The code for expressions uses none of them except around
+// function calls.
+static int INT_TEMPS[NUM_INT_TEMPS] = { 11, 10, 9, 8, RDI, RSI };
+static int XMM_TEMPS[NUM_XMM_TEMPS] = {
+    XMM0 + 8, XMM0 + 9, XMM0 + 10, XMM0 + 11, XMM0 + 12, XMM0 + 13, XMM0 + 14, XMM0 + 15 };
+
+IrFunc *make_ir_func(char *name) {
+    IrFunc *r = arena_malloc(sizeof(IrFunc));
+    r->name = name;
+    r->insns = make_list();
+    r->blocks = make_list();
+    r->nvregs = 0;
+    r->indata = false;
+    return r;
+}
+
+// Returns the number of a new virtual register, to be written as %vN
+// or %vxN.
+int new_vreg(IrFunc *fn) {
+    return fn->nvregs++;
+}
+
+/*
+ * Operands
+ */
+
+static int find_name(char **names, char *s) {
+    for (int i = 0; i < 16; i++)
+        if (!strcmp(names[i], s))
+            return i;
+    return -1;
+}
+
+// Reads the name of a register after %, and returns the number of
+// characters read, or 0 if it is no register.
+static int read_reg(char *s, int *reg, int *width) {
+    char name[16];
+    int len = 0;
+    while (isalnum(s[len]) && len < sizeof(name) - 1) {
+        name[len] = s[len];
+        len++;
+    }
+    name[len] = '\0';
+    if (isalnum(s[len]))
+        return 0;
+    int r;
+    if ((r = find_name(REGS64, name)) >= 0) { *width = 64; *reg = r; return len; }
+    if ((r = find_name(REGS32, name)) >= 0) { *width = 32; *reg = r; return len; }
+    if ((r = find_name(REGS16, name)) >= 0) { *width = 16; *reg = r; return len; }
+    if ((r = find_name(REGS8, name)) >= 0)  { *width = 8;  *reg = r; return len; }
+    if (!strcmp(name, "rip")) {
+        *width = 64;
+        *reg = REG_IP;
+        return len;
+    }
+    if (!strncmp(name, "xmm", 3) && isdigit(name[3])) {
+        char *end;
+        long n = strtol(name + 3, &end, 10);
+        if (*end || n > 15)
+            return 0;
+        *width = 128;
+        *reg = XMM0 + n;
+        return len;
+    }
+    // Virtual registers
+    if (name[0] != 'v')
+        return 0;
+    bool xmm = (name[1] == 'x');
+    char *p = name + (xmm ? 2 : 1);
+    if (!isdigit(*p))
+        return 0;
+    *reg = VREG_BASE + strtol(p, &p, 10);
+    if (xmm)
+        *width = (*p == '\0') ? 128 : 0;
+    else if (*p == '\0')
+        *width = 64;
+    else
+        *width = !strcmp(p, "d") ? 32 : !strcmp(p, "w") ? 16 : !strcmp(p, "b") ? 8 : 0;
+    return *width ? len : 0;
+}
+
+// Reads a number, and returns the number of characters read.
+static int read_number(char *s, long *val, int *numfmt) {
+    char *end;
+    if (s[0] == '0' && s[1] == 'x') {
+        *val = strtoul(s + 2, &end, 16);
+        *numfmt = NUM_HEX;
+    } else if (s[0] == '-') {
+        *val = strtol(s, &end, 10);
+        *numfmt = NUM_DEC;
+    } else {
+        *val = strtoul(s, &end, 10);
+        *numfmt = NUM_UDEC;
+    }
+    return end - s;
+}
+
+static bool is_sym_char(char c) {
+    return isalnum(c) || c == '.' || c == '_' || c == '$';
+}
+
+// Reads a symbol and an optional displacement after it, as in foo+8.
+// The symbol is terminated in place.
+static char *read_sym_disp(char *s, Operand *o) {
+    if (isalpha(*s) || *s == '.' || *s == '_') {
+        o->sym = s;
+        while (is_sym_char(*s))
+            s++;
+        if (*s != '+' && *s != '-')
+            return s;
+        if (*s == '+')
+            *s++ = '\0';
+    }
+    if (*s == '-' || isdigit(*s)) {
+        char *start = s;
+        s += read_number(s, &o->val, &o->numfmt);
+        o->hasdisp = true;
+        if (o->sym && *start == '-')
+            *start = '\0';
+    }
+    return s;
+}
+
+// Parses an operand in place. Returns false if it is not understood.
+static bool parse_operand(char *s, Operand *o) {
+    *o = (Operand){ .reg = NO_REG, .index = NO_REG };
+    if (*s == '*') {
+        o->indirect = true;
+        s++;
+    }
+    if (*s == '%') {
+        o->kind = OPD_REG;
+        int len = read_reg(s + 1, &o->reg, &o->width);
+        return len > 0 && s[len + 1] == '\0';
+    }
+    if (*s == '$') {
+        o->kind = OPD_IMM;
+        char *end = read_sym_disp(s + 1, o);
+        bool ok = (o->sym || o->hasdisp) && *end == '\0';
+        if (o->sym)
+            *end = '\0';
+        return ok;
+    }
+    char *end = read_sym_disp(s, o);
+    if (*end == '\0') {
+        o->kind = o->hasdisp ? OPD_MEM : OPD_SYM;
+        return o->sym || o->hasdisp;
+    }
+    if (*end != '(')
+        return false;
+    o->kind = OPD_MEM;
+    char *p = end + 1;
+    if (*p == '%') {
+        int len = read_reg(p + 1, &o->reg, &o->width);
+        if (!len)
+            return false;
+        p += len + 1;
+    }
+    if (*p == ',') {
+        p++;
+        int width, len;
+        if (*p != '%' || !(len = read_reg(p + 1, &o->index, &width)))
+            return false;
+        p += len + 1;
+        if (*p == ',') {
+            int numfmt;
+            long scale;
+            p++;
+            p += read_number(p, &scale, &numfmt);
+            o->scale = scale;
+        }
+    }
+    o->width = 0;
+    *end = '\0';
+    return p[0] == ')' && p[1] == '\0';
+}
+
+// Returns the name of a register with %, as in %eax.
+char *reg_name(int reg, int width) {
+    if (reg >= VREG_BASE) {
+        int n = reg - VREG_BASE;
+        switch (width) {
+        case 8:   return format("%%v%db", n);
+        case 16:  return format("%%v%dw", n);
+        case 32:  return format("%%v%dd", n);
+        case 128: return format("%%vx%d", n);
+        default:  return format("%%v%d", n);
+        }
+    }
+    if (reg == REG_IP)
+        return "%rip";
+    switch (width) {
+    case 8:   return format("%%%s", REGS8[reg]);
+    case 16:  return format("%%%s", REGS16[reg]);
+    case 32:  return format("%%%s", REGS32[reg]);
+    case 128: return format("%%xmm%d", reg - XMM0);
+    default:  return format("%%%s", REGS64[reg]);
+    }
+}
+
+static void append_reg(String *s, int reg, int width) {
+    char *name = reg_name(reg, width);
+    string_appendf(s, "%s", name);
+    if (reg != REG_IP)
+        arena_free(name);
+}
+
+static void append_number(String *s, long val, int numfmt) {
+    switch (numfmt) {
+    case NUM_HEX:  string_appendf(s, "0x%lx", val); break;
+    case NUM_UDEC: string_appendf(s, "%lu", val); break;
+    default:       string_appendf(s, "%ld", val);
+    }
+}
+
+static void append_operand(String *s, Operand *o) {
+    if (o->indirect)
+        string_appendf(s, "*");
+    switch (o->kind) {
+    case OPD_REG:
+        append_reg(s, o->reg, o->width);
+        return;
+    case OPD_IMM:
+        string_appendf(s, "$");
+        break;
+    }
+    if (o->sym)
+        string_appendf(s, o->hasdisp ? "%s+" : "%s", o->sym);
+    if (o->hasdisp)
+        append_number(s, o->val, o->numfmt);
+    if (o->kind != OPD_MEM || (o->reg == NO_REG && o->index == NO_REG))
+        return;
+    string_appendf(s, "(");
+    if (o->reg != NO_REG)
+        append_reg(s, o->reg, 64);
+    if (o->index != NO_REG) {
+        string_appendf(s, ",");
+        append_reg(s, o->index, 64);
+        if (o->scale)
+            string_appendf(s, ",%d", o->scale);
+    }
+    string_appendf(s, ")");
+}
+
+void set_reg_operand(Operand *o, int reg, int width) {
+    *o = (Operand){ .kind = OPD_REG, .reg = reg, .width = width, .index = NO_REG };
+}
+
+// Whether two operands are the same, however they are written.
+bool same_operand(Operand *a, Operand *b) {
+    if (a->kind != b->kind || a->indirect != b->indirect)
+        return false;
+    if (a->kind == OPD_REG)
+        return a->reg == b->reg && a->width == b->width;
+    if (a->reg != b->reg || a->index != b->index || a->val != b->val)
+        return false;
+    if (a->index != NO_REG && (a->scale ? a->scale : 1) != (b->scale ? b->scale : 1))
+        return false;
+    if (!a->sym || !b->sym)
+        return a->sym == b->sym;
+    return !strcmp(a->sym, b->sym);
+}
+
+/*
+ * Instructions
+ */
+
+static char *copy_string(char *s, int len) {
+    char *r = arena_malloc(len + 1);
+    memcpy(r, s, len);
+    r[len] = '\0';
+    return r;
+}
+
+static bool starts_with(char *s, char *prefix) {
+    return !strncmp(s, prefix, strlen(prefix));
+}
+
+// Splits the operands of an instruction at the commas outside
+// parentheses, and parses them in place.
+static void parse_args(Insn *insn, char *s) {
+    while (*s) {
+        if (insn->nargs == IR_MAXARGS)
+            error("internal error: too many operands: %s", insn->op);
+        while (*s == ' ')
+            s++;
+        char *start = s;
+        int depth = 0;
+        for (; *s && (*s != ',' || depth > 0); s++) {
+            if (*s == '(') depth++;
+            if (*s == ')') depth--;
+        }
+        if (*s == ',')
+            *s++ = '\0';
+        if (!parse_operand(start, &insn->args[insn->nargs++]))
+            error("internal error: bad operand: %s", start);
+    }
+}
+
+// Appends a line of code in assembler syntax. note is the annotation
+// written after it in assembly output.
+void ir_append(IrFunc *fn, char *text, char *note) {
+    Insn *insn = arena_malloc(sizeof(Insn));
+    insn->text = NULL;
+    insn->note = note;
+    insn->buf = NULL;
+    insn->op = NULL;
+    insn->nargs = 0;
+    char *s = (*text == '\t') ? text + 1 : text;
+    int len = strlen(s);
+    if (*s == '.' && !(len > 0 && s[len - 1] == ':')) {
+        if (!strcmp(s, ".text"))
+            fn->indata = false;
+        else if (!strcmp(s, ".data") || starts_with(s, ".section"))
+            fn->indata = true;
+        insn->kind = INSN_DATA;
+        insn->text = text;
+    } else if (fn->indata) {
+        insn->kind = INSN_DATA;
+        insn->text = text;
+    } else if (len > 0 && s[len - 1] == ':') {
+        insn->kind = INSN_LABEL;
+        insn->text = text;
+        insn->op = insn->buf = copy_string(s, len - 1);
+    } else {
+        insn->kind = INSN_OP;
+        insn->op = insn->buf = copy_string(s, len);
+        char *sp = strchr(insn->buf, ' ');
+        if (sp) {
+            *sp = '\0';
+            parse_args(insn, sp + 1);
+        }
+        arena_free(text);
+    }
+    list_push(fn->insns, insn);
+}
+
+// Frees an instruction that has been removed from its block.
+void free_insn(Insn *insn) {
+    arena_free(insn->text);
+    arena_free(insn->note);
+    arena_free(insn->buf);
+    arena_free(insn);
+}
+
+// Replaces an instruction. a1 is NULL for an instruction with one
+// operand. The mnemonic and the symbols are copied, so they may come
+// from another instruction.
+void rewrite_insn(Insn *insn, char *op, Operand *a0, Operand *a1) {
+    Operand args[2];
+    int nargs = a1 ? 2 : 1;
+    args[0] = *a0;
+    if (a1)
+        args[1] = *a1;
+    int len = strlen(op) + 1;
+    for (int i = 0; i < nargs; i++)
+        if (args[i].sym)
+            len += strlen(args[i].sym) + 1;
+    char *buf = arena_malloc(len);
+    char *p = buf;
+    strcpy(p, op);
+    insn->op = p;
+    p += strlen(p) + 1;
+    for (int i = 0; i < nargs; i++) {
+        if (args[i].sym) {
+            strcpy(p, args[i].sym);
+            args[i].sym = p;
+            p += strlen(p) + 1;
+        }
+        insn->args[i] = args[i];
+    }
+    insn->nargs = nargs;
+    arena_free(insn->buf);
+    insn->buf = buf;
+}
+
+// Returns the line of an instruction in assembler syntax.
+char *insn_text(Insn *insn) {
+    if (insn->kind != INSN_OP)
+        return format("%s", insn->text);
+    String *s = make_string();
+    string_appendf(s, "\t%s", insn->op);
+    for (int i = 0; i < insn->nargs; i++) {
+        string_appendf(s, i ? ", " : " ");
+        append_operand(s, &insn->args[i]);
+    }
+    return get_cstring(s);
+}
+
+bool is_jump(Insn *insn) {
+    return insn->kind == INSN_OP && insn->op[0] == 'j';
+}
+
+bool is_indirect_jump(Insn *insn) {
+    return is_jump(insn) && insn->args[0].indirect;
+}
+
+// Whether control never goes on to the next instruction
+static bool is_barrier(Insn *insn) {
+    if (insn->kind != INSN_OP)
+        return false;
+    return !strcmp(insn->op, "jmp") || !strcmp(insn->op, "ret");
+}
+
+static Block *make_block(int id) {
+    Block *r = arena_malloc(sizeof(Block));
+    r->id = id;
+    r->label = NULL;
+    r->taken = false;
+    r->insns = make_list();
+    r->succs = make_list();
+    r->preds = make_list();
+    return r;
+}
+
+static void add_edge(Block *from, Block *to) {
+    for (Iter *i = list_iter(from->succs); !iter_end(i);)
+        if (iter_next(i) == to)
+            return;
+    list_push(from->succs, to);
+    list_push(to->preds, from);
+}
+
+// Marks the blocks whose labels s refers to. Names are looked up
+// through a buffer on the stack, as most words are not labels.
+static void mark_labels(Dict *labels, char *s) {
+    char buf[128];
+    while (*s) {
+        if (!isalpha(*s) && *s != '.' && *s != '_') {
+            s++;
+            continue;
+        }
+        char *start = s;
+        while (is_sym_char(*s))
+            s++;
+        int len = s - start;
+        char *name = (len < sizeof(buf)) ? buf : malloc(len + 1);
+        memcpy(name, start, len);
+        name[len] = '\0';
+        Block *b = dict_get(labels, name);
+        if (b)
+            b->taken = true;
+        if (name != buf)
+            free(name);
+    }
+}
+
+// Marks the blocks whose addresses are taken, rather than jumped to.
+static void mark_address_taken(IrFunc *fn, Dict *labels) {
+    for (Iter *i = list_iter(fn->insns); !iter_end(i);) {
+        Insn *insn = iter_next(i);
+        if (insn->kind == INSN_DATA) {
+            mark_labels(labels, insn->text);
+        } else if (insn->kind == INSN_OP && !is_jump(insn)) {
+            for (int j = 0; j < insn->nargs; j++) {
+                Block *b = insn->args[j].sym ? dict_get(labels, insn->args[j].sym) : NULL;
+                if (b)
+                    b->taken = true;
+            }
+        }
+    }
+}
+
+static void free_blocks(List *blocks) {
+    for (Iter *i = list_iter(blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        list_free(b->insns);
+        list_free(b->succs);
+        list_free(b->preds);
+        arena_free(b);
+    }
+    list_free(blocks);
+}
+
+/*
+ * Splits the instructions into basic blocks and links them. An indirect
+ * jump may go to any label whose address is taken. Blocks are kept in
+ * the order of the code, so that writing them out in order keeps the
+ * fall-through edges.
+ */
+void build_cfg(IrFunc *fn) {
+    free_blocks(fn->blocks);
+    fn->blocks = make_list();
+    Dict *labels = make_dict(NULL);
+    Block *cur = NULL;
+    bool ended = true;
+    for (Iter *i = list_iter(fn->insns); !iter_end(i);) {
+        Insn *insn = iter_next(i);
+        if (!cur || insn->kind == INSN_LABEL || (ended && insn->kind == INSN_OP)) {
+            cur = make_block(list_len(fn->blocks));
+            list_push(fn->blocks, cur);
+            ended = false;
+        }
+        if (insn->kind == INSN_LABEL && !cur->label) {
+            cur->label = insn->op;
+            dict_put(labels, insn->op, cur);
+        }
+        list_push(cur->insns, insn);
+        if (insn->kind == INSN_OP && (is_jump(insn) || !strcmp(insn->op, "ret")))
+            ended = true;
+    }
+    mark_address_taken(fn, labels);
+    int n = list_len(fn->blocks);
+    Block **v = malloc(sizeof(Block *) * (n + 1));
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        v[b->id] = b;
+    }
+    for (int i = 0; i < n; i++) {
+        Block *b = v[i];
+        Insn *last = block_last_op(b);
+        if (last && is_indirect_jump(last)) {
+            for (Iter *j = list_iter(fn->blocks); !iter_end(j);) {
+                Block *to = iter_next(j);
+                if (to->taken)
+                    add_edge(b, to);
+            }
+        } else if (last && is_jump(last)) {
+            Block *to = last->args[0].sym ? dict_get(labels, last->args[0].sym) : NULL;
+            if (to)
+                add_edge(b, to);
+        }
+        if ((!last || !is_barrier(last)) && i + 1 < n)
+            add_edge(b, v[i + 1]);
+    }
+    free(v);
+    dict_free(labels);
+}
+
+// Returns the last instruction of a block, not counting data.
+Insn *block_last_op(Block *b) {
+    Insn *r = NULL;
+    for (Iter *i = list_iter(b->insns); !iter_end(i);) {
+        Insn *insn = iter_next(i);
+        if (insn->kind != INSN_DATA)
+            r = insn;
+    }
+    return (r && r->kind == INSN_OP) ? r : NULL;
+}
+
+// Puts the instructions of the blocks back into one list.
+static void flatten(IrFunc *fn) {
+    list_free(fn->insns);
+    fn->insns = make_list();
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        list_append(fn->insns, b->insns);
+    }
+}
+
+/*
+ * Passes
+ */
+
+static void mark_reachable(Block *b, bool *seen) {
+    if (seen[b->id])
+        return;
+    seen[b->id] = true;
+    for (Iter *i = list_iter(b->succs); !iter_end(i);)
+        mark_reachable(iter_next(i), seen);
+}
+
+// Removes the code of blocks that control never reaches, such as the
+// epilogue after a return statement. Their data is kept, as code
+// elsewhere may refer to it.
+static bool remove_unreachable(IrFunc *fn) {
+    bool *seen = calloc(list_len(fn->blocks), sizeof(bool));
+    mark_reachable(list_head(fn->blocks), seen);
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        if (b->taken)
+            mark_reachable(b, seen);
+    }
+    bool changed = false;
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        if (seen[b->id])
+            continue;
+        List *insns = make_list();
+        for (Iter *j = list_iter(b->insns); !iter_end(j);) {
+            Insn *insn = iter_next(j);
+            if (insn->kind == INSN_DATA) {
+                list_push(insns, insn);
+            } else {
+                free_insn(insn);
+                changed = true;
+            }
+        }
+        list_free(b->insns);
+        b->insns = insns;
+    }
+    free(seen);
+    return changed;
+}
+
+// Calls fn for each register field of the operands of an instruction.
+static void for_each_reg(Insn *insn, void (*fn)(Operand *o, int *reg, void *arg), void *arg) {
+    for (int i = 0; i < insn->nargs; i++) {
+        Operand *o = &insn->args[i];
+        if (o->reg != NO_REG)
+            fn(o, &o->reg, arg);
+        if (o->kind == OPD_MEM && o->index != NO_REG)
+            fn(o, &o->index, arg);
+    }
+}
+
+typedef struct {
+    // Position of the current instruction
+    int pos;
+    // Position of the last use of each virtual register
+    int *last;
+    // Register assigned to each virtual register, or NO_REG
+    int *phys;
+    bool busy[32];
+    // Registers to be freed after the current instruction
+    int ending[IR_MAXARGS * 2];
+    int nending;
+} Assignment;
+
+static void find_last_use(Operand *o, int *reg, void *arg) {
+    Assignment *a = arg;
+    if (*reg >= VREG_BASE)
+        a->last[*reg - VREG_BASE] = a->pos;
+}
+
+static int take_temp(Assignment *a, int *temps, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!a->busy[temps[i]]) {
+            a->busy[temps[i]] = true;
+            return temps[i];
+        }
+    }
+    error("internal error: out of scratch registers");
+}
+
+static void assign_reg(Operand *o, int *reg, void *arg) {
+    Assignment *a = arg;
+    if (*reg < VREG_BASE)
+        return;
+    int v = *reg - VREG_BASE;
+    if (a->phys[v] == NO_REG) {
+        if (o->kind == OPD_REG && o->width == 128)
+            a->phys[v] = take_temp(a, XMM_TEMPS, NUM_XMM_TEMPS);
+        else
+            a->phys[v] = take_temp(a, INT_TEMPS, NUM_INT_TEMPS);
+    }
+    if (a->last[v] == a->pos)
+        a->ending[a->nending++] = a->phys[v];
+    *reg = a->phys[v];
+}
+
+/*
+ * Assigns scratch registers to the virtual registers. The code
+ * generator holds a temporary in one while it evaluates another
+ * operand, so their live ranges nest, and each gets the first register
+ * that is free where it is defined. A range is taken in the order of
+ * the code, so that it covers any branches and loops between the
+ * definition and the last use.
+ */
+static bool assign_registers(IrFunc *fn) {
+    int n = fn->nvregs;
+    if (n == 0)
+        return false;
+    Assignment a = { .pos = 0 };
+    a.last = malloc(sizeof(int) * n);
+    a.phys = malloc(sizeof(int) * n);
+    for (int i = 0; i < n; i++)
+        a.phys[i] = NO_REG;
+    for (Iter *i = list_iter(fn->insns); !iter_end(i); a.pos++) {
+        Insn *insn = iter_next(i);
+        if (insn->kind == INSN_OP)
+            for_each_reg(insn, find_last_use, &a);
+    }
+    a.pos = 0;
+    for (Iter *i = list_iter(fn->insns); !iter_end(i); a.pos++) {
+        Insn *insn = iter_next(i);
+        if (insn->kind != INSN_OP)
+            continue;
+        a.nending = 0;
+        for_each_reg(insn, assign_reg, &a);
+        for (int j = 0; j < a.nending; j++)
+            a.busy[a.ending[j]] = false;
+    }
+    free(a.last);
+    free(a.phys);
+    return true;
+}
+
+typedef struct {
+    char *name;
+    int level;
+    // Returns true if it changed the code.
+    bool (*run)(IrFunc *fn);
+} Pass;
+
+static Pass passes[] = {
+    { "regassign", 0, assign_registers },
+    { "unreachable", 1, remove_unreachable },
+    { "peephole", 1, peephole },
+};
+
+/*
+ * Builds the CFG of a function and runs the passes enabled at the
+ * current optimization level. The CFG is rebuilt after a pass changes
+ * the code, so each pass sees an up-to-date graph.
+ */
+void run_passes(IrFunc *fn) {
+    build_cfg(fn);
+    for (int i = 0; i < sizeof(passes) / sizeof(*passes); i++) {
+        if (passes[i].level > opt_level || list_len(fn->blocks) == 0)
+            continue;
+        if (passes[i].run(fn)) {
+            flatten(fn);
+            build_cfg(fn);
+        }
+    }
+    if (dump_ir)
+        print_ir(stderr, fn);
+}
+
+static void print_blocks(FILE *fp, char *title, List *blocks) {
+    fprintf(fp, " %s:", title);
+    if (list_len(blocks) == 0)
+        fprintf(fp, " -");
+    for (Iter *i = list_iter(blocks); !iter_end(i);)
+        fprintf(fp, " bb%d", ((Block *)iter_next(i))->id);
+}
+
+void print_ir(FILE *fp, IrFunc *fn) {
+    fprintf(fp, "function %s\n", fn->name);
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        fprintf(fp, "bb%d", b->id);
+        if (b->label)
+            fprintf(fp, " %s", b->label);
+        fprintf(fp, " ;");
+        print_blocks(fp, "preds", b->preds);
+        print_blocks(fp, "succs", b->succs);
+        fprintf(fp, "\n");
+        for (Iter *j = list_iter(b->insns); !iter_end(j);) {
+            Insn *insn = iter_next(j);
+            char *text = insn_text(insn);
+            char *s = (*text == '\t') ? text + 1 : text;
+            switch (insn->kind) {
+            case INSN_LABEL: fprintf(fp, "  %s\n", s); break;
+            case INSN_DATA:  fprintf(fp, "    | %s\n", s); break;
+            default:         fprintf(fp, "    %s\n", s);
+            }
+            arena_free(text);
+        }
+    }
+}
+
+// Returns the instructions of a function in order, after the passes.
+List *ir_insns(IrFunc *fn) {
+    flatten(fn);
+    return fn->insns;
+}
+
+// Frees a function and its instructions, including the lines and notes
+// passed to ir_append().
+void free_ir_func(IrFunc *fn) {
+    for (Iter *i = list_iter(fn->insns); !iter_end(i);)
+        free_insn(iter_next(i));
+    list_free(fn->insns);
+    free_blocks(fn->blocks);
+    arena_free(fn);
+}
@@ -0,0 +1,242 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * "8cc -run": loads an object made by the integrated assembler into
+ * memory and calls its main function, without writing any file or
+ * running the assembler or the linker.
+ *
+ * Symbols that are not defined by the program are looked up in the
+ * compiler process with dlsym(), which finds everything in the C
+ * library. The code is placed close to the variables it refers to if
+ * possible, so that 32-bit PC-relative references can reach them.
+ * Calls that cannot reach their target go through a stub that jumps to
+ * the 64-bit address.
+ *
+ * A /tmp/perf-<pid>.map file is written so that perf can name the
+ * compiled functions.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "8cc.h"
+
+#define STUB_SIZE 14
+
+extern char **environ;
+
+static Object *obj;
+static char **addrs;
+static char *stubs;
+static int nstubs;
+static Dict *stub_dict;
+static Dict *externs;
+
+static long page_align(long n) {
+    long size = sysconf(_SC_PAGESIZE);
+    return (n + size - 1) & ~(size - 1);
+}
+
+static bool fits32(long v) {
+    return -2147483648L <= v && v <= 2147483647L;
+}
+
+static char *get_section_addr(Section *sec) {
+    int i = 0;
+    for (Iter *iter = list_iter(obj->sections); !iter_end(iter); i++)
+        if (iter_next(iter) == sec)
+            return addrs[i];
+    error("internal error: unknown section");
+}
+
+static char *get_symbol_addr(Symbol *sym) {
+    if (sym->section)
+        return get_section_addr(sym->section) + sym->value;
+    return dict_get(externs, sym->name);
+}
+
+static void resolve_externs(void) {
+    externs = make_dict(NULL);
+    for (Iter *i = list_iter(obj->symbols); !iter_end(i);) {
+        Symbol *sym = iter_next(i);
+        if (sym->section)
+            continue;
+        char *addr = dlsym(RTLD_DEFAULT, sym->name);
+        if (!addr)
+            error("undefined symbol: %s", sym->name);
+        dict_put(externs, sym->name, addr);
+    }
+}
+
+// Returns the lowest address the code should be close to. Symbols that
+// are only called do not count, as calls can go through stubs.
+static char *get_lowest_extern(void) {
+    char *lowest = NULL;
+    char *lowest_call = NULL;
+    for (Iter *i = list_iter(obj->sections); !iter_end(i);) {
+        Section *sec = iter_next(i);
+        for (Iter *j = list_iter(sec->relocs); !iter_end(j);) {
+            Reloc *rel = iter_next(j);
+            if (rel->sym->section)
+                continue;
+            char *addr = dict_get(externs, rel->sym->name);
+            if (rel->type == RELOC_PC32 && (!lowest || addr < lowest))
+                lowest = addr;
+            if (!lowest_call || addr < lowest_call)
+                lowest_call = addr;
+        }
+    }
+    return lowest ? lowest : lowest_call;
+}
+
+// Returns a stub jumping to sym: "jmp *0(%rip)" followed by the address.
+static char *get_stub(Symbol *sym) {
+    char *stub = dict_get(stub_dict, sym->name);
+    if (stub)
+        return stub;
+    stub = stubs + nstubs++ * STUB_SIZE;
+    memcpy(stub, "\xff\x25\0\0\0\0", 6);
+    char *addr = get_symbol_addr(sym);
+    memcpy(stub + 6, &addr, 8);
+    dict_put(stub_dict, sym->name, stub);
+    return stub;
+}
+
+// Maps size bytes within 32-bit reach of addr if possible. The kernel
+// takes an address only as a hint, so try a few around addr.
+static char *map_near(char *addr, long size) {
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    for (long delta = 1 << 20; addr && delta < (1L << 30); delta *= 2) {
+        for (int below = 0; below < 2; below++) {
+            long hint = below ? (long)addr - delta - size : (long)addr + delta;
+            char *p = mmap((char *)(hint & ~0xfffffL), size, prot, flags, -1, 0);
+            if (p == MAP_FAILED)
+                continue;
+            if (fits32(p - addr) && fits32(p + size - addr))
+                return p;
+            munmap(p, size);
+        }
+    }
+    char *p = mmap(NULL, size, prot, flags, -1, 0);
+    if (p == MAP_FAILED)
+        error("mmap failed");
+    return p;
+}
+
+static void relocate(Section *sec, Reloc *rel) {
+    char *loc = get_section_addr(sec) + rel->offset;
+    char *s = get_symbol_addr(rel->sym);
+    long v;
+    switch (rel->type) {
+    case RELOC_PC32:
+    case RELOC_PLT32:
+        v = s + rel->addend - loc;
+        if (!fits32(v) && rel->type == RELOC_PLT32)
+            v = get_stub(rel->sym) + rel->addend - loc;
+        if (!fits32(v))
+            error("%s is too far from the compiled code", rel->sym->name);
+        break;
+    case RELOC_32:
+    case RELOC_32S:
+        v = (long)s + rel->addend;
+        if (rel->type == RELOC_32 ? (v >> 32) != 0 : !fits32(v))
+            error("absolute address of %s does not fit in 32 bits", rel->sym->name);
+        break;
+    case RELOC_64:
+        v = (long)s + rel->addend;
+        memcpy(loc, &v, 8);
+        return;
+    default:
+        error("internal error: unknown relocation %d", rel->type);
+    }
+    int v32 = v;
+    memcpy(loc, &v32, 4);
+}
+
+static int compare_symbols(const void *a, const void *b) {
+    long x = (*(Symbol **)a)->value;
+    long y = (*(Symbol **)b)->value;
+    return (x < y) ? -1 : (x > y);
+}
+
+static void write_perf_map(Section *text) {
+    int n = 0;
+    Symbol **syms = malloc(sizeof(Symbol *) * list_len(obj->symbols));
+    for (Iter *i = list_iter(obj->symbols); !iter_end(i);) {
+        Symbol *sym = iter_next(i);
+        if (sym->section == text && strncmp(sym->name, ".L", 2))
+            syms[n++] = sym;
+    }
+    qsort(syms, n, sizeof(Symbol *), compare_symbols);
+    FILE *fp = fopen(format("/tmp/perf-%d.map", getpid()), "w");
+    if (!fp)
+        return;
+    for (int i = 0; i < n; i++) {
+        long end = (i + 1 < n) ? syms[i + 1]->value : text->size;
+        fprintf(fp, "%lx %lx %s\n", (long)get_symbol_addr(syms[i]),
+                end - syms[i]->value, syms[i]->name);
+    }
+    fclose(fp);
+}
+
+int run_jit(Object *o, int argc, char **argv) {
+    obj = o;
+    stub_dict = make_dict(NULL);
+    nstubs = 0;
+    resolve_externs();
+
+    int nsecs = list_len(obj->sections);
+    long *offsets = malloc(sizeof(long) * nsecs);
+    long size = 0;
+    int i = 0;
+    for (Iter *iter = list_iter(obj->sections); !iter_end(iter); i++) {
+        offsets[i] = size;
+        size += page_align(((Section *)iter_next(iter))->size);
+    }
+    long stub_off = size;
+    size += page_align(list_len(obj->symbols) * STUB_SIZE);
+
+    char *mem = map_near(get_lowest_extern(), size);
+    addrs = malloc(sizeof(char *) * nsecs);
+    for (i = 0; i < nsecs; i++)
+        addrs[i] = mem + offsets[i];
+    stubs = mem + stub_off;
+
+    Section *text = NULL;
+    i = 0;
+    for (Iter *iter = list_iter(obj->sections); !iter_end(iter); i++) {
+        Section *sec = iter_next(iter);
+        if (sec->body)
+            memcpy(addrs[i], get_cstring(sec->body), sec->size);
+        if (!strcmp(sec->name, ".text"))
+            text = sec;
+    }
+    for (Iter *iter = list_iter(obj->sections); !iter_end(iter);) {
+        Section *sec = iter_next(iter);
+        for (Iter *j = list_iter(sec->relocs); !iter_end(j);)
+            relocate(sec, iter_next(j));
+    }
+    if (text && mprotect(get_section_addr(text), page_align(text->size), PROT_READ | PROT_EXEC))
+        error("mprotect failed");
+    if (mprotect(stubs, size - stub_off, PROT_READ | PROT_EXEC))
+        error("mprotect failed");
+    if (text)
+        write_perf_map(text);
+
+    Symbol *main_sym = NULL;
+    for (Iter *iter = list_iter(obj->symbols); !iter_end(iter);) {
+        Symbol *sym = iter_next(iter);
+        if (!strcmp(sym->name, "main") && sym->section)
+            main_sym = sym;
+    }
+    if (!main_sym)
+        error("main is not defined");
+    int (*mainfn)(int, char **, char **) = (void *)get_symbol_addr(main_sym);
+    return mainfn(argc, argv, environ);
+}
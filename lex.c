@@ -7,35 +7,64 @@
 #include <string.h>
 #include "8cc.h"
 
-static bool at_bol = true;
-
 typedef struct {
     char *displayname;
     char *realname;
     int line;
     int column;
     FILE *fp;
+    // For a file read from a token stream, the next record and the end
+    char *rec;
+    char *end;
+    // Added to the line numbers of the stream by #line
+    int line_adjust;
 } File;
 
-static List *buffer = &EMPTY_LIST;
-static List *altbuffer = NULL;
-static List *file_stack = &EMPTY_LIST;
-static File *file;
-static int line_mark = -1;
-static int column_mark = -1;
-static int ungotten = -1;
+struct LexState {
+    bool at_bol;
+    List *buffer;
+    List *altbuffer;
+    List *file_stack;
+    File *file;
+    int line_mark;
+    int column_mark;
+    int ungotten;
+    // If not NULL, input_position() returns the position of this token
+    Token *position;
+};
 
 static Token *newline_token = &(Token){ .type = TNEWLINE, .nspace = 0 };
 
 static void skip_block_comment(void);
+static void skip_stream_cond_incl(File *f);
+static char *read_stream_header_name(File *f, bool *std);
+static char *read_stream_error_directive(File *f);
+static Token *read_stream_token(File *f);
 
 static File *make_file(char *displayname, char *realname, FILE *fp) {
-    File *r = malloc(sizeof(File));
+    File *r = arena_malloc(sizeof(File));
     r->displayname = displayname;
     r->realname = realname;
     r->line = 1;
     r->column = 0;
     r->fp = fp;
+    r->rec = NULL;
+    r->end = NULL;
+    r->line_adjust = 0;
+    return r;
+}
+
+LexState *make_lex_state(void) {
+    LexState *r = arena_malloc(sizeof(LexState));
+    r->at_bol = true;
+    r->buffer = make_list();
+    r->altbuffer = NULL;
+    r->file_stack = make_list();
+    r->file = NULL;
+    r->line_mark = -1;
+    r->column_mark = -1;
+    r->ungotten = -1;
+    r->position = NULL;
     return r;
 }
 
@@ -54,14 +83,15 @@ void lex_init(char *filename) {
 }
 
 static Token *make_token(Token *tmpl) {
-    Token *r = malloc(sizeof(Token));
+    Token *r = arena_malloc(sizeof(Token));
     *r = *tmpl;
     r->hideset = make_dict(NULL);
-    r->file = file->displayname;
-    r->line = (line_mark < 0) ? file->line : line_mark;
-    r->column = (column_mark < 0) ? file->column : column_mark;
-    line_mark = -1;
-    column_mark = -1;
+    LexState *s = context->lex;
+    r->file = s->file->displayname;
+    r->line = (s->line_mark < 0) ? s->file->line : s->line_mark;
+    r->column = (s->column_mark < 0) ? s->file->column : s->column_mark;
+    s->line_mark = -1;
+    s->column_mark = -1;
     return r;
 }
 
@@ -90,73 +120,108 @@ static Token *make_space(int nspace) {
 }
 
 void push_input_file(char *displayname, char *realname, FILE *fp) {
-    list_push(file_stack, file);
-    file = make_file(displayname, realname, fp);
-    at_bol = true;
+    LexState *s = context->lex;
+    list_push(s->file_stack, s->file);
+    s->file = make_file(displayname, realname, fp);
+    s->at_bol = true;
+    if (trace_enabled())
+        trace_begin(TRACE_CPP, realname, format("\"depth\": %d", list_len(s->file_stack)));
 }
 
 void set_input_file(char *displayname, char *realname, FILE *fp) {
-    file = make_file(displayname, realname, fp);
-    at_bol = true;
+    context->lex->file = make_file(displayname, realname, fp);
+    context->lex->at_bol = true;
+}
+
+// Closes the input file and the files being included from it, which
+// are left open if reading stops at an error.
+void close_input_files(void) {
+    LexState *s = context->lex;
+    while (s->file) {
+        if (s->file->fp && s->file->fp != stdin)
+            fclose(s->file->fp);
+        s->file = list_pop(s->file_stack);
+    }
 }
 
 char *input_position(void) {
-    if (!file)
+    if (context && context->lex->position) {
+        Token *tok = context->lex->position;
+        return format("%s:%d:%d", tok->file, tok->line, tok->column);
+    }
+    if (!context || !context->lex->file)
         return "(unknown)";
+    File *file = context->lex->file;
     return format("%s:%d:%d", file->displayname, file->line, file->column);
 }
 
+// Makes diagnostics refer to tok, for a thread that reads tokens made
+// by another thread.
+void set_input_position(Token *tok) {
+    context->lex->position = tok;
+}
+
+Token *get_input_position(void) {
+    return context->lex->position;
+}
+
 char *get_current_file(void) {
-    return file->realname;
+    return context->lex->file->realname;
 }
 
 int get_current_line(void) {
-    return file->line;
+    return context->lex->file->line;
 }
 
 void set_current_line(int line) {
-    file->line = line;
+    File *f = context->lex->file;
+    f->line_adjust += line - f->line;
+    f->line = line;
 }
 
 char *get_current_displayname(void) {
-    return file->displayname;
+    return context->lex->file->displayname;
 }
 
 void set_current_displayname(char *name) {
-    file->displayname = name;
+    context->lex->file->displayname = name;
 }
 
 static void mark_input(void) {
-    line_mark = file->line;
-    column_mark = file->column;
+    LexState *s = context->lex;
+    s->line_mark = s->file->line;
+    s->column_mark = s->file->column;
 }
 
 static void unget(int c) {
+    LexState *s = context->lex;
     if (c == '\n')
-        file->line--;
-    if (ungotten >= 0)
-        ungetc(ungotten, file->fp);
-    ungotten = c;
-    file->column--;
+        s->file->line--;
+    if (s->ungotten >= 0)
+        ungetc(s->ungotten, s->file->fp);
+    s->ungotten = c;
+    s->file->column--;
 }
 
 static bool skip_newline(int c) {
     if (c == '\n')
         return true;
     if (c == '\r') {
-        int c2 = getc(file->fp);
+        int c2 = getc(context->lex->file->fp);
         if (c2 == '\n')
             return true;
-        ungetc(c2, file->fp);
+        ungetc(c2, context->lex->file->fp);
         return true;
     }
     return false;
 }
 
 static int get(void) {
-    int c = (ungotten >= 0) ? ungotten : getc(file->fp);
+    LexState *s = context->lex;
+    File *file = s->file;
+    int c = (s->ungotten >= 0) ? s->ungotten : getc(file->fp);
     file->column++;
-    ungotten = -1;
+    s->ungotten = -1;
     if (c == '\\') {
         c = getc(file->fp);
         file->column++;
@@ -166,15 +231,15 @@ static int get(void) {
             return get();
         }
         unget(c);
-        at_bol = false;
+        s->at_bol = false;
         return '\\';
     }
     if (skip_newline(c)) {
         file->line++;
         file->column = 1;
-        at_bol = true;
+        s->at_bol = true;
     } else {
-        at_bol = false;
+        s->at_bol = false;
     }
     return c;
 }
@@ -242,6 +307,10 @@ static int skip_space(void) {
 }
 
 void skip_cond_incl(void) {
+    if (context->lex->file->rec) {
+        skip_stream_cond_incl(context->lex->file);
+        return;
+    }
     int nest = 0;
     for (;;) {
         skip_space();
@@ -513,6 +582,8 @@ static Token *read_token_int(void) {
 }
 
 char *read_header_file_name(bool *std) {
+    if (context->lex->file->rec)
+        return read_stream_header_name(context->lex->file, std);
     skip_space();
     char close;
     if (next('"')) {
@@ -543,14 +614,16 @@ bool is_punct(Token *tok, int c) {
 }
 
 void set_input_buffer(List *tokens) {
-    altbuffer = tokens ? list_reverse(tokens) : NULL;
+    context->lex->altbuffer = tokens ? list_reverse(tokens) : NULL;
 }
 
 List *get_input_buffer(void) {
-    return altbuffer ? list_reverse(altbuffer) : NULL;
+    return context->lex->altbuffer ? list_reverse(context->lex->altbuffer) : NULL;
 }
 
 char *read_error_directive(void) {
+    if (context->lex->file->rec)
+        return read_stream_error_directive(context->lex->file);
     String *s = make_string();
     bool bol = true;
     for (;;) {
@@ -567,9 +640,16 @@ char *read_error_directive(void) {
     return get_cstring(s);
 }
 
+// Returns true if tokens have been read ahead and pushed back.
+bool has_ungotten_tokens(void) {
+    LexState *s = context->lex;
+    return list_len(s->buffer) > 0 || s->altbuffer;
+}
+
 void unget_cpp_token(Token *tok) {
     if (!tok) return;
-    list_push(altbuffer ? altbuffer : buffer, tok);
+    LexState *s = context->lex;
+    list_push(s->altbuffer ? s->altbuffer : s->buffer, tok);
 }
 
 Token *peek_cpp_token(void) {
@@ -578,12 +658,8 @@ Token *peek_cpp_token(void) {
     return tok;
 }
 
-static Token *read_cpp_token_int(void) {
-    if (altbuffer)
-        return list_pop(altbuffer);
-    if (list_len(buffer) > 0)
-        return list_pop(buffer);
-    bool bol = at_bol;
+static Token *read_file_token(void) {
+    bool bol = context->lex->at_bol;
     Token *tok = read_token_int();
     while (tok && tok->type == TSPACE) {
         Token *tok2 = read_token_int();
@@ -591,16 +667,300 @@ static Token *read_cpp_token_int(void) {
             tok2->nspace += tok->nspace;
         tok = tok2;
     }
-    if (!tok && list_len(file_stack) > 0) {
-        fclose(file->fp);
-        file = list_pop(file_stack);
-        at_bol = true;
+    if (tok) tok->bol = bol;
+    return tok;
+}
+
+static Token *read_cpp_token_int(void) {
+    LexState *s = context->lex;
+    if (s->altbuffer)
+        return list_pop(s->altbuffer);
+    if (list_len(s->buffer) > 0)
+        return list_pop(s->buffer);
+    Token *tok = s->file->rec ? read_stream_token(s->file) : read_file_token();
+    if (!tok && list_len(s->file_stack) > 0) {
+        if (s->file->fp)
+            fclose(s->file->fp);
+        trace_end(TRACE_CPP);
+        s->file = list_pop(s->file_stack);
+        s->at_bol = true;
         return newline_token;
     }
-    if (tok) tok->bol = bol;
     return tok;
 }
 
 Token *read_cpp_token(void) {
     return read_cpp_token_int();
 }
+
+/*
+ * Token streams
+ *
+ * A header can be lexed once into a stream of records, one for each
+ * token the preprocessor would read from it, which push_token_stream()
+ * then reads back in place of the file. A record also holds where the
+ * lexer stood after the token, so that __LINE__ and diagnostics come out
+ * the same. The name of an #include and the message of an #error, which
+ * the preprocessor reads as characters, have records of their own.
+ */
+
+enum {
+    TREC_HEADER_NAME = 256,
+    TREC_ERROR_TEXT,
+};
+
+typedef struct {
+    int type;
+    int nspace;
+    int line;
+    int column;
+    // Position of the lexer after the token
+    int endline;
+    int endcolumn;
+    // The punctuator or the character, or the length of the string that
+    // follows the record
+    int val;
+    bool bol;
+    // Whether a header name was in angle brackets
+    bool std;
+} TokenRecord;
+
+static bool has_string(int type) {
+    return type != TPUNCT && type != TCHAR && type != TNEWLINE;
+}
+
+// Reads the record at f->rec and returns the string that follows it.
+static char *read_record(File *f, TokenRecord *rec) {
+    memcpy(rec, f->rec, sizeof(TokenRecord));
+    f->rec += sizeof(TokenRecord);
+    f->line = rec->endline + f->line_adjust;
+    f->column = rec->endcolumn;
+    if (!has_string(rec->type))
+        return NULL;
+    char *r = f->rec;
+    f->rec += rec->val + 1;
+    return r;
+}
+
+static Token *read_stream_token(File *f) {
+    if (f->rec == f->end)
+        return NULL;
+    TokenRecord rec;
+    char *s = read_record(f, &rec);
+    if (rec.type == TNEWLINE) {
+        newline_token->bol = rec.bol;
+        return newline_token;
+    }
+    Token *r = arena_malloc(sizeof(Token));
+    // Directives in macro arguments are undefined; the text of one read
+    // as a token is taken as a string.
+    *r = (Token){ (rec.type >= TREC_HEADER_NAME) ? TSTRING : rec.type,
+                  .nspace = rec.nspace, .bol = rec.bol };
+    if (rec.type == TPUNCT)
+        r->punct = rec.val;
+    else if (rec.type == TCHAR)
+        r->c = rec.val;
+    else
+        r->sval = s;
+    r->hideset = make_dict(NULL);
+    r->file = f->displayname;
+    r->line = rec.line + f->line_adjust;
+    r->column = rec.column;
+    return r;
+}
+
+static int next_record_type(File *f) {
+    if (f->rec == f->end)
+        return -1;
+    TokenRecord rec;
+    memcpy(&rec, f->rec, sizeof(TokenRecord));
+    return rec.type;
+}
+
+static void skip_stream_cond_incl(File *f) {
+    int nest = 0;
+    TokenRecord rec;
+    while (f->rec < f->end) {
+        char *sharp = f->rec;
+        read_record(f, &rec);
+        if (rec.type != TPUNCT || rec.val != '#' || !rec.bol || f->rec == f->end)
+            continue;
+        char *name = read_record(f, &rec);
+        if (rec.type != TIDENT)
+            continue;
+        if (!nest && (!strcmp(name, "else") || !strcmp(name, "elif") || !strcmp(name, "endif"))) {
+            f->rec = sharp;
+            return;
+        }
+        if (!strcmp(name, "if") || !strcmp(name, "ifdef") || !strcmp(name, "ifndef"))
+            nest++;
+        else if (nest && !strcmp(name, "endif"))
+            nest--;
+    }
+}
+
+static char *read_stream_header_name(File *f, bool *std) {
+    TokenRecord rec;
+    if (next_record_type(f) != TREC_HEADER_NAME)
+        return NULL;
+    char *r = read_record(f, &rec);
+    *std = rec.std;
+    return r;
+}
+
+static char *read_stream_error_directive(File *f) {
+    TokenRecord rec;
+    if (next_record_type(f) != TREC_ERROR_TEXT)
+        return "";
+    return read_record(f, &rec);
+}
+
+void push_token_stream(char *displayname, char *realname, char *p, long len) {
+    push_input_file(displayname, realname, NULL);
+    context->lex->file->rec = p;
+    context->lex->file->end = p + len;
+}
+
+static void write_record(String *s, TokenRecord *rec, char *str) {
+    for (int i = 0; i < sizeof(TokenRecord); i++)
+        string_append(s, ((char *)rec)[i]);
+    if (!str)
+        return;
+    for (int i = 0; i <= rec->val; i++)
+        string_append(s, str[i]);
+}
+
+static void write_special_record(String *s, int type, char *str, bool std) {
+    File *f = context->lex->file;
+    TokenRecord rec = { type, .endline = f->line, .endcolumn = f->column,
+                        .val = strlen(str), .std = std };
+    write_record(s, &rec, str);
+}
+
+// Marks the lines that begin with '#', counting lines as get() does.
+static bool *find_sharp_lines(char *p, long size, int *nlines) {
+    char *end = p + size;
+    int n = 1;
+    for (char *q = p; q < end; q++)
+        if (*q == '\n' || (*q == '\r' && (q + 1 == end || q[1] != '\n')))
+            n++;
+    bool *r = arena_calloc(n + 1, sizeof(bool));
+    int line = 1;
+    bool bol = true;
+    for (; p < end; p++) {
+        if (*p == '\n' || *p == '\r') {
+            if (*p == '\r' && p + 1 < end && p[1] == '\n')
+                p++;
+            line++;
+            bol = true;
+            continue;
+        }
+        if (bol && *p == '#')
+            r[line] = true;
+        if (!iswhitespace(*p))
+            bol = false;
+    }
+    *nlines = n;
+    return r;
+}
+
+static bool has_sharp_line(bool *sharp, int nlines, int from, int to) {
+    for (int i = from; i <= to && i <= nlines; i++)
+        if (sharp[i])
+            return true;
+    return false;
+}
+
+static bool write_tokens(String *out, bool *sharp, int nlines) {
+    File *f = context->lex->file;
+    Token *prev = newline_token;
+    int line = f->line;
+    for (;;) {
+        Token *tok = read_cpp_token_int();
+        if (!tok)
+            return true;
+        // skip_cond_incl() skips the rest of a line without looking for
+        // comments, so it sees a line with '#' inside a comment that
+        // begins after a token as a directive.
+        int start = (tok == newline_token) ? f->line - 1 : tok->line;
+        if (prev != newline_token && has_sharp_line(sharp, nlines, line + 1, start))
+            return false;
+        TokenRecord rec = { tok->type, .nspace = tok->nspace, .line = tok->line,
+                            .column = tok->column, .endline = f->line,
+                            .endcolumn = f->column, .bol = tok->bol };
+        char *str = NULL;
+        if (tok->type == TPUNCT)
+            rec.val = tok->punct;
+        else if (tok->type == TCHAR)
+            rec.val = tok->c;
+        else if (tok->type != TNEWLINE)
+            rec.val = strlen(str = tok->sval);
+        write_record(out, &rec, str);
+        if (prev->bol && is_punct(prev, '#') && tok->type == TIDENT) {
+            bool std;
+            char *name;
+            if (!strcmp(tok->sval, "include") && (name = read_header_file_name(&std)))
+                write_special_record(out, TREC_HEADER_NAME, name, std);
+            else if (!strcmp(tok->sval, "error"))
+                write_special_record(out, TREC_ERROR_TEXT, read_error_directive(), false);
+            if (has_sharp_line(sharp, nlines, start + 1, f->line))
+                return false;
+        }
+        prev = tok;
+        line = f->line;
+    }
+}
+
+// Returns false if the lexer reports an error.
+static bool try_write_tokens(String *out, bool *sharp, int nlines) {
+    jmp_buf *saved = context->on_error;
+    jmp_buf env;
+    context->on_error = &env;
+    bool ok = false;
+    if (setjmp(env) == 0)
+        ok = write_tokens(out, sharp, nlines);
+    context->on_error = saved;
+    return ok;
+}
+
+// Lexes the contents of a header into a token stream, which is allocated
+// with malloc() and is *len bytes long. Returns NULL if the lexer reports
+// an error or a warning, or if the stream might not be read the same way
+// as the file.
+char *make_token_stream(char *body, long size, long *len) {
+    // A warning of the lexer would go unnoticed.
+    if (suppress_warning)
+        return NULL;
+    // fmemopen() does not accept an empty buffer.
+    FILE *fp = size ? fmemopen(body, size, "r") : fmemopen("\n", 1, "r");
+    if (!fp)
+        return NULL;
+    Context *ctx = context;
+    LexState *lex = ctx->lex;
+    FILE *diag = ctx->diag;
+    Arena *arena = make_arena();
+    Arena *saved = set_arena(arena);
+    char *msg;
+    size_t msglen;
+    ctx->diag = open_memstream(&msg, &msglen);
+    ctx->lex = make_lex_state();
+    set_input_file("-", NULL, fp);
+    int nlines;
+    bool *sharp = find_sharp_lines(body, size, &nlines);
+    String *out = make_string();
+    bool ok = try_write_tokens(out, sharp, nlines);
+    fclose(fp);
+    fclose(ctx->diag);
+    ctx->diag = diag;
+    ctx->lex = lex;
+    char *r = NULL;
+    if (ok && msglen == 0) {
+        *len = string_len(out);
+        r = malloc(*len + 1);
+        memcpy(r, get_cstring(out), *len);
+    }
+    free(msg);
+    set_arena(saved);
+    free_arena(arena);
+    return r;
+}
@@ -0,0 +1,85 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Library interface. See lib8cc.h.
+ */
+
+// For fmemopen() and open_memstream()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+#include "lib8cc.h"
+
+static char *make_cppdefs(char **defines) {
+    String *s = make_string();
+    for (; defines && *defines; defines++) {
+        char *def = format("%s", *defines);
+        char *p = strchr(def, '=');
+        if (p)
+            *p = ' ';
+        string_appendf(s, "#define %s\n", def);
+    }
+    return get_cstring(s);
+}
+
+static void compile(char *src, long len, Lib8ccOptions *opts, FILE *out) {
+    set_output_file(out);
+    for (char **p = opts->include_paths; p && *p; p++)
+        add_include_path(*p);
+    char *defs = make_cppdefs(opts->defines);
+    if (*defs)
+        cpp_eval(defs);
+    char *name = opts->filename ? opts->filename : "(input)";
+    // fmemopen() does not accept an empty buffer.
+    FILE *in = (len > 0) ? fmemopen(src, len, "r") : fmemopen("\n", 1, "r");
+    set_input_file(name, NULL, in);
+    for (;;) {
+        Node *v = read_toplevel();
+        if (!v)
+            break;
+        emit_toplevel(v);
+    }
+}
+
+int lib8cc_compile(char *src, long len, Lib8ccOptions *opts, Lib8ccResult *result) {
+    Lib8ccOptions empty = { 0 };
+    if (!opts)
+        opts = &empty;
+    Context *saved = context;
+    // Everything but the results is allocated from the arena, which is
+    // released before returning.
+    Arena *arena = make_arena();
+    set_arena(arena);
+    Context *ctx = make_context();
+    ctx->arena = arena;
+    size_t codelen, diaglen;
+    FILE *out = open_memstream(&result->code, &codelen);
+    ctx->diag = open_memstream(&result->diagnostics, &diaglen);
+    ctx->read_file = opts->read_file;
+    ctx->read_file_data = opts->data;
+    jmp_buf env;
+    ctx->on_error = &env;
+    set_context(ctx);
+
+    int r = 0;
+    if (setjmp(env) == 0)
+        compile(src, len, opts, out);
+    else
+        r = 1;
+    close_input_files();
+    fclose(out);
+    fclose(ctx->diag);
+    set_context(saved);
+    free_arena(arena);
+
+    result->len = codelen;
+    if (r) {
+        free(result->code);
+        result->code = NULL;
+        result->len = 0;
+    }
+    return r;
+}
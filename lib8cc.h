@@ -0,0 +1,44 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * lib8cc: compiles C source in memory to assembly in memory.
+ *
+ * Link with lib8cc.a. Each call compiles in a fresh context, so calls
+ * may run in parallel from different threads. Errors are returned as
+ * diagnostics instead of terminating the process.
+ */
+
+#ifndef LIB8CC_H
+#define LIB8CC_H
+
+// Returns the contents of the header file at path and sets *len, or
+// returns NULL to look for the file on disk. A header included with
+// quotes from the source is looked up as "./name".
+typedef char *Lib8ccReadFile(char *path, int *len, void *data);
+
+typedef struct {
+    // Name of the source in diagnostics and __FILE__. May be NULL.
+    char *filename;
+    // NULL-terminated arrays of "NAME" or "NAME=VALUE", as with -D, and
+    // of include directories, as with -I. May be NULL.
+    char **defines;
+    char **include_paths;
+    // May be NULL.
+    Lib8ccReadFile *read_file;
+    void *data;
+} Lib8ccOptions;
+
+typedef struct {
+    // Assembly, or NULL if compilation failed. Free with free().
+    char *code;
+    long len;
+    // Errors and warnings; an empty string if there are none. Free with
+    // free().
+    char *diagnostics;
+} Lib8ccResult;
+
+// Returns 0 on success and 1 on error.
+extern int lib8cc_compile(char *src, long len, Lib8ccOptions *opts, Lib8ccResult *result);
+
+#endif /* LIB8CC_H */
@@ -2,11 +2,12 @@
 // This program is free software licensed under the MIT license.
 
 #include <stdlib.h>
+#include "arena.h"
 #include "list.h"
 #include "error.h"
 
 List *make_list(void) {
-    List *r = malloc(sizeof(List));
+    List *r = arena_malloc(sizeof(List));
     r->len = 0;
     r->head = r->tail = NULL;
     return r;
@@ -19,7 +20,7 @@ List *make_list1(void *e) {
 }
 
 void *make_node(void *elem) {
-    ListNode *r = malloc(sizeof(ListNode));
+    ListNode *r = arena_malloc(sizeof(ListNode));
     r->elem = elem;
     r->next = NULL;
     r->prev = NULL;
@@ -33,6 +34,17 @@ List *list_copy(List *list) {
     return r;
 }
 
+// Frees a list and its nodes, but not the elements.
+void list_free(List *list) {
+    ListNode *node = list->head;
+    while (node) {
+        ListNode *next = node->next;
+        arena_free(node);
+        node = next;
+    }
+    arena_free(list);
+}
+
 void list_push(List *list, void *elem) {
     ListNode *node = make_node(elem);
     if (!list->head) {
@@ -114,7 +126,7 @@ int list_len(List *list) {
 }
 
 Iter *list_iter(List *list) {
-    Iter *r = malloc(sizeof(Iter));
+    Iter *r = arena_malloc(sizeof(Iter));
     r->ptr = list->head;
     return r;
 }
@@ -28,6 +28,7 @@ typedef struct Iter {
 extern List *make_list(void);
 extern List *make_list1(void *e);
 extern List *list_copy(List *list);
+extern void list_free(List *list);
 extern void list_push(List *list, void *elem);
 extern void *list_pop(List *list);
 extern void list_append(List *a, List *b);
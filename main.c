@@ -1,6 +1,7 @@
 // Copyright 2012 Rui Ueyama <rui314@gmail.com>
 // This program is free software licensed under the MIT license.
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,7 @@
 #include <unistd.h>
 #include "8cc.h"
 
+static List *inputfiles = &EMPTY_LIST;
 static char *inputfile;
 static char *outputfile;
 static bool wantast;
@@ -16,11 +18,27 @@ static bool cpponly;
 static bool dontasm;
 static bool dontlink;
 static String *cppdefs;
-static List *tmpfiles = &EMPTY_LIST;
+static int njobs = 1;
+static bool external_as;
+static bool jit;
+static bool incremental;
+static bool pipeline;
+static int codegen_threads = 1;
+static bool prefetch_headers;
+static bool peephole_stats;
+static CodegenPool *pool;
+static List *funcs;
+static int jit_argc;
+static char **jit_argv;
+static char *objfile;
+static pid_t as_pid = -1;
 
 static void usage(void) {
     fprintf(stderr,
-            "Usage: 8cc [ -E ][ -a ] [ -h ] <file>\n\n"
+            "Usage: 8cc [ -E ][ -a ] [ -h ] <file>...\n"
+            "       8cc --server\n"
+            "       8cc --client <options> <file>...\n"
+            "       8cc -run <options> <file> <args>...\n"
             "\n"
             "  -I<path>          add to include path\n"
             "  -E                print preprocessed source code\n"
@@ -28,20 +46,56 @@ static void usage(void) {
             "  -D name=def\n"
             "  -S                Stop before assembly (default)\n"
             "  -c                Do not run linker (default)\n"
+            "                    (-o names the object file)\n"
             "  -U name           Undefine name\n"
             "  -a                print AST\n"
             "  -d cpp            print tokens for debugging\n"
+            "  -O<n>             optimization level, 0 or 1 (default)\n"
+            "  -ftrace=<file>    write Chrome trace events to file\n"
+            "  -fcache[=<dir>]   reuse the output of identical compilations\n"
+            "  -fcache-size=<n>  limit the cache to n bytes (K, M, G suffixes)\n"
+            "  -fincremental     reuse the code of unchanged functions\n"
+            "  -fpipeline        run the preprocessor, parser and codegen in threads\n"
+            "  -fcodegen-threads=<n>  generate code for functions in n threads\n"
+            "  -fprefetch-headers  read headers in a helper thread ahead of time\n"
+            "  -fshared-headers  share headers with other 8cc processes in memory\n"
+            "  -fno-integrated-as  assemble with the system's as\n"
+            "  -fdump-ir         print the IR of each function after the passes\n"
+            "  -fpeephole-stats  print the number of peephole rewrites by rule\n"
+            "  -j N              compile up to N files in parallel\n"
             "  -o filename       Output to the specified file\n"
             "  -h                print this help\n"
             "\n"
-            "One of -a, -c, -E or -S must be specified.\n\n");
+            "One of -a, -c, -E or -S must be specified.\n"
+            "\n"
+            "--server runs a compile server, and --client sends the rest\n"
+            "of the command line to it, or compiles locally if no server\n"
+            "is running. The socket is $EIGHTCC_SOCKET, or 8cc.sock in\n"
+            "$XDG_RUNTIME_DIR or in /tmp/8cc-<uid>.\n"
+            "\n"
+            "The cache directory is $EIGHTCC_CACHE_DIR or ~/.cache/8cc by\n"
+            "default, and holds up to 256M.\n"
+            "\n"
+            "-fincremental keeps the code of each function in <output>.fncache.\n"
+            "\n"
+            "The shared memory segment of -fshared-headers is $EIGHTCC_SHM or\n"
+            "/8cc-headers-<uid>.\n"
+            "\n"
+            "-run compiles the file in memory and runs its main function\n"
+            "with the rest of the arguments.\n\n");
     exit(1);
 }
 
-static void delete_temp_files(void) {
-    Iter *iter = list_iter(tmpfiles);
-    while (!iter_end(iter))
-        unlink(iter_next(iter));
+// If the compiler exits while the assembler is still running, the
+// object file would be made from incomplete input. Kill the assembler
+// and remove whatever it has written.
+static void kill_assembler(void) {
+    if (as_pid < 0)
+        return;
+    signal(SIGPIPE, SIG_IGN);
+    kill(as_pid, SIGKILL);
+    waitpid(as_pid, NULL, 0);
+    unlink(objfile);
 }
 
 static char *replace_suffix(char *filename, char suffix) {
@@ -53,16 +107,80 @@ static char *replace_suffix(char *filename, char suffix) {
     return r;
 }
 
+/*
+ * Starts the assembler with a pipe connected to its standard input.
+ * The assembly is written to the pipe as it is generated, so the
+ * assembler runs alongside code generation instead of after it.
+ */
+static FILE *open_asm_pipe(void) {
+    int fds[2];
+    if (pipe(fds) < 0)
+        perror("pipe");
+    trace_begin(TRACE_AS, "as", format("\"output\": \"%s\"", quote_cstring(objfile)));
+    as_pid = fork();
+    if (as_pid < 0)
+        perror("fork");
+    if (as_pid == 0) {
+        dup2(fds[0], 0);
+        close(fds[0]);
+        close(fds[1]);
+        execlp("as", "as", "-o", objfile, (char *)NULL);
+        perror("execlp failed");
+        _exit(1);
+    }
+    close(fds[0]);
+    FILE *fp = fdopen(fds[1], "w");
+    if (!fp)
+        perror("fdopen");
+    return fp;
+}
+
+static void wait_assembler(void) {
+    int status;
+    if (waitpid(as_pid, &status, 0) < 0)
+        perror("waitpid");
+    as_pid = -1;
+    trace_end(TRACE_AS);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        unlink(objfile);
+        error("as failed");
+    }
+}
+
+static bool is_object_output(void) {
+    return !wantast && !cpponly && !dontasm;
+}
+
+// Returns the name of the assembly or object file, or NULL if the output
+// does not go to a file.
+static char *get_output_path(void) {
+    if (jit || wantast || cpponly)
+        return NULL;
+    if (!dontasm)
+        return outputfile ? outputfile : replace_suffix(inputfile, 'o');
+    if (!outputfile)
+        return replace_suffix(inputfile, 's');
+    return strcmp(outputfile, "-") ? outputfile : NULL;
+}
+
+// Returns NULL if the integrated assembler is used.
 static FILE *open_output_file(void) {
+    if (jit) {
+        asm_init();
+        return NULL;
+    }
+    if (is_object_output()) {
+        objfile = get_output_path();
+        if (external_as)
+            return open_asm_pipe();
+        asm_init();
+        return NULL;
+    }
     if (!outputfile) {
-        if (dontasm) {
-            outputfile = replace_suffix(inputfile, 's');
-        } else {
-            outputfile = format("/tmp/8ccXXXXXX.s");
-            if (!mkstemps(outputfile, 2))
-                perror("mkstemps");
-            list_push(tmpfiles, outputfile);
-        }
+        // -a and -E write to stdout by themselves.
+        if (!dontasm)
+            return stdout;
+        outputfile = replace_suffix(inputfile, 's');
     }
     if (!strcmp(outputfile, "-"))
         return stdout;
@@ -72,6 +190,13 @@ static FILE *open_output_file(void) {
     return fp;
 }
 
+static void write_object_file(void) {
+    long start = trace_time();
+    write_elf(objfile, asm_finish());
+    trace_complete(TRACE_AS, "write object", start,
+                   format("\"output\": \"%s\"", quote_cstring(objfile)));
+}
+
 static void parse_debug_arg(char *s) {
     char *tok, *save;
     while ((tok = strtok_r(s, ",", &save)) != NULL) {
@@ -83,10 +208,82 @@ static void parse_debug_arg(char *s) {
     }
 }
 
+static long parse_size(char *s) {
+    char *end;
+    long r = strtol(s, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': r <<= 10; end++; break;
+    case 'm': case 'M': r <<= 20; end++; break;
+    case 'g': case 'G': r <<= 30; end++; break;
+    }
+    if (end == s || *end || r <= 0)
+        error("Invalid size: %s", s);
+    return r;
+}
+
+static int parse_threads(char *s) {
+    char *end;
+    long r = strtol(s, &end, 10);
+    if (end == s || *end || r < 1 || r > 256)
+        error("Invalid number of threads: %s", s);
+    return r;
+}
+
+// -O without a level is -O1. Levels above 1 are the same as -O1.
+static int parse_opt_level(char *s) {
+    if (!s)
+        return 1;
+    char *end;
+    long r = strtol(s, &end, 10);
+    if (end == s || *end || r < 0)
+        error("Invalid optimization level: %s", s);
+    return r > 1 ? 1 : r;
+}
+
+static void parse_f_arg(char *s) {
+    if (!strncmp(s, "trace=", 6))
+        trace_open(s + 6);
+    else if (!strcmp(s, "cache"))
+        cache_open(NULL);
+    else if (!strncmp(s, "cache=", 6))
+        cache_open(s + 6);
+    else if (!strncmp(s, "cache-size=", 11))
+        set_cache_size(parse_size(s + 11));
+    else if (!strcmp(s, "incremental"))
+        incremental = true;
+    else if (!strcmp(s, "pipeline"))
+        pipeline = true;
+    else if (!strcmp(s, "prefetch-headers"))
+        prefetch_headers = true;
+    else if (!strcmp(s, "shared-headers"))
+        open_shared_headers();
+    else if (!strncmp(s, "codegen-threads=", 16))
+        codegen_threads = parse_threads(s + 16);
+    else if (!strcmp(s, "no-integrated-as"))
+        external_as = true;
+    else if (!strcmp(s, "dump-ir"))
+        dump_ir = true;
+    else if (!strcmp(s, "peephole-stats"))
+        peephole_stats = true;
+    else
+        error("Unknown -f parameter: %s", s);
+}
+
 static void parseopt(int argc, char **argv) {
     cppdefs = make_string();
+    char *optstring = "I:ED:O::SU:acd:f:j:o:h";
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-run")) {
+            // Options end at the file name; the rest are for the program.
+            jit = true;
+            memmove(argv + i, argv + i + 1, sizeof(char *) * (argc - i));
+            argc--;
+            optstring = "+I:ED:O::SU:acd:f:j:o:h";
+            break;
+        }
+    }
     for (;;) {
-        int opt = getopt(argc, argv, "I:ED:SU:acd:o:h");
+        int opt = getopt(argc, argv, optstring);
         if (opt == -1)
             break;
         switch (opt) {
@@ -103,6 +300,9 @@ static void parseopt(int argc, char **argv) {
             string_appendf(cppdefs, "#define %s\n", optarg);
             break;
         }
+        case 'O':
+            opt_level = parse_opt_level(optarg);
+            break;
         case 'S':
             dontasm = true;
             break;
@@ -118,6 +318,14 @@ static void parseopt(int argc, char **argv) {
         case 'd':
             parse_debug_arg(optarg);
             break;
+        case 'f':
+            parse_f_arg(optarg);
+            break;
+        case 'j':
+            njobs = atoi(optarg);
+            if (njobs < 1)
+                error("Invalid number of jobs: %s", optarg);
+            break;
         case 'o':
             outputfile = optarg;
             break;
@@ -126,12 +334,21 @@ static void parseopt(int argc, char **argv) {
             usage();
         }
     }
-    if (optind != argc - 1)
+    if (optind == argc)
         usage();
 
+    if (jit) {
+        list_push(inputfiles, argv[optind]);
+        jit_argc = argc - optind;
+        jit_argv = argv + optind;
+        return;
+    }
     if (!wantast && !cpponly && !dontasm && !dontlink)
         error("One of -a, -c, -E or -S must be specified");
-    inputfile = argv[optind];
+    for (int i = optind; i < argc; i++)
+        list_push(inputfiles, argv[i]);
+    if (outputfile && list_len(inputfiles) > 1)
+        error("-o cannot be used with multiple input files");
 }
 
 static void preprocess(void) {
@@ -149,16 +366,65 @@ static void preprocess(void) {
     exit(0);
 }
 
-int main(int argc, char **argv) {
-    setbuf(stdout, NULL);
-    if (atexit(delete_temp_files))
-        perror("atexit");
-    cpp_init();
-    parse_init();
-    parseopt(argc, argv);
-    if (string_len(cppdefs) > 0)
-        cpp_eval(get_cstring(cppdefs));
+// Returns the options that change the output or the diagnostics.
+static char *get_cache_options(void) {
+    return format("%s -O%d%s%s", is_object_output() ? "-c" : "-S", opt_level,
+                  external_as ? " -fno-integrated-as" : "",
+                  suppress_warning ? " -w" : "");
+}
+
+// Diagnostics of the compilation, to be stored in the cache
+static char *diagnostics;
+static size_t diagnostics_len;
+
+// Looks up the output in the cache, and prints the diagnostics stored
+// with it. If it is not there, returns the key to store the output under,
+// leaves the preprocessed tokens for the parser and starts collecting
+// the diagnostics.
+static bool lookup_cache(char **key) {
+    *key = NULL;
+    char *path = get_output_path();
+    if (!cache_enabled() || !path)
+        return false;
+    List *tokens = read_all_tokens();
+    char *k = cache_key(tokens, get_cache_options());
+    char *diag;
+    if (cache_get(k, path, &diag)) {
+        fputs(diag, stderr);
+        return true;
+    }
+    replay_tokens(tokens);
+    *key = k;
+    context->diag_copy = open_memstream(&diagnostics, &diagnostics_len);
+    return false;
+}
+
+static void emit_node(Node *v) {
+    if (wantast) {
+        printf("%s", a2s(v));
+        return;
+    }
+    emit_toplevel(v);
+    if (v->type == AST_FUNC && v->fingerprint)
+        list_push(funcs, v);
+}
+
+// Called for each top-level as it is read.
+static void read_node(Node *v) {
+    if (pool)
+        queue_toplevel(pool, v);
+    else
+        emit_node(v);
+}
+
+static int compile(char *file) {
+    inputfile = file;
     lex_init(inputfile);
+    if (prefetch_headers && strcmp(inputfile, "-"))
+        start_prefetch(inputfile, get_include_path());
+    char *cachekey;
+    if (lookup_cache(&cachekey))
+        return 0;
     set_output_file(open_output_file());
 
     if (cpponly)
@@ -166,29 +432,105 @@ int main(int argc, char **argv) {
 
     if (wantast)
         suppress_warning = true;
-    List *toplevels = read_toplevels();
-    for (Iter *i = list_iter(toplevels); !iter_end(i);) {
-        Node *v = iter_next(i);
-        if (wantast)
-            printf("%s", a2s(v));
-        else
-            emit_toplevel(v);
+    char *fncache = NULL;
+    if (incremental && get_output_path()) {
+        fncache = format("%s.fncache", get_output_path());
+        set_function_cache(read_function_cache(fncache),
+                           cache_key(&EMPTY_LIST, get_cache_options()));
+    }
+    funcs = make_list();
+    if (codegen_threads > 1 && !wantast)
+        pool = start_codegen_workers(codegen_threads);
+    // Functions are kept by the other threads or for the cache.
+    if (!pool && !pipeline && !fncache)
+        release_function_bodies();
+    if (pipeline) {
+        run_pipeline(read_node);
+    } else {
+        for (Node *v; (v = read_toplevel()) != NULL;)
+            read_node(v);
     }
+    if (pool)
+        finish_codegen(pool, emit_node);
 
     close_output_file();
+    if (peephole_stats)
+        print_peephole_stats(stderr);
+    if (jit)
+        return run_jit(asm_finish(), jit_argc, jit_argv);
+    if (as_pid >= 0)
+        wait_assembler();
+    else if (objfile)
+        write_object_file();
+    if (cachekey) {
+        fclose(context->diag_copy);
+        context->diag_copy = NULL;
+        cache_put(cachekey, get_output_path(), diagnostics);
+    }
+    if (fncache)
+        write_function_cache(fncache, funcs);
+    return 0;
+}
 
-    if (!wantast && !dontasm) {
-        char *objfile = replace_suffix(inputfile, 'o');
-        pid_t pid = fork();
-        if (pid < 0) perror("fork");
-        if (pid == 0) {
-            execlp("as", "as", "-o", objfile, "-c", outputfile, (char *)NULL);
-            perror("execl failed");
+static bool wait_worker(void) {
+    int status;
+    if (wait(&status) < 0)
+        error("wait failed");
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Compiles each input file in its own child process, running up to
+ * njobs of them at a time. The children are forked after the
+ * preprocessor and the parser have been initialized, so the include
+ * path and the predefined macros are set up only once and are shared
+ * copy-on-write.
+ */
+static int compile_all(void) {
+    bool ok = true;
+    int running = 0;
+    for (Iter *i = list_iter(inputfiles); !iter_end(i);) {
+        char *file = iter_next(i);
+        if (running == njobs) {
+            ok &= wait_worker();
+            running--;
         }
-        int status;
-        waitpid(pid, &status, 0);
-        if (status < 0)
-            error("as failed");
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid < 0)
+            perror("fork");
+        if (pid == 0)
+            exit(compile(file));
+        running++;
     }
-    return 0;
+    for (; running > 0; running--)
+        ok &= wait_worker();
+    return ok ? 0 : 1;
+}
+
+static int run(int argc, char **argv) {
+    parseopt(argc, argv);
+    if (string_len(cppdefs) > 0)
+        cpp_eval(get_cstring(cppdefs));
+    if (list_len(inputfiles) == 1)
+        return compile(list_head(inputfiles));
+    return compile_all();
+}
+
+int main(int argc, char **argv) {
+    setbuf(stdout, NULL);
+    if (argc > 1 && !strcmp(argv[1], "--client")) {
+        argv[1] = argv[0];
+        int status = run_client(argc - 1, argv + 1);
+        if (status >= 0)
+            return status;
+        argc--;
+        argv++;
+    }
+    if (atexit(kill_assembler))
+        perror("atexit");
+    set_context(make_context());
+    if (argc == 2 && !strcmp(argv[1], "--server"))
+        run_server(run);
+    return run(argc, argv);
 }
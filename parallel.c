@@ -0,0 +1,194 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Parallel code generation (-fcodegen-threads=<n>).
+ *
+ * Once parsed, functions are independent of each other, so a pool of
+ * worker threads generates their code while the parser goes on. Each
+ * worker has a code generator state of its own and keeps the code of a
+ * function in its node. The top-levels are then emitted in source order
+ * by the calling thread, so the output is the same as without workers:
+ * labels are numbered within their function, and global variables,
+ * which use the global label counter, are generated by the caller.
+ *
+ * Each worker has a deque of tasks. New tasks are dealt out to the
+ * deques in turn. A worker takes the oldest task from its own deque,
+ * and when that is empty, steals the newest one from another deque.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#ifdef __8cc__
+
+// 8cc has no thread-local variables, so there are no workers, and the
+// code of a function is generated when it is emitted.
+
+struct CodegenPool {
+    List *toplevels;
+};
+
+CodegenPool *start_codegen_workers(int n) {
+    CodegenPool *r = malloc(sizeof(CodegenPool));
+    r->toplevels = make_list();
+    return r;
+}
+
+void queue_toplevel(CodegenPool *pool, Node *v) {
+    list_push(pool->toplevels, v);
+}
+
+void finish_codegen(CodegenPool *pool, void (*emit)(Node *v)) {
+    for (Iter *i = list_iter(pool->toplevels); !iter_end(i);)
+        emit(iter_next(i));
+}
+
+#else
+
+#include <pthread.h>
+
+typedef struct {
+    Node *node;
+    bool done;
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    List *tasks;
+} Deque;
+
+typedef struct {
+    CodegenPool *pool;
+    int index;
+    Context *ctx;
+} Worker;
+
+struct CodegenPool {
+    int nworkers;
+    Deque *deques;
+    pthread_t *threads;
+    // Protects the fields below and the done flags of the tasks
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // Number of tasks in the deques not yet claimed by a worker
+    int pending;
+    bool closing;
+    // Tasks of all top-levels in source order
+    List *toplevels;
+    int next;
+};
+
+// Waits for a task and takes it. Returns NULL when the pool is closing
+// and no task is left.
+static Task *take_task(CodegenPool *pool, int self) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending == 0 && !pool->closing)
+        pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->pending == 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    // A claimed task is in some deque, but another worker may have taken
+    // the one in ours, so look until one is found.
+    pool->pending--;
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0;; i++) {
+        bool own = (i % pool->nworkers == 0);
+        Deque *d = &pool->deques[(self + i) % pool->nworkers];
+        pthread_mutex_lock(&d->lock);
+        Task *t = NULL;
+        if (list_len(d->tasks) > 0)
+            t = own ? list_shift(d->tasks) : list_pop(d->tasks);
+        pthread_mutex_unlock(&d->lock);
+        if (t)
+            return t;
+    }
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = arg;
+    CodegenPool *pool = w->pool;
+    set_context(w->ctx);
+    for (;;) {
+        Task *t = take_task(pool, w->index);
+        if (!t)
+            return NULL;
+        emit_toplevel(t->node);
+        pthread_mutex_lock(&pool->lock);
+        t->done = true;
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Starts n workers. The output file must have been set.
+CodegenPool *start_codegen_workers(int n) {
+    CodegenPool *r = malloc(sizeof(CodegenPool));
+    r->nworkers = n;
+    r->deques = malloc(sizeof(Deque) * n);
+    r->threads = malloc(sizeof(pthread_t) * n);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->work, NULL);
+    pthread_cond_init(&r->done, NULL);
+    r->pending = 0;
+    r->closing = false;
+    r->toplevels = make_list();
+    r->next = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&r->deques[i].lock, NULL);
+        r->deques[i].tasks = make_list();
+    }
+    for (int i = 0; i < n; i++) {
+        Worker *w = malloc(sizeof(Worker));
+        w->pool = r;
+        w->index = i;
+        w->ctx = malloc(sizeof(Context));
+        memcpy(w->ctx, context, sizeof(Context));
+        w->ctx->gen = make_worker_gen_state();
+        if (pthread_create(&r->threads[i], NULL, run_worker, w))
+            error("cannot create a thread");
+    }
+    return r;
+}
+
+// Adds a top-level. Functions are handed to the workers.
+void queue_toplevel(CodegenPool *pool, Node *v) {
+    Task *t = malloc(sizeof(Task));
+    t->node = v;
+    t->done = (v->type != AST_FUNC);
+    list_push(pool->toplevels, t);
+    if (t->done)
+        return;
+    Deque *d = &pool->deques[pool->next++ % pool->nworkers];
+    pthread_mutex_lock(&d->lock);
+    list_push(d->tasks, t);
+    pthread_mutex_unlock(&d->lock);
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Calls emit for each top-level in source order, after its code has
+// been generated, and stops the workers.
+void finish_codegen(CodegenPool *pool, void (*emit)(Node *v)) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (Iter *i = list_iter(pool->toplevels); !iter_end(i);) {
+        Task *t = iter_next(i);
+        pthread_mutex_lock(&pool->lock);
+        while (!t->done)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+        emit(t->node);
+    }
+    for (int i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->threads[i], NULL);
+}
+
+#endif
@@ -19,14 +19,39 @@
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static Dict *globalenv = &EMPTY_DICT;
-static Dict *localenv;
-static Dict *struct_defs = &EMPTY_DICT;
-static Dict *union_defs = &EMPTY_DICT;
-static List *gotos;
-static Dict *labels;
-static List *localvars;
-static Ctype *current_func_type;
+#define DEP_HASH_SIZE 4096
+
+// The hash of the last declaration of an identifier
+typedef struct Dep {
+    char *name;
+    char *hash;
+    struct Dep *next;
+} Dep;
+
+struct ParseState {
+    Dict *globalenv;
+    Dict *localenv;
+    Dict *struct_defs;
+    Dict *union_defs;
+    List *gotos;
+    Dict *labels;
+    List *localvars;
+    Ctype *current_func_type;
+    List *pending_toplevels;
+    // Name of the function being read, if any, and the number of labels
+    // made in it so far
+    char *fname;
+    int labelseq;
+    // Code of functions compiled before, by fingerprint, and the hash of
+    // the last declaration of each identifier. NULL unless incremental.
+    Dict *fncache;
+    Dep **deps;
+    char *seed;
+    // If true, a function body and its code generation are allocated
+    // from body_arena, which is released when the next top-level is read.
+    bool release_bodies;
+    Arena *body_arena;
+};
 
 Ctype *ctype_void = &(Ctype){ CTYPE_VOID, 0, true };
 Ctype *ctype_bool = &(Ctype){ CTYPE_BOOL, 1, false };
@@ -42,8 +67,6 @@ static Ctype *ctype_ulong = &(Ctype){ CTYPE_LONG, 8, false };
 static Ctype *ctype_llong = &(Ctype){ CTYPE_LLONG, 8, true };
 static Ctype *ctype_ullong = &(Ctype){ CTYPE_LLONG, 8, false };
 
-static int labelseq = 0;
-
 typedef Node *MakeVarFn(Ctype *ctype, char *name);
 
 static Ctype* make_ptr_type(Ctype *ctype);
@@ -88,12 +111,21 @@ enum {
  * Constructors
  */
 
-char *make_label(void) {
-    return format(".L%d", labelseq++);
+// Labels are numbered within the function they are in, so that the
+// code of a function does not depend on the functions before it.
+static char *make_label(void) {
+    ParseState *s = context->parse;
+    return format(".L%s.%d", s->fname ? s->fname : "", s->labelseq++);
+}
+
+// Returns the innermost scope.
+static Dict *env(void) {
+    ParseState *s = context->parse;
+    return s->localenv ? s->localenv : s->globalenv;
 }
 
 static Node *make_ast(Node *tmpl) {
-    Node *r = malloc(sizeof(Node));
+    Node *r = arena_malloc(sizeof(Node));
     *r = *tmpl;
     return r;
 }
@@ -119,22 +151,23 @@ static Node *ast_floattype(Ctype *ctype, double val) {
 
 static Node *ast_lvar(Ctype *ctype, char *name) {
     Node *r = make_ast(&(Node){ AST_LVAR, ctype, .varname = name });
-    if (localenv)
-        dict_put(localenv, name, r);
-    if (localvars)
-        list_push(localvars, r);
+    ParseState *s = context->parse;
+    if (s->localenv)
+        dict_put(s->localenv, name, r);
+    if (s->localvars)
+        list_push(s->localvars, r);
     return r;
 }
 
 static Node *ast_gvar(Ctype *ctype, char *name) {
     Node *r = make_ast(&(Node){ AST_GVAR, ctype, .varname = name, .glabel = name });
-    dict_put(globalenv, name, r);
+    dict_put(context->parse->globalenv, name, r);
     return r;
 }
 
 static Node *ast_typedef(Ctype *ctype, char *name) {
     Node *r = make_ast(&(Node){ AST_TYPEDEF, ctype, .typedefname = name });
-    dict_put(localenv ? localenv : globalenv, name, r);
+    dict_put(env(), name, r);
     return r;
 }
 
@@ -219,7 +252,7 @@ static Node *ast_switch(Node *expr, Node *body) {
     return make_ast(&(Node){ AST_SWITCH, .switchexpr = expr, .switchbody = body });
 }
 
-static Node *ast_case(int begin, int end) {
+static Node *ast_case(long begin, long end) {
     return make_ast(&(Node){ AST_CASE, .casebeg = begin, .caseend = end });
 }
 
@@ -260,19 +293,19 @@ static Node *ast_label_addr(char *label) {
 }
 
 static Ctype *make_type(Ctype *tmpl) {
-    Ctype *r = malloc(sizeof(Ctype));
+    Ctype *r = arena_malloc(sizeof(Ctype));
     *r = *tmpl;
     return r;
 }
 
 static Ctype *copy_type(Ctype *ctype) {
-    Ctype *r = malloc(sizeof(Ctype));
+    Ctype *r = arena_malloc(sizeof(Ctype));
     memcpy(r, ctype, sizeof(Ctype));
     return r;
 }
 
 static Ctype *make_numtype(int type, bool sig) {
-    Ctype *r = malloc(sizeof(Ctype));
+    Ctype *r = arena_calloc(1, sizeof(Ctype));
     r->type = type;
     r->sig = sig;
     if (type == CTYPE_VOID)         r->size = 0;
@@ -390,7 +423,7 @@ static Ctype *copy_incomplete_type(Ctype *ctype) {
 }
 
 static Ctype *get_typedef(char *name) {
-    Node *node = dict_get(localenv ? localenv : globalenv, name);
+    Node *node = dict_get(env(), name);
     return (node && node->type == AST_TYPEDEF) ? node->ctype : NULL;
 }
 
@@ -420,7 +453,7 @@ static bool next_token(int type) {
 }
 
 void *make_pair(void *first, void *second) {
-    Pair *r = malloc(sizeof(Pair));
+    Pair *r = arena_malloc(sizeof(Pair));
     r->first = first;
     r->second = second;
     return r;
@@ -460,6 +493,29 @@ static Ctype *result_type(int op, Ctype *ctype) {
     }
 }
 
+// Integers narrower than int are promoted to int.
+static Ctype *promote_int(Ctype *ctype) {
+    return (is_inttype(ctype) && ctype->size < 4) ? ctype_int : ctype;
+}
+
+// Returns the type both operands of an arithmetic operator are converted
+// to (C11 6.3.1.8). An unsigned integer wins unless the signed one has a
+// higher rank and is wider. If it is not wider, as long and long long
+// are not here, the result is the unsigned type of the signed one's rank.
+static Ctype *common_type(Ctype *a, Ctype *b) {
+    a = promote_int(a);
+    b = promote_int(b);
+    if (!is_inttype(a) || !is_inttype(b) || a->sig == b->sig)
+        return larger_type(a, b);
+    Ctype *u = a->sig ? b : a;
+    Ctype *s = a->sig ? a : b;
+    if (conversion_rank(u) >= conversion_rank(s))
+        return u;
+    if (s->size > u->size)
+        return s;
+    return make_numtype(s->type, false);
+}
+
 static Node *usual_conv(int op, Node *left, Node *right) {
     if (!is_arithtype(left->ctype) || !is_arithtype(right->ctype)) {
         Ctype *resulttype;
@@ -473,13 +529,12 @@ static Node *usual_conv(int op, Node *left, Node *right) {
         }
         return ast_binop(resulttype, op, left, right);
     }
-    int rank1 = conversion_rank(left->ctype);
-    int rank2 = conversion_rank(right->ctype);
-    if (rank1 < rank2)
-        left = ast_conv(right->ctype, left);
-    else if (rank1 != rank2)
-        right = ast_conv(left->ctype, right);
-    Ctype *resulttype = result_type(op, left->ctype);
+    Ctype *ctype = common_type(left->ctype, right->ctype);
+    if (left->ctype != ctype)
+        left = ast_conv(ctype, left);
+    if (right->ctype != ctype)
+        right = ast_conv(ctype, right);
+    Ctype *resulttype = result_type(op, ctype);
     return ast_binop(resulttype, op, left, right);
 }
 
@@ -532,7 +587,19 @@ static Ctype *convert_array(Ctype *ctype) {
  * Integer constant expression
  */
 
-int eval_intexpr(Node *node) {
+// Converts a constant to an integer or pointer type.
+static long cast_intval(Ctype *ctype, long val) {
+    if (ctype->type == CTYPE_BOOL)
+        return !!val;
+    switch (ctype->size) {
+    case 1: return ctype->sig ? (signed char)val : (unsigned char)val;
+    case 2: return ctype->sig ? (short)val : (unsigned short)val;
+    case 4: return ctype->sig ? (int)val : (unsigned int)val;
+    }
+    return val;
+}
+
+long eval_intexpr(Node *node) {
     switch (node->type) {
     case AST_LITERAL:
         if (is_inttype(node->ctype))
@@ -541,8 +608,11 @@ int eval_intexpr(Node *node) {
     case '!': return !eval_intexpr(node->operand);
     case '~': return ~eval_intexpr(node->operand);
     case OP_UMINUS: return -eval_intexpr(node->operand);
-    case OP_CAST: return eval_intexpr(node->operand);
-    case AST_CONV: return eval_intexpr(node->operand);
+    case OP_CAST:
+    case AST_CONV:
+        if (!is_inttype(node->ctype) && node->ctype->type != CTYPE_PTR)
+            return eval_intexpr(node->operand);
+        return cast_intval(node->ctype, eval_intexpr(node->operand));
     case AST_TERNARY: {
         long cond = eval_intexpr(node->cond);
         if (cond)
@@ -566,7 +636,10 @@ int eval_intexpr(Node *node) {
     case OP_NE: return L != R;
     case OP_SAL: return L << R;
     case OP_SAR: return L >> R;
-    case OP_SHR: return ((unsigned long)L) >> R;
+    case OP_SHR:
+        if (node->left->ctype->size < 8)
+            return ((unsigned int)L) >> R;
+        return ((unsigned long)L) >> R;
     case OP_LOGAND: return L && R;
     case OP_LOGOR:  return L || R;
 #undef L
@@ -576,7 +649,7 @@ int eval_intexpr(Node *node) {
     }
 }
 
-static int read_intexpr() {
+static long read_intexpr() {
     return eval_intexpr(read_conditional_expr());
 }
 
@@ -643,8 +716,10 @@ static Node *read_float(char *s) {
     return r;
 }
 
+// e is a digit in a hexadecimal number, whose exponent starts with p.
 static Node *read_number(char *s) {
-    bool isfloat = strpbrk(s, ".pe");
+    bool ishex = !strncasecmp(s, "0x", 2);
+    bool isfloat = strpbrk(s, ishex ? ".pP" : ".eE");
     return isfloat ? read_float(s) : read_int(s);
 }
 
@@ -842,7 +917,7 @@ static void read_static_assert(void) {
  */
 
 static Node *read_var_or_func(char *name) {
-    Node *v = dict_get(localenv ? localenv : globalenv, name);
+    Node *v = dict_get(env(), name);
     if (!v || v->ctype->type == CTYPE_FUNC)
         return ast_funcdesg(name, v);
     return v;
@@ -870,7 +945,6 @@ static int get_compound_assign_op(Token *tok) {
     case OP_A_XOR: return '^';
     case OP_A_SAL: return OP_SAL;
     case OP_A_SAR: return OP_SAR;
-    case OP_A_SHR: return OP_SHR;
     default: return 0;
     }
 }
@@ -969,7 +1043,7 @@ static Node *read_label_addr(void) {
     if (tok->type != TIDENT)
         error("Label name expected after &&, but got %s", t2s(tok));
     Node *r = ast_label_addr(tok->sval);
-    list_push(gotos, r);
+    list_push(context->parse->gotos, r);
     return r;
 }
 
@@ -992,9 +1066,16 @@ static Node *read_unary_deref(void) {
     return ast_uop(AST_DEREF, operand->ctype->ptr, operand);
 }
 
+// Converts an operand narrower than int to int.
+static Node *promote_operand(Node *node) {
+    Ctype *ctype = promote_int(node->ctype);
+    return (ctype == node->ctype) ? node : ast_conv(ctype, node);
+}
+
 static Node *read_unary_minus(void) {
     Node *expr = read_cast_expr();
     ensure_arithtype(expr);
+    expr = promote_operand(expr);
     return ast_uop(OP_UMINUS, expr->ctype, expr);
 }
 
@@ -1003,6 +1084,7 @@ static Node *read_unary_bitnot(void) {
     expr = convert_funcdesg(expr);
     if (!is_inttype(expr->ctype))
         error("invalid use of ~: %s", a2s(expr));
+    expr = promote_operand(expr);
     return ast_uop('~', expr->ctype, expr);
 }
 
@@ -1084,6 +1166,17 @@ static Node *read_additive_expr(void) {
     return node;
 }
 
+// The left operand is promoted, and >> shifts logically if it is
+// unsigned after that.
+static Node *make_shift(int op, Node *left, Node *right) {
+    ensure_inttype(left);
+    ensure_inttype(right);
+    left = promote_operand(left);
+    if (op == OP_SAR && !left->ctype->sig)
+        op = OP_SHR;
+    return ast_binop(left->ctype, op, left, right);
+}
+
 static Node *read_shift_expr(void) {
     Node *node = read_additive_expr();
     for (;;) {
@@ -1091,14 +1184,10 @@ static Node *read_shift_expr(void) {
         if (next_token(OP_SAL))
             op = OP_SAL;
         else if (next_token(OP_SAR))
-            op = node->ctype->sig ? OP_SAR : OP_SHR;
+            op = OP_SAR;
         else
             break;
-        Node *right = read_additive_expr();
-        ensure_inttype(node);
-        ensure_inttype(right);
-        Ctype *resulttype = larger_type(node->ctype, right->ctype);
-        node = ast_binop(resulttype, op, node, right);
+        node = make_shift(op, node, read_additive_expr());
     }
     return node;
 }
@@ -1159,6 +1248,19 @@ static Node *read_logor_expr(void) {
     return node;
 }
 
+// The operands of ?: are converted to their common type if both are
+// numbers.
+static Node *make_ternary(Node *cond, Node *then, Node *els) {
+    if (!then || !is_arithtype(then->ctype) || !is_arithtype(els->ctype))
+        return ast_ternary(els->ctype, cond, then, els);
+    Ctype *ctype = common_type(then->ctype, els->ctype);
+    if (then->ctype != ctype)
+        then = ast_conv(ctype, then);
+    if (els->ctype != ctype)
+        els = ast_conv(ctype, els);
+    return ast_ternary(ctype, cond, then, els);
+}
+
 static Node *read_conditional_expr(void) {
     Node *node = read_logor_expr();
     if (!next_token('?'))
@@ -1166,7 +1268,7 @@ static Node *read_conditional_expr(void) {
     Node *then = read_comma_expr();
     expect(':');
     Node *els = read_conditional_expr();
-    return ast_ternary(els->ctype, node, then, els);
+    return make_ternary(node, then, els);
 }
 
 static Node *read_assignment_expr(void) {
@@ -1178,14 +1280,18 @@ static Node *read_assignment_expr(void) {
         Node *then = read_comma_expr();
         expect(':');
         Node *els = read_conditional_expr();
-        return ast_ternary(els->ctype, node, then, els);
+        return make_ternary(node, then, els);
     }
     int cop = get_compound_assign_op(tok);
     if (is_punct(tok, '=') || cop) {
         Node *value = read_assignment_expr();
         if (is_punct(tok, '=') || cop)
             ensure_lvalue(node);
-        Node *right = cop ? usual_conv(cop, node, value) : value;
+        Node *right = value;
+        if (cop == OP_SAL || cop == OP_SAR)
+            right = make_shift(cop, node, value);
+        else if (cop)
+            right = usual_conv(cop, node, value);
         if (is_arithtype(node->ctype) && node->ctype->type != right->ctype->type)
             right = ast_conv(node->ctype, right);
         return ast_binop(node->ctype, '=', node, right);
@@ -1417,6 +1523,12 @@ static Ctype *read_rectype_def(Dict *env, bool is_struct) {
     if (r && !fields)
         return r;
     if (r && fields) {
+        // A redefinition makes a new type, as objects of the old one may
+        // still be waiting for code generation.
+        if (r->fields) {
+            r = make_struct_type(NULL, 0, is_struct);
+            dict_put(env, tag, r);
+        }
         r->fields = fields;
         r->size = size;
         return r;
@@ -1424,12 +1536,20 @@ static Ctype *read_rectype_def(Dict *env, bool is_struct) {
     return r;
 }
 
+// Struct and union tags are not scoped, so those defined in a function
+// body outlive it.
 static Ctype *read_struct_def(void) {
-    return read_rectype_def(struct_defs, true);
+    Arena *saved = set_arena(context->arena);
+    Ctype *r = read_rectype_def(context->parse->struct_defs, true);
+    set_arena(saved);
+    return r;
 }
 
 static Ctype *read_union_def(void) {
-    return read_rectype_def(union_defs, false);
+    Arena *saved = set_arena(context->arena);
+    Ctype *r = read_rectype_def(context->parse->union_defs, false);
+    set_arena(saved);
+    return r;
 }
 
 /*----------------------------------------------------------------------
@@ -1456,7 +1576,7 @@ static Ctype *read_enum_def(void) {
         if (next_token('='))
             val = read_intexpr();
         Node *constval = ast_inttype(ctype_int, val++);
-        dict_put(localenv ? localenv : globalenv, name, constval);
+        dict_put(env(), name, constval);
         if (next_token(','))
             continue;
         if (next_token('}'))
@@ -1901,7 +2021,11 @@ static void read_decl(List *block, MakeVarFn *make_var) {
     for (;;) {
         char *name = NULL;
         Ctype *ctype = read_declarator(&name, copy_incomplete_type(basetype), NULL, DECL_BODY);
-        ctype->isstatic = (sclass == S_STATIC);
+        // Basic types such as ctype_int are shared by all compilations.
+        if (sclass == S_STATIC) {
+            ctype = copy_type(ctype);
+            ctype->isstatic = true;
+        }
         Token *tok = read_token();
         if (is_punct(tok, '=')) {
             if (sclass == S_TYPEDEF)
@@ -1931,17 +2055,18 @@ static void read_decl(List *block, MakeVarFn *make_var) {
  */
 
 static Node *read_func_body(Ctype *functype, char *fname, List *params) {
-    localenv = make_dict(localenv);
-    localvars = make_list();
-    current_func_type = functype;
+    ParseState *s = context->parse;
+    s->localenv = make_dict(s->localenv);
+    s->localvars = make_list();
+    s->current_func_type = functype;
     Node *funcname = ast_string(fname);
-    dict_put(localenv, "__func__", funcname);
-    dict_put(localenv, "__FUNCTION__", funcname);
+    dict_put(s->localenv, "__func__", funcname);
+    dict_put(s->localenv, "__FUNCTION__", funcname);
     Node *body = read_compound_stmt();
-    Node *r = ast_func(functype, fname, params, body, localvars);
-    current_func_type = NULL;
-    localenv = NULL;
-    localvars = NULL;
+    Node *r = ast_func(functype, fname, params, body, s->localvars);
+    s->current_func_type = NULL;
+    s->localenv = NULL;
+    s->localvars = NULL;
     return r;
 }
 
@@ -1977,10 +2102,10 @@ static bool is_funcdef(void) {
 }
 
 static void backfill_labels(void) {
-    for (Iter *i = list_iter(gotos); !iter_end(i);) {
+    for (Iter *i = list_iter(context->parse->gotos); !iter_end(i);) {
         Node *src = iter_next(i);
         char *label = src->label;
-        Node *dst = dict_get(labels, label);
+        Node *dst = dict_get(context->parse->labels, label);
         if (!dst)
             error("stray %s: %s", src->type == AST_GOTO ? "goto" : "unary &&", label);
         if (dst->newlabel)
@@ -1990,21 +2115,147 @@ static void backfill_labels(void) {
     }
 }
 
+/*
+ * Incremental compilation
+ *
+ * The fingerprint of a function is the hash of its tokens and of the
+ * last declaration of each identifier in them. The hash of a
+ * declaration covers the declarations of its identifiers in turn, so a
+ * change to a declaration changes the fingerprints of the functions
+ * that depend on it, directly or not, and of no others.
+ */
+
+static Dep *get_dep(char *name) {
+    unsigned hash = 0;
+    for (char *p = name; *p; p++)
+        hash = hash * 31 + *p;
+    Dep **bucket = &context->parse->deps[hash % DEP_HASH_SIZE];
+    for (Dep *d = *bucket; d; d = d->next)
+        if (!strcmp(d->name, name))
+            return d;
+    Dep *d = arena_malloc(sizeof(Dep));
+    d->name = name;
+    d->hash = NULL;
+    d->next = *bucket;
+    *bucket = d;
+    return d;
+}
+
+static char *hash_decl(List *tokens) {
+    ParseState *s = context->parse;
+    String *seed = make_string();
+    string_appendf(seed, "%s", s->seed);
+    for (Iter *i = list_iter(tokens); !iter_end(i);) {
+        Token *tok = iter_next(i);
+        if (tok->type != TIDENT)
+            continue;
+        char *dep = get_dep(tok->sval)->hash;
+        string_appendf(seed, " %s", dep ? dep : "-");
+    }
+    return hash_tokens(get_cstring(seed), tokens);
+}
+
+static void add_decl(List *tokens) {
+    char *hash = hash_decl(tokens);
+    for (Iter *i = list_iter(tokens); !iter_end(i);) {
+        Token *tok = iter_next(i);
+        if (tok->type == TIDENT)
+            get_dep(tok->sval)->hash = hash;
+    }
+}
+
+// Returns true if the tokens define a struct or a union. Tags are not
+// scoped, so such a definition in a function body is seen by the
+// functions after it.
+static bool has_tag_def(List *tokens) {
+    List *v = list_copy(tokens);
+    while (list_len(v) > 0) {
+        Token *tok = list_shift(v);
+        if (!is_punct(tok, KSTRUCT) && !is_punct(tok, KUNION))
+            continue;
+        Token *next = list_head(v);
+        if (next && next->type == TIDENT && list_len(v) > 1)
+            next = list_get(v, 1);
+        if (is_punct(next, '{'))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Returns the fingerprint of a function whose tokens up to the opening
+ * brace of the body are sig. The body is read, and put back unless its
+ * code is found in the function cache, in which case the code is set to
+ * *code. Returns NULL if the code of the function cannot be reused.
+ */
+static char *read_fingerprint(List *sig, char **code) {
+    ParseState *s = context->parse;
+    List *body = make_list();
+    for (int depth = 1; depth > 0;) {
+        Token *tok = read_token();
+        if (!tok)
+            error("premature end of input");
+        list_push(body, tok);
+        if (is_punct(tok, '{'))
+            depth++;
+        else if (is_punct(tok, '}'))
+            depth--;
+    }
+    List *tokens = list_copy(sig);
+    list_append(tokens, body);
+    char *key = hash_decl(tokens);
+    add_decl(sig);
+    if (has_tag_def(body)) {
+        add_decl(body);
+        key = NULL;
+    }
+    *code = key ? dict_get(s->fncache, key) : NULL;
+    if (!*code)
+        for (Iter *i = list_iter(list_reverse(body)); !iter_end(i);)
+            unget_token(iter_next(i));
+    return key;
+}
+
 static Node *read_funcdef(void) {
+    ParseState *s = context->parse;
+    List *sig = s->fncache ? make_list() : NULL;
+    record_tokens(sig);
     int sclass;
     Ctype *basetype = read_decl_spec(&sclass);
-    localenv = make_dict(globalenv);
-    gotos = make_list();
-    labels = make_dict(NULL);
+    s->localenv = make_dict(s->globalenv);
+    s->gotos = make_list();
+    s->labels = make_dict(NULL);
     char *name;
     List *params = make_list();
     Ctype *functype = read_declarator(&name, basetype, params, DECL_BODY);
     functype->isstatic = (sclass == S_STATIC);
     ast_gvar(functype, name);
     expect('{');
-    Node *r = read_func_body(functype, name, params);
-    backfill_labels();
-    localenv = NULL;
+    record_tokens(NULL);
+    char *code = NULL;
+    char *key = sig ? read_fingerprint(sig, &code) : NULL;
+    Node *r;
+    if (code) {
+        r = ast_func(functype, name, params, NULL, NULL);
+        r->code = code;
+    } else {
+        if (s->release_bodies) {
+            s->body_arena = make_arena();
+            set_arena(s->body_arena);
+        }
+        int seq = s->labelseq;
+        s->fname = name;
+        s->labelseq = 0;
+        r = read_func_body(functype, name, params);
+        backfill_labels();
+        r->nlabels = s->labelseq;
+        s->fname = NULL;
+        s->labelseq = seq;
+    }
+    r->fingerprint = key;
+    s->localenv = NULL;
+    s->gotos = NULL;
+    s->labels = NULL;
     return r;
 }
 
@@ -2042,7 +2293,7 @@ static Node *read_opt_decl_or_stmt(void) {
 
 static Node *read_for_stmt(void) {
     expect('(');
-    localenv = make_dict(localenv);
+    context->parse->localenv = make_dict(context->parse->localenv);
     Node *init = read_opt_decl_or_stmt();
     Node *cond = read_expr_opt();
     if (cond && is_flotype(cond->ctype))
@@ -2051,7 +2302,7 @@ static Node *read_for_stmt(void) {
     Node *step = read_expr_opt();
     expect(')');
     Node *body = read_stmt();
-    localenv = dict_parent(localenv);
+    context->parse->localenv = dict_parent(context->parse->localenv);
     return ast_for(init, cond, step, body);
 }
 
@@ -2097,15 +2348,15 @@ static Node *read_switch_stmt(void) {
 }
 
 static Node *read_case_label(void) {
-    int beg = read_intexpr();
-    int end;
+    long beg = read_intexpr();
+    long end;
     if (next_token(KTHREEDOTS))
         end = read_intexpr();
     else
         end = beg;
     expect(':');
     if (beg > end)
-        error("case region is not in correct order: %d %d", beg, end);
+        error("case region is not in correct order: %ld %ld", beg, end);
     return ast_case(beg, end);
 }
 
@@ -2132,7 +2383,7 @@ static Node *read_return_stmt(void) {
     Node *retval = read_expr_opt();
     expect(';');
     if (retval)
-        return ast_return(ast_conv(current_func_type->rettype, retval));
+        return ast_return(ast_conv(context->parse->current_func_type->rettype, retval));
     return ast_return(NULL);
 }
 
@@ -2148,7 +2399,7 @@ static Node *read_goto_stmt(void) {
         error("identifier expected, but got %s", t2s(tok));
     expect(';');
     Node *r = ast_goto(tok->sval);
-    list_push(gotos, r);
+    list_push(context->parse->gotos, r);
     return r;
 }
 
@@ -2156,9 +2407,9 @@ static Node *read_label(Token *tok) {
     expect(':');
     char *label = tok->sval;
     Node *r = ast_label(label);
-    if (dict_get(labels, label))
+    if (dict_get(context->parse->labels, label))
         error("duplicate label: %s", t2s(tok));
-    dict_put(labels, label, r);
+    dict_put(context->parse->labels, label, r);
     return r;
 }
 
@@ -2193,14 +2444,14 @@ static Node *read_stmt(void) {
 }
 
 static Node *read_compound_stmt(void) {
-    localenv = make_dict(localenv);
+    context->parse->localenv = make_dict(context->parse->localenv);
     List *list = make_list();
     for (;;) {
         if (next_token('}'))
             break;
         read_decl_or_stmt(list);
     }
-    localenv = dict_parent(localenv);
+    context->parse->localenv = dict_parent(context->parse->localenv);
     return ast_compound_stmt(list);
 }
 
@@ -2223,24 +2474,105 @@ static void read_decl_or_stmt(List *list) {
  * Compilation unit
  */
 
-List *read_toplevels(void) {
-    List *r = make_list();
+static void trace_toplevel(Token *tok, Node *node, long start) {
+    if (!trace_enabled())
+        return;
+    char *name = "(declaration)";
+    if (node && node->type == AST_FUNC)
+        name = node->fname;
+    else if (node && node->type == AST_DECL)
+        name = node->declvar->varname;
+    trace_complete(TRACE_PARSE, name, start,
+                   format("\"file\": \"%s\", \"line\": %d", quote_cstring(tok->file), tok->line));
+}
+
+// Frees the previous function body, unless tokens read ahead of it
+// may still be in its arena.
+static void release_body(void) {
+    ParseState *s = context->parse;
+    if (!s->body_arena)
+        return;
+    set_arena(context->arena);
+    if (!has_ungotten_tokens())
+        free_arena(s->body_arena);
+    s->body_arena = NULL;
+}
+
+/*
+ * Returns the next top-level function definition or declaration, or
+ * NULL at the end of input. A function is returned as soon as its body
+ * has been read, so the caller can emit it before the rest of the file
+ * is parsed. If release_function_bodies() has been called, the function
+ * is freed by the next call.
+ */
+Node *read_toplevel(void) {
     for (;;) {
-        if (!peek_token())
+        if (list_len(context->parse->pending_toplevels) > 0)
+            return list_shift(context->parse->pending_toplevels);
+        release_body();
+        Token *tok = peek_token();
+        if (!tok)
+            return NULL;
+        long start = trace_time();
+        if (is_funcdef()) {
+            Node *r = read_funcdef();
+            trace_toplevel(tok, r, start);
             return r;
-        if (is_funcdef())
-            list_push(r, read_funcdef());
-        else
-            read_decl(r, ast_gvar);
+        }
+        // A declaration may declare any number of variables.
+        List *tokens = context->parse->fncache ? make_list() : NULL;
+        record_tokens(tokens);
+        read_decl(context->parse->pending_toplevels, ast_gvar);
+        record_tokens(NULL);
+        if (tokens)
+            add_decl(tokens);
+        trace_toplevel(tok, list_head(context->parse->pending_toplevels), start);
     }
 }
 
+// Enables incremental compilation. A function whose fingerprint is in
+// cache is returned with the cached code instead of a body. seed stands
+// for everything besides the source that affects the code.
+void set_function_cache(Dict *cache, char *seed) {
+    context->parse->fncache = cache;
+    context->parse->deps = arena_calloc(DEP_HASH_SIZE, sizeof(Dep *));
+    context->parse->seed = seed;
+}
+
+// Makes the memory of each function body, including that of its code
+// generation, be released after the function is emitted. The caller
+// must be done with a function when it calls read_toplevel() again.
+void release_function_bodies(void) {
+    context->parse->release_bodies = true;
+}
+
 /*----------------------------------------------------------------------
  * Initializer
  */
 
+ParseState *make_parse_state(void) {
+    ParseState *r = arena_malloc(sizeof(ParseState));
+    r->globalenv = make_dict(NULL);
+    r->localenv = NULL;
+    r->struct_defs = make_dict(NULL);
+    r->union_defs = make_dict(NULL);
+    r->gotos = NULL;
+    r->labels = NULL;
+    r->localvars = NULL;
+    r->current_func_type = NULL;
+    r->pending_toplevels = make_list();
+    r->fname = NULL;
+    r->labelseq = 0;
+    r->fncache = NULL;
+    r->deps = NULL;
+    r->seed = NULL;
+    r->release_bodies = false;
+    r->body_arena = NULL;
+    return r;
+}
+
 void parse_init(void) {
     Ctype *t = make_func_type(ctype_void, make_list(), true);
-    dict_put(globalenv, "__builtin_va_start", ast_gvar(t, "__builtin_va_start"));
-    dict_put(globalenv, "__builtin_va_arg", ast_gvar(t, "__builtin_va_arg"));
+    dict_put(context->parse->globalenv, "__builtin_va_start", ast_gvar(t, "__builtin_va_start"));
+    dict_put(context->parse->globalenv, "__builtin_va_arg", ast_gvar(t, "__builtin_va_arg"));
 }
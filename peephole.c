@@ -0,0 +1,761 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Peephole optimizer.
+ *
+ * The code generator keeps values in rax and moves them around through
+ * the stack, which leaves sequences such as a push followed by a pop, or
+ * a value moved to another register only to be moved on again. This
+ * pass looks at a few instructions of a basic block at a time and
+ * rewrites known patterns into shorter code.
+ *
+ * Some rules only apply if a register is not read afterwards, so the
+ * pass first computes which registers are live at the end of each block
+ * from the CFG. Each instruction is described by the registers it reads
+ * and writes. Instructions the pass does not know are taken to read
+ * every register, which keeps it safe.
+ *
+ * -fpeephole-stats prints how many times each rule was applied.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+// Registers as bits, by their numbers in the IR, and 32 is the flags.
+typedef unsigned long RegSet;
+
+#define REG(n)     (1UL << (n))
+#define XMM(n)     (1UL << (16 + (n)))
+#define FLAGS      (1UL << 32)
+#define ALL_REGS   (~0UL)
+
+// Registers that a call may read, and those it may change
+#define CALL_USES (REG(RDI) | REG(RSI) | REG(RDX) | REG(RCX) | REG(8) | REG(9) | \
+                   REG(RAX) | REG(RSP) | 0xff0000UL)
+#define CALL_DEFS (REG(RAX) | REG(RCX) | REG(RDX) | REG(RSI) | REG(RDI) | \
+                   REG(8) | REG(9) | REG(10) | REG(11) | 0xffff0000UL | FLAGS)
+// Return values and callee-saved registers
+#define RET_USES (REG(RAX) | REG(RDX) | XMM(0) | XMM(1) | REG(RBX) | REG(RSP) | \
+                  REG(RBP) | REG(12) | REG(13) | REG(14) | REG(15))
+
+enum {
+    RULE_PUSH_POP,
+    RULE_POP_PUSH,
+    RULE_SELF_MOVE,
+    RULE_DEAD_MOVE,
+    RULE_COPY_FORWARD,
+    RULE_DOUBLE_CONV,
+    RULE_SET_BRANCH,
+    RULE_JUMP_NEXT,
+    NRULES,
+};
+
+static char *rule_names[] = {
+    "push-pop", "pop-push", "self-move", "dead-move",
+    "copy-forward", "double-conversion", "set-branch", "jump-to-next",
+};
+
+static long stats[NRULES];
+
+static void count(int rule) {
+#ifdef __8cc__
+    stats[rule]++;
+#else
+    __atomic_fetch_add(&stats[rule], 1, __ATOMIC_RELAXED);
+#endif
+}
+
+void print_peephole_stats(FILE *fp) {
+    fprintf(fp, "peephole rewrites:\n");
+    for (int i = 0; i < NRULES; i++)
+        fprintf(fp, "  %-20s %ld\n", rule_names[i], stats[i]);
+}
+
+/*
+ * Operands
+ */
+
+// Returns the register number of a register operand and sets *width to
+// its size in bits, or returns -1 if it is no register.
+static int get_reg(Operand *o, int *width) {
+    if (o->kind != OPD_REG || o->indirect)
+        return -1;
+    *width = o->width;
+    return o->reg;
+}
+
+static bool is_reg(Operand *o) {
+    int width;
+    return get_reg(o, &width) >= 0;
+}
+
+static bool is_mem(Operand *o) {
+    return o->kind == OPD_MEM || o->kind == OPD_SYM;
+}
+
+static bool is_reg_named(Operand *o, int reg, int width) {
+    int w;
+    return get_reg(o, &w) == reg && w == width;
+}
+
+// Whether a direct jump goes to label
+static bool jumps_to(Insn *insn, char *label) {
+    Operand *o = &insn->args[0];
+    return label && o->kind == OPD_SYM && !strcmp(o->sym, label);
+}
+
+static RegSet reg_set(int reg) {
+    if (reg == NO_REG || reg == REG_IP)
+        return 0;
+    // Virtual registers are assigned before the pass runs.
+    return reg >= VREG_BASE ? ALL_REGS : REG(reg);
+}
+
+// Returns the registers an operand mentions.
+static RegSet regs_in(Operand *o) {
+    if (o->kind == OPD_MEM)
+        return reg_set(o->reg) | reg_set(o->index);
+    return reg_set(o->reg);
+}
+
+/*
+ * Effects of instructions
+ */
+
+static bool in_list(char *s, char **list) {
+    for (; *list; list++)
+        if (!strcmp(s, *list))
+            return true;
+    return false;
+}
+
+static char *MOVES[] = {
+    "mov", "movl", "movq", "movw", "movb", "movsd", "movss", "movslq",
+    "movsbq", "movswq", "movzb", "movzx", "movzbl", "movzwl", "movzwq",
+    "movsbl", "movswl", "lea", "cvtpd2ps", "cvtps2pd", "cvtsi2sd",
+    "cvtsi2ss", "cvttsd2si", "cvttss2si", "cvtsd2ss", "cvtss2sd", NULL };
+static char *INT_ALU[] = {
+    "add", "sub", "and", "or", "xor", "imul", "shl", "shr", "sar", "sal",
+    "addl", "subl", "andl", "orl", "xorl", "imull", "shll", "shrl", "sarl", "sall",
+    "addq", "subq", "andq", "orq", "xorq", "imulq", NULL };
+static char *SSE_ALU[] = {
+    "addsd", "subsd", "mulsd", "divsd", "addss", "subss", "mulss", "divss",
+    "xorpd", "xorps", NULL };
+static char *COMPARES[] = {
+    "cmp", "cmpl", "cmpq", "test", "testl", "testq", "ucomisd", "ucomiss", NULL };
+static char *CONDS[] = {
+    "e", "ne", "z", "nz", "l", "ge", "g", "le", "b", "ae", "a", "be", "p", "np", NULL };
+
+// Adds the effect of writing to an operand. A write to the low 8 or 16
+// bits of a register, or to part of an xmm register, keeps the rest, so
+// it reads the register too.
+static void add_write(Operand *arg, bool whole, RegSet *use, RegSet *def) {
+    int width;
+    int r = get_reg(arg, &width);
+    if (r < 0) {
+        *use |= regs_in(arg);
+        return;
+    }
+    *def |= REG(r);
+    if (width < 32 || (width == 128 && !whole))
+        *use |= REG(r);
+}
+
+static bool is_cond(char *s) {
+    return in_list(s, CONDS);
+}
+
+/*
+ * Sets the registers an instruction reads and writes. Unknown
+ * instructions read everything and write nothing.
+ */
+static void get_effect(Insn *insn, RegSet *use, RegSet *def) {
+    char *op = insn->op;
+    Operand *a = insn->args;
+    int n = insn->nargs;
+    *use = *def = 0;
+    if (!strcmp(op, "nop"))
+        return;
+    if (!strcmp(op, "push") && n == 1) {
+        *use = regs_in(&a[0]) | REG(RSP);
+        *def = REG(RSP);
+        return;
+    }
+    if (!strcmp(op, "pop") && n == 1) {
+        *use = REG(RSP);
+        *def = REG(RSP);
+        add_write(&a[0], true, use, def);
+        return;
+    }
+    if (!strcmp(op, "call")) {
+        *use = CALL_USES | (n ? regs_in(&a[0]) : 0);
+        *def = CALL_DEFS;
+        return;
+    }
+    if (!strcmp(op, "ret")) {
+        *use = RET_USES;
+        return;
+    }
+    if (!strcmp(op, "leave")) {
+        *use = REG(RBP);
+        *def = REG(RSP) | REG(RBP);
+        return;
+    }
+    if (!strcmp(op, "jmp") && n == 1) {
+        if (a[0].indirect)
+            *use = regs_in(&a[0]);
+        return;
+    }
+    if (op[0] == 'j' && is_cond(op + 1)) {
+        *use = FLAGS;
+        return;
+    }
+    if (!strncmp(op, "set", 3) && is_cond(op + 3) && n == 1) {
+        *use = FLAGS;
+        add_write(&a[0], true, use, def);
+        return;
+    }
+    if (!strcmp(op, "cqto") || !strcmp(op, "cltd")) {
+        *use = REG(RAX);
+        *def = REG(RDX);
+        return;
+    }
+    if (!strcmp(op, "cltq")) {
+        *use = *def = REG(RAX);
+        return;
+    }
+    if (in_list(op, (char *[]){ "idiv", "div", "idivl", "divl", "idivq", "divq", NULL }) && n == 1) {
+        *use = REG(RAX) | REG(RDX) | regs_in(&a[0]);
+        *def = REG(RAX) | REG(RDX) | FLAGS;
+        return;
+    }
+    if (in_list(op, (char *[]){ "mul", "imul", "mulq", "imulq", NULL }) && n == 1) {
+        *use = REG(RAX) | regs_in(&a[0]);
+        *def = REG(RAX) | REG(RDX) | FLAGS;
+        return;
+    }
+    if (in_list(op, COMPARES) && n == 2) {
+        *use = regs_in(&a[0]) | regs_in(&a[1]);
+        *def = FLAGS;
+        return;
+    }
+    if (in_list(op, MOVES) && n == 2) {
+        *use = regs_in(&a[0]);
+        // Loads of scalars from memory clear the rest of an xmm register.
+        bool whole = is_mem(&a[0]) && in_list(op, (char *[]){ "movsd", "movss", "movq", NULL });
+        add_write(&a[1], whole, use, def);
+        return;
+    }
+    if ((in_list(op, INT_ALU) || in_list(op, SSE_ALU)) && (n == 2 || n == 3)) {
+        for (int i = 0; i < n; i++)
+            *use |= regs_in(&a[i]);
+        add_write(&a[n - 1], false, use, def);
+        if (in_list(op, INT_ALU))
+            *def |= FLAGS;
+        return;
+    }
+    if (in_list(op, (char *[]){ "neg", "not", "inc", "dec", "negl", "notl", "incl", "decl",
+                                "negq", "notq", "incq", "decq", NULL }) && n == 1) {
+        *use = regs_in(&a[0]);
+        add_write(&a[0], false, use, def);
+        if (strncmp(op, "not", 3))
+            *def |= FLAGS;
+        return;
+    }
+    *use = ALL_REGS;
+}
+
+/*
+ * Liveness
+ */
+
+typedef struct {
+    RegSet use;
+    RegSet def;
+    RegSet in;
+    RegSet out;
+    // True if the registers live at the end are not known
+    bool open;
+} BlockLive;
+
+static void compute_block_effect(Block *b, BlockLive *bl) {
+    bl->use = bl->def = 0;
+    for (Iter *i = list_iter(b->insns); !iter_end(i);) {
+        Insn *insn = iter_next(i);
+        if (insn->kind != INSN_OP)
+            continue;
+        RegSet use, def;
+        get_effect(insn, &use, &def);
+        bl->use |= use & ~bl->def;
+        bl->def |= def;
+    }
+    Insn *last = block_last_op(b);
+    bl->open = list_len(b->succs) == 0 && !(last && !strcmp(last->op, "ret"));
+    if (last && is_jump(last) && !is_indirect_jump(last)) {
+        bl->open = true;
+        for (Iter *i = list_iter(b->succs); !iter_end(i);) {
+            Block *succ = iter_next(i);
+            if (jumps_to(last, succ->label))
+                bl->open = false;
+        }
+    }
+}
+
+// Returns the registers live at the end of each block, indexed by id.
+static RegSet *compute_liveness(IrFunc *fn) {
+    int n = list_len(fn->blocks);
+    BlockLive *v = calloc(n, sizeof(BlockLive));
+    Block **blocks = malloc(sizeof(Block *) * (n + 1));
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        blocks[b->id] = b;
+        compute_block_effect(b, &v[b->id]);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = n - 1; i >= 0; i--) {
+            Block *b = blocks[i];
+            BlockLive *bl = &v[b->id];
+            RegSet out = bl->open ? ALL_REGS : 0;
+            for (Iter *j = list_iter(b->succs); !iter_end(j);)
+                out |= v[((Block *)iter_next(j))->id].in;
+            RegSet in = bl->use | (out & ~bl->def);
+            if (in != bl->in || out != bl->out)
+                changed = true;
+            bl->in = in;
+            bl->out = out;
+        }
+    }
+    RegSet *r = malloc(sizeof(RegSet) * (n + 1));
+    for (int i = 0; i < n; i++)
+        r[i] = v[i].out;
+    free(v);
+    free(blocks);
+    return r;
+}
+
+/*
+ * Rules
+ */
+
+// The instructions of a block being rewritten. Deleted ones are NULL.
+typedef struct {
+    Insn **insns;
+    int len;
+    // Registers live after each instruction
+    RegSet *live;
+} Window;
+
+// Returns the index of the next instruction after i, or -1.
+static int next_op(Window *w, int i) {
+    for (i++; i < w->len; i++)
+        if (w->insns[i] && w->insns[i]->kind == INSN_OP)
+            return i;
+    return -1;
+}
+
+static void compute_live(Window *w, RegSet out) {
+    for (int i = w->len - 1; i >= 0; i--) {
+        w->live[i] = out;
+        Insn *insn = w->insns[i];
+        if (!insn || insn->kind != INSN_OP)
+            continue;
+        RegSet use, def;
+        get_effect(insn, &use, &def);
+        out = use | (out & ~def);
+    }
+}
+
+static bool is_dead(Window *w, int i, RegSet regs) {
+    return (w->live[i] & regs) == 0;
+}
+
+static bool is_op(Insn *insn, char *op, int nargs) {
+    return !strcmp(insn->op, op) && insn->nargs == nargs;
+}
+
+static RegSet reg_bit(Operand *o) {
+    int width;
+    int r = get_reg(o, &width);
+    return r < 0 ? 0 : reg_set(r);
+}
+
+// Removes a push of a register and the pop of it a few instructions
+// later, if the code between leaves the stack and the register alone,
+// or if the register is not read after the pop.
+static bool push_pop_around(Window *w, int i) {
+    Insn *a = w->insns[i];
+    RegSet r = reg_bit(&a->args[0]);
+    if (!r)
+        return false;
+    bool written = false;
+    int j = i;
+    for (int k = 0; k < 8; k++) {
+        if ((j = next_op(w, j)) < 0)
+            return false;
+        Insn *b = w->insns[j];
+        if (is_op(b, "pop", 1) && same_operand(&b->args[0], &a->args[0]))
+            break;
+        RegSet use, def;
+        get_effect(b, &use, &def);
+        if (is_jump(b) || ((use | def) & REG(RSP)))
+            return false;
+        if (def & r)
+            written = true;
+    }
+    Insn *b = w->insns[j];
+    if (!is_op(b, "pop", 1) || !same_operand(&b->args[0], &a->args[0]))
+        return false;
+    if (written && !is_dead(w, j, r))
+        return false;
+    w->insns[i] = w->insns[j] = NULL;
+    return true;
+}
+
+// push X; pop Y => mov X, Y
+static bool push_pop(Window *w, int i, int j) {
+    Insn *a = w->insns[i], *b = w->insns[j];
+    if (!is_op(a, "push", 1))
+        return false;
+    if (!is_op(b, "pop", 1))
+        return push_pop_around(w, i);
+    if (is_mem(&a->args[0]) && is_mem(&b->args[0]))
+        return false;
+    if (same_operand(&a->args[0], &b->args[0]))
+        w->insns[i] = NULL;
+    else
+        rewrite_insn(a, "mov", &a->args[0], &b->args[0]);
+    w->insns[j] = NULL;
+    return true;
+}
+
+// pop X; push X => mov (%rsp), X
+static bool pop_push(Window *w, int i, int j) {
+    Insn *a = w->insns[i], *b = w->insns[j];
+    if (!is_op(a, "pop", 1) || !is_op(b, "push", 1))
+        return false;
+    if (!is_reg(&a->args[0]) || !same_operand(&a->args[0], &b->args[0]))
+        return false;
+    Operand top = { .kind = OPD_MEM, .reg = RSP, .index = NO_REG };
+    rewrite_insn(a, "mov", &top, &a->args[0]);
+    w->insns[j] = NULL;
+    return true;
+}
+
+static bool self_move(Window *w, int i) {
+    Insn *a = w->insns[i];
+    if (!is_op(a, "mov", 2) && !is_op(a, "movsd", 2) && !is_op(a, "movss", 2))
+        return false;
+    int width;
+    if (get_reg(&a->args[0], &width) < 0 || width == 32 || !same_operand(&a->args[0], &a->args[1]))
+        return false;
+    w->insns[i] = NULL;
+    return true;
+}
+
+static bool dead_move(Window *w, int i) {
+    Insn *a = w->insns[i];
+    if (!in_list(a->op, MOVES) || a->nargs != 2)
+        return false;
+    RegSet dst = reg_bit(&a->args[1]);
+    if (!dst || !is_dead(w, i, dst))
+        return false;
+    w->insns[i] = NULL;
+    return true;
+}
+
+static char *EXTENSIONS[] = {
+    "movslq", "movsbq", "movswq", "movzb", "movzx", "movzbl", "movzwl", NULL };
+
+// mov %S, %R; movslq %eR, D => movslq %eS, D if R is not read later
+static bool copy_to_extension(Window *w, int i, int j) {
+    Insn *a = w->insns[i], *b = w->insns[j];
+    if (!in_list(b->op, EXTENSIONS) || b->nargs != 2)
+        return false;
+    int swidth, rwidth, width, dwidth;
+    int src = get_reg(&a->args[0], &swidth);
+    int reg = get_reg(&a->args[1], &rwidth);
+    if (src < 0 || src >= 16 || swidth != 64 || rwidth != 64)
+        return false;
+    if (get_reg(&b->args[0], &width) != reg)
+        return false;
+    // The extension may write R itself.
+    int dst = get_reg(&b->args[1], &dwidth);
+    if (!is_dead(w, j, REG(reg)) && !(dst == reg && dwidth >= 32))
+        return false;
+    if (regs_in(&b->args[1]) & REG(reg) && dst != reg)
+        return false;
+    Operand narrow;
+    set_reg_operand(&narrow, src, width);
+    rewrite_insn(b, b->op, &narrow, &b->args[1]);
+    w->insns[i] = NULL;
+    return true;
+}
+
+// mov S, %R; mov %R, D => mov S, D if R is not read later
+static bool copy_forward(Window *w, int i, int j) {
+    Insn *a = w->insns[i], *b = w->insns[j];
+    if (is_op(a, "mov", 2) && copy_to_extension(w, i, j))
+        return true;
+    if (!is_op(a, "mov", 2) && !is_op(a, "movsd", 2))
+        return false;
+    if (!is_op(b, a->op, 2) || !same_operand(&a->args[1], &b->args[0]))
+        return false;
+    int width;
+    if (get_reg(&a->args[1], &width) < 0 || width == 32 || width == 16 || width == 8)
+        return false;
+    Operand *src = &a->args[0], *dst = &b->args[1];
+    RegSet r = reg_bit(&a->args[1]);
+    if (!is_dead(w, j, r) || (regs_in(dst) & r))
+        return false;
+    if (is_mem(src) && is_mem(dst))
+        return false;
+    // An immediate needs a register, as a store to memory has no size.
+    if (src->kind == OPD_IMM && !is_reg(dst))
+        return false;
+    rewrite_insn(a, a->op, src, dst);
+    w->insns[j] = NULL;
+    return true;
+}
+
+enum { EXT_NONE, EXT_S8, EXT_S16, EXT_S32, EXT_Z8, EXT_Z16, EXT_Z32 };
+
+// Returns how the value an instruction puts in a 64-bit register is
+// extended, and sets *reg to the register. Any write to a 32-bit
+// register clears the upper half.
+static int get_extension(Insn *insn, int *reg) {
+    if (insn->nargs != 2)
+        return EXT_NONE;
+    int width;
+    *reg = get_reg(&insn->args[1], &width);
+    if (*reg < 0 || *reg >= 16)
+        return EXT_NONE;
+    char *op = insn->op;
+    if (!strcmp(op, "movslq")) return EXT_S32;
+    if (!strcmp(op, "movswq")) return EXT_S16;
+    if (!strcmp(op, "movsbq")) return EXT_S8;
+    if (!strcmp(op, "movzx") || !strcmp(op, "movzb") || !strcmp(op, "movzbl") || !strcmp(op, "movzbq"))
+        return EXT_Z8;
+    if (!strcmp(op, "movzwl") || !strcmp(op, "movzwq"))
+        return EXT_Z16;
+    Operand *src = &insn->args[0];
+    if (!strcmp(op, "mov") && (width == 64 || width == 32) && src->kind == OPD_IMM && !src->sym) {
+        long v = src->val;
+        if (width == 32 && v < 0) return EXT_Z32;
+        if (0 <= v && v < 128) return EXT_S8;
+        if (0 <= v && v < 256) return EXT_Z8;
+        if (-128 <= v && v < 128) return EXT_S8;
+        if (-32768 <= v && v < 32768) return EXT_S16;
+        if (-2147483648L <= v && v < 2147483648L) return EXT_S32;
+    }
+    if (width == 32 && (in_list(op, MOVES) || in_list(op, INT_ALU)))
+        return EXT_Z32;
+    return EXT_NONE;
+}
+
+// Whether a value extended as ext is unchanged by extending its low bits
+// with the instruction b. A 32-bit mov of a register to itself is a
+// zero extension.
+static bool extends_as(int ext, Insn *b) {
+    char *op = b->op;
+    if (!strcmp(op, "movslq"))
+        return ext != EXT_NONE && ext != EXT_Z32;
+    if (!strcmp(op, "movswq"))
+        return ext == EXT_S8 || ext == EXT_S16 || ext == EXT_Z8;
+    if (!strcmp(op, "movsbq"))
+        return ext == EXT_S8;
+    if (!strcmp(op, "movzb") || !strcmp(op, "movzx") || !strcmp(op, "movzbl") || !strcmp(op, "movzbq"))
+        return ext == EXT_Z8;
+    if (!strcmp(op, "movzwl") || !strcmp(op, "movzwq"))
+        return ext == EXT_Z8 || ext == EXT_Z16;
+    int w0, w1;
+    if (!strcmp(op, "mov") && get_reg(&b->args[0], &w0) == get_reg(&b->args[1], &w1) && w0 == 32 && w1 == 32)
+        return ext == EXT_Z8 || ext == EXT_Z16 || ext == EXT_Z32;
+    return false;
+}
+
+// Extending a value that is already extended is a move.
+static bool double_conversion(Window *w, int i, int j) {
+    Insn *a = w->insns[i], *b = w->insns[j];
+    int reg;
+    int ext = get_extension(a, &reg);
+    if (ext == EXT_NONE || b->nargs != 2 || !extends_as(ext, b))
+        return false;
+    int width;
+    if (get_reg(&b->args[0], &width) != reg || get_reg(&b->args[1], &width) < 0)
+        return false;
+    Operand src, dst;
+    set_reg_operand(&src, reg, 64);
+    set_reg_operand(&dst, b->args[1].reg, width == 128 ? 128 : 64);
+    if (same_operand(&src, &dst))
+        w->insns[j] = NULL;
+    else
+        rewrite_insn(b, "mov", &src, &dst);
+    return true;
+}
+
+static char *invert_cond(char *cond) {
+    for (int i = 0; CONDS[i]; i += 2) {
+        if (!strcmp(CONDS[i], cond))
+            return CONDS[i + 1];
+        if (!strcmp(CONDS[i + 1], cond))
+            return CONDS[i];
+    }
+    return NULL;
+}
+
+// setCC %al; [movzb %al, %eax;] test %rax, %rax; je L => jNCC L
+static bool set_branch(Window *w, int i) {
+    Insn *set = w->insns[i];
+    if (strncmp(set->op, "set", 3) || !is_cond(set->op + 3) || !is_reg_named(&set->args[0], RAX, 8))
+        return false;
+    int j = next_op(w, i);
+    if (j < 0)
+        return false;
+    int k = j;
+    Insn *ext = w->insns[j];
+    if ((is_op(ext, "movzb", 2) && is_reg_named(&ext->args[1], RAX, 32)) ||
+        (is_op(ext, "movzx", 2) && is_reg_named(&ext->args[1], RAX, 64))) {
+        if (!is_reg_named(&ext->args[0], RAX, 8) || (k = next_op(w, j)) < 0)
+            return false;
+    }
+    Insn *test = w->insns[k];
+    if (!is_op(test, "test", 2) || !same_operand(&test->args[0], &test->args[1]))
+        return false;
+    int width;
+    if (get_reg(&test->args[0], &width) != RAX)
+        return false;
+    int l = next_op(w, k);
+    if (l < 0)
+        return false;
+    Insn *jump = w->insns[l];
+    bool jz = is_op(jump, "je", 1) || is_op(jump, "jz", 1);
+    bool jnz = is_op(jump, "jne", 1) || is_op(jump, "jnz", 1);
+    if (!(jz || jnz) || !is_dead(w, l, REG(RAX) | FLAGS))
+        return false;
+    char op[8];
+    snprintf(op, sizeof(op), "j%s", jz ? invert_cond(set->op + 3) : set->op + 3);
+    rewrite_insn(set, op, &jump->args[0], NULL);
+    w->insns[j] = w->insns[k] = w->insns[l] = NULL;
+    return true;
+}
+
+static bool apply_rules(Window *w, int i) {
+    Insn *insn = w->insns[i];
+    int j = next_op(w, i);
+    if (j >= 0) {
+        if (push_pop(w, i, j)) { count(RULE_PUSH_POP); return true; }
+        if (pop_push(w, i, j)) { count(RULE_POP_PUSH); return true; }
+        if (copy_forward(w, i, j)) { count(RULE_COPY_FORWARD); return true; }
+        if (double_conversion(w, i, j)) { count(RULE_DOUBLE_CONV); return true; }
+    }
+    if (insn->nargs == 1 && set_branch(w, i)) { count(RULE_SET_BRANCH); return true; }
+    if (self_move(w, i)) { count(RULE_SELF_MOVE); return true; }
+    if (dead_move(w, i)) { count(RULE_DEAD_MOVE); return true; }
+    return false;
+}
+
+static bool optimize_block(Block *b, RegSet out) {
+    Window w;
+    w.len = list_len(b->insns);
+    w.insns = malloc(sizeof(Insn *) * (w.len + 1));
+    w.live = malloc(sizeof(RegSet) * (w.len + 1));
+    int n = 0;
+    for (Iter *i = list_iter(b->insns); !iter_end(i);)
+        w.insns[n++] = iter_next(i);
+    compute_live(&w, out);
+
+    bool changed = false;
+    for (int i = 0; i < w.len; i++) {
+        if (!w.insns[i] || w.insns[i]->kind != INSN_OP)
+            continue;
+        if (!apply_rules(&w, i))
+            continue;
+        changed = true;
+        compute_live(&w, out);
+        // Look at the rewritten code again from a few instructions back.
+        for (int k = 0; k < 4 && i > 0; i--)
+            if (w.insns[i - 1] && w.insns[i - 1]->kind == INSN_OP)
+                k++;
+        i--;
+    }
+    if (changed) {
+        // The rules only clear slots, so the old list still has the
+        // removed instructions at the same positions.
+        List *insns = make_list();
+        n = 0;
+        for (Iter *i = list_iter(b->insns); !iter_end(i); n++) {
+            Insn *insn = iter_next(i);
+            if (w.insns[n])
+                list_push(insns, insn);
+            else
+                free_insn(insn);
+        }
+        list_free(b->insns);
+        b->insns = insns;
+    }
+    free(w.insns);
+    free(w.live);
+    return changed;
+}
+
+static bool block_has_code(Block *b) {
+    for (Iter *i = list_iter(b->insns); !iter_end(i);)
+        if (((Insn *)iter_next(i))->kind == INSN_OP)
+            return true;
+    return false;
+}
+
+// Removes jumps to the label that follows them.
+static bool remove_jumps_to_next(IrFunc *fn) {
+    bool changed = false;
+    int n = list_len(fn->blocks);
+    Block **v = malloc(sizeof(Block *) * (n + 1));
+    int k = 0;
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);)
+        v[k++] = iter_next(i);
+    for (int i = 0; i < n; i++) {
+        Insn *last = block_last_op(v[i]);
+        if (!last || !is_jump(last) || is_indirect_jump(last))
+            continue;
+        // Look at the labels up to the next instruction.
+        bool found = false;
+        for (int j = i + 1; j < n && !found; j++) {
+            if (jumps_to(last, v[j]->label))
+                found = true;
+            if (block_has_code(v[j]))
+                break;
+        }
+        if (!found)
+            continue;
+        List *insns = make_list();
+        for (Iter *j = list_iter(v[i]->insns); !iter_end(j);) {
+            Insn *insn = iter_next(j);
+            if (insn != last)
+                list_push(insns, insn);
+        }
+        free_insn(last);
+        list_free(v[i]->insns);
+        v[i]->insns = insns;
+        count(RULE_JUMP_NEXT);
+        changed = true;
+    }
+    free(v);
+    return changed;
+}
+
+bool peephole(IrFunc *fn) {
+    RegSet *out = compute_liveness(fn);
+    bool changed = false;
+    for (Iter *i = list_iter(fn->blocks); !iter_end(i);) {
+        Block *b = iter_next(i);
+        if (optimize_block(b, out[b->id]))
+            changed = true;
+    }
+    free(out);
+    if (remove_jumps_to_next(fn))
+        changed = true;
+    return changed;
+}
@@ -0,0 +1,225 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Pipelined compilation (-fpipeline).
+ *
+ * The preprocessor, the parser and the code generator run in three
+ * threads. The preprocessor thread puts tokens into a ring, which the
+ * parser reads instead of running the preprocessor, and the parser puts
+ * each top-level function or declaration into another ring as soon as
+ * it has been read. The calling thread takes them from there and emits
+ * them.
+ *
+ * The rings have one producer and one consumer each, so they need no
+ * locks: the producer alone moves the tail and the consumer alone moves
+ * the head.
+ *
+ * The preprocessor thread uses the caller's preprocessor and lexer
+ * state. The parser has a preprocessor and lexer state with a token
+ * source of its own, and the code generator has a lexer state of its
+ * own, which points diagnostics at the end of the top-level being
+ * emitted, as without threads. Each thread has a context of its own.
+ *
+ * An error in the preprocessor or the parser is reported by that thread
+ * and then sent down the rings in place of a token or a top-level, so
+ * that the calling thread stops the others and exits. A consumer that
+ * stops early marks its ring stopped, so that the producer gives up
+ * rather than waiting for room.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+#ifdef __8cc__
+
+// 8cc has neither thread-local variables nor atomic operations.
+void run_pipeline(void (*emit)(Node *v)) {
+    for (Node *v; (v = read_toplevel()) != NULL;)
+        emit(v);
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+
+#define RING_SIZE 4096
+
+typedef struct {
+    void *buf[RING_SIZE];
+    long head;
+    long tail;
+    // Set by the consumer when it has taken the final NULL
+    bool done;
+    // Set by the consumer when it takes no more
+    bool stopped;
+} Ring;
+
+// Sent in place of a token or a top-level after an error
+static char failed;
+#define FAILED ((void *)&failed)
+
+// Returns false if the consumer has stopped.
+static bool ring_push(Ring *r, void *p) {
+    long tail = r->tail;
+    for (;;) {
+        if (__atomic_load_n(&r->stopped, __ATOMIC_ACQUIRE))
+            return false;
+        if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) < RING_SIZE)
+            break;
+        sched_yield();
+    }
+    r->buf[tail % RING_SIZE] = p;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void *ring_pop(Ring *r) {
+    long head = r->head;
+    while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+        sched_yield();
+    void *p = r->buf[head % RING_SIZE];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+// A NULL ends the stream. Once it has been taken, NULL is returned
+// without waiting, as the parser may peek at the end of input again.
+static void *ring_pop_or_end(Ring *r) {
+    if (r->done)
+        return NULL;
+    void *p = ring_pop(r);
+    if (!p)
+        r->done = true;
+    return p;
+}
+
+static void stop_ring(Ring *r) {
+    __atomic_store_n(&r->stopped, true, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    Context *ctx;
+    Ring *in;
+    Ring *out;
+} Stage;
+
+static Token *read_ring_token(void *ring) {
+    Token *tok = ring_pop_or_end(ring);
+    // The preprocessor has reported an error.
+    if (tok == FAILED)
+        longjmp(*context->on_error, 1);
+    if (tok)
+        set_input_position(tok);
+    return tok;
+}
+
+static void *run_cpp(void *arg) {
+    Stage *stage = arg;
+    set_context(stage->ctx);
+    jmp_buf env;
+    context->on_error = &env;
+    if (setjmp(env)) {
+        ring_push(stage->out, FAILED);
+        return NULL;
+    }
+    for (;;) {
+        Token *tok = read_token();
+        if (!ring_push(stage->out, tok) || !tok)
+            return NULL;
+    }
+}
+
+// Sends each top-level with the token the parser read last.
+static void *run_parser(void *arg) {
+    Stage *stage = arg;
+    set_context(stage->ctx);
+    set_token_source(read_ring_token, stage->in);
+    jmp_buf env;
+    context->on_error = &env;
+    if (setjmp(env)) {
+        stop_ring(stage->in);
+        ring_push(stage->out, FAILED);
+        return NULL;
+    }
+    for (;;) {
+        Node *v = read_toplevel();
+        if (!ring_push(stage->out, v ? make_pair(v, get_input_position()) : NULL)) {
+            stop_ring(stage->in);
+            return NULL;
+        }
+        if (!v)
+            return NULL;
+    }
+}
+
+// Returns false after an error.
+static bool run_codegen(Ring *nodes, void (*emit)(Node *v)) {
+    jmp_buf env;
+    context->on_error = &env;
+    if (setjmp(env))
+        return false;
+    for (;;) {
+        Pair *p = ring_pop_or_end(nodes);
+        if (!p)
+            return true;
+        if (p == FAILED)
+            return false;
+        set_input_position(p->second);
+        emit(p->first);
+    }
+}
+
+static pthread_t start_thread(void *(*fn)(void *), Stage *stage) {
+    pthread_t r;
+    if (pthread_create(&r, NULL, fn, stage))
+        error("cannot create a thread");
+    return r;
+}
+
+static Context *copy_context(Context *ctx) {
+    Context *r = malloc(sizeof(Context));
+    memcpy(r, ctx, sizeof(Context));
+    return r;
+}
+
+// Reads the rest of the input and calls emit for each top-level
+// function or declaration in source order, on the calling thread.
+void run_pipeline(void (*emit)(Node *v)) {
+    Context *saved = context;
+    Context *cpp_ctx = copy_context(context);
+    Context *parser_ctx = copy_context(context);
+    parser_ctx->lex = make_lex_state();
+    parser_ctx->cpp = make_cpp_state();
+    Context *gen_ctx = copy_context(parser_ctx);
+    gen_ctx->lex = make_lex_state();
+
+    Ring *tokens = calloc(1, sizeof(Ring));
+    Ring *nodes = calloc(1, sizeof(Ring));
+    Stage cpp = { cpp_ctx, NULL, tokens };
+    Stage parser = { parser_ctx, tokens, nodes };
+    pthread_t cpp_thread = start_thread(run_cpp, &cpp);
+    pthread_t parser_thread = start_thread(run_parser, &parser);
+
+    set_context(gen_ctx);
+    bool ok = run_codegen(nodes, emit);
+    stop_ring(nodes);
+    pthread_join(parser_thread, NULL);
+    pthread_join(cpp_thread, NULL);
+    set_context(saved);
+    free(tokens);
+    free(nodes);
+    free(cpp_ctx);
+    free(parser_ctx);
+    free(gen_ctx);
+    if (ok)
+        return;
+    // The error has been reported by the thread that ran into it.
+    if (context->on_error)
+        longjmp(*context->on_error, 1);
+    exit(1);
+}
+
+#endif
@@ -0,0 +1,317 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Register allocation for local variables.
+ *
+ * Scalar locals and parameters whose address is never taken are kept
+ * in registers instead of stack slots. The nodes of a function are
+ * numbered in the order the code generator visits them, and the live
+ * interval of a variable runs from its first to its last occurrence.
+ * A loop keeps alive the variables that are live when it is entered,
+ * so an interval that overlaps a loop is extended to cover all of it,
+ * unless the variable is declared in the loop. Backward gotos make
+ * loops too. A computed goto may go anywhere, so functions with one
+ * keep all variables on the stack.
+ *
+ * Registers are assigned by linear scan over the intervals sorted by
+ * their start. When no register is free, the interval that ends last
+ * is left on the stack.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "8cc.h"
+
+typedef struct {
+    Node *var;
+    int start;
+    int end;
+    // Position of the declaration, or -1 for a parameter
+    int decl;
+    bool addressed;
+    char *reg;
+} Interval;
+
+typedef struct {
+    // The intervals of variables in order, indexed by their lindex
+    Interval **vars;
+    int nvars;
+    int nalloc;
+    // Ranges of loops, as intervals without a variable
+    List *loops;
+    // Labels, and gotos as intervals whose var is the goto node
+    Dict *labels;
+    List *gotos;
+    bool computed_goto;
+    int pos;
+} Liveness;
+
+static bool is_candidate(Node *var) {
+    switch (var->ctype->type) {
+    case CTYPE_BOOL: case CTYPE_CHAR: case CTYPE_SHORT: case CTYPE_INT:
+    case CTYPE_LONG: case CTYPE_LLONG: case CTYPE_PTR:
+        return !var->lvarinit;
+    }
+    return false;
+}
+
+static Interval *make_interval(Node *var, int start, int end) {
+    Interval *r = arena_malloc(sizeof(Interval));
+    r->var = var;
+    r->start = start;
+    r->end = end;
+    r->decl = -1;
+    r->addressed = false;
+    r->reg = NULL;
+    return r;
+}
+
+// lindex may be left over from another function, so the interval it
+// points to is checked to be the variable's.
+static Interval *get_interval(Liveness *lv, Node *var) {
+    int i = var->lindex;
+    if (0 <= i && i < lv->nvars && lv->vars[i]->var == var)
+        return lv->vars[i];
+    return NULL;
+}
+
+static Interval *add_interval(Liveness *lv, Node *var) {
+    if (lv->nvars == lv->nalloc) {
+        lv->nalloc = lv->nalloc ? lv->nalloc * 2 : 16;
+        lv->vars = realloc(lv->vars, sizeof(Interval *) * lv->nalloc);
+    }
+    Interval *iv = make_interval(var, lv->pos, lv->pos);
+    var->lindex = lv->nvars;
+    lv->vars[lv->nvars++] = iv;
+    return iv;
+}
+
+static void use(Liveness *lv, Node *var) {
+    Interval *iv = get_interval(lv, var);
+    if (!iv)
+        iv = add_interval(lv, var);
+    if (lv->pos < iv->start)
+        iv->start = lv->pos;
+    if (lv->pos > iv->end)
+        iv->end = lv->pos;
+}
+
+static void walk(Liveness *lv, Node *node);
+
+static void walk_list(Liveness *lv, List *nodes) {
+    for (Iter *i = list_iter(nodes); !iter_end(i);)
+        walk(lv, iter_next(i));
+}
+
+static void walk_loop(Liveness *lv, Node *a, Node *b, Node *c) {
+    int start = lv->pos;
+    walk(lv, a);
+    walk(lv, b);
+    walk(lv, c);
+    list_push(lv->loops, make_interval(NULL, start, lv->pos));
+}
+
+static void walk(Liveness *lv, Node *node) {
+    if (!node)
+        return;
+    lv->pos++;
+    switch (node->type) {
+    case AST_LITERAL: case AST_STRING: case AST_GVAR: case AST_BREAK:
+    case AST_CONTINUE: case AST_CASE: case AST_DEFAULT:
+        return;
+    case AST_LVAR:
+        use(lv, node);
+        return;
+    case AST_FUNCALL:
+        walk_list(lv, node->args);
+        return;
+    case AST_FUNCPTR_CALL:
+        walk_list(lv, node->args);
+        walk(lv, node->fptr);
+        return;
+    case AST_DECL:
+        use(lv, node->declvar);
+        get_interval(lv, node->declvar)->decl = lv->pos;
+        if (node->declinit)
+            for (Iter *i = list_iter(node->declinit); !iter_end(i);)
+                walk(lv, ((Node *)iter_next(i))->initval);
+        return;
+    case AST_ADDR:
+        if (node->operand->type == AST_LVAR) {
+            use(lv, node->operand);
+            get_interval(lv, node->operand)->addressed = true;
+            return;
+        }
+        walk(lv, node->operand);
+        return;
+    case AST_CONV: case AST_DEREF: case OP_UMINUS: case OP_CAST: case '!': case '~':
+    case OP_PRE_INC: case OP_PRE_DEC: case OP_POST_INC: case OP_POST_DEC:
+        walk(lv, node->operand);
+        return;
+    case AST_COMPUTED_GOTO:
+        lv->computed_goto = true;
+        walk(lv, node->operand);
+        return;
+    case OP_LABEL_ADDR:
+        lv->computed_goto = true;
+        return;
+    case AST_IF: case AST_TERNARY:
+        walk(lv, node->cond);
+        walk(lv, node->then);
+        walk(lv, node->els);
+        return;
+    case AST_FOR:
+        walk(lv, node->forinit);
+        walk_loop(lv, node->forcond, node->forbody, node->forstep);
+        return;
+    case AST_WHILE: case AST_DO:
+        walk_loop(lv, node->forcond, node->forbody, NULL);
+        return;
+    case AST_SWITCH:
+        walk(lv, node->switchexpr);
+        walk(lv, node->switchbody);
+        return;
+    case AST_RETURN:
+        walk(lv, node->retval);
+        return;
+    case AST_COMPOUND_STMT:
+        walk_list(lv, node->stmts);
+        return;
+    case AST_STRUCT_REF:
+        walk(lv, node->struc);
+        return;
+    case AST_VA_START: case AST_VA_ARG:
+        walk(lv, node->ap);
+        return;
+    case AST_LABEL:
+        if (node->newlabel)
+            dict_put(lv->labels, node->newlabel, make_interval(NULL, lv->pos, lv->pos));
+        return;
+    case AST_GOTO:
+        list_push(lv->gotos, make_interval(node, lv->pos, lv->pos));
+        return;
+    default:
+        walk(lv, node->left);
+        walk(lv, node->right);
+    }
+}
+
+// Extends intervals over the loops they overlap until nothing changes.
+static void extend_intervals(Liveness *lv) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int i = 0; i < lv->nvars; i++) {
+            Interval *iv = lv->vars[i];
+            for (Iter *j = list_iter(lv->loops); !iter_end(j);) {
+                Interval *loop = iter_next(j);
+                if (iv->end < loop->start || loop->end < iv->start)
+                    continue;
+                if (loop->start <= iv->decl && iv->decl <= loop->end)
+                    continue;
+                if (iv->start <= loop->start && loop->end <= iv->end)
+                    continue;
+                if (loop->start < iv->start)
+                    iv->start = loop->start;
+                if (loop->end > iv->end)
+                    iv->end = loop->end;
+                changed = true;
+            }
+        }
+    }
+}
+
+static int compare_intervals(const void *a, const void *b) {
+    return (*(Interval **)a)->start - (*(Interval **)b)->start;
+}
+
+/*
+ * Assigns registers to the locals and parameters of func, setting lreg
+ * of their nodes. Registers are taken from regs in order. Returns the
+ * number of the registers at the beginning of regs that are used.
+ */
+int allocate_registers(Node *func, char **regs, int nregs) {
+    Liveness lv = {
+        .loops = make_list(),
+        .labels = make_dict(NULL),
+        .gotos = make_list(),
+    };
+    for (Iter *i = list_iter(func->params); !iter_end(i);) {
+        Node *v = iter_next(i);
+        v->lreg = NULL;
+        use(&lv, v);
+    }
+    for (Iter *i = list_iter(func->localvars); !iter_end(i);)
+        ((Node *)iter_next(i))->lreg = NULL;
+    walk(&lv, func->body);
+
+    if (lv.computed_goto) {
+        free(lv.vars);
+        return 0;
+    }
+    for (Iter *i = list_iter(lv.gotos); !iter_end(i);) {
+        Interval *go = iter_next(i);
+        Interval *label = dict_get(lv.labels, go->var->newlabel);
+        if (label && label->start < go->start)
+            list_push(lv.loops, make_interval(NULL, label->start, go->start));
+    }
+    extend_intervals(&lv);
+
+    int n = 0;
+    Interval **v = arena_malloc(sizeof(Interval *) * (lv.nvars + 1));
+    for (int i = 0; i < lv.nvars; i++) {
+        Interval *iv = lv.vars[i];
+        if (!iv->addressed && is_candidate(iv->var))
+            v[n++] = iv;
+    }
+    free(lv.vars);
+    qsort(v, n, sizeof(Interval *), compare_intervals);
+
+    // Intervals holding a register, sorted by their end
+    List *active = make_list();
+    bool *used = arena_calloc(nregs, sizeof(bool));
+    int nused = 0;
+    for (int i = 0; i < n; i++) {
+        Interval *iv = v[i];
+        while (list_len(active) > 0 && ((Interval *)list_head(active))->end < iv->start) {
+            Interval *done = list_shift(active);
+            for (int r = 0; r < nregs; r++)
+                if (regs[r] == done->reg)
+                    used[r] = false;
+        }
+        if (list_len(active) == nregs) {
+            Interval *last = list_tail(active);
+            if (last->end <= iv->end)
+                continue;
+            list_pop(active);
+            iv->reg = last->reg;
+            last->reg = NULL;
+        } else {
+            for (int r = 0; r < nregs; r++) {
+                if (!used[r]) {
+                    used[r] = true;
+                    iv->reg = regs[r];
+                    if (r + 1 > nused)
+                        nused = r + 1;
+                    break;
+                }
+            }
+        }
+        List *sorted = make_list();
+        bool added = false;
+        for (Iter *j = list_iter(active); !iter_end(j);) {
+            Interval *a = iter_next(j);
+            if (!added && iv->end < a->end) {
+                list_push(sorted, iv);
+                added = true;
+            }
+            list_push(sorted, a);
+        }
+        if (!added)
+            list_push(sorted, iv);
+        active = sorted;
+    }
+    for (int i = 0; i < n; i++)
+        v[i]->var->lreg = v[i]->reg;
+    return nused;
+}
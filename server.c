@@ -0,0 +1,333 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Compile server.
+ *
+ * "8cc --server" initializes the compiler once and then waits for
+ * requests on a Unix domain socket. Each request is compiled in a
+ * child forked from the server, which therefore starts with the
+ * preprocessor and the parser already initialized and with the
+ * server's header file cache.
+ *
+ * "8cc --client <args>" sends the arguments and the working directory
+ * to the server together with its standard input, output and error.
+ * The child compiles with these file descriptors, so the assembly and
+ * diagnostics go straight to the client's files, and the client exits
+ * with the child's exit status.
+ *
+ * Children report which headers they read from disk through a pipe
+ * (see file.c), so the server can cache them for later requests.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "8cc.h"
+
+#define MAX_REQUEST (1024 * 1024)
+
+static char *server_socket;
+static pid_t server_pid;
+
+// The default socket is in a directory that only the user can access,
+// so other users can neither connect to it nor replace it.
+static char *get_socket_dir(void) {
+    char *dir = getenv("XDG_RUNTIME_DIR");
+    return dir ? dir : format("/tmp/8cc-%d", getuid());
+}
+
+char *get_server_socket(void) {
+    char *path = getenv("EIGHTCC_SOCKET");
+    return path ? path : format("%s/8cc.sock", get_socket_dir());
+}
+
+static void make_socket_dir(void) {
+    char *dir = get_socket_dir();
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        error("cannot create %s: %s", dir, strerror(errno));
+    struct stat st;
+    if (lstat(dir, &st) < 0)
+        error("cannot stat %s: %s", dir, strerror(errno));
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+        error("%s must be a directory that only you can access", dir);
+}
+
+// Removes a socket left by a previous server, but nothing that is not
+// a socket or is someone else's.
+static void remove_stale_socket(char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        if (errno == ENOENT)
+            return;
+        error("cannot stat %s: %s", path, strerror(errno));
+    }
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+        error("%s exists and is not your socket", path);
+    unlink(path);
+}
+
+// Returns true if the process at the other end of sock runs as the
+// same user.
+static bool same_user(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return false;
+    return cred.uid == getuid();
+}
+
+static void make_addr(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        error("socket path too long: %s", path);
+    strcpy(addr->sun_path, path);
+}
+
+/*----------------------------------------------------------------------
+ * Messages
+ *
+ * A request is a 4-byte length followed by the working directory and
+ * the arguments, each terminated by a NUL. The client's stdin, stdout
+ * and stderr are attached to the first byte. The response is a single
+ * byte holding the exit status.
+ */
+
+static bool write_all(int fd, char *buf, int len) {
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char *buf, int len) {
+    while (len > 0) {
+        int n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_request(int sock, String *req) {
+    int len = string_len(req);
+    int fds[] = { 0, 1, 2 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &len, .iov_len = sizeof(len) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) != sizeof(len))
+        return false;
+    return write_all(sock, get_cstring(req), len);
+}
+
+// Reads a request and installs the client's file descriptors as this
+// process's standard input, output and error.
+static List *read_request(int sock) {
+    int len;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = &len, .iov_len = sizeof(len) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control, .msg_controllen = sizeof(control) };
+    if (recvmsg(sock, &msg, 0) != sizeof(len))
+        return NULL;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return NULL;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if (len <= 0 || MAX_REQUEST < len)
+        return NULL;
+    char *buf = malloc(len);
+    if (!read_all(sock, buf, len) || buf[len - 1] != '\0')
+        return NULL;
+    List *r = make_list();
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1)
+        list_push(r, p);
+    return r;
+}
+
+/*----------------------------------------------------------------------
+ * Client
+ */
+
+int run_client(int argc, char **argv) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    struct sockaddr_un addr;
+    make_addr(&addr, get_server_socket());
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || !same_user(sock)) {
+        close(sock);
+        return -1;
+    }
+    String *req = make_string();
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        error("getcwd failed");
+    string_appendf(req, "%s", cwd);
+    string_append(req, '\0');
+    for (int i = 0; i < argc; i++) {
+        string_appendf(req, "%s", argv[i]);
+        string_append(req, '\0');
+    }
+    unsigned char status;
+    if (!send_request(sock, req) || !read_all(sock, (char *)&status, 1))
+        error("lost connection to the compile server");
+    close(sock);
+    return status;
+}
+
+/*----------------------------------------------------------------------
+ * Server
+ */
+
+// Runs in a child of the server. The compilation itself runs in a
+// grandchild, so that its exit status can be sent back even if it
+// calls exit() from deep inside the compiler.
+static void serve(int conn, int (*compile)(int argc, char **argv)) {
+    signal(SIGCHLD, SIG_DFL);
+    List *req = read_request(conn);
+    if (!req || list_len(req) < 2 || chdir(list_shift(req)) < 0)
+        exit(1);
+    int argc = list_len(req);
+    char **argv = malloc(sizeof(char *) * (argc + 1));
+    for (int i = 0; i < argc; i++)
+        argv[i] = list_shift(req);
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0)
+        exit(1);
+    if (pid == 0) {
+        close(conn);
+        exit(compile(argc, argv));
+    }
+    int status;
+    char r = 1;
+    if (waitpid(pid, &status, 0) == pid && WIFEXITED(status))
+        r = WEXITSTATUS(status);
+    write_all(conn, &r, 1);
+    exit(0);
+}
+
+static void read_reports(int fd) {
+    static String *buf;
+    if (!buf)
+        buf = make_string();
+    char tmp[4096];
+    int n = read(fd, tmp, sizeof(tmp));
+    for (int i = 0; i < n; i++) {
+        if (tmp[i] != '\n') {
+            string_append(buf, tmp[i]);
+            continue;
+        }
+        cache_reported_file(get_cstring(buf));
+        buf = make_string();
+    }
+}
+
+static void remove_socket(void) {
+    // Children inherit atexit handlers.
+    if (getpid() == server_pid)
+        unlink(server_socket);
+}
+
+// exit() is not async-signal-safe, so this removes the socket itself
+// and then dies of the signal.
+static void handle_signal(int sig) {
+    if (getpid() == server_pid)
+        unlink(server_socket);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void run_server(int (*compile)(int argc, char **argv)) {
+    if (!getenv("EIGHTCC_SOCKET"))
+        make_socket_dir();
+    server_socket = get_server_socket();
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        error("socket failed: %s", strerror(errno));
+    struct sockaddr_un addr;
+    make_addr(&addr, server_socket);
+    remove_stale_socket(server_socket);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("cannot bind to %s: %s", server_socket, strerror(errno));
+    if (listen(sock, 64) < 0)
+        error("listen failed: %s", strerror(errno));
+    server_pid = getpid();
+    if (atexit(remove_socket))
+        perror("atexit");
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    int reports[2];
+    if (pipe(reports) < 0)
+        error("pipe failed: %s", strerror(errno));
+    // Children are never waited for.
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        struct pollfd fds[] = {
+            { .fd = sock, .events = POLLIN },
+            { .fd = reports[0], .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error("poll failed: %s", strerror(errno));
+        }
+        if (fds[1].revents & POLLIN)
+            read_reports(reports[0]);
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0)
+            continue;
+        if (!same_user(conn)) {
+            close(conn);
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            close(reports[0]);
+            set_file_report_fd(reports[1]);
+            serve(conn, compile);
+        }
+        close(conn);
+    }
+}
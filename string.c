@@ -9,8 +9,8 @@
 #define INIT_SIZE 8
 
 String *make_string(void) {
-    String *r = malloc(sizeof(String));
-    r->body = malloc(INIT_SIZE);
+    String *r = arena_malloc(sizeof(String));
+    r->body = arena_malloc(INIT_SIZE);
     r->nalloc = INIT_SIZE;
     r->len = 0;
     r->body[0] = '\0';
@@ -19,8 +19,8 @@ String *make_string(void) {
 
 static void realloc_body(String *s) {
     int newsize = s->nalloc * 2;
-    char *body = malloc(newsize);
-    strcpy(body, s->body);
+    char *body = arena_malloc(newsize);
+    memcpy(body, s->body, s->len + 1);
     s->body = body;
     s->nalloc = newsize;
 }
@@ -109,7 +109,234 @@ testfail '&"a";'
 testfail '&1;'
 testfail '&a();'
 
+# Duplicate case values
+testfail 'switch(1){case 1: case 1:;}'
+testfail 'switch(1){case 1 ... 3: case 2:;}'
+
 # -D command line options
 testcpp '77' 'foo' '-Dfoo=77'
 
+# -ftrace
+echo '#include <stdbool.h>
+int f(){return 0;}' | ./8cc -ftrace=tmp.json -S -o /dev/null - || fail "Failed to write a trace"
+grep -q '"name": "./include/stdbool.h", "ph": "B"' tmp.json || fail "No include event in trace"
+grep -q '"name": "f", "ph": "X"' tmp.json || fail "No function event in trace"
+
+# Multiple input files
+echo 'int f(){return 1;}' > tmp.1.c
+echo 'int g(){return 2;}' > tmp.2.c
+echo 'int h(){' > tmp.3.c
+rm -f tmp.1.o tmp.2.o tmp.3.o
+./8cc -j 2 -c tmp.1.c tmp.2.c || fail "Failed to compile multiple files"
+[ -f tmp.1.o -a -f tmp.2.o ] || fail "Missing output of multiple files"
+./8cc -j 2 -c tmp.1.c tmp.3.c 2> /dev/null && fail "Should fail to compile, but succeeded: tmp.3.c"
+[ -f tmp.3.o ] && fail "Object file left behind by a failed compile"
+
+# Assembler output
+PATH= ./8cc -c -o tmp.x.o tmp.1.c || fail "Failed to assemble tmp.1.c"
+nm tmp.x.o | grep -q ' T f$' || fail "Missing symbol in tmp.x.o"
+./8cc -fno-integrated-as -c -o tmp.y.o tmp.1.c || fail "Failed to assemble tmp.1.c with as"
+nm tmp.y.o | grep -q ' T f$' || fail "Missing symbol in tmp.y.o"
+
+# -fcache
+rm -rf tmp.cache
+./8cc -fcache=tmp.cache -S -o tmp.c1.s tmp.1.c || fail "-fcache: failed to compile"
+./8cc -fcache=tmp.cache -S -o tmp.c2.s tmp.1.c || fail "-fcache: failed to compile"
+cmp -s tmp.c1.s tmp.c2.s || fail "-fcache: different output on a hit"
+assertequal "$(ls tmp.cache | wc -l)" 1
+./8cc -fcache=tmp.cache -c -o tmp.c1.o tmp.1.c
+./8cc -fcache=tmp.cache -S -o tmp.c3.s -Df=g tmp.1.c
+assertequal "$(ls tmp.cache | wc -l)" 3
+./8cc -fcache=tmp.cache -fcache-size=1 -S -o tmp.c4.s tmp.2.c
+assertequal "$(ls tmp.cache | wc -l)" 1
+echo 'int f(void) { return g(); }' > tmp.c5.c
+./8cc -fcache=tmp.cache -S -o tmp.c5.s tmp.c5.c 2> tmp.c5.1
+./8cc -fcache=tmp.cache -S -o tmp.c5.s tmp.c5.c 2> tmp.c5.2
+grep -q 'assume returning int: g()' tmp.c5.1 || fail "-fcache: missing warning"
+cmp -s tmp.c5.1 tmp.c5.2 || fail "-fcache: different diagnostics on a hit"
+rm -rf tmp.cache
+
+# -fincremental
+echo 'struct S { int a; };
+int f(struct S *s) { return s->a ? 3 : 4; }
+int g(void) { return 1; }' > tmp.inc.c
+fingerprints() {
+    grep -o '^[0-9a-f]\{64\} ' tmp.inc.s.fncache | sort
+}
+./8cc -fincremental -S -o tmp.inc.s tmp.inc.c || fail "-fincremental: failed to compile"
+fingerprints > tmp.inc.1
+sed -i 's/return 1/return 2/' tmp.inc.c
+./8cc -fincremental -S -o tmp.inc.s tmp.inc.c
+./8cc -S -o tmp.inc2.s tmp.inc.c
+cmp -s tmp.inc.s tmp.inc2.s || fail "-fincremental: different output"
+fingerprints > tmp.inc.2
+assertequal "$(comm -12 tmp.inc.1 tmp.inc.2 | wc -l)" 1
+sed -i 's/int a/long a/' tmp.inc.c
+./8cc -fincremental -S -o tmp.inc.s tmp.inc.c
+assertequal "$(fingerprints | comm -12 tmp.inc.2 - | wc -l)" 1
+
+# -fpipeline
+echo '#include <stdbool.h>
+struct S { int a; long b; } x;
+bool f(struct S *s) { return s->a; }
+int g(void) { struct S { int c; }; return sizeof(struct S); }
+int h(void) { return y; }' > tmp.p.c
+./8cc -S -o tmp.p1.s -Dy=1 tmp.p.c
+./8cc -fpipeline -S -o tmp.p2.s -Dy=1 tmp.p.c || fail "-fpipeline: failed to compile"
+cmp -s tmp.p1.s tmp.p2.s || fail "-fpipeline: different output"
+./8cc -fpipeline -S -o tmp.p2.s tmp.p.c 2>&1 | grep -q 'tmp.p.c:5:' || fail "-fpipeline: wrong error position"
+echo 'int f(int x) {
+  switch (x) { case 1: case 1: return 2; }
+  return 0;
+}
+int g(void) { return 0; }
+#error stop' > tmp.p4.c
+./8cc -fpipeline -S -o tmp.p4.s tmp.p4.c 2>&1 | grep -q 'tmp.p4.c:4:' || fail "-fpipeline: wrong codegen error position"
+sed -i 's/case 1: case 1/case 1: case 2/' tmp.p4.c
+./8cc -fpipeline -S -o tmp.p4.s tmp.p4.c 2>/dev/null && fail "-fpipeline: #error ignored"
+
+# -fcodegen-threads
+./8cc -fcodegen-threads=3 -S -o tmp.p3.s -Dy=1 tmp.p.c || fail "-fcodegen-threads: failed to compile"
+cmp -s tmp.p1.s tmp.p3.s || fail "-fcodegen-threads: different output"
+./8cc -c -o tmp.p1.o -Dy=1 tmp.p.c
+./8cc -fcodegen-threads=2 -fpipeline -c -o tmp.p3.o -Dy=1 tmp.p.c
+cmp -s tmp.p1.o tmp.p3.o || fail "-fcodegen-threads: different object"
+
+# -fprefetch-headers
+echo '#define X 5' > tmp.pf.h
+echo '#include "tmp.pf.h"
+#include <stdbool.h>
+bool x = X;' > tmp.pf.c
+assertequal "$(./8cc -fprefetch-headers -S -o - tmp.pf.c | grep -c 'byte 1')" 1
+
+# -fshared-headers
+export EIGHTCC_SHM=/8cc-test-$$
+echo '#ifndef TMP_SH_H
+#define TMP_SH_H
+int x = 5;
+#endif' > tmp.sh.h
+echo '+ 1' > tmp.sh2.h
+echo '#include "tmp.sh.h"
+#include "tmp.sh.h"
+int y = 1
+#include "tmp.sh2.h"
+#include "tmp.sh2.h"
+;' > tmp.sh.c
+./8cc -S -o tmp.sh1.s tmp.sh.c
+./8cc -fshared-headers -S -o tmp.sh2.s tmp.sh.c
+./8cc -fshared-headers -S -o tmp.sh3.s tmp.sh.c
+cmp -s tmp.sh1.s tmp.sh2.s || fail "-fshared-headers: different output"
+cmp -s tmp.sh1.s tmp.sh3.s || fail "-fshared-headers: different output when cached"
+assertequal "$(grep -c 'long 3' tmp.sh3.s)" 1
+sed -i 's/5/77/' tmp.sh.h
+assertequal "$(./8cc -fshared-headers -S -o - tmp.sh.c | grep -c 'long 77')" 1
+echo 'int a = __LINE__;
+#line 50
+int b = __LINE__;
+#if 0
+#error no
+#elif 1
+int c = __LINE__;
+#endif' > tmp.sh3.h
+echo "#if 0
+don't
+#endif
+int d = __LINE__;" > tmp.sh4.h
+echo '#include "tmp.sh3.h"
+#include "tmp.sh4.h"' > tmp.sh4.c
+./8cc -E tmp.sh4.c > tmp.sh1.i
+./8cc -fshared-headers -E tmp.sh4.c > tmp.sh2.i
+./8cc -fshared-headers -E tmp.sh4.c > tmp.sh3.i
+cmp -s tmp.sh1.i tmp.sh2.i || fail "-fshared-headers: different tokens"
+cmp -s tmp.sh1.i tmp.sh3.i || fail "-fshared-headers: different tokens when cached"
+assertequal "$(grep -c 'int c = 54' tmp.sh3.i)" 1
+rm -f /dev/shm/8cc-test-$$
+unset EIGHTCC_SHM
+
+# IR passes
+echo 'int f(int x) { if (x) return 1; return 2; }' > tmp.ir.c
+assertequal "$(./8cc -O0 -S -o - tmp.ir.c | grep -c 'ret ')" 3
+assertequal "$(./8cc -S -o - tmp.ir.c | grep -c 'ret ')" 2
+./8cc -fdump-ir -S -o /dev/null tmp.ir.c 2> tmp.ir.out
+grep -q '^function f$' tmp.ir.out || fail "-fdump-ir: no function"
+grep -q '^bb3 .Lf.0 ; preds: bb1 succs: -$' tmp.ir.out || fail "-fdump-ir: no block"
+echo 'int f(int a, int b, int c, int d) { return (a * b) / (c - d) + (a ^ c) * (b | d); }' > tmp.ir.c
+./8cc -O0 -S -o tmp.ir.s tmp.ir.c
+assertequal "$(grep -c 'mov %rax, %r10' tmp.ir.s)" 1
+grep -q '%v' tmp.ir.s && fail "virtual register in the output"
+echo 'int g(int); int f(int x) { return g(x + 1); }' > tmp.ir.c
+assertequal "$(./8cc -O0 -S -o - tmp.ir.c | grep -c 'push %rax')" 1
+assertequal "$(./8cc -S -o - tmp.ir.c | grep -c 'push %rax')" 0
+./8cc -fpeephole-stats -S -o /dev/null tmp.ir.c 2> tmp.ir.out
+grep -q '^  push-pop  *1$' tmp.ir.out || fail "-fpeephole-stats: no push-pop"
+
+# Switch lowering
+echo 'int f(int x) { switch (x) { case 1: case 2: case 4: case 5: return 1; } return 0; }' > tmp.sw.c
+assertequal "$(./8cc -S -o - tmp.sw.c | grep -c '^\.section \.rodata')" 1
+echo 'int f(int x) { switch (x) { case 1: case 20: case 400: case 8000: return 1; } return 0; }' > tmp.sw.c
+assertequal "$(./8cc -S -o - tmp.sw.c | grep -c '^\.section \.rodata')" 0
+
+# Strength reduction
+echo 'int f(int x, unsigned long y) { return x * 10 + x / 7 + x % 8 + y / 3; }' > tmp.sr.c
+assertequal "$(./8cc -S -o - tmp.sr.c | grep -c 'idiv\|imul %rcx, %rax')" 0
+
+# Integer widths
+echo 'int f(int a, int b) { return a / b; } unsigned g(unsigned a, unsigned b) { return a % b; }' > tmp.w.c
+./8cc -S -o tmp.w.s tmp.w.c
+assertequal "$(grep -c 'cltd\|idiv %ecx\|xor %edx, %edx\|div %ecx' tmp.w.s)" 4
+assertequal "$(grep -c 'cqto\|idiv %rcx' tmp.w.s)" 0
+
+# Compare and branch
+echo 'int f(int n, double x, double y) { int s = 0; for (int i = 0; i < n && x < y; i++) s += i; return s; }' > tmp.cb.c
+./8cc -S -o tmp.cb.s tmp.cb.c
+assertequal "$(grep -c 'set\|movzb' tmp.cb.s)" 0
+assertequal "$(grep -c 'jge \|jbe ' tmp.cb.s)" 2
+
+# Direct operands
+echo 'long g; int f(int x, long *p) { g++; return (x + 1 < 10) + (*p == 0) + (g & 8); }' > tmp.op.c
+./8cc -S -o tmp.op.s tmp.op.c
+assertequal "$(grep -c 'push %rax\|mov \$' tmp.op.s)" 0
+assertequal "$(grep -c 'addq \$1, g(%rip)\|add \$1, %eax\|cmp \$10, %eax\|test %rax, %rax\|and \$8, %rax' tmp.op.s)" 5
+
+# Addressing modes
+echo 'struct s { int a, b[4]; }; int f(int *p, int i, struct s *q) { return p[i] + q->b[2]; }' > tmp.am.c
+./8cc -S -o tmp.am.s tmp.am.c
+assertequal "$(grep -c 'movslq 0(%[a-z0-9]*,%[a-z0-9]*,4), %rax\|movslq 12(%[a-z0-9]*), %rax' tmp.am.s)" 2
+assertequal "$(grep -c 'sal \|lea \|imul ' tmp.am.s)" 0
+
+# Function bodies are freed after they are emitted
+for i in $(seq 2000); do
+    echo "int f$i(int a) { int s = 0; for (int i = 0; i < a; i++) s += i * $i; return s; }"
+done > tmp.big.c
+(ulimit -v 65536; ./8cc -S -o tmp.big.s tmp.big.c) || fail "Peak memory grows with the number of functions"
+
+# -run
+echo 'extern void *stderr;
+int main(int argc, char **argv) {
+    printf("%s %d\n", argv[1], argc);
+    fprintf(stderr, "%d", getpid());
+    return 3;
+}' > tmp.run.c
+out=$(./8cc -run tmp.run.c hello -x 2> tmp.pid)
+[ $? -eq 3 ] || fail "-run: wrong exit status"
+assertequal "$out" "hello 3"
+perfmap=/tmp/perf-$(tail -c 10 tmp.pid | grep -o '[0-9]*$').map
+grep -q ' main$' $perfmap || fail "-run: no perf map"
+rm -f $perfmap
+
+# Compile server
+EIGHTCC_SOCKET=tmp.sock ./8cc --server &
+server=$!
+for i in 1 2 3 4 5; do [ -S tmp.sock ] && break; sleep 0.1; done
+[ -S tmp.sock ] || fail "Compile server did not start"
+assertequal "$(echo 'int x = 77;' | EIGHTCC_SOCKET=tmp.sock ./8cc --client -S -o - - | grep -c 'long 77')" 1
+echo 'int f(){' | EIGHTCC_SOCKET=tmp.sock ./8cc --client -S -o /dev/null - 2> /dev/null && fail "Compile server should fail"
+kill $server
+wait $server 2> /dev/null
+[ -e tmp.sock ] && fail "Compile server did not remove its socket"
+touch tmp.sock
+EIGHTCC_SOCKET=tmp.sock ./8cc --server 2> /dev/null && fail "Compile server should not remove a file"
+[ -f tmp.sock ] || fail "Compile server removed a file"
+rm -f tmp.sock
+
 echo "All tests passed"
@@ -39,6 +39,64 @@ void test_inc_dec(void) {
     expect(15, a);
 }
 
+static int gi = 5;
+static long gl;
+
+// Variables in registers, on the stack and in memory are updated in place.
+void test_inc_dec_vars(void) {
+    char c = 127;
+    expect(127, c++);
+    expect(-128, c);
+    expect(127, --c);
+    int x[] = { 1, 2, 3 };
+    int *p = x;
+    expect(1, *p++);
+    expect(3, *++p);
+    expect(2, *--p);
+    int m = 10, *mp = &m;
+    expect(10, m++);
+    expect(12, ++*mp);
+    expect(12, m);
+    expect(5, gi++);
+    expect(5, --gi);
+    gl = 1L << 40;
+    expectl((1L << 40) + 1, ++gl);
+    expectl((1L << 40) + 1, gl--);
+    expectl(1L << 40, gl);
+}
+
+// The right operands of these are taken as immediates or directly from
+// where the variable is.
+void test_direct_operands(void) {
+    int a = 6, b = 3;
+    long l = 100, *lp = &l;
+    expect(7, a + 1);
+    expect(3, a - b);
+    expect(2, a & b);
+    expect(7, a | 1);
+    expect(5, a ^ b);
+    expect(24, a << 2);
+    expect(-2, -8 >> 2);
+    expectl(106, l + a);
+    expectl(600, l * a);
+    expectl(103, *lp + b);
+    expectl(1000, *lp + l * 9);
+    expectl(1L << 40, gl - 0);
+    expect(6, gi + 1);
+    expect(1, a > 5);
+    expect(0, a < b);
+    expect(1, a != 0);
+    expect(0, a == 0);
+    expect(1, l >= gl - gl);
+    expect(1, gi == 5);
+    int x[4];
+    int *p = x + 1, *q = x + 3;
+    expect(1, p < q);
+    expect(1, p != 0);
+    expect(0, p == 0);
+    expect(1, *(q - 2) == *p);
+}
+
 void test_bool(void) {
     expect(0, !1);
     expect(1 ,!0);
@@ -57,12 +115,129 @@ void test_comma(void) {
     expectf(7.0, (1, 3, 5, 7.0));
 }
 
+#define E1(a, b, c, d) (((a) * (b)) - ((c) + (d)))
+#define E2(a, b, c, d) (E1(a, b, c, d) + E1(b, d, a, c))
+#define E3(a, b, c, d) (E2(a, b, c, d) - E2(c, a, d, b))
+#define E4(a, b, c, d) (E3(a, b, c, d) + E3(d, b, c, a))
+#define E5(a, b, c, d) (E4(a, b, c, d) - E4(b, a, c, d))
+#define E6(a, b, c, d) (E5(a, b, c, d) + E5(a, c, b, d))
+#define E7(a, b, c, d) (E6(a, b, c, d) - E6(d, c, b, a))
+
+static int id(int x) { return x; }
+
+void test_temporaries(void) {
+    int a = 1, b = 2, c = 3, d = 5;
+    expect(-8, E4(a, b, c, d));
+    // Needs more scratch registers than there are
+    expect(56, E7(a, b, c, d));
+    expect(66, E3(a, b, c, d) * id(E2(d, c, b, a)) - id(7) * (E2(a, b, c, d) + id(2)));
+    int x[] = { 1, 2, 3, 4 };
+    int *p = x;
+    expect(4, *(p + (a + b)));
+    expect(1, (a < b) + (c > d) * (a == b));
+}
+
+// Multiplication and division by constants are lowered to shifts and
+// multiplications, which must round as idiv does.
+void test_const_operands(void) {
+    int a = 7, b = -7, min = -2147483647 - 1;
+    long l = -1234567890123L;
+    unsigned int u = 4000000000u;
+    unsigned long ul = 9000000000000000000UL * 2;
+    expect(63, a * 9);
+    expect(-84, 12 * b);
+    expect(-35, b * 5);
+    expect(700, a * 100);
+    expectl(-4938271560492L, l * 4);
+    expect(2, a / 3);
+    expect(-2, b / 3);
+    expect(1, a % 3);
+    expect(-1, b % 3);
+    expect(3, a / 2);
+    expect(-3, b / 2);
+    expect(-1, b % 2);
+    expect(-3, b % 4);
+    expect(-306783378, min / 7);
+    expect(-2, min % 7);
+    expect(min, min / 1);
+    expectl(-176366841L, l / 7000);
+    expectl(-123, l % 1000);
+    expectl(-77160493132L, l / 16);
+    expect(571428571, u / 7);
+    expect(3, u % 7);
+    expect(15625000, u / 256);
+    expectl(1800000000000000000L, ul / 10);
+    expectl(5, ul % 13);
+    int x[] = { 1, 2, 3, 4 };
+    struct { int a, b, c; } s[] = { { 1, 2, 3 }, { 4, 5, 6 } };
+    expect(4, *(x + 3));
+    expect(6, (s + 1)->c);
+}
+
+// int is computed in 32 bits, and unsigned operands are divided as
+// unsigned.
+void test_widths(void) {
+    int a = -7, b = 2, max = 2147483647;
+    unsigned u = 4000000000u, v = 3;
+    unsigned long ul = 18000000000000000000UL, w = 7;
+    long l = -7;
+    expect(-3, a / b);
+    expect(-1, a % b);
+    expect(1333333333, u / v);
+    expect(1, u % v);
+    expectl(2571428571428571428L, ul / w);
+    expectl(4, ul % w);
+    expectl(-3, l / b);
+    expect(-2147483648, max + 1);
+    expectl(-2147483648L, (long)(max + 1));
+    expectl(2147483648L, (long)max + 1);
+    expect(1431655764, -4u / v);
+    char c = 16;
+    expect(256, c << 4);
+    int i = -1;
+    int arr[] = { 1, 2, 3 };
+    int *p = arr + 1;
+    expect(1, p[i]);
+    expect(1, *(p + i));
+    expect(3, p[i + 2]);
+}
+
+// ++ and -- on a narrow lvalue that is not a variable wrap around in
+// the type of the lvalue.
+void test_narrow_inc_dec(void) {
+    struct S { int x; unsigned short y; } ss[3] = { {0, 0}, {1, 2}, {5, 65535} };
+    int i = 1;
+    if (++ss[i + 1].y)
+        fail("++ss[i + 1].y");
+    expect(0, ss[2].y);
+    unsigned char buf[1] = { 0 };
+    unsigned char *p = buf;
+    expectl(255, (unsigned long)--p[0]);
+    signed char sc[1] = { 127 };
+    expect(-128, ++sc[0]);
+    unsigned long v = 0x8000000000000001UL;
+    v >>= 15;
+    expectl(0x1000000000000L, v);
+    long l = -0x10000;
+    l >>= 4;
+    expectl(-0x1000, l);
+    unsigned u = 0x80000000;
+    u >>= 31;
+    expect(1, u);
+}
+
 void testmain(void) {
     print("basic arithmetic");
     test_basic();
     test_relative();
     test_inc_dec();
+    test_inc_dec_vars();
+    test_direct_operands();
     test_bool();
     test_ternary();
     test_comma();
+    test_temporaries();
+    test_const_operands();
+    test_widths();
+    test_narrow_inc_dec();
 }
@@ -59,6 +59,42 @@ void t7(void) {
     expect(68, a[8]);
 }
 
+struct pt { short tag; long v[3]; };
+static struct pt gpts[4];
+static int gints[5];
+
+// Indexing and fields folded into addressing modes
+void t8(void) {
+    struct pt pts[3];
+    struct pt *p = pts;
+    for (int i = 0; i < 3; i++) {
+        p[i].tag = i;
+        for (int j = 0; j < 3; j++)
+            p[i].v[j] = i * 10 + j;
+    }
+    int i = 2;
+    expect(2, pts[i].tag);
+    expectl(21, p[i].v[1]);
+    expectl(12, pts[1].v[i]);
+    expectl(22, (p + 1)[1].v[2]);
+    expectl(11, *(&p[1].v[0] + 1));
+    for (int j = 0; j < 5; j++)
+        gints[j] = j * j;
+    expect(9, gints[i + 1]);
+    expect(16, gints[4]);
+    gpts[i].v[i] = 7;
+    gpts[3] = pts[1];
+    expectl(7, gpts[2].v[2]);
+    expectl(10, gpts[3].v[0]);
+    expect(1, gpts[3].tag);
+    double d[3];
+    float f[3];
+    d[i] = 1.5;
+    f[i - 1] = 2.5;
+    expectd(1.5, d[2]);
+    expectf(2.5, f[1]);
+}
+
 void testmain(void) {
     print("array");
     t1();
@@ -67,4 +103,5 @@ void testmain(void) {
     t4();
     t5();
     t6();
+    t8();
 }
@@ -23,6 +23,17 @@ void testmain(void) {
     int i = -1;
     expect(0, i >= 0);
 
+    unsigned u = -1;
+    expect(1, u > 1);
+    expect(0, u < 0x7fffffff);
+    expect(1, u >= i);
+    unsigned long ul = -1;
+    expect(1, ul > 1);
+    unsigned char uc = 200;
+    expect(1, uc - 201 < 0);
+    char *p = (char *)0x80000000L, *q = (char *)0x10L;
+    expect(1, p > q);
+
     expect(1, 10.0 == 10.0);
     expect(0, 10.0 == 20.0);
     expect(0, 10.0 != 10.0);
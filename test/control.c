@@ -130,6 +130,14 @@ void test_do(void) {
     i = 70;
     do i++; while (v -= 0.5);
     expect(72, i);
+
+    acc = 0;
+    i = 0;
+    do {
+        if (i % 2) continue;
+        acc += i;
+    } while (++i < 10);
+    expect(20, acc);
 }
 
 void test_switch(void) {
@@ -195,6 +203,161 @@ void test_switch(void) {
         ;
 }
 
+static int switch_dense(int x) {
+    switch (x) {
+    case -2: return 1;
+    case -1: return 2;
+    case 0: return 3;
+    default: return 9;
+    case 2: return 4;
+    case 4 ... 6: return 5;
+    }
+}
+
+static int switch_sparse(int x) {
+    int r = 0;
+    switch (x) {
+    case 1000000: r = 1; break;
+    case -7: r = 2; break;
+    case 12: r = 3; break;
+    case 300 ... 400: r = 4; break;
+    case 5000: r = 5;
+    case 77777: r += 6; break;
+    case 2147483647: r = 7; break;
+    case -2147483647 - 1: r = 8; break;
+    }
+    return r;
+}
+
+static int switch_nested(int x, int y) {
+    switch (x) {
+    case 1:
+        switch (y) {
+        case 1: return 11;
+        case 2: return 12;
+        case 3: return 13;
+        case 4: return 14;
+        }
+        return 10;
+    case 2: return 20;
+    case 3: return 30;
+    case 4: return 40;
+    }
+    return 0;
+}
+
+static int switch_long(long x) {
+    switch (x) {
+    case 0: return 1;
+    case 1: return 2;
+    case 2: return 3;
+    case 3: return 4;
+    case 0x100000000L: return 5;
+    case -0x100000000L: return 6;
+    }
+    return 0;
+}
+
+static int switch_long_sparse(long x) {
+    switch (x) {
+    case 1: return 1;
+    case 1000: return 2;
+    case 0x7fffffffffffffffL: return 3;
+    case 0x100000005L ... 0x100000009L: return 4;
+    case -5: return 5;
+    }
+    return 0;
+}
+
+static int switch_unsigned(unsigned x) {
+    switch (x) {
+    case 1: return 1;
+    case 0x80000000: return 2;
+    case 0xfffffff0 ... 0xffffffff: return 3;
+    case 100: return 4;
+    case 7: return 5;
+    }
+    return 0;
+}
+
+static int switch_ulong(unsigned long x) {
+    switch (x) {
+    case 1: return 1;
+    case 0x8000000000000000UL: return 2;
+    case 0xfffffffffffffff0UL ... 0xffffffffffffffffUL: return 3;
+    case 100: return 4;
+    case 7: return 5;
+    }
+    return 0;
+}
+
+static int switch_truncated(long x) {
+    switch ((int)x) {
+    case 0: return 1;
+    case 1: return 2;
+    case 2: return 3;
+    case 3: return 4;
+    }
+    return 0;
+}
+
+void test_switch_lowering(void) {
+    expect(1, switch_dense(-2));
+    expect(3, switch_dense(0));
+    expect(9, switch_dense(1));
+    expect(4, switch_dense(2));
+    expect(9, switch_dense(3));
+    expect(5, switch_dense(5));
+    expect(9, switch_dense(7));
+    expect(9, switch_dense(-3));
+    expect(9, switch_dense(-2147483647 - 1));
+    expect(1, switch_sparse(1000000));
+    expect(2, switch_sparse(-7));
+    expect(3, switch_sparse(12));
+    expect(0, switch_sparse(13));
+    expect(4, switch_sparse(300));
+    expect(4, switch_sparse(400));
+    expect(0, switch_sparse(401));
+    expect(11, switch_sparse(5000));
+    expect(6, switch_sparse(77777));
+    expect(7, switch_sparse(2147483647));
+    expect(8, switch_sparse(-2147483647 - 1));
+    expect(0, switch_sparse(0));
+    expect(13, switch_nested(1, 3));
+    expect(10, switch_nested(1, 5));
+    expect(40, switch_nested(4, 1));
+    expect(0, switch_nested(5, 1));
+    expect(2, switch_long(1));
+    expect(0, switch_long(0x100000001L));
+    expect(0, switch_long(-0x100000000L + 1));
+    expect(5, switch_long(0x100000000L));
+    expect(6, switch_long(-0x100000000L));
+    expect(0, switch_long(-1));
+    expect(1, switch_long_sparse(1));
+    expect(0, switch_long_sparse(0x100000001L));
+    expect(3, switch_long_sparse(0x7fffffffffffffffL));
+    expect(4, switch_long_sparse(0x100000007L));
+    expect(0, switch_long_sparse(7));
+    expect(5, switch_long_sparse(-5));
+    expect(0, switch_long_sparse(0xfffffffbL));
+    expect(1, switch_unsigned(1));
+    expect(2, switch_unsigned(0x80000000));
+    expect(3, switch_unsigned(0xffffffff));
+    expect(3, switch_unsigned(0xfffffff0));
+    expect(0, switch_unsigned(0xffffff00));
+    expect(5, switch_unsigned(7));
+    expect(0, switch_unsigned(8));
+    expect(1, switch_ulong(1));
+    expect(2, switch_ulong(0x8000000000000000UL));
+    expect(3, switch_ulong(-1));
+    expect(0, switch_ulong(-17));
+    expect(4, switch_ulong(100));
+    expect(0, switch_ulong(0x80000000));
+    expect(2, switch_truncated(0x100000001L));
+    expect(0, switch_truncated(4294967298L + 2));
+    expect(3, switch_truncated(4294967298L));
+}
+
 void test_goto(void) {
     int acc = 0;
     goto x;
@@ -238,6 +401,34 @@ void test_logor(void) {
     expect(0, 0 || 0);
 }
 
+static int count_if(int a, int b, unsigned u, double x, double y) {
+    int r = 0;
+    if (a < b && b < 10) r += 1;
+    if (a > b || u > 5) r += 2;
+    if (!(a == b) && !(x != y)) r += 4;
+    if (x < y) r += 8;
+    if (x >= y) r += 16;
+    if (x == y || (a && !b)) r += 32;
+    return r;
+}
+
+void test_branch(void) {
+    double nan = 0.0 / 0.0;
+    expect(1 + 2 + 4 + 16 + 32, count_if(1, 2, -1, 1.0, 1.0));
+    expect(8, count_if(3, 3, 0, 1.0, 2.0));
+    expect(2, count_if(3, 3, 6, nan, 1.0));
+    expect(2 + 32, count_if(1, 0, 0, 1.0, nan));
+    expect(0, nan == nan);
+    expect(1, nan != nan);
+    expect(0, nan < 1.0 || nan >= 1.0);
+    expect(1, nan ? 1 : 0);
+    int n = 0;
+    for (int i = 0; i < 10 && n < 3; i++)
+        n += (i & 1) || i == 4;
+    expect(3, n);
+    expect(7, (1 < 2 && 3 > 2) ? 7 : 8);
+}
+
 void testmain(void) {
     print("control flow");
     test_if();
@@ -245,7 +436,9 @@ void testmain(void) {
     test_while();
     test_do();
     test_switch();
+    test_switch_lowering();
     test_goto();
     test_computed_goto();
     test_logor();
+    test_branch();
 }
@@ -20,8 +20,72 @@ void test_float(void) {
     expectf(4, b);
 }
 
+static double gd = 2.5;
+
+void test_int(void) {
+    int i = -3;
+    unsigned u = 4000000000u;
+    long l = i;
+    expectl(-3, l);
+    l = u;
+    expectl(4000000000L, l);
+    l = i * 1000000000;
+    expectl(1294967296, l);
+    unsigned char uc = 200;
+    unsigned short us = 60000;
+    expect(200, uc);
+    expect(60000, us);
+    expectl(200, (long)uc);
+    int big = 300;
+    expect(44, (char)big);
+    expect(44, (unsigned char)big);
+    expect(-5536, (short)60000);
+    expectl(-1, (long)(char)255);
+    expectf(4000000000.0, u);
+    expectf(3.0, -i);
+    expectf(2.5, gd);
+    double d = 3000000000.0;
+    expectl(3000000000L, (long)d);
+    d = 0 - 7.9;
+    expect(-7, (int)d);
+}
+
+// Of a signed and an unsigned type of different rank but the same
+// width, the unsigned type of the higher rank is used.
+void test_common_type(void) {
+    unsigned long ul = 1;
+    long long ll = -1;
+    unsigned long long ull = 1;
+    long l = -1;
+    expect(0, ll < ul);
+    expect(0, l < ull);
+    expect(1, ll + ul == 0);
+    expect(8, sizeof(ll + ul));
+    unsigned u = 1;
+    expect(1, l < u);
+    expect(0, -1 < u);
+}
+
+// Operands of shifts and unary - and ~ are promoted before the operator
+// is chosen.
+void test_promoted_operand(void) {
+    unsigned short us = 1;
+    unsigned char uc = 0;
+    expect(-1, (-us) >> 3);
+    expect(-1, ~us >> 3);
+    expect(-1, ~uc);
+    expect(4, sizeof(-uc));
+    expect(4, sizeof(~us));
+    us = 65535;
+    expect(8191, us >> 3);
+    expect(-65535, -us);
+}
+
 void testmain(void) {
     print("type conversion");
     test_bool();
     test_float();
+    test_int();
+    test_common_type();
+    test_promoted_operand();
 }
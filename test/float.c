@@ -16,8 +16,26 @@ double recursive(double a) {
     return recursive(3.33);
 }
 
+#define E1(a, b, c, d) (((a) * (b)) - ((c) + (d)))
+#define E2(a, b, c, d) (E1(a, b, c, d) + E1(b, d, a, c))
+#define E3(a, b, c, d) (E2(a, b, c, d) - E2(c, a, d, b))
+#define E4(a, b, c, d) (E3(a, b, c, d) + E3(d, b, c, a))
+#define E5(a, b, c, d) (E4(a, b, c, d) - E4(b, a, c, d))
+#define E6(a, b, c, d) (E5(a, b, c, d) + E5(a, c, b, d))
+#define E7(a, b, c, d) (E6(a, b, c, d) - E6(d, c, b, a))
+#define E8(a, b, c, d) (E7(a, b, c, d) + E7(b, d, c, a))
+
+void test_temporaries(void) {
+    double a = 0.5, b = 1.5, c = 2.0, d = 3.25;
+    expectd(7.25, E5(a, b, c, d));
+    // Needs more scratch registers than there are
+    expectd(15.75, E8(a, b, c, d));
+    expect(1, (a + b) * c > (c - a) * b);
+}
+
 void testmain(void) {
     print("float");
+    test_temporaries();
 
     expect(0.7, .7);
     float v1 = 10.0;
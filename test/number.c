@@ -8,6 +8,9 @@ void testmain(void) {
 
     expect(1, 0x1);
     expect(17, 0x11);
+    expect(0x2e, 46);
+    expect(0x1E5, 485);
+    expectl(0x2de92c6fL, 770255983L);
     expect(511, 0777);
     expect(11, 0b1011);  // GNU extension
 
@@ -21,6 +24,9 @@ void testmain(void) {
 
     expectd(55.3, 55.3);
     expectd(200, 2e2);
+    expectd(200, 2E2);
+    expectd(24, 0x3p3);
+    expectd(24, 0x3P3);
     expectd(0x0.DE488631p8, 0xDE.488631);
 
     expect(4, sizeof(5));
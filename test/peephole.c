@@ -0,0 +1,78 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+#include "test.h"
+
+static int three(int a, int b, int c) {
+    return a * 100 + b * 10 + c;
+}
+
+static int branches(int a, int b) {
+    int r = 0;
+    if (a < b) r += 1;
+    if (a <= b) r += 2;
+    if (a > b) r += 4;
+    if (a >= b) r += 8;
+    if (a == b) r += 16;
+    if (a != b) r += 32;
+    if (!(a < b)) r += 64;
+    return r;
+}
+
+static int float_branches(double a, double b) {
+    int r = 0;
+    if (a == b) r += 4;
+    if (a != b) r += 8;
+    return r;
+}
+
+static int post_inc(void) {
+    int i = 5;
+    int j = i++;
+    int k = i--;
+    return j * 100 + k * 10 + i;
+}
+
+static long widen(char c, short s, int i) {
+    long a = c;
+    long b = s;
+    long d = i;
+    return a + b + d;
+}
+
+static int loop(int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        if (i % 3 == 0)
+            s += i;
+    return s;
+}
+
+static int switch_fallthrough(int x) {
+    int r = 0;
+    switch (x) {
+    case 1: r += 1;
+    case 2: r += 2; break;
+    case 3: r += 3;
+    }
+    return r;
+}
+
+void testmain(void) {
+    print("peephole");
+    expect(123, three(1, 2, 3));
+    expect(121, three(three(0, 0, 3), 2, 1) - 200);
+    expect(1 + 2 + 32, branches(1, 2));
+    expect(2 + 8 + 16 + 64, branches(2, 2));
+    expect(4 + 8 + 32 + 64, branches(3, 2));
+    expect(8, float_branches(1.0, 2.0));
+    expect(4, float_branches(2.0, 2.0));
+    expect(565, post_inc());
+    expectl(-1 - 2 - 3, widen(-1, -2, -3));
+    expectl(127 + 32767 + 2147483647L, widen(127, 32767, 2147483647));
+    expect(0 + 3 + 6 + 9, loop(10));
+    expect(3, switch_fallthrough(1));
+    expect(2, switch_fallthrough(2));
+    expect(3, switch_fallthrough(3));
+    expect(0, switch_fallthrough(4));
+}
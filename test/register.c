@@ -0,0 +1,78 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+#include "test.h"
+
+static int sum8(int a, int b, int c, int d, int e, int f, int g, int h) {
+    return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + g * 7 + h * 8;
+}
+
+static int fib(int n) {
+    if (n < 2)
+        return n;
+    return fib(n - 1) + fib(n - 2);
+}
+
+// More live variables than registers
+static long many(long n) {
+    long a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7, h = 8;
+    for (long i = 0; i < n; i++) {
+        a += b; b += c; c += d; d += e;
+        e += f; f += g; g += h; h += 1;
+    }
+    return a + b + c + d + e + f + g + h;
+}
+
+// Values are kept across calls.
+static int across_calls(int n) {
+    int x = n, y = n * 2, z = n * 3;
+    int r = fib(x) + fib(y) + fib(z);
+    return r + x + y + z;
+}
+
+static int backward_goto(void) {
+    int i = 0, sum = 0;
+ again:
+    sum += i;
+    if (++i < 10)
+        goto again;
+    return sum;
+}
+
+static int widths(void) {
+    char c = 200;
+    short s = 70000;
+    int i = 5000000000L;
+    _Bool b = 5;
+    long l = 5000000000L;
+    return c + s + i + b + (l > 4000000000L);
+}
+
+static int addressed(void) {
+    int x = 3;
+    int *p = &x;
+    *p = 4;
+    return x;
+}
+
+static int loop_carried(void) {
+    int prev = 0, r = 0;
+    for (int i = 0; i < 5; i++) {
+        int cur = i * i;
+        r += cur - prev;
+        prev = cur;
+    }
+    return r;
+}
+
+void testmain(void) {
+    print("register allocation");
+    expect(204, sum8(1, 2, 3, 4, 5, 6, 7, 8));
+    expect(55, fib(10));
+    expectl(21345, many(10));
+    expect(62, across_calls(3));
+    expect(45, backward_goto());
+    expect(-56 + 4464 + 705032704 + 1 + 1, widths());
+    expect(4, addressed());
+    expect(16, loop_carried());
+}
@@ -0,0 +1,113 @@
+// Copyright 2012 Rui Ueyama <rui314@gmail.com>
+// This program is free software licensed under the MIT license.
+
+/*
+ * Writes compilation events in the Chrome trace event format, so that
+ * the result can be loaded into chrome://tracing or Perfetto.
+ *
+ * Includes, top-level parsing, code generation and the assembler are
+ * interleaved in time and do not nest each other (a header can span
+ * several top-level declarations), so each of them gets its own row.
+ */
+
+// For clock_gettime()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "8cc.h"
+
+static FILE *tracefp;
+static bool first_event = true;
+// Only the process that opened the trace file writes its footer.
+// Forked compile workers share the file and name their own rows.
+static pid_t owner;
+static pid_t named_pid;
+
+static char *thread_names[] = {
+    [TRACE_CPP] = "preprocessor",
+    [TRACE_PARSE] = "parser",
+    [TRACE_CODEGEN] = "codegen",
+    [TRACE_AS] = "assembler",
+};
+
+static void emit_event(char *fmt, ...);
+
+static void name_threads(void) {
+    named_pid = getpid();
+    for (int i = 1; i < sizeof(thread_names) / sizeof(*thread_names); i++)
+        emit_event("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                   "\"args\": {\"name\": \"%s\"}}", named_pid, i, thread_names[i]);
+}
+
+static void emit_event(char *fmt, ...) {
+    if (named_pid != getpid())
+        name_threads();
+    va_list args;
+    va_start(args, fmt);
+    char *event = vformat(fmt, args);
+    va_end(args);
+    // One write per event, so that events from workers do not interleave.
+    fprintf(tracefp, "%s%s", first_event ? "\n" : ",\n", event);
+    fflush(tracefp);
+    first_event = false;
+}
+
+static char *make_args(char *args) {
+    return args ? format(", \"args\": {%s}", args) : "";
+}
+
+static void close_trace_file(void) {
+    if (owner == getpid())
+        fprintf(tracefp, "\n]}\n");
+    fclose(tracefp);
+}
+
+void trace_open(char *path) {
+    tracefp = fopen(path, "w");
+    if (!tracefp)
+        error("Cannot open trace file: %s", path);
+    owner = getpid();
+    fprintf(tracefp, "{\"traceEvents\": [");
+    name_threads();
+    if (atexit(close_trace_file))
+        perror("atexit");
+}
+
+bool trace_enabled(void) {
+    return tracefp != NULL;
+}
+
+// Returns the current time in microseconds, or 0 if tracing is off.
+long trace_time(void) {
+    if (!tracefp)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void trace_begin(int tid, char *name, char *args) {
+    if (!tracefp)
+        return;
+    emit_event("{\"name\": \"%s\", \"ph\": \"B\", \"ts\": %ld, \"pid\": %d, \"tid\": %d%s}",
+               quote_cstring(name), trace_time(), getpid(), tid, make_args(args));
+}
+
+void trace_end(int tid) {
+    if (!tracefp)
+        return;
+    emit_event("{\"ph\": \"E\", \"ts\": %ld, \"pid\": %d, \"tid\": %d}",
+               trace_time(), getpid(), tid);
+}
+
+void trace_complete(int tid, char *name, long start, char *args) {
+    if (!tracefp)
+        return;
+    emit_event("{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %ld, \"dur\": %ld, "
+               "\"pid\": %d, \"tid\": %d%s}",
+               quote_cstring(name), start, trace_time() - start, getpid(), tid,
+               make_args(args));
+}
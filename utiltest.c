@@ -1,8 +1,14 @@
 // Copyright 2012 Rui Ueyama <rui314@gmail.com>
 // This program is free software licensed under the MIT license.
 
+// For fmemopen()
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "8cc.h"
+#include "lib8cc.h"
 
 #define assert_true(expr) assert_true2(__LINE__, #expr, (expr))
 #define assert_null(...) assert_null2(__LINE__, __VA_ARGS__)
@@ -135,10 +141,73 @@ static void test_dict(void) {
     assert_int(60, (long)dict_get(dict4, "abc"));
 }
 
+static char *read_first_token(char *s) {
+    set_input_file("(test)", NULL, fmemopen(s, strlen(s), "r"));
+    return t2s(read_token());
+}
+
+static void test_context(void) {
+    Context *a = make_context();
+    Context *b = make_context();
+    set_context(a);
+    cpp_eval("#define X 1\n");
+    assert_string("1", read_first_token("X"));
+    assert_string("0", read_first_token("__COUNTER__"));
+    set_context(b);
+    assert_string("X", read_first_token("X"));
+    assert_string("0", read_first_token("__COUNTER__"));
+    set_context(a);
+    assert_string("1", read_first_token("__COUNTER__"));
+}
+
+static char *read_test_header(char *path, int *len, void *data) {
+    if (strcmp(path, "./test.h"))
+        return NULL;
+    *len = strlen(data);
+    return data;
+}
+
+static void test_lib8cc(void) {
+    Lib8ccOptions opts = { 0 };
+    opts.read_file = read_test_header;
+    opts.data = "#define VAL 42\n";
+    char *defs[] = { "NAME=g", NULL };
+    opts.defines = defs;
+    Lib8ccResult r;
+    char *src = "#include \"test.h\"\nint NAME(void) { return VAL; }\n";
+    assert_int(0, lib8cc_compile(src, strlen(src), &opts, &r));
+    assert_true(strstr(r.code, "g:") != NULL);
+    assert_true(strstr(r.code, "$42") != NULL);
+    assert_string("", r.diagnostics);
+    free(r.code);
+    free(r.diagnostics);
+
+    src = "int f(void) { return x; }";
+    assert_int(1, lib8cc_compile(src, strlen(src), NULL, &r));
+    assert_null(r.code);
+    assert_true(strstr(r.diagnostics, "(input):1:23: ") != NULL);
+    free(r.diagnostics);
+
+    // A header being read at an error is closed.
+    FILE *fp = fopen("tmp.utiltest.h", "w");
+    fprintf(fp, "int x = y;\n");
+    fclose(fp);
+    int fd = dup(0);
+    close(fd);
+    src = "#include \"tmp.utiltest.h\"\n";
+    assert_int(1, lib8cc_compile(src, strlen(src), NULL, &r));
+    free(r.diagnostics);
+    assert_int(fd, dup(0));
+    close(fd);
+    remove("tmp.utiltest.h");
+}
+
 int main(int argc, char **argv) {
     test_string();
     test_list();
     test_dict();
+    test_context();
+    test_lib8cc();
     printf("Passed\n");
     return 0;
 }